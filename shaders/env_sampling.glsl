@@ -99,6 +99,28 @@ vec3 Environment_sample(sampler2D lat_long_tex, in vec3 randVal, out vec3 to_lig
 }
 
 
+//-----------------------------------------------------------------------
+// Sun & Sky: the light sampling only covers a cone around the sun, uniformly in solid angle. The
+// rest of the sky is only reached by the BSDF rays (EnvPdf is 0 there).
+//-----------------------------------------------------------------------
+float SunConeSinRadius()
+{
+  return (0.00465f * 10.0f) * _sunAndSky.sun_disk_scale;
+}
+
+// 1 - cos of the cone, without the cancellation of the small angles
+float SunConeOneMinusCos()
+{
+  float s = SunConeSinRadius();
+  return s * s / (1.0 + sqrt(max(0.0, 1.0 - s * s)));
+}
+
+float SunConePdf()
+{
+  return 1.0 / (2.0 * M_PI * SunConeOneMinusCos());
+}
+
+
 //-----------------------------------------------------------------------
 // Sampling the HDR environment or Sun and Sky
 //-----------------------------------------------------------------------
@@ -110,18 +132,16 @@ vec4 EnvSample(inout vec3 radiance)
   // Sun & Sky or HDR
   if(_sunAndSky.in_use == 1)
   {
-    // #TODO: find proper light direction + PDF
-    float sun_radius = (0.00465f * 10.0f) * _sunAndSky.sun_disk_scale;
-    vec3  T, B;
-    CreateCoordinateSystem(_sunAndSky.sun_direction, T, B);
-    vec3 dir;
-    dir.x = rand(prd.seed) * sun_radius;
-    dir.y = rand(prd.seed) * sun_radius;
-    dir.z = sqrt(max(0.0, 1.0 - dir.x * dir.x - dir.y * dir.y));
-
-    lightDir = normalize(T * dir.x + B * dir.y + _sunAndSky.sun_direction * dir.z);
+    vec3 sunDir = normalize(_sunAndSky.sun_direction);
+    vec3 T, B;
+    CreateCoordinateSystem(sunDir, T, B);
+    float cos_theta = 1.0 - rand(prd.seed) * SunConeOneMinusCos();
+    float sin_theta = sqrt(max(0.0, 1.0 - cos_theta * cos_theta));
+    float phi       = rand(prd.seed) * 2.0 * M_PI;
+
+    lightDir = normalize(T * (cos(phi) * sin_theta) + B * (sin(phi) * sin_theta) + sunDir * cos_theta);
     radiance = sun_and_sky(_sunAndSky, lightDir);
-    pdf      = 0.5;
+    pdf      = SunConePdf();
   }
   else
   {
@@ -134,5 +154,19 @@ vec4 EnvSample(inout vec3 radiance)
   return vec4(lightDir, pdf);
 }
 
+//-----------------------------------------------------------------------
+// Solid angle pdf of EnvSample() for a direction, for MIS of the rays hitting the environment
+//-----------------------------------------------------------------------
+float EnvPdf(in vec3 dir)
+{
+  if(_sunAndSky.in_use == 1)
+    return 1.0 - dot(dir, normalize(_sunAndSky.sun_direction)) <= SunConeOneMinusCos() ? SunConePdf() : 0.0;
+
+  uvec2 tsize = textureSize(environmentTexture, 0);
+  vec2  uv    = GetSphericalUv(dir);  // Same parametrization as Environment_sample
+  uvec2 texel = min(uvec2(uv * vec2(tsize)), tsize - 1);
+  return envSamplingData[texel.y * tsize.x + texel.x].pdf;
+}
+
 
 #endif  // ENV_SAMPLING_GLSL
@@ -124,6 +124,15 @@ struct State
   Material mat;
 };
 
+// RTX pipeline, rays of the paths: the closest hit and its shading, done by the closest-hit
+// shader of the material class
+struct HitPayload
+{
+  PtPayload hit;
+  State     state;
+  vec3      geomNormal;
+};
+
 
 //-----------------------------------------------------------------------
 struct BsdfSampleRec
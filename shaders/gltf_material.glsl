@@ -28,6 +28,8 @@
 #define GLTFMATERIAL_GLSL 1
 
 #include "env_sampling.glsl"
+#include "shade_state.glsl"
+#include "profile.glsl"
 
 //-----------------------------------------------------------------------
 #define SRGB_FAST_APPROXIMATION 1
@@ -167,11 +169,23 @@ void GetSpecularGlossiness(inout State state, in GltfShadeMaterial material)
 
 
 //-----------------------------------------------------------------------
+// Material of the hit. `materialClass` is the MaterialClass of the instance, known by the
+// closest-hit shaders of the RTX pipeline, or -1 for any material.
 //-----------------------------------------------------------------------
-void GetMaterialsAndTextures(inout State state, in Ray r)
+void GetMaterialsAndTextures(inout State state, in Ray r, int materialClass)
 {
   GltfShadeMaterial material = materials[state.matID];
 
+  // KHR_materials_unlit: only the base color is used
+  if(materialClass == eClassUnlit)
+  {
+    state.texCoord     = (vec4(state.texCoord.xy, 1, 1) * material.uvTransform).xy;
+    state.mat.emission = vec3(0);
+    GetMetallicRoughness(state, material);
+    state.mat.unlit = true;
+    return;
+  }
+
   state.mat.specular     = 0.5;
   state.mat.subsurface   = 0;
   state.mat.specularTint = 1;
@@ -211,7 +225,7 @@ void GetMaterialsAndTextures(inout State state, in Ray r)
 
   // KHR_materials_transmission
   state.mat.transmission = material.transmissionFactor;
-  if(material.transmissionTexture > -1)
+  if(materialClass != eClassOpaque && material.transmissionTexture > -1)
   {
     state.mat.transmission *= textureLod(texturesMap[nonuniformEXT(material.transmissionTexture)], state.texCoord, 0).r;
   }
@@ -262,4 +276,38 @@ void GetMaterialsAndTextures(inout State state, in Ray r)
   state.mat.sheen     = sheen.w;
 }
 
+void GetMaterialsAndTextures(inout State state, in Ray r)
+{
+  GetMaterialsAndTextures(state, r, -1);
+}
+
+//-----------------------------------------------------------------------
+// Shading state of a hit: attributes of the triangle, then material. Returns the geometric
+// normal. The path tracer calls it on the closest hit of the ray query, the RTX pipeline in the
+// closest-hit shader of the material class.
+//-----------------------------------------------------------------------
+vec3 ShadeHit(in PtPayload hit, in Ray r, inout State state, int materialClass)
+{
+  PROFILE_BEGIN(eProfileShadeState);
+  ShadeState sstate = GetShadeState(hit);
+  PROFILE_END(eProfileShadeState);
+  state.position       = sstate.position;
+  state.normal         = sstate.normal;
+  state.tangent        = sstate.tangent_u[0];
+  state.bitangent      = sstate.tangent_v[0];
+  state.texCoord       = sstate.text_coords[0];
+  state.matID          = sstate.matIndex;
+  state.vertColor      = sstate.color;
+  state.isEmitter      = false;
+  state.specularBounce = false;
+  state.isSubsurface   = false;
+  state.ffnormal       = dot(state.normal, r.direction) <= 0.0 ? state.normal : -state.normal;
+
+  // Filling material structures
+  PROFILE_BEGIN(eProfileMaterial);
+  GetMaterialsAndTextures(state, r, materialClass);
+  PROFILE_END(eProfileMaterial);
+  return sstate.geom_normal;
+}
+
 #endif  // GLTFMATERIAL_GLSL
@@ -68,7 +68,10 @@ END_ENUM();
 // Output image - Set 1
 START_ENUM(OutputBindings)
 eSampler = 0,  // As sampler
-eStore = 1   // As storage
+eStore = 1,   // As storage
+eExposure = 2,  // Luminance histogram and auto-exposure
+eLumSampler = 3,  // Low resolution luminance, as sampler (local exposure)
+eLumStore = 4   // Low resolution luminance, as storage
 END_ENUM();
 
 // Scene Data - Set 2
@@ -79,7 +82,9 @@ eInstData = 2,
 ePuncLights = 3,
 eTrigLights = 4,
 eLightBufInfo = 5,
-eTextures = 6  // must be last elem            
+eNodeData = 6,
+eTrigLightGeoms = 7,
+eTextures = 8  // must be last elem            
 END_ENUM();
 
 // Environment - Set 3
@@ -91,7 +96,40 @@ END_ENUM();
 
 // Ray Query - Set 4
 START_ENUM(RayQBindings)
-eGbuffer = 0
+eVisibility = 0,
+ePrimaryHits = 1,  // Raster pre-pass: instance and primitive seen at each pixel
+eShadowQueue = 2,  // Deferred shadow rays: ShadowQueue header
+eShadowRecords = 3,  // Deferred shadow rays: ShadowRecord[]
+eShadowAccum = 4,  // Deferred shadow rays: rgb per pixel of the frame
+eWorkQueue = 5,  // Persistent threads queue and lane utilization, WorkQueue
+eGuideCells = 6,  // Path guiding: GuideCell[], hash table of the spatial cells
+eRayStats = 7,  // Ray and path counters of the frame, RayStats (PT_STATS)
+eProfile = 8,  // Shader clocks per stage and per material, ProfileCounter[] (PT_PROFILE)
+eIndirect = 9   // Decoupled indirect lighting: IndirectCell[]
+END_ENUM();
+
+// Order of the pixels in the tile of a workgroup of pathtrace.comp
+START_ENUM(PixelOrder)
+ePixelLinear = 0,  // Workgroup shape, row by row
+ePixelSwizzle = 1,  // Subgroups of 32 on 4x8 pixels
+ePixelMorton = 2,  // Z-order curve
+ePixelHilbert = 3   // Hilbert curve
+END_ENUM();
+
+// Decoupled indirect lighting, RtxState::indirectRes. The direct lighting stays per pixel, the
+// indirect paths start from one pixel per cell and are upsampled with the normal and distance
+// of the first hits (joint bilateral). The pixel of the cell changes every frame.
+START_ENUM(IndirectResolution)
+eIndirectFull = 0,  // Direct and indirect lighting in the same dispatch
+eIndirectHalf = 1,  // One pixel per 2x2
+eIndirectQuarter = 2,  // One pixel per 4x4
+eIndirectCheckerboard = 3   // One pixel per 2x1, alternating with the rows and the frames
+END_ENUM();
+
+// Termination of the paths, RtxState::rrMode
+START_ENUM(RrMode)
+eRrThroughput = 0,  // Russian roulette on the throughput of the path
+eRrAdjoint = 1   // Russian roulette and splitting on the expected contribution to the pixel (ADRRS)
 END_ENUM();
 
 START_ENUM(DebugMode)
@@ -137,6 +175,22 @@ struct VertexAttributes
 #define ALPHA_OPAQUE 0
 #define ALPHA_MASK 1
 #define ALPHA_BLEND 2
+
+// Hit groups of the RTX pipeline, selected per instance (instanceShaderBindingTableRecordOffset):
+// a closest-hit shader specialized for each class, see pathtrace.rchit
+START_ENUM(MaterialClass)
+eClassOpaque = 0,  // Metallic-roughness (or specular-glossiness), no transmission
+eClassAlphaTested = 1,  // Alpha mask or blend, the only class with any-hit shaders
+eClassTransmissive = 2,  // KHR_materials_transmission, volume
+eClassUnlit = 3   // KHR_materials_unlit, base color only
+END_ENUM();
+#define MATERIAL_CLASSES 4
+#define RAY_TYPES 2  // Hit groups per class: paths, then shadow rays (sbtRecordOffset)
+
+// Geometry levels of detail (MeshLod): a ray of level r traces the TLAS instances with the bit r of
+// their mask. Level 0 is the full detail, the simplified meshes are the next levels.
+#define LOD_LEVELS 3
+
 struct GltfShadeMaterial
 {
 	// 0
@@ -191,19 +245,140 @@ struct GltfShadeMaterial
 	// 52
 };
 
-// Gbuffer
-struct GeomData {
-	vec3 normal;
-	vec3 tangent;
-	vec2 texCoord;
-	//8
-	uint matIndex;
-	vec3 position;
-	//12
-	vec3 vertColor; //vertex color
+// Visibility buffer: what the camera ray hits, written on the first sample of each frame.
+// The shading attributes are reconstructed on demand, see GetShadeState(VisibilityData)
+#define VISIBILITY_MISS 0xFFFFFFFF
+struct VisibilityData
+{
+	uint instanceID;    // Index of the instance in the TLAS (node), VISIBILITY_MISS for the environment
+	uint primitiveID;   // Triangle in the primitive mesh
+	uint barycentrics;  // packUnorm2x16
+};
+
+// Decoupled indirect lighting: paths of the pixel of a cell, with what the camera sees there
+struct IndirectCell
+{
+	vec3  radiance;
+	float hitT;    // Distance of the first hit, INFINITY for the environment
+	vec3  normal;  // Facing the camera
 	float pad;
 };
 
+// Deferred shadow rays: the path tracer queues the rays with their unoccluded contribution, the
+// occlusion pass (shadow_trace.comp) traces them all and adds the visible ones to the pixel.
+#define SHADOW_RECORDS_PER_PIXEL 2   // Capacity of the queue, the rays past it are traced inline
+#define SHADOW_GROUP_SIZE 64
+struct ShadowQueue
+{
+	uint count;     // Number of queued rays, can go past the capacity
+	uint groupX;    // VkDispatchIndirectCommand of the occlusion pass
+	uint groupY;
+	uint groupZ;
+	uint capacity;  // Number of ShadowRecord in the buffer
+	uint pad0;
+	uint pad1;
+	uint pad2;
+};
+
+struct ShadowRecord
+{
+	vec3  origin;
+	float tmax;
+	vec3  direction;
+	uint  pixel;         // y * width + x
+	uint  contribRG;     // packHalf2x16
+	uint  contribB;      // packHalf2x16 in the low half, cull mask of the ray in the high half
+};
+
+// In-shader counters of the rays and paths of the frame, see stats.glsl. Set to 0 to compile
+// them out of the shaders and of the application.
+#ifndef PT_STATS
+#define PT_STATS 1
+#endif
+#define STATS_PATH_LENGTHS 16  // Histogram bins, the last one counts all longer paths
+struct RayStats
+{
+	uint primaryRays;     // Closest hit of the camera rays, not the ones found by the raster pre-pass
+	uint indirectRays;    // Closest hit of the bounces
+	uint shadowRays;      // Any hit, inline and deferred
+	uint candidateHits;   // HitTest() calls, non-opaque candidates of the traversal
+	uint rrTerminations;  // Paths killed by the Russian roulette
+	uint envEscapes;      // Rays reaching the environment
+	uint paths;           // Samples, primary misses included
+	uint pad0;
+	uint pathLength[STATS_PATH_LENGTHS];  // Bounces of the paths
+};
+
+// Shader clock attribution, see profile.glsl: time of the stages of the path tracer and of the
+// hits on each material. Costs a clock read around each stage, set to 1 to compile it in.
+#ifndef PT_PROFILE
+#define PT_PROFILE 0
+#endif
+START_ENUM(ProfileStage)
+eProfileTraversal = 0,   // ClosestHit
+eProfileShadow = 1,      // AnyHit, inline and deferred
+eProfileShadeState = 2,  // GetShadeState
+eProfileMaterial = 3,    // GetMaterialsAndTextures
+eProfileBsdf = 4         // Sample and Eval
+END_ENUM();
+#define PROFILE_STAGES 5
+// The stages, followed by one per material. Clocks of all invocations, 64 bits in two words.
+struct ProfileCounter
+{
+	uint clocksLo;
+	uint clocksHi;
+	uint count;  // Invocations which flushed the stage, hits on the material
+	uint pad0;
+};
+
+#define BOUNCE_STAT_DEPTH 16  // Bounces with statistics, the last one counts all deeper bounces
+
+// Pixels fetched by the persistent threads variant of pathtrace.comp, and lane utilization
+// counters of all variants. Reset every frame.
+struct WorkQueue
+{
+	uint next;         // Next work item (pixel)
+	uint activeSteps;  // Bounces done by the lanes
+	uint slotSteps;    // Bounces the subgroups went through, times the subgroup size
+	uint pad0;
+
+	// Paths per bounce, when RtxState::bounceStats is set
+	uint bouncePaths[BOUNCE_STAT_DEPTH];       // Paths reaching the bounce
+	uint bounceTerminated[BOUNCE_STAT_DEPTH];  // Killed by the Russian roulette
+	uint bounceSplits[BOUNCE_STAT_DEPTH];      // Branches added by splitting
+};
+
+// Path guiding: a hash grid of cells over the scene, each learning the incident radiance in
+// GUIDE_BINS directions (equal area: cos theta x phi). Paths splat their contributions in
+// `train`, guide_update.comp turns them into the `pdf` used to sample directions.
+#define GUIDE_RES 8                                // Directional bins per axis
+#define GUIDE_BINS (GUIDE_RES * GUIDE_RES)
+#define GUIDE_VERTICES 4                           // First vertices of a path used for training
+#define GUIDE_PROBES 8                             // Linear probing of the hash table
+#define GUIDE_MIN_SAMPLES 64                       // Training samples before a cell distribution is updated
+#define GUIDE_MAX_SAMPLES 16384                    // Per update, keeps the fixed point sums in range
+#define GUIDE_UPDATE_GROUP_SIZE 64
+struct GuideCell
+{
+	uint  key;                // Hash of the cell coordinates, 0 for an empty slot
+	uint  samples;            // Training samples since the last update
+	float total;              // Sum of `train` at the last update, 0 while the cell cannot guide
+	float radiance;           // Mean incident radiance at the last update, for ADRRS
+	uint  train[GUIDE_BINS];  // Learned radiance, fixed point
+	float pdf[GUIDE_BINS];    // Probability of each bin
+};
+
+// Per instance (node) of the TLAS, in the same order: the nodes, then the instances of MeshLod
+struct NodeData
+{
+	mat4 objectToWorld;
+	mat4 worldToObject;
+	int  primMesh;  // Index in InstanceData
+	int  pad0;
+	int  pad1;
+	int  pad2;
+};
+
 // Use with PushConstant
 struct RtxState
 {
@@ -221,6 +396,35 @@ struct RtxState
 	int   minHeatmap;             // Debug mode - heat map
 	int   maxHeatmap;
 	uint time;                   // How long has the app been running. miliseconds.
+
+	vec2  jitter;                 // Sub-pixel position of the first sample, shared by all pixels with the raster pre-pass
+	int   rasterPrimary;          // First hit of the first sample comes from the raster pre-pass
+	int   deferShadows;           // Shadow rays are queued and traced by shadow_trace.comp
+
+	int   lightMis;               // 1: MIS of light and BSDF sampling, 0: light sampling only
+	int   guiding;                // Path guiding, see path_guiding.glsl
+	int   guideTrain;             // Paths splat their contributions in the guiding cells
+	float guideProb;              // Probability of the guided sampling against BSDF sampling
+
+	float guideCellSize;          // Side of a guiding cell, world space
+	uint  guideCapacity;          // Number of GuideCell
+	int   rrMode;                 // See RrMode
+	int   bounceStats;            // Count the paths of each bounce in WorkQueue
+	int   heatmapStage;           // eHeatmap: -1 for the whole pixel, or the ProfileStage (PT_PROFILE)
+	int   indirectRes;            // See IndirectResolution
+	int   indirectPass;           // 1: dispatch of the decoupled indirect paths, see IndirectMain()
+	int   lodDepth;               // First bounce tracing the simplified meshes (MeshLod), 0: full detail only
+	int   laneStats;              // Count the SIMD lane utilization in WorkQueue, set by the dispatch sweep and bounceStats
+};
+
+// Raster pre-pass finding the primary visibility, one draw per node
+struct RasterPushConstant
+{
+	mat4 mvp;
+	uint instanceID;  // Node, same index as in the TLAS
+	int  primMesh;
+	int  pad0;
+	int  pad1;
 };
 
 // Structure used for retrieving the primitive information in the closest hit
@@ -270,24 +474,28 @@ struct PuncLight // point, spot, or directional light.
 	ImptSampData impSamp;
 };
 
-struct TrigLight { // triangles of emissive meshes
-	uint matIndex;
-	uint transformIndex;
+struct TrigLightGeom { // triangle of an emissive mesh, object space, shared by its instances
 	vec3 v0;
 	vec3 v1;
 	vec3 v2;
 	vec2 uv0;
 	vec2 uv1;
 	vec2 uv2;
+};
+
+struct TrigLight { // triangles of emissive meshes, one per instance
+	uint matIndex;
+	uint transformIndex;  // NodeData of the instance
+	uint geomIndex;       // TrigLightGeom of the triangle
+	uint pad;
 	ImptSampData impSamp;
-	vec3 pad;
 };
 
 struct LightBufInfo {
 	uint puncLightSize;
 	uint trigLightSize;
 	float trigSampProb;
-	int pad;
+	float trigLightWeight;  // Sum of the weights of the triangle lights, normalizes their pdf
 };
 
 // Tonemapper used in post.frag
@@ -305,6 +513,31 @@ struct Tonemapper
 	float key;     // Log-average luminance
 };
 
+// Auto-exposure, see exposure_histogram.comp and exposure_average.comp
+#define EXPOSURE_HISTOGRAM_BINS 256  // Bin 0 holds the black pixels
+#define EXPOSURE_GROUP_SIZE 16       // 16x16 pixels per workgroup, one texel of the luminance image
+
+struct ExposureData
+{
+	float avgLum;     // Temporally smoothed log-average luminance, used by the tonemapper
+	float frameLum;   // Log-average luminance of the last frame
+	int   pad0;
+	int   pad1;
+	uint  histogram[EXPOSURE_HISTOGRAM_BINS];
+};
+
+// Push constant of the exposure compute shaders
+struct ExposureSettings
+{
+	ivec2 size;         // Rendered area of the offscreen image
+	float minLogLum;    // log2 of the luminance mapped to the first non-black bin
+	float logLumRange;  // log2 range covered by the histogram
+	float adaptation;   // Blending factor toward the new exposure, 1 = no smoothing
+	int   pad0;
+	int   pad1;
+	int   pad2;
+};
+
 
 struct SunAndSky
 {
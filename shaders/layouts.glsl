@@ -40,19 +40,32 @@ layout(set = S_OUT,   binding = eStore)					uniform image2D			resultImage;
 //
 layout(set = S_SCENE, binding = eInstData,	scalar)   buffer _InstanceInfo	{ InstanceData geoInfo[]; };
 layout(set = S_SCENE, binding = eCamera,	  scalar)   uniform _SceneCamera	{ SceneCamera sceneCamera; };
-// layout(set = S_SCENE, binding = eGbuffer,	  scalar)   buffer _Gbuffer	{ GeomData Gbuffer[]; };
 layout(set = S_SCENE, binding = eMaterials,	scalar)		buffer _MaterialBuffer	{ GltfShadeMaterial materials[]; };
 layout(set = S_SCENE, binding = ePuncLights,scalar)		buffer _PuncLights		{ PuncLight puncLights[]; };
 layout(set = S_SCENE, binding = eTrigLights,scalar)		buffer _TrigLights		{ TrigLight trigLights[]; };
-// layout(set = S_SCENE, binding = eTrigLightTransforms,scalar)  uniform _TrigLightTransforms { mat4 trigLightTransforms[16]; };
+layout(set = S_SCENE, binding = eTrigLightGeoms,scalar)	buffer _TrigLightGeoms	{ TrigLightGeom trigLightGeoms[]; };
 layout(set = S_SCENE, binding = eLightBufInfo     )		uniform _LightBufInfo		{ LightBufInfo lightBufInfo; };
+layout(set = S_SCENE, binding = eNodeData,	scalar)		buffer _NodeData		{ NodeData nodes[]; };
 layout(set = S_SCENE, binding = eTextures         )   uniform sampler2D		texturesMap[]; 
 //
 layout(set = S_ENV, binding = eSunSky,		scalar)		uniform _SSBuffer		{ SunAndSky _sunAndSky; };
 layout(set = S_ENV, binding = eHdr)						uniform sampler2D		environmentTexture;
 layout(set = S_ENV, binding = eImpSamples,  scalar)		buffer _EnvSampBuffer	{ ImptSampData envSamplingData[]; };
 
-layout(set = S_RAYQ, binding = eGbuffer,  scalar)		buffer _Gbuffer	{ GeomData gbuffer[]; };
+layout(set = S_RAYQ, binding = eVisibility,  scalar)	buffer _Visibility	{ VisibilityData visibility[]; };
+layout(set = S_RAYQ, binding = ePrimaryHits, rg32ui)	uniform readonly uimage2D primaryHits;
+layout(set = S_RAYQ, binding = eShadowQueue,  scalar)	buffer _ShadowQueue	{ ShadowQueue shadowQueue; };
+layout(set = S_RAYQ, binding = eShadowRecords, scalar)	buffer _ShadowRecords	{ ShadowRecord shadowRecords[]; };
+layout(set = S_RAYQ, binding = eShadowAccum,  scalar)	buffer _ShadowAccum	{ float shadowAccum[]; };
+layout(set = S_RAYQ, binding = eWorkQueue,    scalar)	buffer _WorkQueue	{ WorkQueue workQueue; };
+layout(set = S_RAYQ, binding = eGuideCells,   scalar)	buffer _GuideCells	{ GuideCell guideCells[]; };
+layout(set = S_RAYQ, binding = eIndirect,     scalar)	buffer _Indirect	{ IndirectCell indirectCells[]; };
+#if PT_STATS
+layout(set = S_RAYQ, binding = eRayStats,     scalar)	buffer _RayStats	{ RayStats rayStats; };
+#endif
+#if PT_PROFILE
+layout(set = S_RAYQ, binding = eProfile,      scalar)	buffer _Profile		{ ProfileCounter profileCounters[]; };
+#endif
 
 layout(buffer_reference, scalar) buffer Vertices { VertexAttributes v[]; };
 layout(buffer_reference, scalar) buffer Indices	 { uvec3 i[];            };
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Path guiding, used when rtxState.guiding is set.
+// Cells of a hash grid (rtxState.guideCellSize) learn online the radiance arriving from
+// GUIDE_BINS directions: the first GUIDE_VERTICES vertices of each path splat, when the path
+// is done, what came back through the direction they sampled. IndirectStep() then samples
+// either the BSDF or the learned distribution (one-sample MIS with the mixture pdf).
+// See guide_update.comp for the update of the distributions, RayQuery for the schedule.
+
+#ifndef PATH_GUIDING_GLSL
+#define PATH_GUIDING_GLSL 1
+
+#define GUIDE_INVALID 0xFFFFFFFFu
+#define GUIDE_MIN_ROUGHNESS 0.2  // Below, the BSDF lobe is narrower than a bin
+
+uint GuideHash(ivec3 p) {
+  uint h = (uint(p.x) * 73856093u) ^ (uint(p.y) * 19349663u) ^ (uint(p.z) * 83492791u);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return max(h, 1u);  // 0 is an empty slot
+}
+
+//-----------------------------------------------------------------------
+// Cell containing the position, inserted in the table when `insert` (training)
+//
+uint GuideFindCell(vec3 position, bool insert) {
+  uint capacity = rtxState.guideCapacity;
+  uint key = GuideHash(ivec3(floor(position / rtxState.guideCellSize)));
+  uint slot = key % capacity;
+  for(int i = 0; i < GUIDE_PROBES; i++) {
+    uint k = guideCells[slot].key;
+    if(k == key)
+      return slot;
+    if(k == 0u) {
+      if(!insert)
+        return GUIDE_INVALID;
+      uint prev = atomicCompSwap(guideCells[slot].key, 0u, key);
+      if(prev == 0u || prev == key)
+        return slot;
+    }
+    slot = (slot + 1) % capacity;
+  }
+  return GUIDE_INVALID;  // Table full around this slot
+}
+
+//-----------------------------------------------------------------------
+// Equal area bins: cos(theta) along x, phi along y
+//
+uint GuideBin(vec3 dir) {
+  vec2 uv = vec2(dir.z * 0.5 + 0.5, atan(dir.y, dir.x) * M_1_OVER_PI * 0.5 + 0.5);
+  uvec2 b = min(uvec2(uv * float(GUIDE_RES)), uvec2(GUIDE_RES - 1));
+  return b.y * GUIDE_RES + b.x;
+}
+
+vec3 GuideBinDirection(uint bin, vec2 rnd) {
+  vec2 uv = (vec2(bin % GUIDE_RES, bin / GUIDE_RES) + rnd) / float(GUIDE_RES);
+  float cosTheta = uv.x * 2.0 - 1.0;
+  float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+  float phi = (uv.y * 2.0 - 1.0) * M_PI;
+  return vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+//-----------------------------------------------------------------------
+// Probability to take the guided direction at this hit, 0 if the cell has not learned yet or
+// if the material is too specular to benefit from it
+//
+float GuideSelectProb(uint cell, in State state) {
+  if(cell == GUIDE_INVALID || guideCells[cell].total <= 0.0)
+    return 0.0;
+  if(state.mat.roughness < GUIDE_MIN_ROUGHNESS || state.mat.transmission > 0.0)
+    return 0.0;
+  return rtxState.guideProb;
+}
+
+// Solid angle pdf of GuideSample()
+float GuidePdf(uint cell, vec3 dir) {
+  return guideCells[cell].pdf[GuideBin(dir)] * float(GUIDE_BINS) / (4.0 * M_PI);
+}
+
+vec3 GuideSample(uint cell) {
+  float u = rand(prd.seed);
+  float cdf = 0.0;
+  uint bin = 0;
+  for(; bin < GUIDE_BINS - 1; bin++) {
+    cdf += guideCells[cell].pdf[bin];
+    if(u < cdf)
+      break;
+  }
+  return GuideBinDirection(bin, vec2(rand(prd.seed), rand(prd.seed)));
+}
+
+//-----------------------------------------------------------------------
+// Training sample: estimate of the radiance arriving in `bin` over the pdf of the direction
+// (Monte Carlo estimate of the integral over the bin). Normalized by the firefly threshold to
+// fit in 16 bits, GUIDE_MAX_SAMPLES of them fit in the 32 bits of a bin.
+//
+void GuideSplat(uint cell, uint bin, float value) {
+  if(atomicAdd(guideCells[cell].samples, 1) >= GUIDE_MAX_SAMPLES)
+    return;
+  uint fixedValue = uint(clamp(value / rtxState.fireflyClampThreshold, 0.0, 1.0) * 65535.0);
+  if(fixedValue > 0)
+    atomicAdd(guideCells[cell].train[bin], fixedValue);
+}
+
+#endif  // PATH_GUIDING_GLSL
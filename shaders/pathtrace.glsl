@@ -22,6 +22,8 @@
 // * `samplePixel()` is setting a ray from the camera origin through a pixel (jitter)
 // * `IndirectSample()` will loop until the ray depth is reached or the environment is hit.
 // * `DirectLight()` is the contribution at the hit, if the shadow ray is not hitting anything.
+//   Lights (environment, triangles, punctual) are sampled at every hit, lights hit by BSDF
+//   sampling are weighted against it with MIS.
 
 #define ENVMAP 1
 #define RR 1        // Using russian roulette
@@ -37,19 +39,27 @@
 //-----------------------------------------------------------------------
 //-----------------------------------------------------------------------
 vec3 Eval(in State state, in vec3 V, in vec3 N, in vec3 L, inout float pdf) {
+  PROFILE_BEGIN(eProfileBsdf);
+  vec3 f;
   if(rtxState.pbrMode == 0)
-    return DisneyEval(state, V, N, L, pdf);
+    f = DisneyEval(state, V, N, L, pdf);
   else
-    return PbrEval(state, V, N, L, pdf);
+    f = PbrEval(state, V, N, L, pdf);
+  PROFILE_END(eProfileBsdf);
+  return f;
 }
 
 //-----------------------------------------------------------------------
 //-----------------------------------------------------------------------
 vec3 Sample(in State state, in vec3 V, in vec3 N, inout vec3 L, inout float pdf, inout RngStateType seed) {
+  PROFILE_BEGIN(eProfileBsdf);
+  vec3 f;
   if(rtxState.pbrMode == 0)
-    return DisneySample(state, V, N, L, pdf, seed);
+    f = DisneySample(state, V, N, L, pdf, seed);
   else
-    return PbrSample(state, V, N, L, pdf, seed);
+    f = PbrSample(state, V, N, L, pdf, seed);
+  PROFILE_END(eProfileBsdf);
+  return f;
 }
 
 //-----------------------------------------------------------------------
@@ -76,104 +86,6 @@ vec3 DebugInfo(in State state) {
   return vec3(1000, 0, 0);
 }
 
-//-----------------------------------------------------------------------
-// Use for light/env contribution
-struct VisibilityContribution {
-  vec3 radiance;   // Radiance at the point if light is visible
-  vec3 lightDir;   // Direction to the light, to shoot shadow ray
-  float lightDist;  // Distance to the light (1e32 for infinite or sky)
-  bool visible;    // true if in front of the face and should shoot shadow ray
-};
-
-//-----------------------------------------------------------------------
-//-----------------------------------------------------------------------
-VisibilityContribution DirectLight(in Ray r, in State state) {
-  vec3 Li = vec3(0);
-  float lightPdf;
-  vec3 lightContrib;
-  vec3 lightDir;
-  float lightDist = 1e32;
-  bool isLight = false;
-
-  VisibilityContribution contrib;
-  contrib.radiance = vec3(0);
-  contrib.visible = false;
-
-  // keep it simple and use either point light or environment light, each with the same
-  // probability. If the environment factor is zero, we always use the point light
-  // Note: see also miss shader
-  float p_select_light = rtxState.hdrMultiplier > 0.0f ? 0.5f : 1.0f;
-
-  // in general, you would select the light depending on the importance of it
-  // e.g. by incorporating their luminance
-
-  // Point lights
-  if(sceneCamera.nbLights != 0 && rand(prd.seed) <= p_select_light) {
-    isLight = true;
-
-    // randomly select one of the lights
-    int light_index = int(min(rand(prd.seed) * sceneCamera.nbLights, sceneCamera.nbLights));
-    PuncLight light = puncLights[light_index];
-
-    vec3 pointToLight = -light.direction;
-    float rangeAttenuation = 1.0;
-    float spotAttenuation = 1.0;
-
-    if(light.type != LightType_Directional) {
-      pointToLight = light.position - state.position;
-    }
-
-    lightDist = length(pointToLight);
-
-    // Compute range and spot light attenuation.
-    if(light.type != LightType_Directional) {
-      rangeAttenuation = getRangeAttenuation(light.range, lightDist);
-    }
-    if(light.type == LightType_Spot) {
-      spotAttenuation = getSpotAttenuation(pointToLight, light.direction, light.outerConeCos, light.innerConeCos);
-    }
-
-    vec3 intensity = rangeAttenuation * spotAttenuation * light.intensity * light.color;
-
-    lightContrib = intensity;
-    lightDir = normalize(pointToLight);
-    lightPdf = 1.0;
-  }
-  // Environment Light
-  else {
-    vec4 dirPdf = EnvSample(lightContrib);
-    lightDir = dirPdf.xyz;
-    lightPdf = dirPdf.w;
-  }
-
-  if(state.isSubsurface || dot(lightDir, state.ffnormal) > 0.0) {
-    // We should shoot a ray toward the environment and check if it is not
-    // occluded by an object before doing the following,
-    // but the call to traceRayEXT have to store
-    // live states (ex: sstate), which is really costly. So we will do
-    // all the computation, but adding the contribution at the end of the
-    // shader.
-    // See: https://developer.nvidia.com/blog/best-practices-using-nvidia-rtx-ray-tracing/
-    {
-      BsdfSampleRec bsdfSampleRec;
-
-      bsdfSampleRec.f = Eval(state, -r.direction, state.ffnormal, lightDir, bsdfSampleRec.pdf);
-
-      float misWeight = isLight ? 1.0 : max(0.0, powerHeuristic(lightPdf, bsdfSampleRec.pdf));
-
-      Li += misWeight * bsdfSampleRec.f * abs(dot(lightDir, state.ffnormal)) * lightContrib / lightPdf;
-    }
-
-    contrib.visible = true;
-    contrib.lightDir = lightDir;
-    contrib.lightDist = lightDist;
-    contrib.radiance = Li;
-  }
-
-  return contrib;
-}
-
-//-----------------------------------------------------------------------
 //-----------------------------------------------------------------------
 vec2 SampleTriangleUniform(vec3 v0, vec3 v1, vec3 v2) {
   float ru = rand(prd.seed);
@@ -197,23 +109,15 @@ vec4 SampleTriangleLight(vec3 x, out vec3 radiance, out float dist) {
   if(rand(prd.seed) > trigLights[id].impSamp.q)
     id = trigLights[id].impSamp.alias;
 
-  TrigLight light = trigLights[id];
-  vec4 dirAndPdf;
-
-  // vec4 tmp0 = (trigLightTransforms[light.transformIndex] * vec4(light.v0, 1.0));
-  // vec4 tmp1 = (trigLightTransforms[light.transformIndex] * vec4(light.v1, 1.0));
-  // vec4 tmp2 = (trigLightTransforms[light.transformIndex] * vec4(light.v2, 1.0));
-  // vec3 v0 = tmp0.xyz / tmp0.w;
-  // vec3 v1 = tmp1.xyz / tmp1.w;
-  // vec3 v2 = tmp2.xyz / tmp2.w;
+  TrigLight     light = trigLights[id];
+  TrigLightGeom geom  = trigLightGeoms[light.geomIndex];
+  vec4          dirAndPdf;
 
-  // vec3 v0 = vec3(trigLightTransforms[light.transformIndex] * vec4(light.v0, 1.0));
-  // vec3 v1 = vec3(trigLightTransforms[light.transformIndex] * vec4(light.v1, 1.0));
-  // vec3 v2 = vec3(trigLightTransforms[light.transformIndex] * vec4(light.v2, 1.0));
-
-  vec3 v0 = light.v0;
-  vec3 v1 = light.v1;
-  vec3 v2 = light.v2;
+  // Object space, shared by the instances of the mesh and moved with this one
+  mat4 objectToWorld = nodes[light.transformIndex].objectToWorld;
+  vec3 v0 = vec3(objectToWorld * vec4(geom.v0, 1.0));
+  vec3 v1 = vec3(objectToWorld * vec4(geom.v1, 1.0));
+  vec3 v2 = vec3(objectToWorld * vec4(geom.v2, 1.0));
 
   vec3 normal = cross(v1 - v0, v2 - v0);
   float area = length(normal) * 0.5;
@@ -225,14 +129,13 @@ vec4 SampleTriangleLight(vec3 x, out vec3 radiance, out float dist) {
   GltfShadeMaterial mat = materials[light.matIndex];
   vec3 emission = mat.emissiveFactor;
   if(mat.emissiveTexture > -1) {
-    vec2 uv = baryCoord.x * light.uv0 + baryCoord.y * light.uv1 + (1 - baryCoord.x - baryCoord.y) * light.uv2;
+    vec2 uv = baryCoord.x * geom.uv0 + baryCoord.y * geom.uv1 + (1 - baryCoord.x - baryCoord.y) * geom.uv2;
     emission *= SRGBtoLINEAR(textureLod(texturesMap[nonuniformEXT(mat.emissiveTexture)], uv, 0)).rgb;
   }
   dirAndPdf.xyz = normalize(y - x);
   dist = length(y - x);
   dirAndPdf.w = light.impSamp.pdf * dist * dist / (area * abs(dot(dirAndPdf.xyz, normal)));
-  radiance = emission / area;
-  // radiance = emission;
+  radiance = emission;
   return dirAndPdf;
 }
 
@@ -240,141 +143,523 @@ vec4 SamplePuncLight(vec3 x, out vec3 radiance, out float dist) {
   if(lightBufInfo.puncLightSize == 0)
     return vec4(-1.0);
 
-  int id = min(int(float(lightBufInfo.trigLightSize) * rand(prd.seed)), int(lightBufInfo.puncLightSize) - 1);
+  int id = min(int(float(lightBufInfo.puncLightSize) * rand(prd.seed)), int(lightBufInfo.puncLightSize) - 1);
 
   if(rand(prd.seed) > puncLights[id].impSamp.q)
     id = puncLights[id].impSamp.alias;
 
   PuncLight light = puncLights[id];
+  vec3 pointToLight = -light.direction;
+  float attenuation = 1.0;
+  dist = INFINITY;
+  if(light.type != LightType_Directional) {
+    pointToLight = light.position - x;
+    dist = length(pointToLight);
+    attenuation = light.range > 0.0 ? getRangeAttenuation(light.range, dist) : 1.0 / (dist * dist);
+  }
+  if(light.type == LightType_Spot) {
+    attenuation *= getSpotAttenuation(pointToLight, light.direction, light.outerConeCos, light.innerConeCos);
+  }
+
   vec4 dirAndPdf;
-  dirAndPdf.xyz = normalize(light.position - x);
+  dirAndPdf.xyz = normalize(pointToLight);
   dirAndPdf.w = light.impSamp.pdf;
-  dist = length(light.position - x);
-  radiance = light.color * light.intensity / (dist * dist);
+  radiance = light.color * light.intensity * attenuation;
   return dirAndPdf;
 }
 
-vec3 IndirectSample(Ray r, State state, float hitT) {
-  if(hitT >= INFINITY)
-    return vec3(0.0);
-  vec3 radiance = vec3(0.0);
-  vec3 throughput = vec3(1.0);
-  vec3 absorption = vec3(0.0);
-  for(int depth = 0; depth < rtxState.maxDepth; depth++) {
-    if(depth > 0) {
-      ClosestHit(r);
-      hitT = prd.hitT;
-
-      // Hitting the environment
-      if(hitT >= INFINITY) {
-        if (depth == 1) return vec3(0.0);
-        vec3 env;
-        if(_sunAndSky.in_use == 1)
-          env = sun_and_sky(_sunAndSky, r.direction);
-        else {
-          vec2 uv = GetSphericalUv(r.direction);  // See sampling.glsl
-          env = texture(environmentTexture, uv).rgb;
-        }
-            // Done sampling return
-        return radiance + (env * rtxState.hdrMultiplier * throughput);
-      }
+//-----------------------------------------------------------------------
+// Light selection for the next event estimation: the environment with rtxState.environmentProb,
+// otherwise the triangle lights with lightBufInfo.trigSampProb and the punctual lights.
+// The environment is not selected when it is black, and always when there are no other lights.
+//
+float EnvSelectProb() {
+  if(rtxState.hdrMultiplier <= 0.0)
+    return 0.0;
+  if(lightBufInfo.trigLightSize == 0 && lightBufInfo.puncLightSize == 0)
+    return 1.0;
+  return rtxState.environmentProb;
+}
 
-      // Get Position, Normal, Tangents, Texture Coordinates, Color
-      ShadeState sstate = GetShadeState(prd);
-      state.position = sstate.position;
-      state.normal = sstate.normal;
-      state.tangent = sstate.tangent_u[0];
-      state.bitangent = sstate.tangent_v[0];
-      state.texCoord = sstate.text_coords[0];
-      state.matID = sstate.matIndex;
-      state.vertColor = sstate.color;
-      state.position = sstate.position;
-      state.isEmitter = false;
-      state.specularBounce = false;
-      state.isSubsurface = false;
-      state.ffnormal = dot(state.normal, r.direction) <= 0.0 ? state.normal : -state.normal;
-
-      // Filling material structures
-      GetMaterialsAndTextures(state, r);
-    }
+// Direction to a light and its solid angle pdf, selection included (w <= 0 if nothing was sampled).
+// Punctual lights are `isDelta`, BSDF sampling never hits them.
+vec4 SampleLight(vec3 x, out vec3 Li, out float dist, out bool isDelta) {
+  vec4 dirAndPdf;
+  Li = vec3(0.0);
+  dist = INFINITY;
+  isDelta = false;
+
+  float envProb = EnvSelectProb();
+  float rnd = rand(prd.seed);
+  if(rnd < envProb) {
+    dirAndPdf = EnvSample(Li);
+    dirAndPdf.w *= envProb;
+  } else if(rnd < envProb + (1.0 - envProb) * lightBufInfo.trigSampProb) {
+    dirAndPdf = SampleTriangleLight(x, Li, dist);
+    dirAndPdf.w *= (1.0 - envProb) * lightBufInfo.trigSampProb;
+  } else {
+    dirAndPdf = SamplePuncLight(x, Li, dist);
+    dirAndPdf.w *= (1.0 - envProb) * (1.0 - lightBufInfo.trigSampProb);
+    isDelta = true;
+  }
+  return dirAndPdf;
+}
 
-    // Color at vertices
-    state.mat.albedo *= state.vertColor;
+// Pdf of SampleLight() for a ray escaping to the environment
+float EnvLightPdf(vec3 dir) {
+  float envProb = EnvSelectProb();
+  return envProb > 0.0 ? envProb * EnvPdf(dir) : 0.0;
+}
 
-    // Reset absorption when ray is going out of surface
-    if(dot(state.normal, state.ffnormal) > 0.0) {
-      absorption = vec3(0.0);
-    }
+// Pdf of SampleLight() for a ray hitting an emissive triangle at `dist`.
+// Triangle lights are picked proportionally to their power, luminance * area * 2pi (two-sided,
+// see Scene::createTrigLightImptSampAccel): the area of the triangle cancels out.
+float TrigLightPdf(uint matIndex, vec3 dir, float dist, vec3 geomNormal) {
+  float lum = luminance(materials[matIndex].emissiveFactor);
+  float cosLight = abs(dot(dir, geomNormal));
+  if(lum <= 1e-2 || cosLight <= 0.0 || lightBufInfo.trigLightWeight <= 0.0)  // Not a triangle light
+    return 0.0;
+  float selectPdf = (1.0 - EnvSelectProb()) * lightBufInfo.trigSampProb * M_TWO_PI * lum / lightBufInfo.trigLightWeight;
+  return selectPdf * dist * dist / cosLight;
+}
+
+//-----------------------------------------------------------------------
+// MIS weights, power heuristic. With rtxState.lightMis == 0, only light sampling brings the
+// lights it can reach.
+//
+float LightMisWeight(float lightPdf, float bsdfPdf, bool isDelta, bool bsdfContinues) {
+  if(isDelta || !bsdfContinues || rtxState.lightMis == 0)
+    return 1.0;
+  return powerHeuristic(lightPdf, bsdfPdf);
+}
+
+float BsdfMisWeight(float bsdfPdf, float lightPdf) {
+  if(lightPdf <= 0.0)
+    return 1.0;
+  return rtxState.lightMis == 1 ? powerHeuristic(bsdfPdf, lightPdf) : 0.0;
+}
+
+//-----------------------------------------------------------------------
+// Use for light/env contribution
+struct VisibilityContribution {
+  vec3 radiance;   // Radiance at the point if light is visible
+  vec3 lightDir;   // Direction to the light, to shoot shadow ray
+  float lightDist;  // Distance to the light (1e32 for infinite or sky)
+  bool visible;    // true if in front of the face and should shoot shadow ray
+};
+
+//-----------------------------------------------------------------------
+// Next event estimation: contribution of a light sample at the hit, if the shadow ray is not
+// hitting anything. `bsdfContinues` when the BSDF sample of this hit is traced, the light it may
+// hit then gets the other MIS weight (see IndirectStep).
+//
+VisibilityContribution DirectLight(in Ray r, in State state, bool bsdfContinues) {
+  VisibilityContribution contrib;
+  contrib.radiance = vec3(0);
+  contrib.visible = false;
 
-    // Emissive material
-    if (depth > 1)
-      radiance += state.mat.emission * throughput;
+  vec3 Li;
+  float lightDist;
+  bool isDelta;
+  vec4 dirAndPdf = SampleLight(state.position, Li, lightDist, isDelta);
+  if(dirAndPdf.w <= 0.0)
+    return contrib;
 
-    // KHR_materials_unlit
-    if(state.mat.unlit) {
-      return radiance + state.mat.albedo * throughput;
+  vec3 lightDir = dirAndPdf.xyz;
+  if(state.isSubsurface || dot(lightDir, state.ffnormal) > 0.0) {
+    BsdfSampleRec bsdfSampleRec;
+    bsdfSampleRec.f = Eval(state, -r.direction, state.ffnormal, lightDir, bsdfSampleRec.pdf);
+
+    // The BSDF sample of IndirectScatter() has the guiding mixture pdf, the weights must use it too
+    float bsdfPdf = bsdfSampleRec.pdf;
+    if(rtxState.guiding == 1) {
+      uint guideCell = GuideFindCell(state.position, false);
+      float guideProb = GuideSelectProb(guideCell, state);
+      if(guideProb > 0.0)
+        bsdfPdf = mix(bsdfPdf, GuidePdf(guideCell, lightDir), guideProb);
     }
 
-    // Add absoption (transmission / volume)
-    throughput *= exp(-absorption * hitT);
-
-    // add punc light
-    if (depth > 1)
-    {
-      vec4 dirAndPdf;
-      float dist, dummyPdf;
-      vec3 Li;
-      dirAndPdf = SamplePuncLight(state.position, Li, dist);
-      if(dirAndPdf.w > 0) {
-        Ray shadowRay;
-        shadowRay.direction = dirAndPdf.xyz;
-        shadowRay.origin = state.position + shadowRay.direction * 1e-4;
-        if(!AnyHit(shadowRay, dist - 2e-4))
-          radiance += Li * Eval(state, -r.direction, state.ffnormal, shadowRay.direction, dummyPdf) *
-            max(dot(state.ffnormal, dirAndPdf.xyz), 0.0) / dirAndPdf.w * throughput;
+    float misWeight = LightMisWeight(dirAndPdf.w, bsdfPdf, isDelta, bsdfContinues);
+
+    contrib.visible = true;
+    contrib.lightDir = lightDir;
+    contrib.lightDist = lightDist;
+    contrib.radiance = misWeight * bsdfSampleRec.f * abs(dot(lightDir, state.ffnormal)) * Li / dirAndPdf.w;
+  }
+
+  return contrib;
+}
+
+//-----------------------------------------------------------------------
+// Contribution of DirectLight() times `throughput` if the light is visible.
+// With deferred shadows the ray is queued, shadow_trace.comp adds it if visible.
+//
+vec3 ShadowedContribution(VisibilityContribution contrib, State state, vec3 throughput) {
+  if(!contrib.visible)
+    return vec3(0.0);
+
+  Ray shadowRay;
+  shadowRay.direction = contrib.lightDir;
+  shadowRay.origin = state.position + shadowRay.direction * 1e-4;
+  float tmax = contrib.lightDist - 2e-4;
+  vec3 radiance = contrib.radiance * throughput;
+
+  if(rtxState.deferShadows == 1 && QueueShadowRay(shadowRay, tmax, radiance))
+    return vec3(0.0);
+  return AnyHit(shadowRay, tmax) ? vec3(0.0) : radiance;
+}
+
+//-----------------------------------------------------------------------
+// Path after the first hit, advanced one bounce at a time by IndirectStep()
+//
+struct PathState {
+  Ray   r;
+  vec3  radiance;
+  vec3  throughput;
+  vec3  absorption;
+  float hitT;
+  int   depth;
+  float bsdfPdf;  // Pdf of the BSDF sample which gave `r`, for the MIS of the light it hits
+
+  // Path guiding training, one record per vertex which sampled its direction (see GuideTrain)
+  uint guideCell[GUIDE_VERTICES];
+  uint guideBin[GUIDE_VERTICES];
+  vec3 guideRadiance[GUIDE_VERTICES];  // path.radiance at the vertex
+  vec3 guideWeight[GUIDE_VERTICES];    // Throughput to the vertex times f * cos, no pdf
+  int  guideCount;
+};
+
+// Splitting (eRrAdjoint): the vertex which split, before it sampled its direction. The branches
+// are traced one after the other (ResumeSplit), a path splits at one vertex at most.
+PathState splitPath;
+State     splitState;
+int       splitCount = 0;      // Branches left
+bool      splitDone  = false;  // The path already split
+float     pixelMean  = 0.0;    // Luminance of the pixel accumulated so far, 0 if unknown
+
+PathState StartPath(Ray r, float hitT) {
+  PathState path;
+  path.r = r;
+  path.radiance = vec3(0.0);
+  path.throughput = vec3(1.0);
+  path.absorption = vec3(0.0);
+  path.hitT = hitT;
+  path.depth = 0;
+  path.bsdfPdf = 0.0;
+  path.guideCount = 0;
+  splitCount = 0;
+  splitDone = false;
+  return path;
+}
+
+// Estimate of the pixel for the adjoint Russian roulette, from the previous frames
+void StartPixel(ivec2 coords) {
+  pixelMean = rtxState.frame > 0 ? luminance(imageLoad(resultImage, coords).xyz) : 0.0;
+}
+
+//-----------------------------------------------------------------------
+// What came back through each recorded direction [first, guideCount), over its pdf
+//
+void GuideTrain(in PathState path, int first) {
+  for(int i = first; i < path.guideCount; i++) {
+    float weight = luminance(path.guideWeight[i]);
+    if(weight > 0.0)
+      GuideSplat(path.guideCell[i], path.guideBin[i], luminance(path.radiance - path.guideRadiance[i]) / weight);
+  }
+}
+
+uint laneSteps = 0;  // Bounces done by this invocation, for the lane utilization (WorkQueue)
+
+void CountBounce(int depth, uint terminated, uint splits) {
+  if(rtxState.bounceStats == 0)
+    return;
+  int slot = min(depth, BOUNCE_STAT_DEPTH - 1);
+  atomicAdd(workQueue.bouncePaths[slot], 1);
+  if(terminated > 0)
+    atomicAdd(workQueue.bounceTerminated[slot], terminated);
+  if(splits > 0)
+    atomicAdd(workQueue.bounceSplits[slot], splits);
+}
+
+//-----------------------------------------------------------------------
+// Russian roulette after the vertex sampled its direction: probability to continue below 1, number
+// of branches above 1.
+// - eRrThroughput: on the throughput of the path
+// - eRrAdjoint: the expected contribution of the path to the pixel, throughput times the radiance
+//   learned by the guiding cell, relative to the pixel estimate, is kept in a weight window around
+//   1: paths below are killed with the roulette, paths above are split. Falls back to the
+//   throughput when there is no estimate yet.
+//
+#define ADRRS_WINDOW 5.0       // Ratio of the bounds of the weight window
+#define ADRRS_MIN_SURVIVAL 0.05  // The estimates are coarse, bounds the boost of the survivors
+#define SPLIT_MAX 4
+
+float RussianRoulette(vec3 throughput, in State state, uint cell, int depth) {
+  if(depth < RR_DEPTH)
+    return 1.0;
+  if(rtxState.rrMode == eRrAdjoint && pixelMean > 0.0 && cell != GUIDE_INVALID && guideCells[cell].radiance > 0.0) {
+    float expected = luminance(throughput) * guideCells[cell].radiance / pixelMean;
+    float low = 2.0 / (1.0 + ADRRS_WINDOW);
+    if(expected < low)
+      return max(expected, ADRRS_MIN_SURVIVAL);  // Survivors reach the center of the window
+    if(expected > low * ADRRS_WINDOW)
+      return min(floor(expected), float(SPLIT_MAX));
+    return 1.0;
+  }
+  return min(max(throughput.x, max(throughput.y, throughput.z)) * state.eta * state.eta + 0.001, 0.95);
+}
+
+//-----------------------------------------------------------------------
+// Attributes and material of the closest hit (prd), returns the geometric normal. In the RTX
+// pipeline, the closest-hit shader of the material class did it for the traced rays
+// (traceray_rtx.glsl), not for the hits of the raster pre-pass.
+//
+vec3 HitShading(Ray r, inout State state, bool traced) {
+#ifdef RTX_PIPELINE
+  if(traced) {
+    int depth = state.depth;
+    state = hitPayload.state;
+    state.depth = depth;
+    return hitPayload.geomNormal;
+  }
+#endif
+  return ShadeHit(prd, r, state, -1);
+}
+
+//-----------------------------------------------------------------------
+// TLAS mask of the rays of a bounce: the simplified meshes of MeshLod from rtxState.lodDepth on,
+// the next level at each following bounce. The shadow rays of the hit keep the mask of the ray
+// which found it: they start on the same surface.
+//
+uint LodCullMask(int depth) {
+  int level = rtxState.lodDepth > 0 ? clamp(depth - rtxState.lodDepth + 1, 0, LOD_LEVELS - 1) : 0;
+  return 1u << level;
+}
+
+//-----------------------------------------------------------------------
+// Hit of the bounce: emission and next event estimation. `state` is the hit of the previous
+// bounce (DirectSample at depth 0). Return false when the path is terminated.
+//
+bool IndirectHit(inout PathState path, inout State state) {
+  Ray r = path.r;
+  int depth = path.depth;
+  float hitT = path.hitT;
+  vec3 radiance = path.radiance;
+  vec3 throughput = path.throughput;
+  vec3 absorption = path.absorption;
+  float lightPdf = 0.0;  // Pdf of light sampling reaching the emitter hit by the BSDF sample
+
+  if(depth > 0) {
+    rayCullMask = LodCullMask(depth);
+    ClosestHit(r);
+    STATS_ADD(indirectRays, 1);
+    hitT = prd.hitT;
+
+    // Hitting the environment
+    if(hitT >= INFINITY) {
+      STATS_ADD(envEscapes, 1);
+      vec3 env;
+      if(_sunAndSky.in_use == 1)
+        env = sun_and_sky(_sunAndSky, r.direction);
+      else {
+        vec2 uv = GetSphericalUv(r.direction);  // See sampling.glsl
+        env = texture(environmentTexture, uv).rgb;
       }
+      float misWeight = BsdfMisWeight(path.bsdfPdf, EnvLightPdf(r.direction));
+          // Done sampling return
+      path.radiance = radiance + (env * rtxState.hdrMultiplier * throughput) * misWeight;
+      return false;
     }
 
-    BsdfSampleRec bsdfSampleRec;
-    // Sampling for the next ray
-    bsdfSampleRec.f = Sample(state, -r.direction, state.ffnormal, bsdfSampleRec.L, bsdfSampleRec.pdf, prd.seed);
+    // Get Position, Normal, Tangents, Texture Coordinates, Color and material
+    vec3 geomNormal = HitShading(r, state, true);
+    lightPdf = TrigLightPdf(state.matID, r.direction, hitT, geomNormal);
+  }
 
-    // Set absorption only if the ray is currently inside the object.
-    if(dot(state.ffnormal, bsdfSampleRec.L) < 0.0) {
-      absorption = -log(state.mat.attenuationColor) / vec3(state.mat.attenuationDistance);
-    }
+  // Color at vertices
+  state.mat.albedo *= state.vertColor;
+
+  // Reset absorption when ray is going out of surface
+  if(dot(state.normal, state.ffnormal) > 0.0) {
+    absorption = vec3(0.0);
+  }
 
-    if(bsdfSampleRec.pdf > 0.0) {
-      throughput *= bsdfSampleRec.f * abs(dot(state.ffnormal, bsdfSampleRec.L)) / bsdfSampleRec.pdf;
-    } else {
-      break;
+  // Emissive material, the first hit is done by DirectSample()
+  if(depth > 0)
+    radiance += state.mat.emission * throughput * BsdfMisWeight(path.bsdfPdf, lightPdf);
+
+  // KHR_materials_unlit
+  if(state.mat.unlit) {
+    path.radiance = radiance + state.mat.albedo * throughput;
+    return false;
+  }
+
+  // Add absoption (transmission / volume)
+  throughput *= exp(-absorption * hitT);
+
+  // Next event estimation, the first hit is done by DirectSample()
+  if(depth > 0) {
+    bool bsdfContinues = depth + 1 < rtxState.maxDepth;
+    radiance += ShadowedContribution(DirectLight(r, state, bsdfContinues), state, throughput);
+  }
+
+  path.radiance = radiance;
+  path.throughput = throughput;
+  path.absorption = absorption;
+  path.hitT = hitT;
+  return true;
+}
+
+//-----------------------------------------------------------------------
+// Direction of the next bounce from the hit of IndirectHit(), then Russian roulette or splitting.
+// Return false when the path is terminated.
+//
+bool IndirectScatter(inout PathState path, in State state) {
+  Ray r = path.r;
+  int depth = path.depth;
+  vec3 radiance = path.radiance;
+  vec3 throughput = path.throughput;
+  vec3 absorption = path.absorption;
+
+  BsdfSampleRec bsdfSampleRec;
+  // Sampling for the next ray
+  bsdfSampleRec.f = Sample(state, -r.direction, state.ffnormal, bsdfSampleRec.L, bsdfSampleRec.pdf, prd.seed);
+
+  // Path guiding: one-sample MIS between the BSDF and the learned distribution of the cell.
+  // Sample() only returns the lobe it picked, the mixture pdf needs Eval() of the whole BSDF.
+  // The cells also give the radiance estimate of the adjoint Russian roulette.
+  uint guideCell = GUIDE_INVALID;
+  if(rtxState.guiding == 1 || rtxState.rrMode == eRrAdjoint) {
+    guideCell = GuideFindCell(state.position, rtxState.guideTrain == 1);
+    float guideProb = rtxState.guiding == 1 ? GuideSelectProb(guideCell, state) : 0.0;
+    if(guideProb > 0.0) {
+      if(rand(prd.seed) < guideProb)
+        bsdfSampleRec.L = GuideSample(guideCell);
+      float bsdfPdf = 0.0;
+      bsdfSampleRec.f = Eval(state, -r.direction, state.ffnormal, bsdfSampleRec.L, bsdfPdf);
+      bsdfSampleRec.pdf = mix(bsdfPdf, GuidePdf(guideCell, bsdfSampleRec.L), guideProb);
     }
+  }
+  vec3 guideWeight = throughput * bsdfSampleRec.f * abs(dot(state.ffnormal, bsdfSampleRec.L));
 
-    // Debugging info
-    // if(rtxState.debugging_mode == eWeight && (depth == rtxState.maxDepth - 1)) {
-    //     return throughput;
-    // }
+  // Set absorption only if the ray is currently inside the object.
+  if(dot(state.ffnormal, bsdfSampleRec.L) < 0.0) {
+    absorption = -log(state.mat.attenuationColor) / vec3(state.mat.attenuationDistance);
+  }
 
-#ifdef RR
-    // For Russian-Roulette (minimizing live state)
-    float rrPcont = (depth >= RR_DEPTH) ? min(max(throughput.x, max(throughput.y, throughput.z)) * state.eta * state.eta + 0.001, 0.95) : 1.0;
-#endif
+  if(bsdfSampleRec.pdf > 0.0) {
+    throughput *= bsdfSampleRec.f * abs(dot(state.ffnormal, bsdfSampleRec.L)) / bsdfSampleRec.pdf;
+  } else {
+    CountBounce(depth, 0, 0);
+    return false;
+  }
 
-    // Next ray
-    r.direction = bsdfSampleRec.L;
-    r.origin = OffsetRay(state.position, dot(bsdfSampleRec.L, state.ffnormal) > 0 ? state.ffnormal : -state.ffnormal);
+  // Debugging info
+  // if(rtxState.debugging_mode == eWeight && (depth == rtxState.maxDepth - 1)) {
+  //     return throughput;
+  // }
+
+  // Next ray
+  r.direction = bsdfSampleRec.L;
+  r.origin = OffsetRay(state.position, dot(bsdfSampleRec.L, state.ffnormal) > 0 ? state.ffnormal : -state.ffnormal);
 
 #ifdef RR
-    if(rand(prd.seed) >= rrPcont)
-      break;                // paths with low throughput that won't contribute
-    throughput /= rrPcont;  // boost the energy of the non-terminated paths
+  float rrFactor = RussianRoulette(throughput, state, guideCell, depth);
+  if(rrFactor < 1.0) {
+    if(rand(prd.seed) >= rrFactor) {
+      CountBounce(depth, 1, 0);
+      STATS_ADD(rrTerminations, 1);
+      return false;  // paths with low throughput that won't contribute
+    }
+    throughput /= rrFactor;  // boost the energy of the non-terminated paths
+    guideWeight /= rrFactor;
+  } else if(rrFactor > 1.0 && !splitDone && depth + 1 < rtxState.maxDepth) {
+    // This direction is the first branch, the others resample it from the same vertex
+    int branches = int(rrFactor);
+    splitPath = path;
+    splitPath.throughput /= float(branches);
+    splitState = state;
+    splitCount = branches - 1;
+    splitDone = true;
+    throughput /= float(branches);
+    guideWeight /= float(branches);
+    CountBounce(depth, 0, splitCount);
+  } else
 #endif
+    CountBounce(depth, 0, 0);
+
+  if(rtxState.guideTrain == 1 && guideCell != GUIDE_INVALID && path.guideCount < GUIDE_VERTICES) {
+    path.guideCell[path.guideCount] = guideCell;
+    path.guideBin[path.guideCount] = GuideBin(bsdfSampleRec.L);
+    path.guideRadiance[path.guideCount] = radiance;
+    path.guideWeight[path.guideCount] = guideWeight;
+    path.guideCount++;
   }
 
-  return radiance;
+  path.r = r;
+  path.throughput = throughput;
+  path.absorption = absorption;
+  path.depth = depth + 1;
+  path.bsdfPdf = bsdfSampleRec.pdf;
+  return path.depth < rtxState.maxDepth;
+}
+
+//-----------------------------------------------------------------------
+// One bounce of the path, `state` is the hit of the previous bounce (DirectSample at depth 0).
+// Return false when the path is terminated, path.radiance is then final unless ResumeSplit()
+// has branches left.
+//
+bool IndirectStep(inout PathState path, inout State state) {
+  laneSteps++;
+  uint64_t profileStart = ProfileClock();
+  bool alive = IndirectHit(path, state) && IndirectScatter(path, state);
+  if(prd.hitT < INFINITY)
+    ProfileMaterial(state.matID, profileStart);  // Traversal of the ray which found the hit included
+  return alive;
+}
+
+//-----------------------------------------------------------------------
+// Next branch of the split vertex, once the current one is done. Keeps the radiance of the
+// branches done. Return false when there is no branch left to trace.
+//
+bool ResumeSplit(inout PathState path, inout State state) {
+  while(splitCount > 0) {
+    // The branch done trains its records from the split vertex on, earlier vertices wait for all
+    // branches (GuideTrain with 0)
+    if(rtxState.guideTrain == 1)
+      GuideTrain(path, splitPath.guideCount);
+    vec3 radiance = path.radiance;
+    path = splitPath;
+    path.radiance = radiance;
+    state = splitState;
+    splitCount--;
+    laneSteps++;
+    if(IndirectScatter(path, state))
+      return true;
+  }
+  return false;
+}
+
+vec3 IndirectSample(Ray r, State state, float hitT) {
+  if(hitT >= INFINITY || rtxState.maxDepth <= 0) {
+    StatsPathEnd(0);
+    return vec3(0.0);
+  }
+  PathState path = StartPath(r, hitT);
+  do {
+    while(IndirectStep(path, state)) {
+    }
+  } while(ResumeSplit(path, state));
+  StatsPathEnd(path.depth);
+  if(rtxState.guideTrain == 1)
+    GuideTrain(path, 0);
+  return path.radiance;
 }
 
-vec3 DirectSample(Ray r, out State state, out float firstHitT) {
+//-----------------------------------------------------------------------
+// First hit of the camera ray and its shading state, false when it is the environment
+//
+bool PrimaryHit(Ray r, out State state, out float firstHitT, bool firstSample) {
   // for (int id = 0; id < lightBufInfo.trigLightSize; id++){
   //   TrigLight light = trigLights[id];
   //   vec3 v0 = light.v0;
@@ -397,12 +682,35 @@ vec3 DirectSample(Ray r, out State state, out float firstHitT) {
   //   if (length(r1)*sin1 <= 0.1) return vec3(0, 1, 0);
   //   if (length(r2)*sin2 <= 0.1) return vec3(0, 1, 0);
   // }
-  // TODO: write to gbuffer
-  ClosestHit(r);
+  // The raster pre-pass already found what the first sample sees
+  bool traced = !firstSample || rtxState.rasterPrimary == 0 || !RasterHit(r, pixelCoords);
+  rayCullMask = LodCullMask(0);
+  if(traced) {
+    ClosestHit(r);
+    STATS_ADD(primaryRays, 1);
+  }
   firstHitT = prd.hitT;
+
+  // Keeping what the camera sees, attributes are reconstructed on demand with GetShadeState(VisibilityData)
+  if(firstSample)
+    visibility[rtxState.size.x * pixelCoords.y + pixelCoords.x] = PackVisibility(prd);
+
   if(prd.hitT >= INFINITY) {
+    STATS_ADD(envEscapes, 1);
     // state.position = vec3(INFINITY) + abs(r.origin);
+    return false;
+  }
+
+  HitShading(r, state, traced);
 
+  // Color at vertices
+  state.mat.albedo *= state.vertColor;
+  return true;
+}
+
+vec3 DirectSample(Ray r, out State state, out float firstHitT, bool firstSample) {
+  uint64_t profileStart = ProfileClock();
+  if(!PrimaryHit(r, state, firstHitT, firstSample)) {
     vec3 env;
     if(_sunAndSky.in_use == 1)
       env = sun_and_sky(_sunAndSky, r.direction);
@@ -414,34 +722,6 @@ vec3 DirectSample(Ray r, out State state, out float firstHitT) {
     return (env * rtxState.hdrMultiplier);
   }
 
-  ShadeState sstate = GetShadeState(prd);
-  GeomData gData;
-  state.position = sstate.position;
-  gData.position = sstate.position;
-  state.normal = sstate.normal;
-  gData.normal = sstate.normal;
-  state.tangent = sstate.tangent_u[0];
-  gData.tangent = sstate.tangent_u[0];
-  state.bitangent = sstate.tangent_v[0];
-  state.texCoord = sstate.text_coords[0];
-  gData.texCoord = sstate.text_coords[0];
-  state.matID = sstate.matIndex;
-  gData.matIndex = sstate.matIndex;
-  state.isEmitter = false;
-  state.specularBounce = false;
-  state.isSubsurface = false;
-  state.ffnormal = dot(state.normal, r.direction) <= 0.0 ? state.normal : -state.normal;
-
-  state.vertColor = sstate.color;
-  gData.vertColor = sstate.color;
-
-  // Filling material structures
-  GetMaterialsAndTextures(state, r);
-
-  // Color at vertices
-  state.mat.albedo *= sstate.color;
-  gbuffer[rtxState.size.x * gl_GlobalInvocationID.y + gl_GlobalInvocationID.x] = gData;
-
   if(rtxState.debugging_mode > eIndirectResult)
     return DebugInfo(state);
 
@@ -449,93 +729,18 @@ vec3 DirectSample(Ray r, out State state, out float firstHitT) {
     return state.mat.albedo;
   }
 
-  Ray shadowRay;
-  BsdfSampleRec bsdfSampleRec;
-  if(rand(prd.seed) > (1.0 - state.mat.roughness * 2.0)) { // importance sampling on light sources
-    vec4 dirAndPdf;
-    vec3 Li = vec3(0.0);
-    float dist = INFINITY;
-    float rnd = rand(prd.seed);
-    if(rnd < rtxState.environmentProb) {
-        // Sample environment
-      dirAndPdf = EnvSample(Li);
-      if(dirAndPdf.w <= 0.0)
-        return state.mat.emission;
-      dirAndPdf.w *= rtxState.environmentProb;
-    } else {
-      if(rnd < rtxState.environmentProb + (1.0 - rtxState.environmentProb) * lightBufInfo.trigSampProb) {
-          // Sample triangle mesh light
-        dirAndPdf = SampleTriangleLight(state.position, Li, dist);
-        dirAndPdf.w *= lightBufInfo.trigSampProb;
-      } else {
-          // Sample point light
-        dirAndPdf = SamplePuncLight(state.position, Li, dist);
-        dirAndPdf.w *= 1.0 - lightBufInfo.trigSampProb;
-      }
-      if(dirAndPdf.w <= 0.0)
-        return state.mat.emission;
-
-      dirAndPdf.w *= (1.0 - rtxState.environmentProb);
-    }
-      // shadowRay.origin = OffsetRay(state.position, state.ffnormal);
-      // float offset = length(state.position - shadowRay.origin) + 1e-4;
-    shadowRay.direction = dirAndPdf.xyz;
-    shadowRay.origin = state.position + shadowRay.direction * 1e-4;
-
-    if(AnyHit(shadowRay, dist - 2e-4))
-      return state.mat.emission;
-    else {
-      bsdfSampleRec.f = Eval(state, -r.direction, state.ffnormal, shadowRay.direction, bsdfSampleRec.pdf);
-      return Li * bsdfSampleRec.f *
-        max(dot(state.ffnormal, dirAndPdf.xyz), 0.0) / dirAndPdf.w + state.mat.emission;
-    }
-  } else { // importance sampling on brdf
-    bsdfSampleRec.f = Sample(state, -r.direction, state.ffnormal, bsdfSampleRec.L, bsdfSampleRec.pdf, prd.seed);
-
-    if(bsdfSampleRec.pdf > 0.0) {
-      vec3 throughput = bsdfSampleRec.f * abs(dot(state.ffnormal, bsdfSampleRec.L)) / bsdfSampleRec.pdf;
-      shadowRay.direction = bsdfSampleRec.L;
-      shadowRay.origin = OffsetRay(state.position, dot(bsdfSampleRec.L, state.ffnormal) > 0 ? state.ffnormal : -state.ffnormal);
-      ClosestHit(shadowRay);
-      if(prd.hitT >= INFINITY) {
-        vec3 env;
-        if(_sunAndSky.in_use == 1)
-          env = sun_and_sky(_sunAndSky, shadowRay.direction);
-        else {
-          vec2 uv = GetSphericalUv(shadowRay.direction);  // See sampling.glsl
-          env = texture(environmentTexture, uv).rgb;
-        }
-        // Done sampling return
-        return state.mat.emission + (env * rtxState.hdrMultiplier) * throughput;
-      }
-      State state2;
-      sstate = GetShadeState(prd);
-      // state2.position = sstate.position;
-      // state2.normal = sstate.normal;
-      // state2.tangent = sstate.tangent_u[0];
-      // state2.bitangent = sstate.tangent_v[0];
-      // state2.texCoord = sstate.text_coords[0];
-      state2.matID = sstate.matIndex;
-      // state2.isEmitter = false;
-      // state2.specularBounce = false;
-      // state2.isSubsurface = false;
-      state2.ffnormal = dot(state2.normal, r.direction) <= 0.0 ? state2.normal : -state2.normal;
-      // state2.vertColor = sstate.color;
-      GetMaterialsAndTextures(state2, shadowRay);
-
-      return state.mat.emission + state2.mat.emission * throughput;
-    } else {
-      return vec3(0.0);
-    }
-  }
+  // Next event estimation, the BSDF sample of this hit is traced by IndirectSample() which adds
+  // the lights it hits with the other MIS weight. That part of the direct lighting is then in
+  // eIndirectResult, eDirectResult keeps the light sample alone.
+  bool bsdfContinues = rtxState.maxDepth > 1 && rtxState.debugging_mode != eDirectResult;
+  vec3 radiance = state.mat.emission + ShadowedContribution(DirectLight(r, state, bsdfContinues), state, vec3(1.0));
+  ProfileMaterial(state.matID, profileStart);
+  return radiance;
 }
 
 //-----------------------------------------------------------------------
 //-----------------------------------------------------------------------
-Ray raySpawn(ivec2 imageCoords, ivec2 sizeImage) {
-  // Subpixel jitter: send the ray through a different position inside the pixel each time, to provide antialiasing.
-  vec2 subpixel_jitter = rtxState.frame == 0 ? vec2(0.5f, 0.5f) : vec2(rand(prd.seed), rand(prd.seed));
-
+Ray raySpawn(ivec2 imageCoords, ivec2 sizeImage, vec2 subpixel_jitter) {
   // Compute sampling position between [-1 .. 1]
   const vec2 pixelCenter = vec2(imageCoords) + subpixel_jitter;
   const vec2 inUV = pixelCenter / vec2(sizeImage.xy);
@@ -557,3 +762,66 @@ Ray raySpawn(ivec2 imageCoords, ivec2 sizeImage) {
 
   return Ray(origin.xyz + randomAperturePos, finalRayDir);
 }
+
+Ray raySpawn(ivec2 imageCoords, ivec2 sizeImage) {
+  // Subpixel jitter: send the ray through a different position inside the pixel each time, to provide antialiasing.
+  vec2 subpixel_jitter = rtxState.frame == 0 ? vec2(0.5f, 0.5f) : vec2(rand(prd.seed), rand(prd.seed));
+  return raySpawn(imageCoords, sizeImage, subpixel_jitter);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Radiance of a sample, clamped to cut fireflies
+//
+vec3 ClampFirefly(vec3 radiance) {
+  float lum = dot(radiance, vec3(0.212671f, 0.715160f, 0.072169f));
+  if(lum > rtxState.fireflyClampThreshold) {
+    radiance *= rtxState.fireflyClampThreshold / lum;
+  }
+  return radiance;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Color of the frame for the pixel: accumulated in the output image, or kept for the occlusion pass
+//
+void StorePixel(ivec2 imageCoords, vec3 pixelColor, uint64_t start) {
+  // Debug - Heatmap
+  if(rtxState.debugging_mode == eHeatmap) {
+    uint64_t end = clockRealtimeEXT();
+    uint64_t clocks = end - start;
+#if PT_PROFILE
+    if(rtxState.heatmapStage >= 0 && rtxState.heatmapStage < PROFILE_STAGES)
+      clocks = profileClocks[rtxState.heatmapStage];  // Only one stage, see profile.glsl
+#endif
+    float low = rtxState.minHeatmap;
+    float high = rtxState.maxHeatmap;
+    float val = clamp((float(clocks) - low) / (high - low), 0.0, 1.0);
+    pixelColor = temperature(val);
+
+    // Wrap & SM visualization
+    // pixelColor = temperature(float(gl_SMIDNV) / float(gl_SMCountNV - 1)) * float(gl_WarpIDNV) / float(gl_WarpsPerSMNV - 1);
+  }
+  ProfileFlush();
+
+  // With deferred shadows, the visible shadow rays are added to the color of the frame, which is
+  // accumulated by shadow_resolve.comp
+  if(rtxState.deferShadows == 1) {
+    if(all(lessThan(imageCoords, rtxState.size))) {
+      uint pixel = imageCoords.y * rtxState.size.x + imageCoords.x;
+      shadowAccum[pixel * 3 + 0] = pixelColor.x;
+      shadowAccum[pixel * 3 + 1] = pixelColor.y;
+      shadowAccum[pixel * 3 + 2] = pixelColor.z;
+    }
+    return;
+  }
+
+  // Saving pixel color
+  if(rtxState.frame > 0) {
+    // Do accumulation over time
+    vec3 old_color = imageLoad(resultImage, imageCoords).xyz;
+    vec3 new_result = mix(old_color, pixelColor, 1.0f / float(rtxState.frame + 1));
+    imageStore(resultImage, imageCoords, vec4(new_result, 1.f));
+  } else {
+    // First frame, replace the value in the buffer
+    imageStore(resultImage, imageCoords, vec4(pixelColor, 1.f));
+  }
+}
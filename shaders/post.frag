@@ -25,6 +25,7 @@
 #extension GL_GOOGLE_include_directive : enable
 #extension GL_EXT_debug_printf : enable
 #extension GL_ARB_gpu_shader_int64 : enable  // Shader reference
+#extension GL_EXT_scalar_block_layout : enable
 
 
 #define TONEMAP_UNCHARTED
@@ -36,7 +37,9 @@
 layout(location = 0) in vec2 uvCoords;
 layout(location = 0) out vec4 fragColor;
 
-layout(set = 0, binding = 0) uniform sampler2D inImage;
+layout(set = 0, binding = eSampler) uniform sampler2D inImage;
+layout(set = 0, binding = eLumSampler) uniform sampler2D lumImage;  // Average luminance of 16x16 tiles, with mipmaps
+layout(set = 0, binding = eExposure, scalar) readonly buffer _Exposure { ExposureData exposure; };
 
 layout(push_constant) uniform _Tonemapper
 {
@@ -69,6 +72,16 @@ vec3 toneExposure(vec3 RGB, float logAvgLum)
   return RGB / XYZ.y * Yd;
 }
 
+// Luminance of the image averaged over 2^level pixels. The low resolution luminance image
+// starts at 16x16 pixels, finer levels are taken from it as well.
+float localLuminance(vec2 uv, int level)
+{
+  if(level == 0)
+    return luminance(texture(inImage, uv).rgb);
+  vec2 lumUv = uv * vec2(textureSize(inImage, 0)) / (vec2(textureSize(lumImage, 0)) * EXPOSURE_GROUP_SIZE);
+  return textureLod(lumImage, lumUv, max(level - 4, 0)).r;
+}
+
 vec3 toneLocalExposure(vec3 RGB, float logAvgLum)
 {
   vec3  XYZ = RGB2XYZ * RGB;
@@ -79,8 +92,8 @@ vec3 toneLocalExposure(vec3 RGB, float logAvgLum)
   float scale[7] = float[7](1, 2, 4, 8, 16, 32, 64);
   for(int i = 0; i < 7; ++i)
   {
-    float v1 = luminance(texture(inImage, uvCoords * tm.zoom, i).rgb) * factor;
-    float v2 = luminance(texture(inImage, uvCoords * tm.zoom, i + 1).rgb) * factor;
+    float v1 = localLuminance(uvCoords * tm.zoom, i) * factor;
+    float v2 = localLuminance(uvCoords * tm.zoom, i + 1) * factor;
     if(abs(v1 - v2) / ((tm.key * pow(2, phi) / (scale[i] * scale[i])) + v1) > epsilon)
     {
       La = v1;
@@ -102,8 +115,7 @@ void main()
 
   if(((tm.autoExposure >> 0) & 1) == 1)
   {
-    vec4  avg     = textureLod(inImage, vec2(0.5), 20);  // Get the average value of the image
-    float avgLum2 = luminance(avg.rgb);                  // Find the luminance
+    float avgLum2 = max(exposure.avgLum, 1e-4);  // Log-average luminance, see exposure_average.comp
     if(((tm.autoExposure >> 1) & 1) == 1)
       hdr.rgb = toneLocalExposure(hdr.rgb, avgLum2);  // Adjust exposure
     else
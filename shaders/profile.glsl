@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Shader clock attribution (PT_PROFILE), compiled out otherwise.
+// - PROFILE_BEGIN / PROFILE_END around a stage, in the same scope, add to the clocks of the
+//   invocation: the eHeatmap debug mode can show one stage (RtxState::heatmapStage)
+// - ProfileFlush() adds them to the stage counters once the pixel is done
+// - ProfileMaterial() adds the time since `start` (ProfileClock) to a material
+// Shaders using it need GL_EXT_shader_realtime_clock.
+
+#ifndef PROFILE_GLSL
+#define PROFILE_GLSL 1
+
+#if PT_PROFILE
+
+uint64_t profileClocks[PROFILE_STAGES];
+
+#define PROFILE_BEGIN(stage) uint64_t profileStart_##stage = clockRealtimeEXT()
+#define PROFILE_END(stage) profileClocks[stage] += clockRealtimeEXT() - profileStart_##stage
+
+uint64_t ProfileClock() {
+  return clockRealtimeEXT();
+}
+
+void ProfileReset() {
+  for(int i = 0; i < PROFILE_STAGES; i++)
+    profileClocks[i] = 0;
+}
+
+// 64 bits with 32 bits atomics: the carry of the low word goes to the high word
+void ProfileAdd(uint counter, uint64_t clocks, uint count) {
+  uint lo = uint(clocks & 0xFFFFFFFFul);
+  uint hi = uint(clocks >> 32);
+  uint prev = atomicAdd(profileCounters[counter].clocksLo, lo);
+  if(prev + lo < prev)
+    hi++;
+  if(hi > 0)
+    atomicAdd(profileCounters[counter].clocksHi, hi);
+  atomicAdd(profileCounters[counter].count, count);
+}
+
+void ProfileFlush() {
+  for(int i = 0; i < PROFILE_STAGES; i++) {
+    if(profileClocks[i] > 0)
+      ProfileAdd(i, profileClocks[i], 1);
+  }
+  ProfileReset();
+}
+
+void ProfileMaterial(uint matIndex, uint64_t start) {
+  uint counter = PROFILE_STAGES + matIndex;
+  if(counter < profileCounters.length())
+    ProfileAdd(counter, clockRealtimeEXT() - start, 1);
+}
+
+#else
+
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+uint64_t ProfileClock() {
+  return 0;
+}
+void ProfileReset() {}
+void ProfileFlush() {}
+void ProfileMaterial(uint matIndex, uint64_t start) {}
+
+#endif  // PT_PROFILE
+
+#endif  // PROFILE_GLSL
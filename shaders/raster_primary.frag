@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Raster pre-pass of the primary visibility, see raster_primary.hpp
+// Writes the instance and the triangle seen at the pixel. Alpha-masked materials use the same
+// test as HitTest() in traceray_rq.glsl, blended materials are kept and left to the path tracer.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_scalar_block_layout : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+
+#include "host_device.h"
+
+layout(push_constant) uniform _RasterPushConstant
+{
+  RasterPushConstant pc;
+};
+
+// clang-format off
+layout(set = S_SCENE, binding = eInstData, scalar) readonly buffer _InstanceInfo { InstanceData geoInfo[]; };
+layout(set = S_SCENE, binding = eMaterials, scalar) readonly buffer _MaterialBuffer { GltfShadeMaterial materials[]; };
+layout(set = S_SCENE, binding = eTextures) uniform sampler2D texturesMap[];
+// clang-format on
+
+layout(location = 0) in vec2 inTexCoord;
+layout(location = 0) out uvec2 outHit;
+
+void main()
+{
+  GltfShadeMaterial mat = materials[max(0, geoInfo[pc.primMesh].materialIndex)];
+  if(mat.alphaMode == ALPHA_MASK)
+  {
+    float alpha = mat.pbrBaseColorFactor.a;
+    if(mat.pbrBaseColorTexture > -1)
+    {
+      vec2 uv = (vec4(inTexCoord, 1, 1) * mat.uvTransform).xy;
+      alpha *= textureLod(texturesMap[nonuniformEXT(mat.pbrBaseColorTexture)], uv, 0).a;
+    }
+    if(alpha <= mat.alphaCutoff)
+      discard;
+  }
+
+  outHit = uvec2(pc.instanceID, gl_PrimitiveID);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Raster pre-pass of the primary visibility, see raster_primary.hpp
+// Vertices are pulled from the same buffers as the ones used for shading.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_scalar_block_layout : enable
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_buffer_reference2 : require
+
+#include "host_device.h"
+
+layout(push_constant) uniform _RasterPushConstant
+{
+  RasterPushConstant pc;
+};
+
+// clang-format off
+layout(set = S_SCENE, binding = eInstData, scalar) readonly buffer _InstanceInfo { InstanceData geoInfo[]; };
+layout(buffer_reference, scalar) readonly buffer Vertices { VertexAttributes v[]; };
+// clang-format on
+
+layout(location = 0) out vec2 outTexCoord;
+
+void main()
+{
+  Vertices         vertices = Vertices(geoInfo[pc.primMesh].vertexAddress);
+  VertexAttributes attr     = vertices.v[gl_VertexIndex];
+
+  outTexCoord = attr.texcoord;
+  gl_Position = pc.mvp * vec4(attr.position, 1.0);
+}
@@ -144,4 +144,164 @@ ShadeState GetShadeState(in PtPayload hstate)
   return sstate;
 }
 
+//-----------------------------------------------------------------------
+// Visibility buffer: compact hit of the camera ray
+//-----------------------------------------------------------------------
+VisibilityData PackVisibility(in PtPayload hstate)
+{
+  VisibilityData vis;
+  vis.instanceID   = hstate.hitT < INFINITY ? uint(hstate.instanceID) : VISIBILITY_MISS;
+  vis.primitiveID  = uint(hstate.primitiveID);
+  vis.barycentrics = packUnorm2x16(hstate.baryCoord);
+  return vis;
+}
+
+// Rebuilding the hit information, the transformations come from the node.
+// The distance of the hit is not stored, hitT is only telling if something was hit.
+PtPayload UnpackVisibility(in VisibilityData vis)
+{
+  PtPayload hstate;
+  hstate.seed = 0;
+  if(vis.instanceID == VISIBILITY_MISS)
+  {
+    hstate.hitT = INFINITY;
+    return hstate;
+  }
+
+  NodeData node              = nodes[vis.instanceID];
+  hstate.hitT                = 0.0;
+  hstate.primitiveID         = int(vis.primitiveID);
+  hstate.instanceID          = int(vis.instanceID);
+  hstate.instanceCustomIndex = node.primMesh;
+  hstate.baryCoord           = unpackUnorm2x16(vis.barycentrics);
+  hstate.objectToWorld       = mat4x3(node.objectToWorld);
+  hstate.worldToObject       = mat4x3(node.worldToObject);
+  return hstate;
+}
+
+ShadeState GetShadeState(in VisibilityData vis)
+{
+  return GetShadeState(UnpackVisibility(vis));
+}
+
+//-----------------------------------------------------------------------
+// Primary hit from the raster pre-pass. The camera ray goes through the same sub-pixel position
+// as the rasterization (rtxState.jitter), so only the triangle found there is intersected.
+// Returns false when the TLAS has to be traversed: blended material, back face or numerical miss.
+//
+bool RasterHit(Ray r, ivec2 coords)
+{
+  uvec2 hit = imageLoad(primaryHits, coords).xy;
+  if(hit.x == VISIBILITY_MISS)
+  {
+    prd.hitT = INFINITY;  // Nothing was rasterized, the ray sees the environment
+    return true;
+  }
+
+  NodeData          node = nodes[hit.x];
+  InstanceData      inst = geoInfo[node.primMesh];
+  GltfShadeMaterial mat  = materials[max(0, inst.materialIndex)];
+
+  // Stochastic opacity in HitTest, unless the instance is forced opaque
+  if(mat.alphaMode == ALPHA_BLEND && (mat.pbrBaseColorFactor.a < 1.0 || mat.pbrBaseColorTexture > -1))
+    return false;
+
+  Indices  indices  = Indices(inst.indexAddress);
+  Vertices vertices = Vertices(inst.vertexAddress);
+  uvec3    tri      = indices.i[hit.y];
+  vec3     v0       = vec3(node.objectToWorld * vec4(vertices.v[tri.x].position, 1.0));
+  vec3     v1       = vec3(node.objectToWorld * vec4(vertices.v[tri.y].position, 1.0));
+  vec3     v2       = vec3(node.objectToWorld * vec4(vertices.v[tri.z].position, 1.0));
+
+  // Moller-Trumbore, the barycentrics are the same as the ones of the ray query
+  vec3  e1  = v1 - v0;
+  vec3  e2  = v2 - v0;
+  vec3  p   = cross(r.direction, e2);
+  float det = dot(e1, p);
+
+  // Back faces are culled in ClosestHit, the pre-pass does not cull
+  if(abs(det) < 1e-12 || (det < 0.0 && mat.doubleSided == 0))
+    return false;
+
+  float invDet = 1.0 / det;
+  vec3  s      = r.origin - v0;
+  vec3  q      = cross(s, e1);
+  float u      = dot(s, p) * invDet;
+  float v      = dot(r.direction, q) * invDet;
+  float t      = dot(e2, q) * invDet;
+  if(u < 0.0 || v < 0.0 || u + v > 1.0 || t <= 0.0)
+    return false;
+
+  prd.hitT                = t;
+  prd.primitiveID         = int(hit.y);
+  prd.instanceID          = int(hit.x);
+  prd.instanceCustomIndex = node.primMesh;
+  prd.baryCoord           = vec2(u, v);
+  prd.objectToWorld       = mat4x3(node.objectToWorld);
+  prd.worldToObject       = mat4x3(node.worldToObject);
+  return true;
+}
+
+//-----------------------------------------------------------------------
+// Opacity of a candidate hit, from the alpha of the material. The hit is kept with this
+// probability (stochastic alpha blending): HitTest() of the ray query, the any-hit shaders of
+// the RTX pipeline.
+//-----------------------------------------------------------------------
+float HitOpacity(int instanceCustomIndex, int primitiveID, vec2 bary)
+{
+  // Retrieve the Primitive mesh buffer information
+  InstanceData      pinfo    = geoInfo[instanceCustomIndex];
+  const uint        matIndex = max(0, pinfo.materialIndex);  // material of primitive mesh
+  GltfShadeMaterial mat      = materials[matIndex];
+
+  //// Early out if there is no opacity function
+  //if(mat.alphaMode == ALPHA_OPAQUE)
+  //{
+  //  return 1.0;
+  //}
+
+  float baseColorAlpha = mat.pbrBaseColorFactor.a;
+  if(mat.pbrBaseColorTexture > -1)
+  {
+    const uint idGeo  = instanceCustomIndex;  // Geometry of this instance
+    const uint idPrim = primitiveID;          // Triangle ID
+
+    // Primitive buffer addresses
+    Indices  indices  = Indices(geoInfo[idGeo].indexAddress);
+    Vertices vertices = Vertices(geoInfo[idGeo].vertexAddress);
+
+    // Indices of this triangle primitive.
+    uvec3 tri = indices.i[idPrim];
+
+    // All vertex attributes of the triangle.
+    VertexAttributes attr0 = vertices.v[tri.x];
+    VertexAttributes attr1 = vertices.v[tri.y];
+    VertexAttributes attr2 = vertices.v[tri.z];
+
+    // Get the texture coordinate
+    const vec3 barycentrics = vec3(1.0 - bary.x - bary.y, bary.x, bary.y);
+    const vec2 uv0          = attr0.texcoord;
+    const vec2 uv1          = attr1.texcoord;
+    const vec2 uv2          = attr2.texcoord;
+    vec2       texcoord0    = uv0 * barycentrics.x + uv1 * barycentrics.y + uv2 * barycentrics.z;
+
+    // Uv Transform
+    texcoord0 = (vec4(texcoord0.xy, 1, 1) * mat.uvTransform).xy;
+
+    baseColorAlpha *= textureLod(texturesMap[nonuniformEXT(mat.pbrBaseColorTexture)], texcoord0, 0).a;
+  }
+
+  float opacity;
+  if(mat.alphaMode == ALPHA_MASK)
+  {
+    opacity = baseColorAlpha > mat.alphaCutoff ? 1.0 : 0.0;
+  }
+  else
+  {
+    opacity = baseColorAlpha;
+  }
+
+  return opacity;
+}
+
 #endif  // SHADE_STATE_GLSL
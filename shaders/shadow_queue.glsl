@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Deferred shadow rays, used when rtxState.deferShadows is set.
+// The path tracer does not trace its shadow rays: it queues them with the contribution they bring
+// if the light is visible. The occlusion pass (shadow_trace.comp) traces the whole queue with a
+// small kernel, without the State/Material live state of the shading.
+// Requires GL_KHR_shader_subgroup_ballot.
+
+#ifndef SHADOW_QUEUE_GLSL
+#define SHADOW_QUEUE_GLSL 1
+
+//-----------------------------------------------------------------------
+// Return true if the ray is queued, false if it must be traced inline (queue full)
+//
+bool QueueShadowRay(Ray r, float tmax, vec3 contribution)
+{
+  uvec2 pixel = uvec2(pixelCoords);
+  if(any(greaterThanEqual(pixel, uvec2(rtxState.size))))
+    return true;  // Outside of the image, nothing to add
+
+  // The firefly clamp of the sample does not see this contribution anymore, clamping it alone
+  float lum = dot(contribution, vec3(0.212671f, 0.715160f, 0.072169f));
+  if(lum > rtxState.fireflyClampThreshold)
+    contribution *= rtxState.fireflyClampThreshold / lum;
+  contribution = min(contribution / float(rtxState.spp), vec3(65504.0));  // half float range
+
+  // One atomic per subgroup reserves the slots of all active lanes: the queue stays compact
+  uvec4 ballot = subgroupBallot(true);
+  uint  count  = subgroupBallotBitCount(ballot);
+  uint  base   = 0;
+  if(subgroupElect())
+  {
+    base = atomicAdd(shadowQueue.count, count);
+    atomicMax(shadowQueue.groupX, (min(base + count, shadowQueue.capacity) + SHADOW_GROUP_SIZE - 1) / SHADOW_GROUP_SIZE);
+  }
+  uint slot = subgroupBroadcastFirst(base) + subgroupBallotExclusiveBitCount(ballot);
+  if(slot >= shadowQueue.capacity)
+    return false;
+
+  ShadowRecord rec;
+  rec.origin         = r.origin;
+  rec.tmax           = tmax;
+  rec.direction      = r.direction;
+  rec.pixel          = pixel.y * rtxState.size.x + pixel.x;
+  rec.contribRG      = packHalf2x16(contribution.xy);
+  rec.contribB       = packHalf2x16(vec2(contribution.z, 0)) | (rayCullMask << 16);  // Same geometry as inline
+  shadowRecords[slot] = rec;
+  return true;
+}
+
+#endif  // SHADOW_QUEUE_GLSL
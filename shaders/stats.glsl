@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// Ray and path counters (RayStats), compiled out when PT_STATS is 0.
+// The active lanes of the subgroup add their counts together, one atomic per subgroup.
+// Shaders using it need GL_KHR_shader_subgroup_ballot and GL_KHR_shader_subgroup_arithmetic.
+
+#ifndef STATS_GLSL
+#define STATS_GLSL 1
+
+#if PT_STATS
+
+#define STATS_ADD(counter, value)                                                                                      \
+  {                                                                                                                    \
+    uint statsSum_ = subgroupAdd(uint(value));                                                                         \
+    if(subgroupElect() && statsSum_ > 0)                                                                               \
+      atomicAdd(rayStats.counter, statsSum_);                                                                          \
+  }
+
+// Histogram of the path lengths: one atomic per distinct length in the subgroup
+void StatsPathEnd(int depth) {
+  uint bin = uint(clamp(depth, 0, STATS_PATH_LENGTHS - 1));
+  STATS_ADD(paths, 1);
+  while(true) {
+    if(subgroupBroadcastFirst(bin) == bin) {
+      uint count = subgroupBallotBitCount(subgroupBallot(true));
+      if(subgroupElect())
+        atomicAdd(rayStats.pathLength[bin], count);
+      break;
+    }
+  }
+}
+
+#else
+
+#define STATS_ADD(counter, value)
+void StatsPathEnd(int depth) {}
+
+#endif  // PT_STATS
+
+#endif  // STATS_GLSL
@@ -20,10 +20,14 @@
 
 //-------------------------------------------------------------------------------------------------
 // This file has the Ray Query functions for Closest-Hit and Any-Hit shader.
-// The RTX pipeline implementation of thoses functions are in traceray_rtx.
+// The RTX pipeline implementation of thoses functions are in traceray_rtx.glsl.
 // This is used in pathtrace.glsl (Ray-Generation shader)
 
 #include "shade_state.glsl"
+#include "stats.glsl"
+#include "profile.glsl"
+
+uint rayCullMask = 1u;  // Level of detail of the traced rays, TLAS instance mask (see LodCullMask)
 
 //----------------------------------------------------------
 // Testing if the hit is opaque or alpha-transparent
@@ -31,71 +35,13 @@
 //----------------------------------------------------------
 bool HitTest(in rayQueryEXT rayQuery, in Ray r)
 {
+  STATS_ADD(candidateHits, 1);
   int InstanceCustomIndexEXT = rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, false);
   int PrimitiveID            = rayQueryGetIntersectionPrimitiveIndexEXT(rayQuery, false);
-
-  // Retrieve the Primitive mesh buffer information
-  InstanceData      pinfo    = geoInfo[InstanceCustomIndexEXT];
-  const uint        matIndex = max(0, pinfo.materialIndex);  // material of primitive mesh
-  GltfShadeMaterial mat      = materials[matIndex];
-
-  //// Back face culling defined by material
-  //bool front_face = rayQueryGetIntersectionFrontFaceEXT(rayQuery, false);
-  //if(mat.doubleSided == 0 && front_face == false)
-  //{
-  //  return false;
-  //}
-
-  //// Early out if there is no opacity function
-  //if(mat.alphaMode == ALPHA_OPAQUE)
-  //{
-  //  return true;
-  //}
-
-  float baseColorAlpha = mat.pbrBaseColorFactor.a;
-  if(mat.pbrBaseColorTexture > -1)
-  {
-    const uint idGeo  = InstanceCustomIndexEXT;  // Geometry of this instance
-    const uint idPrim = PrimitiveID;             // Triangle ID
-
-    // Primitive buffer addresses
-    Indices  indices  = Indices(geoInfo[idGeo].indexAddress);
-    Vertices vertices = Vertices(geoInfo[idGeo].vertexAddress);
-
-    // Indices of this triangle primitive.
-    uvec3 tri = indices.i[idPrim];
-
-    // All vertex attributes of the triangle.
-    VertexAttributes attr0 = vertices.v[tri.x];
-    VertexAttributes attr1 = vertices.v[tri.y];
-    VertexAttributes attr2 = vertices.v[tri.z];
-
-    // Get the texture coordinate
-    vec2       bary         = rayQueryGetIntersectionBarycentricsEXT(rayQuery, false);
-    const vec3 barycentrics = vec3(1.0 - bary.x - bary.y, bary.x, bary.y);
-    const vec2 uv0          = attr0.texcoord;
-    const vec2 uv1          = attr1.texcoord;
-    const vec2 uv2          = attr2.texcoord;
-    vec2       texcoord0    = uv0 * barycentrics.x + uv1 * barycentrics.y + uv2 * barycentrics.z;
-
-    // Uv Transform
-    texcoord0 = (vec4(texcoord0.xy, 1, 1) * mat.uvTransform).xy;
-
-    baseColorAlpha *= texture(texturesMap[nonuniformEXT(mat.pbrBaseColorTexture)], texcoord0).a;
-  }
-
-  float opacity;
-  if(mat.alphaMode == ALPHA_MASK)
-  {
-    opacity = baseColorAlpha > mat.alphaCutoff ? 1.0 : 0.0;
-  }
-  else
-  {
-    opacity = baseColorAlpha;
-  }
+  vec2 bary                  = rayQueryGetIntersectionBarycentricsEXT(rayQuery, false);
 
   // do alpha blending the stochastically way
-  if(rand(prd.seed) > opacity)
+  if(rand(prd.seed) > HitOpacity(InstanceCustomIndexEXT, PrimitiveID, bary))
     return false;
 
   return true;
@@ -107,6 +53,7 @@ bool HitTest(in rayQueryEXT rayQuery, in Ray r)
 //
 void ClosestHit(Ray r)
 {
+  PROFILE_BEGIN(eProfileTraversal);
   uint rayFlags = gl_RayFlagsCullBackFacingTrianglesEXT;  // gl_RayFlagsNoneEXT
   prd.hitT      = INFINITY;
 
@@ -115,7 +62,7 @@ void ClosestHit(Ray r)
   rayQueryInitializeEXT(rayQuery,     //
                         topLevelAS,   // acceleration structure
                         rayFlags,     // rayFlags
-                        0xFF,         // cullMask
+                        rayCullMask,  // cullMask
                         r.origin,     // ray origin
                         0.0,          // ray min range
                         r.direction,  // ray direction
@@ -144,6 +91,7 @@ void ClosestHit(Ray r)
     prd.objectToWorld       = rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true);
     prd.worldToObject       = rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true);
   }
+  PROFILE_END(eProfileTraversal);
 }
 
 
@@ -152,6 +100,8 @@ void ClosestHit(Ray r)
 //
 bool AnyHit(Ray r, float maxDist)
 {
+  STATS_ADD(shadowRays, 1);
+  PROFILE_BEGIN(eProfileShadow);
   shadow_payload.isHit = true;      // Asume hit, will be set to false if hit nothing (miss shader)
   shadow_payload.seed  = prd.seed;  // don't care for the update - but won't affect the rahit shader
   uint rayFlags = gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT | gl_RayFlagsCullBackFacingTrianglesEXT;
@@ -161,7 +111,7 @@ bool AnyHit(Ray r, float maxDist)
   rayQueryInitializeEXT(rayQuery,     //
                         topLevelAS,   // acceleration structure
                         rayFlags,     // rayFlags
-                        0xFF,         // cullMask
+                        rayCullMask,  // cullMask
                         r.origin,     // ray origin
                         0.0,          // ray min range
                         r.direction,  // ray direction
@@ -180,6 +130,7 @@ bool AnyHit(Ray r, float maxDist)
   }
 
 
+  PROFILE_END(eProfileShadow);
   // add to ray contribution from next event estimation
   return (rayQueryGetIntersectionTypeEXT(rayQuery, true) != gl_RayQueryCommittedIntersectionNoneEXT);
 }
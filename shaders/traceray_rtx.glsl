@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//-------------------------------------------------------------------------------------------------
+// This file has the RTX pipeline functions for Closest-Hit and Any-Hit, same as traceray_rq.glsl.
+// The closest-hit shader of the material class of the instance also shades the hit
+// (pathtrace.rchit), the any-hit shaders only run on the alpha-tested instances.
+// This is used in pathtrace.glsl (Ray-Generation shader)
+
+#include "shade_state.glsl"
+#include "stats.glsl"
+#include "profile.glsl"
+
+layout(location = 0) rayPayloadEXT HitPayload hitPayload;
+layout(location = 1) rayPayloadEXT ShadowHitPayload shadow_payload;
+
+uint rayCullMask = 1u;  // Level of detail of the traced rays, TLAS instance mask (see LodCullMask)
+
+//-----------------------------------------------------------------------
+// Shoot a ray and return the information of the closest hit, in the
+// PtPayload structure (PRD). The shading is in hitPayload, see HitShading().
+//
+void ClosestHit(Ray r)
+{
+  PROFILE_BEGIN(eProfileTraversal);
+  uint rayFlags       = gl_RayFlagsCullBackFacingTrianglesEXT;
+  hitPayload.hit.seed = prd.seed;  // Stochastic opacity in pathtrace.rahit
+  traceRayEXT(topLevelAS,   // acceleration structure
+              rayFlags,     // rayFlags
+              rayCullMask,  // cullMask
+              0,            // sbtRecordOffset: hit group of the paths
+              RAY_TYPES,    // sbtRecordStride
+              0,            // missIndex
+              r.origin,     // ray origin
+              0.0,          // ray min range
+              r.direction,  // ray direction
+              INFINITY,     // ray max range
+              0);           // payload (location = 0)
+  prd = hitPayload.hit;
+  PROFILE_END(eProfileTraversal);
+}
+
+//-----------------------------------------------------------------------
+// Shadow ray - return true if a ray hits anything
+//
+bool AnyHit(Ray r, float maxDist)
+{
+  STATS_ADD(shadowRays, 1);
+  PROFILE_BEGIN(eProfileShadow);
+  shadow_payload.isHit = true;      // Asume hit, will be set to false if hit nothing (miss shader)
+  shadow_payload.seed  = prd.seed;  // don't care for the update - but won't affect the rahit shader
+  uint rayFlags = gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT | gl_RayFlagsCullBackFacingTrianglesEXT;
+
+  traceRayEXT(topLevelAS,   // acceleration structure
+              rayFlags,     // rayFlags
+              rayCullMask,  // cullMask
+              1,            // sbtRecordOffset: hit group of the shadow rays
+              RAY_TYPES,    // sbtRecordStride
+              1,            // missIndex
+              r.origin,     // ray origin
+              0.0,          // ray min range
+              r.direction,  // ray direction
+              maxDist,      // ray max range
+              1);           // payload (location = 1)
+
+  PROFILE_END(eProfileShadow);
+  return shadow_payload.isHit;
+}
@@ -22,13 +22,16 @@
  *	The Acceleration structure class will holds the scene made of BLASes an TLASes.
  * - It expect a scene in a format of GltfScene  
  * - Each glTF primitive mesh will be in a separate BLAS
- * - All BLASes are using one single Hit shader
+ * - The simplified meshes (MeshLod) have their instances after the ones of the nodes, the mask
+ *   selects the level of detail of the rays
+ * - The hit shaders of an instance are the ones of its material class (RTX pipeline)
  * - It creates a descriptorSet holding the TLAS
  * 
  */
 
 
 #include "accelstruct.hpp"
+#include "memory_tracker.hpp"
 #include "nvvk/raytraceKHR_vk.hpp"
 #include "shaders/host_device.h"
 #include "tools.hpp"
@@ -52,14 +55,14 @@ void AccelStructure::destroy()
   vkDestroyDescriptorSetLayout(m_device, m_rtDescSetLayout, nullptr);
 }
 
-void AccelStructure::create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index)
+void AccelStructure::create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index, const MeshLod& lod)
 {
-  MilliTimer timer;
+  MilliTimer timer("Acceleration structures");
   LOGI("Create acceleration structure \n");
   destroy();  // reset
 
   createBottomLevelAS(gltfScene, vertex, index);
-  createTopLevelAS(gltfScene);
+  createTopLevelAS(gltfScene, lod);
   createRtDescriptorSet();
   timer.print();
 }
@@ -104,6 +107,26 @@ nvvk::RaytracingBuilderKHR::BlasInput AccelStructure::primitiveToGeometry(const
   return input;
 }
 
+//--------------------------------------------------------------------------------------------------
+// Size of the BLAS of a primitive, as built (before compaction)
+//
+VkDeviceSize AccelStructure::blasBuildSize(const nvh::GltfPrimMesh& prim, VkBuffer vertex, VkBuffer index)
+{
+  auto input = primitiveToGeometry(prim, vertex, index);
+
+  VkAccelerationStructureBuildGeometryInfoKHR buildInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
+  buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+  buildInfo.flags         = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+  buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+  buildInfo.geometryCount = static_cast<uint32_t>(input.asGeometry.size());
+  buildInfo.pGeometries   = input.asGeometry.data();
+
+  uint32_t                                 primitiveCount = input.asBuildOffsetInfo[0].primitiveCount;
+  VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+  vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitiveCount, &sizeInfo);
+  return sizeInfo.accelerationStructureSize;
+}
+
 //--------------------------------------------------------------------------------------------------
 //
 //
@@ -111,6 +134,9 @@ void AccelStructure::createBottomLevelAS(nvh::GltfScene&                  gltfSc
                                          const std::vector<nvvk::Buffer>& vertex,
                                          const std::vector<nvvk::Buffer>& index)
 {
+  TRACE_SCOPE("BLAS build");
+  MemoryScope memScope(MemCategory::eBlas);
+
   // BLAS - Storing each primitive in a geometry
   uint32_t                                           prim_idx{0};
   std::vector<nvvk::RaytracingBuilderKHR::BlasInput> allBlas;
@@ -129,20 +155,23 @@ void AccelStructure::createBottomLevelAS(nvh::GltfScene&                  gltfSc
 //--------------------------------------------------------------------------------------------------
 //
 //
-void AccelStructure::createTopLevelAS(nvh::GltfScene& gltfScene)
+void AccelStructure::createTopLevelAS(nvh::GltfScene& gltfScene, const MeshLod& lod)
 {
+  TRACE_SCOPE("TLAS build");
+  MemoryScope memScope(MemCategory::eTlas);
+
   std::vector<VkAccelerationStructureInstanceKHR> tlas;
-  tlas.reserve(gltfScene.m_nodes.size());
+  tlas.reserve(gltfScene.m_nodes.size() + lod.getInstances().size());
 
-  for(auto& node : gltfScene.m_nodes)
-  {
+  auto addInstance = [&](const nvh::GltfNode& node, uint32_t primIndex, uint32_t mask) {
     // Flags
     VkGeometryInstanceFlagsKHR flags{};
-    nvh::GltfPrimMesh&         primMesh = gltfScene.m_primMeshes[node.primMesh];
+    nvh::GltfPrimMesh&         primMesh = gltfScene.m_primMeshes[primIndex];
     nvh::GltfMaterial&         mat      = gltfScene.m_materials[primMesh.materialIndex];
 
     // Always opaque, no need to use anyhit (faster)
-    if(mat.alphaMode == 0 || (mat.baseColorFactor.w == 1.0f && mat.baseColorTexture == -1))
+    bool opaque = mat.alphaMode == 0 || (mat.baseColorFactor.w == 1.0f && mat.baseColorTexture == -1);
+    if(opaque)
       flags |= VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR;
     // Need to skip the cull flag in traceray_rtx for double sided materials
     if(mat.doubleSided == 1)
@@ -150,17 +179,37 @@ void AccelStructure::createTopLevelAS(nvh::GltfScene& gltfScene)
 
     VkAccelerationStructureInstanceKHR rayInst{};
     rayInst.transform                      = nvvk::toTransformMatrixKHR(node.worldMatrix);
-    rayInst.instanceCustomIndex            = node.primMesh;  // gl_InstanceCustomIndexEXT: to find which primitive
-    rayInst.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(node.primMesh);
+    rayInst.instanceCustomIndex            = primIndex;  // gl_InstanceCustomIndexEXT: to find which primitive
+    rayInst.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(primIndex);
     rayInst.flags                          = flags;
-    rayInst.instanceShaderBindingTableRecordOffset = 0;  // We will use the same hit group for all objects
-    rayInst.mask                                   = 0xFF;
+    rayInst.instanceShaderBindingTableRecordOffset = materialClass(mat, opaque) * RAY_TYPES;  // Hit groups of the class
+    rayInst.mask                                   = mask;  // Levels of detail answered, see MeshLod
     tlas.emplace_back(rayInst);
-  }
+  };
+
+  for(uint32_t nodeIndex = 0; nodeIndex < gltfScene.m_nodes.size(); nodeIndex++)
+    addInstance(gltfScene.m_nodes[nodeIndex], gltfScene.m_nodes[nodeIndex].primMesh, lod.nodeMask(nodeIndex));
+  for(const MeshLod::Instance& inst : lod.getInstances())
+    addInstance(gltfScene.m_nodes[inst.node], inst.primMesh, inst.mask);
   LOGI(" TLAS(%d)", tlas.size());
   m_rtBuilder.buildTlas(tlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Hit shaders of the material in the RTX pipeline (MaterialClass). Alpha-tested first: only that
+// class has any-hit shaders, the other instances are forced opaque.
+//
+int AccelStructure::materialClass(const nvh::GltfMaterial& mat, bool opaque)
+{
+  if(!opaque)
+    return eClassAlphaTested;
+  if(mat.unlit.active)
+    return eClassUnlit;
+  if(mat.transmission.factor > 0.f)
+    return eClassTransmissive;
+  return eClassOpaque;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Descriptor set holding the TLAS
 //
@@ -23,13 +23,15 @@
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
 #include "nvvk/raytraceKHR_vk.hpp"
+#include "mesh_lod.hpp"
 
 
 /*
  
  This is for uploading a glTF scene to an acceleration structure.
  - setup as usual
- - create passing the glTF scene and the buffer of vertices and indices pre-constructed
+ - create passing the glTF scene and the buffer of vertices and indices pre-constructed, and the
+   levels of detail of the meshes (MeshLod)
  - retrieve the TLAS with getTlas
  - get the descriptor set and layout 
 
@@ -39,7 +41,8 @@ class AccelStructure
 public:
   void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator);
   void destroy();
-  void create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index);
+  void create(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index, const MeshLod& lod);
+  VkDeviceSize blasBuildSize(const nvh::GltfPrimMesh& prim, VkBuffer vertex, VkBuffer index);
 
   VkAccelerationStructureKHR getTlas() { return m_rtBuilder.getAccelerationStructure(); }
   VkDescriptorSetLayout      getDescLayout() { return m_rtDescSetLayout; }
@@ -48,7 +51,8 @@ public:
 private:
   nvvk::RaytracingBuilderKHR::BlasInput primitiveToGeometry(const nvh::GltfPrimMesh& prim, VkBuffer vertex, VkBuffer index);
   void                                  createBottomLevelAS(nvh::GltfScene& gltfScene, const std::vector<nvvk::Buffer>& vertex, const std::vector<nvvk::Buffer>& index);
-  void                                  createTopLevelAS(nvh::GltfScene& gltfScene);
+  void                                  createTopLevelAS(nvh::GltfScene& gltfScene, const MeshLod& lod);
+  static int                            materialClass(const nvh::GltfMaterial& mat, bool opaque);
   void                                  createRtDescriptorSet();
 
 
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Error of the accumulated image over time against a reference, see convergence_tracker.hpp
+ */
+
+
+#include "convergence_tracker.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <cmath>
+#include <fstream>
+
+
+bool ConvergenceTracker::hasReference()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_hasReference;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Frames of the previous accumulation still in flight are discarded by the worker
+//
+void ConvergenceTracker::restart()
+{
+  m_runStart    = Clock::now();
+  m_lastRequest = m_runStart;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(!m_curve.empty())
+    m_previous = std::move(m_curve);
+  m_curve.clear();
+  m_run++;
+}
+
+std::vector<ConvergenceTracker::Point> ConvergenceTracker::getCurve()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_curve;
+}
+
+std::vector<ConvergenceTracker::Point> ConvergenceTracker::getPrevious()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_previous;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Both curves, one point per line
+//
+bool ConvergenceTracker::writeCsv(const std::string& filename)
+{
+  std::ofstream out(filename);
+  if(!out)
+  {
+    LOGE("ConvergenceTracker: cannot write %s\n", filename.c_str());
+    return false;
+  }
+
+  out << "curve,time_ms,spp,rmse\n";
+  auto writeCurve = [&](const char* name, const std::vector<Point>& curve) {
+    for(const auto& p : curve)
+      out << name << "," << p.timeMs << "," << p.spp << "," << p.rmse << "\n";
+  };
+  writeCurve("current", getCurve());
+  writeCurve("previous", getPrevious());
+  LOGI("Convergence curves written to %s\n", filename.c_str());
+  return true;
+}
+
+bool ConvergenceTracker::wantsFrame()
+{
+  if(m_grabReference)
+    return true;
+  if(!m_enabled || !hasReference())
+    return false;
+  return std::chrono::duration<float, std::milli>(Clock::now() - m_lastRequest).count() >= m_periodMs;
+}
+
+void ConvergenceTracker::scheduled()
+{
+  m_lastRequest = Clock::now();
+
+  Scheduled s;
+  s.timeMs    = std::chrono::duration<double, std::milli>(m_lastRequest - m_runStart).count();
+  s.reference = m_grabReference;
+  s.run       = m_run;
+  m_scheduled.push_back(s);
+  m_grabReference = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called from FrameCapture::poll, frames arrive in the order they were scheduled
+//
+void ConvergenceTracker::consume(const CapturedFramePtr& frame)
+{
+  if(m_scheduled.empty())
+    return;
+  Scheduled s = m_scheduled.front();
+  m_scheduled.pop_front();
+
+  Job job;
+  job.frame     = frame;
+  job.timeMs    = s.timeMs;
+  job.reference = s.reference;
+  job.run       = s.run;
+
+  if(!m_thread.joinable())
+    start();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_queue.size() >= 2 && !job.reference)
+      return;  // Still busy with the previous measures, skipping this one
+    m_queue.push_back(std::move(job));
+  }
+  m_cond.notify_one();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Releasing the frames not compared yet, the readback buffers are about to be destroyed
+//
+void ConvergenceTracker::flush()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_queue.clear();
+  m_scheduled.clear();
+}
+
+void ConvergenceTracker::start()
+{
+  m_quit   = false;
+  m_thread = std::thread(&ConvergenceTracker::worker, this);
+}
+
+void ConvergenceTracker::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_cond.notify_all();
+  if(m_thread.joinable())
+    m_thread.join();
+}
+
+void ConvergenceTracker::worker()
+{
+  TraceRecorder::get().setThreadName("Convergence");
+  while(true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [&] { return m_quit || !m_queue.empty(); });
+      if(m_quit)
+        return;
+      job = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    TRACE_SCOPE("Compare", "worker");
+    compare(job);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// RMSE of the RGB channels against the reference, or the frame becomes the reference
+//
+void ConvergenceTracker::compare(const Job& job)
+{
+  const CapturedFrame& frame = *job.frame;
+  if(frame.format != VK_FORMAT_R32G32B32A32_SFLOAT)
+    return;
+
+  const size_t nbPixels = size_t(frame.size.width) * frame.size.height;
+  auto         pixel    = [&](size_t i) { return reinterpret_cast<const float*>(frame.data + i * frame.pixelStride); };
+
+  if(job.reference)
+  {
+    m_reference.resize(nbPixels * 3);
+    for(size_t i = 0; i < nbPixels; i++)
+    {
+      const float* rgb = pixel(i);
+      for(int c = 0; c < 3; c++)
+        m_reference[i * 3 + c] = rgb[c];
+    }
+    m_referenceSize = frame.size;
+    LOGI("Convergence reference: %u x %u, %d spp\n", frame.size.width, frame.size.height, frame.spp);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hasReference = true;
+    m_curve.clear();
+    m_previous.clear();
+    return;
+  }
+
+  if(frame.size.width != m_referenceSize.width || frame.size.height != m_referenceSize.height)
+    return;
+
+  double sum = 0;
+  for(size_t i = 0; i < nbPixels; i++)
+  {
+    const float* rgb = pixel(i);
+    for(int c = 0; c < 3; c++)
+    {
+      double d = double(rgb[c]) - m_reference[i * 3 + c];
+      sum += d * d;
+    }
+  }
+
+  Point p;
+  p.timeMs = job.timeMs;
+  p.spp    = frame.spp;
+  p.rmse   = std::sqrt(sum / double(nbPixels * 3));
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(job.run == m_run && m_curve.size() < m_maxPoints)
+    m_curve.push_back(p);
+}
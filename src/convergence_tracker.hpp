@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Error of the accumulated image against a reference, over the time since the last reset.
+// Compares sampling strategies at equal time: a converged image is taken as reference once,
+// then each accumulation gives a curve of the RMSE over the elapsed milliseconds. The curve of
+// the previous accumulation is kept next to it.
+// Frames are read back every `m_periodMs` and compared on a worker thread.
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_capture.hpp"
+
+
+class ConvergenceTracker : public FrameSink
+{
+public:
+  struct Point
+  {
+    double timeMs{0};  // Since the reset of the accumulation
+    int    spp{0};
+    double rmse{0};
+  };
+
+  ~ConvergenceTracker() override { stop(); }
+
+  void setReference() { m_grabReference = true; }  // The next frame becomes the reference
+  bool hasReference();
+  void restart();  // The accumulation was reset, the current curve becomes the previous one
+  bool writeCsv(const std::string& filename);
+
+  std::vector<Point> getCurve();
+  std::vector<Point> getPrevious();
+
+  // FrameSink
+  CaptureKind kind() override { return CaptureKind::eHdr; }
+  bool        wantsFrame() override;
+  void        scheduled() override;
+  void        consume(const CapturedFramePtr& frame) override;
+  void        flush() override;
+
+  bool     m_enabled{false};
+  float    m_periodMs{250.f};  // Between two measures
+  uint32_t m_maxPoints{2048};  // Per curve
+
+private:
+  struct Job
+  {
+    CapturedFramePtr frame;
+    double           timeMs{0};
+    bool             reference{false};
+    uint32_t         run{0};
+  };
+
+  struct Scheduled
+  {
+    double   timeMs{0};
+    bool     reference{false};
+    uint32_t run{0};
+  };
+
+  void start();
+  void stop();
+  void worker();
+  void compare(const Job& job);
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point     m_runStart{Clock::now()};
+  Clock::time_point     m_lastRequest{};
+  std::deque<Scheduled> m_scheduled;  // Captures in flight, delivered in order
+  bool                  m_grabReference{false};
+
+  std::thread             m_thread;
+  std::deque<Job>         m_queue;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+  bool                    m_quit{false};
+
+  // Guarded by m_mutex
+  uint32_t           m_run{0};
+  std::vector<Point> m_curve;
+  std::vector<Point> m_previous;
+  bool               m_hasReference{false};
+
+  // Worker thread only
+  std::vector<float> m_reference;  // RGB
+  VkExtent2D         m_referenceSize{};
+};
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+#include "dispatch_sweep.hpp"
+#include "nvh/nvprint.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+
+void DispatchSweep::setup(VkDevice device, VkPhysicalDevice physicalDevice)
+{
+  m_device = device;
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  m_timestampPeriod = properties.limits.timestampPeriod;
+}
+
+void DispatchSweep::destroy()
+{
+  vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+  m_queryPool  = VK_NULL_HANDLE;
+  m_queryCount = 0;
+  m_running    = false;
+  m_done       = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Two timestamps per measured frame, for all variants
+//
+void DispatchSweep::start(const std::vector<std::string>& variants)
+{
+  if(variants.empty() || m_running)
+    return;
+
+  uint32_t queryCount = static_cast<uint32_t>(variants.size()) * m_measuredFrames * 2;
+  if(queryCount > m_queryCount)
+  {
+    vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+    VkQueryPoolCreateInfo createInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    createInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    createInfo.queryCount = queryCount;
+    vkCreateQueryPool(m_device, &createInfo, nullptr, &m_queryPool);
+    m_queryCount = queryCount;
+  }
+
+  m_names   = variants;
+  m_results.clear();
+  m_utilization.assign(variants.size(), 0.f);
+  m_rays.assign(variants.size(), 0.);
+  m_variant   = 0;
+  m_frame     = 0;
+  m_running   = true;
+  m_done      = false;
+  m_startTime = std::chrono::steady_clock::now();
+  LOGI("Dispatch sweep: %d variants, %d frames each\n", int(m_names.size()), int(m_measuredFrames));
+}
+
+void DispatchSweep::begin(VkCommandBuffer cmdBuf)
+{
+  if(m_variant == 0 && m_frame == 0)
+    vkCmdResetQueryPool(cmdBuf, m_queryPool, 0, m_queryCount);
+
+  if(m_frame >= m_warmupFrames)
+  {
+    uint32_t query = (m_variant * m_measuredFrames + (m_frame - m_warmupFrames)) * 2;
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, query);
+  }
+}
+
+void DispatchSweep::end(VkCommandBuffer cmdBuf, float laneUtilization, double raysPerFrame)
+{
+  if(m_frame >= m_warmupFrames)
+  {
+    m_utilization[m_variant] = laneUtilization;
+    m_rays[m_variant]        = raysPerFrame;
+    uint32_t query = (m_variant * m_measuredFrames + (m_frame - m_warmupFrames)) * 2 + 1;
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, query);
+  }
+
+  // Next frame, next variant
+  if(++m_frame == m_warmupFrames + m_measuredFrames)
+  {
+    m_frame = 0;
+    if(++m_variant == static_cast<int>(m_names.size()))
+    {
+      m_variant = 0;
+      m_running = false;
+      m_done    = true;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Waiting for the last frame of the sweep, it must have been submitted
+//
+bool DispatchSweep::collect()
+{
+  if(!m_done)
+    return false;
+  m_done = false;
+
+  uint32_t              count = static_cast<uint32_t>(m_names.size()) * m_measuredFrames * 2;
+  std::vector<uint64_t> timestamps(count);
+  VkResult result = vkGetQueryPoolResults(m_device, m_queryPool, 0, count, sizeof(uint64_t) * count, timestamps.data(),
+                                          sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+  if(result != VK_SUCCESS)
+  {
+    LOGE("Dispatch sweep: cannot read the timestamps\n");
+    return false;
+  }
+
+  m_results.resize(m_names.size());
+  for(size_t v = 0; v < m_names.size(); v++)
+  {
+    double ticks = 0;
+    for(uint32_t f = 0; f < m_measuredFrames; f++)
+    {
+      size_t query = (v * m_measuredFrames + f) * 2;
+      ticks += double(timestamps[query + 1] - timestamps[query]);
+    }
+    m_results[v].name       = m_names[v];
+    m_results[v].msPerFrame = ticks * m_timestampPeriod / 1e6 / m_measuredFrames;
+    m_results[v].laneUtilization = m_utilization[v];
+    m_results[v].raysPerFrame    = m_rays[v];
+  }
+
+  for(auto& r : m_results)
+    LOGI(" - %-28s %8.3f ms/frame %5.1f%% lanes %8.1f Mrays/s\n", r.name.c_str(), r.msPerFrame, r.laneUtilization * 100.0,
+         r.mraysPerSecond());
+  LOGI("Dispatch sweep: fastest is %s\n", m_results[getBest()].name.c_str());
+  return true;
+}
+
+int DispatchSweep::getBest() const
+{
+  if(m_results.empty())
+    return 0;
+  auto best = std::min_element(m_results.begin(), m_results.end(),
+                               [](const Result& a, const Result& b) { return a.msPerFrame < b.msPerFrame; });
+  return static_cast<int>(std::distance(m_results.begin(), best));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Report of the last sweep: one object per variant, the fastest first, and the load of the
+// system sampled during the sweep
+//
+bool DispatchSweep::writeJson(const std::string& filename, const std::vector<SystemSample>& system) const
+{
+  if(m_results.empty())
+    return false;
+  std::ofstream out(filename);
+  if(!out)
+  {
+    LOGE("Dispatch sweep: cannot write %s\n", filename.c_str());
+    return false;
+  }
+
+  std::vector<const Result*> sorted;
+  for(auto& r : m_results)
+    sorted.push_back(&r);
+  std::stable_sort(sorted.begin(), sorted.end(), [](const Result* a, const Result* b) { return a->msPerFrame < b->msPerFrame; });
+
+  out << "{\n  \"measuredFrames\": " << m_measuredFrames << ",\n  \"variants\": [\n";
+  for(size_t i = 0; i < sorted.size(); i++)
+  {
+    const Result& r = *sorted[i];
+    out << "    {\"name\": \"" << r.name << "\", \"msPerFrame\": " << r.msPerFrame
+        << ", \"laneUtilization\": " << r.laneUtilization << ", \"raysPerFrame\": " << r.raysPerFrame
+        << ", \"mraysPerSecond\": " << r.mraysPerSecond() << "}" << (i + 1 < sorted.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"system\": ";
+  SystemMonitor::writeJson(out, system, "  ");
+  out << "\n}\n";
+  LOGI("Dispatch sweep: report written to %s\n", filename.c_str());
+  return true;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Sweep of the dispatch variants of a renderer (Renderer::variants()).
+// The same frame is rendered with each variant, the renderer is bracketed by timestamps. The
+// first frames of each variant are not measured (pipeline creation, caches).
+// - start() with the names of the variants
+// - each frame: begin() / end() around the renderer, using getVariant()
+// - collect() once isDone(): reads the queries, returns the results
+// - writeJson() for the report of the last sweep
+//
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "system_monitor.hpp"
+#include "vulkan/vulkan_core.h"
+
+class DispatchSweep
+{
+public:
+  struct Result
+  {
+    std::string name;
+    double      msPerFrame{0};
+    double      laneUtilization{0};  // As reported by the renderer, 0 if not measured
+    double      raysPerFrame{0};     // As reported by the renderer (PT_STATS), 0 if not measured
+    double      mraysPerSecond() const { return msPerFrame > 0 ? raysPerFrame / (msPerFrame * 1000.0) : 0; }
+  };
+
+  void setup(VkDevice device, VkPhysicalDevice physicalDevice);
+  void destroy();
+
+  void start(const std::vector<std::string>& variants);
+  bool isRunning() const { return m_running; }
+  bool isDone() const { return m_done; }
+  int  getVariant() const { return m_variant; }
+
+  void begin(VkCommandBuffer cmdBuf);
+  void end(VkCommandBuffer cmdBuf, float laneUtilization = 0.f, double raysPerFrame = 0.);
+  bool collect();
+  bool writeJson(const std::string& filename, const std::vector<SystemSample>& system = {}) const;
+
+  std::chrono::steady_clock::time_point getStartTime() const { return m_startTime; }
+
+  const std::vector<Result>& getResults() const { return m_results; }
+  int                        getBest() const;
+
+  uint32_t m_warmupFrames{4};
+  uint32_t m_measuredFrames{16};
+
+private:
+  VkDevice    m_device{VK_NULL_HANDLE};
+  float       m_timestampPeriod{1.0f};  // Nanoseconds per tick
+  VkQueryPool m_queryPool{VK_NULL_HANDLE};
+  uint32_t    m_queryCount{0};
+
+  std::vector<std::string> m_names;
+  std::vector<Result>      m_results;
+  std::vector<float>       m_utilization;  // Last reported during the measured frames, per variant
+  std::vector<double>      m_rays;         // Same, rays per frame
+  bool                     m_running{false};
+  bool                     m_done{false};
+  int                      m_variant{0};
+  uint32_t                 m_frame{0};  // Frame of the current variant, warm-up included
+
+  std::chrono::steady_clock::time_point m_startTime;
+};
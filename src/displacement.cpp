@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Subdivision and displacement of the meshes with a height map, see displacement.hpp
+ */
+
+
+#include "displacement.hpp"
+#include "tools.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+
+namespace {
+const uint32_t kNoSplit  = ~0u;
+const int      kMaxDepth = 32;  // Safety, the texel size stops the subdivision before
+
+//--------------------------------------------------------------------------------------------------
+// Height map read on the CPU from the decoded glTF image (8 bits per channel)
+//
+struct HeightMap
+{
+  const unsigned char* data{nullptr};
+  int                  width{0};
+  int                  height{0};
+  int                  stride{0};
+
+  float texel(int x, int y) const
+  {
+    x                      = ((x % width) + width) % width;  // Repeat
+    y                      = ((y % height) + height) % height;
+    const unsigned char* p = data + (size_t(y) * width + x) * stride;
+    return stride >= 3 ? (p[0] + p[1] + p[2]) / (3.f * 255.f) : p[0] / 255.f;  // Grey, any channel order
+  }
+
+  // Bilinear
+  float sample(const nvmath::vec2f& uv) const
+  {
+    float x  = uv.x * width - 0.5f;
+    float y  = uv.y * height - 0.5f;
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    int   ix = static_cast<int>(fx);
+    int   iy = static_cast<int>(fy);
+    float tx = x - fx;
+    float ty = y - fy;
+    float h0 = texel(ix, iy) * (1.f - tx) + texel(ix + 1, iy) * tx;
+    float h1 = texel(ix, iy + 1) * (1.f - tx) + texel(ix + 1, iy + 1) * tx;
+    return h0 * (1.f - ty) + h1 * ty;
+  }
+};
+
+struct Vertex
+{
+  nvmath::vec3f position;
+  nvmath::vec3f normal;
+  nvmath::vec4f tangent;
+  nvmath::vec2f texcoord;
+  nvmath::vec4f color;
+};
+
+// A mesh to displace, with its material parameters
+struct Job
+{
+  uint32_t  primMesh{0};
+  HeightMap map;
+  float     scale{1.f};
+  float     offset{0.f};
+};
+
+//--------------------------------------------------------------------------------------------------
+// Subdivision of one mesh. Each edge is decided once (m_edges) and keeps its midpoint, shared by
+// the two triangles of the edge.
+//
+class MeshSubdivider
+{
+public:
+  MeshSubdivider(const Job& job, float maxEdge, float tolerance, uint32_t maxTriangles)
+      : m_job(job)
+      , m_maxEdge(maxEdge)
+      , m_tolerance(tolerance)
+      , m_maxTriangles(maxTriangles)
+  {
+  }
+
+  // False when the mesh alone is over maxTriangles
+  bool run(const nvh::GltfScene& gltf)
+  {
+    const nvh::GltfPrimMesh& prim = gltf.m_primMeshes[m_job.primMesh];
+    vertices.resize(prim.vertexCount);
+    for(uint32_t i = 0; i < prim.vertexCount; i++)
+    {
+      size_t idx  = prim.vertexOffset + i;
+      vertices[i] = {gltf.m_positions[idx], gltf.m_normals[idx], gltf.m_tangents[idx], gltf.m_texcoords0[idx],
+                     gltf.m_colors0[idx]};
+    }
+    bounds(posMin, posMax);
+    float diagonal = nvmath::length(posMax - posMin);
+    m_maxEdge *= diagonal;
+    m_minEdge = diagonal * 1e-4f;
+
+    for(uint32_t i = 0; i + 2 < prim.indexCount && !m_overBudget; i += 3)
+    {
+      const uint32_t* tri = &gltf.m_indices[prim.firstIndex + i];
+      subdivide(tri[0], tri[1], tri[2], 0);
+    }
+    if(m_overBudget)
+      return false;
+    displace();
+    bounds(posMin, posMax);
+    return true;
+  }
+
+  std::vector<Vertex>   vertices;
+  std::vector<uint32_t> indices;
+  nvmath::vec3f         posMin;
+  nvmath::vec3f         posMax;
+
+private:
+  void bounds(nvmath::vec3f& lo, nvmath::vec3f& hi) const
+  {
+    lo = hi = vertices.empty() ? nvmath::vec3f(0.f, 0.f, 0.f) : vertices[0].position;
+    for(const Vertex& v : vertices)
+      for(int k = 0; k < 3; k++)
+      {
+        lo[k] = std::min(lo[k], v.position[k]);
+        hi[k] = std::max(hi[k], v.position[k]);
+      }
+  }
+
+  bool needsSplit(const Vertex& a, const Vertex& b) const
+  {
+    const HeightMap& map    = m_job.map;
+    float            length = nvmath::length(b.position - a.position);
+    nvmath::vec2f    duv    = b.texcoord - a.texcoord;
+    float            texels = nvmath::length(nvmath::vec2f(duv.x * map.width, duv.y * map.height));
+    if(texels < 1.f || length < m_minEdge)
+      return false;
+    if(length > m_maxEdge)
+      return true;
+
+    // Height along the edge, against the linear interpolation of its ends
+    int   samples = std::min(16, std::max(2, static_cast<int>(texels)));
+    float ha      = map.sample(a.texcoord);
+    float hb      = map.sample(b.texcoord);
+    for(int i = 1; i < samples; i++)
+    {
+      float t = static_cast<float>(i) / samples;
+      float h = map.sample(a.texcoord * (1.f - t) + b.texcoord * t);
+      if(std::abs(h - (ha * (1.f - t) + hb * t)) > m_tolerance)
+        return true;
+    }
+    return false;
+  }
+
+  uint32_t midpoint(uint32_t a, uint32_t b)
+  {
+    uint32_t lo  = std::min(a, b);  // Same evaluation from both triangles of the edge
+    uint32_t hi  = std::max(a, b);
+    uint64_t key = (uint64_t(lo) << 32) | hi;
+    auto     it  = m_edges.find(key);
+    if(it != m_edges.end())
+      return it->second;
+
+    uint32_t mid = kNoSplit;
+    if(needsSplit(vertices[lo], vertices[hi]))
+    {
+      const Vertex& v0 = vertices[lo];
+      const Vertex& v1 = vertices[hi];
+      Vertex        v;
+      v.position = (v0.position + v1.position) * 0.5f;
+      v.normal   = nvmath::normalize(v0.normal + v1.normal);
+      v.tangent  = nvmath::vec4f(nvmath::normalize(nvmath::vec3f(v0.tangent) + nvmath::vec3f(v1.tangent)), v0.tangent.w);
+      v.texcoord = (v0.texcoord + v1.texcoord) * 0.5f;
+      v.color    = (v0.color + v1.color) * 0.5f;
+      mid        = static_cast<uint32_t>(vertices.size());
+      vertices.push_back(v);
+    }
+    m_edges[key] = mid;
+    return mid;
+  }
+
+  void emit(uint32_t a, uint32_t b, uint32_t c)
+  {
+    indices.insert(indices.end(), {a, b, c});
+    m_overBudget = indices.size() / 3 > m_maxTriangles;
+  }
+
+  void subdivide(uint32_t i0, uint32_t i1, uint32_t i2, int depth)
+  {
+    if(m_overBudget)
+      return;
+    if(depth >= kMaxDepth)
+    {
+      emit(i0, i1, i2);
+      return;
+    }
+
+    uint32_t v[3] = {i0, i1, i2};
+    uint32_t m[3] = {midpoint(i0, i1), midpoint(i1, i2), midpoint(i2, i0)};  // Edge k is (v[k], v[k+1])
+    int      n    = (m[0] != kNoSplit) + (m[1] != kNoSplit) + (m[2] != kNoSplit);
+    depth++;
+
+    if(n == 0)
+    {
+      emit(i0, i1, i2);
+    }
+    else if(n == 3)
+    {
+      subdivide(i0, m[0], m[2], depth);
+      subdivide(m[0], i1, m[1], depth);
+      subdivide(m[2], m[1], i2, depth);
+      subdivide(m[0], m[1], m[2], depth);
+    }
+    else
+    {
+      // Rotated so that the split edges are (a,b), then (b,c)
+      int      r   = n == 1 ? (m[0] != kNoSplit ? 0 : m[1] != kNoSplit ? 1 : 2) : (m[2] == kNoSplit ? 0 : m[0] == kNoSplit ? 1 : 2);
+      uint32_t a   = v[r];
+      uint32_t b   = v[(r + 1) % 3];
+      uint32_t c   = v[(r + 2) % 3];
+      uint32_t mab = m[r];
+      uint32_t mbc = m[(r + 1) % 3];
+      if(n == 1)
+      {
+        subdivide(a, mab, c, depth);
+        subdivide(mab, b, c, depth);
+      }
+      else
+      {
+        subdivide(mab, b, mbc, depth);
+        // Remaining quad a, mab, mbc, c: cut along the shorter diagonal
+        float d0 = nvmath::length(vertices[mbc].position - vertices[a].position);
+        float d1 = nvmath::length(vertices[c].position - vertices[mab].position);
+        if(d0 < d1)
+        {
+          subdivide(a, mab, mbc, depth);
+          subdivide(a, mbc, c, depth);
+        }
+        else
+        {
+          subdivide(a, mab, c, depth);
+          subdivide(mab, mbc, c, depth);
+        }
+      }
+    }
+  }
+
+  // Moves the vertices along their normal, then computes the normals of the displaced surface
+  void displace()
+  {
+    for(auto& v : vertices)
+      v.position += nvmath::normalize(v.normal) * (m_job.offset + m_job.scale * m_job.map.sample(v.texcoord));
+
+    std::vector<nvmath::vec3f> normals(vertices.size(), nvmath::vec3f(0.f, 0.f, 0.f));
+    for(size_t i = 0; i < indices.size(); i += 3)
+    {
+      const nvmath::vec3f& p0 = vertices[indices[i]].position;
+      nvmath::vec3f        n  = nvmath::cross(vertices[indices[i + 1]].position - p0, vertices[indices[i + 2]].position - p0);
+      for(int k = 0; k < 3; k++)
+        normals[indices[i + k]] += n;  // Weighted by the area
+    }
+    for(size_t i = 0; i < vertices.size(); i++)
+    {
+      if(nvmath::length(normals[i]) <= 0.f)
+        continue;
+      Vertex& v = vertices[i];
+      v.normal  = nvmath::normalize(normals[i]);
+      nvmath::vec3f t(v.tangent);
+      t = t - v.normal * nvmath::dot(v.normal, t);  // Gram-Schmidt
+      if(nvmath::length(t) > 0.f)
+        v.tangent = nvmath::vec4f(nvmath::normalize(t), v.tangent.w);
+    }
+  }
+
+  const Job&                             m_job;
+  float                                  m_maxEdge;
+  float                                  m_minEdge{0.f};
+  float                                  m_tolerance;
+  uint32_t                               m_maxTriangles;
+  bool                                   m_overBudget{false};
+  std::unordered_map<uint64_t, uint32_t> m_edges;
+};
+
+// Height map and parameters from the extras of the material, false when there is none
+bool readDisplacement(const tinygltf::Model& tmodel, int materialIndex, Job& job)
+{
+  if(materialIndex < 0 || materialIndex >= static_cast<int>(tmodel.materials.size()))
+    return false;
+  const tinygltf::Value& extras = tmodel.materials[materialIndex].extras;
+  if(!extras.IsObject() || !extras.Has("displacementTexture"))
+    return false;
+
+  const tinygltf::Value& info    = extras.Get("displacementTexture");
+  int                    texture = info.Has("index") ? info.Get("index").Get<int>() : -1;
+  if(texture < 0 || texture >= static_cast<int>(tmodel.textures.size()))
+    return false;
+  int source = tmodel.textures[texture].source;
+  if(source < 0 || source >= static_cast<int>(tmodel.images.size()))
+    return false;
+  const tinygltf::Image& image = tmodel.images[source];
+  if(image.image.empty() || image.width <= 0 || image.height <= 0 || image.bits != 8)
+  {
+    LOGW("Displacement: image %d is not loaded with 8 bits per channel\n", source);
+    return false;
+  }
+
+  job.map.data   = image.image.data();
+  job.map.width  = image.width;
+  job.map.height = image.height;
+  job.map.stride = std::max(1, image.component);
+  if(extras.Has("displacementScale") && extras.Get("displacementScale").IsNumber())
+    job.scale = static_cast<float>(extras.Get("displacementScale").GetNumberAsDouble());
+  if(extras.Has("displacementOffset") && extras.Get("displacementOffset").IsNumber())
+    job.offset = static_cast<float>(extras.Get("displacementOffset").GetNumberAsDouble());
+  return true;
+}
+}  // namespace
+
+
+//--------------------------------------------------------------------------------------------------
+// Subdivides and displaces every mesh with a height map, under the triangle budget. The instances
+// of a mesh share it: it is processed once.
+//
+void Displacement::apply(nvh::GltfScene& gltf, const tinygltf::Model& tmodel)
+{
+  m_reports.clear();
+  std::vector<Job> jobs;
+  for(uint32_t primIndex = 0; primIndex < gltf.m_primMeshes.size(); primIndex++)
+  {
+    Job job;
+    job.primMesh = primIndex;
+    if(readDisplacement(tmodel, gltf.m_primMeshes[primIndex].materialIndex, job))
+      jobs.push_back(job);
+  }
+  if(jobs.empty())
+    return;
+
+  MilliTimer timer("Displacement");
+  LOGI(" - Displace %d meshes", jobs.size());
+
+  std::vector<MeshSubdivider> meshes;
+  meshes.reserve(jobs.size());
+  float                       relax = 1.f;  // Doubled each time the budget is exceeded
+  for(int attempt = 0;; attempt++)
+  {
+    bool     last   = attempt == 12;  // Criteria so loose that the meshes are only displaced
+    uint32_t budget = last ? ~0u : m_settings.triangleBudget;
+    meshes.clear();
+    for(const Job& job : jobs)
+      meshes.emplace_back(job, m_settings.maxEdge * relax, m_settings.tolerance * relax, budget);
+
+    std::atomic<uint64_t> total{0};
+    std::atomic<bool>     over{false};
+    parallelRanges(
+        meshes.size(),
+        [&](size_t begin, size_t end) {
+          for(size_t i = begin; i < end && !over; i++)
+          {
+            over = over || !meshes[i].run(gltf);
+            total += meshes[i].indices.size() / 3;
+            over = over || total > budget;
+          }
+        },
+        1);
+    if(!over)
+      break;
+    relax *= 2.f;
+    LOGI(" - Over the budget of %d triangles, relaxed x%g", m_settings.triangleBudget, relax);
+  }
+
+  // The displaced meshes replace the original ones
+  for(size_t j = 0; j < jobs.size(); j++)
+  {
+    nvh::GltfPrimMesh& prim = gltf.m_primMeshes[jobs[j].primMesh];
+    MeshSubdivider&    mesh = meshes[j];
+
+    MeshReport report;
+    report.primMesh     = jobs[j].primMesh;
+    report.name         = prim.name;
+    report.trianglesIn  = prim.indexCount / 3;
+    report.trianglesOut = static_cast<uint32_t>(mesh.indices.size() / 3);
+    m_reports.push_back(report);
+
+    prim.vertexOffset = static_cast<uint32_t>(gltf.m_positions.size());
+    prim.vertexCount  = static_cast<uint32_t>(mesh.vertices.size());
+    prim.firstIndex   = static_cast<uint32_t>(gltf.m_indices.size());
+    prim.indexCount   = static_cast<uint32_t>(mesh.indices.size());
+    gltf.m_indices.insert(gltf.m_indices.end(), mesh.indices.begin(), mesh.indices.end());
+    for(const Vertex& v : mesh.vertices)
+    {
+      gltf.m_positions.push_back(v.position);
+      gltf.m_normals.push_back(v.normal);
+      gltf.m_tangents.push_back(v.tangent);
+      gltf.m_texcoords0.push_back(v.texcoord);
+      gltf.m_colors0.push_back(v.color);
+    }
+    prim.posMin = mesh.posMin;
+    prim.posMax = mesh.posMax;
+  }
+  timer.print();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Triangles and BLAS size of each displaced mesh
+//
+void Displacement::printReport() const
+{
+  for(const MeshReport& r : m_reports)
+    LOGI("Displaced mesh %d (%s): %s -> %s triangles, BLAS %s bytes\n", r.primMesh, r.name.c_str(),
+         FormatNumbers(r.trianglesIn).c_str(), FormatNumbers(r.trianglesOut).c_str(), FormatNumbers(r.blasSize).c_str());
+}
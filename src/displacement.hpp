@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Load-time displacement mapping. The meshes whose material has a height map are subdivided on the
+// CPU and their vertices moved along the normal, before the vertex buffers and the BLAS are made:
+// the rest of the renderer sees ordinary triangles.
+// - The height map is given in the extras of the glTF material:
+//     "extras": { "displacementTexture": { "index": 3 }, "displacementScale": 0.05, "displacementOffset": 0.0 }
+//   The displacement is offset + scale * height, height being the grey level of the texture in [0, 1].
+// - An edge is split when it is longer than maxEdge, or when the height map varies along it more than
+//   tolerance. The decision only depends on the edge, so neighboring triangles agree and there are
+//   no T-junctions. Edges shorter than a texel are never split.
+// - The meshes are subdivided in parallel. When the total exceeds triangleBudget, the criteria are
+//   relaxed and the subdivision starts again.
+// - Vertices duplicated in the source (UV seams, hard edges) are displaced independently.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "nvh/gltfscene.hpp"
+#include "vulkan/vulkan_core.h"
+
+
+class Displacement
+{
+public:
+  struct Settings
+  {
+    uint32_t triangleBudget{4000000};  // Triangles of all the displaced meshes
+    float    maxEdge{0.02f};            // Longest edge, relative to the size of the mesh
+    float    tolerance{0.02f};          // Variation of the height along an edge, in [0, 1]
+  };
+
+  struct MeshReport
+  {
+    uint32_t     primMesh{0};
+    std::string  name;
+    uint32_t     trianglesIn{0};
+    uint32_t     trianglesOut{0};
+    VkDeviceSize blasSize{0};  // Build size, before compaction; set once the BLAS are made
+  };
+
+  // Replaces the displaced meshes of gltf: their new vertices and indices are appended to the arrays
+  void apply(nvh::GltfScene& gltf, const tinygltf::Model& tmodel);
+  void printReport() const;
+
+  std::vector<MeshReport>& getReports() { return m_reports; }
+
+  Settings m_settings;
+
+private:
+  std::vector<MeshReport> m_reports;
+};
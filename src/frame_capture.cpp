@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Asynchronous readback of the rendered image, see frame_capture.hpp
+ */
+
+
+#include "frame_capture.hpp"
+#include "memory_tracker.hpp"
+#include "nvh/nvprint.hpp"
+
+#include <algorithm>
+
+
+void FrameCapture::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, const nvvk::Queue& queue, nvvk::ResourceAllocator* allocator)
+{
+  m_device = device;
+  m_pAlloc = allocator;
+  m_queue  = queue;
+  m_debug.setup(device);
+
+  // Readback memory: cached for the CPU reads when possible, a non-coherent type is invalidated in poll()
+  const std::array<VkMemoryPropertyFlags, 3> readbackFlags{
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+  };
+  VkPhysicalDeviceMemoryProperties memProps;
+  VkPhysicalDeviceProperties       props;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
+  vkGetPhysicalDeviceProperties(physicalDevice, &props);
+  m_nonCoherentAtomSize = props.limits.nonCoherentAtomSize;
+  m_readbackFlags       = readbackFlags.back();
+  for(auto flags : readbackFlags)
+  {
+    auto found = std::find_if(memProps.memoryTypes, memProps.memoryTypes + memProps.memoryTypeCount,
+                              [flags](const VkMemoryType& t) { return (t.propertyFlags & flags) == flags; });
+    if(found != memProps.memoryTypes + memProps.memoryTypeCount)
+    {
+      m_readbackFlags = flags;
+      break;
+    }
+  }
+
+  VkCommandPoolCreateInfo poolInfo{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+  poolInfo.flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = queue.familyIndex;
+  vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_cmdPool);
+
+  std::array<VkCommandBuffer, kNbSlots> cmdBufs{};
+  VkCommandBufferAllocateInfo           allocInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+  allocInfo.commandPool        = m_cmdPool;
+  allocInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = kNbSlots;
+  vkAllocateCommandBuffers(m_device, &allocInfo, cmdBufs.data());
+
+  for(uint32_t i = 0; i < kNbSlots; i++)
+  {
+    VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    vkCreateFence(m_device, &fenceInfo, nullptr, &m_slots[i].fence);
+    m_slots[i].cmdBuf = cmdBufs[i];
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// All sinks are flushed first, they might still reference the mapped memory
+//
+void FrameCapture::destroy()
+{
+  for(auto* sink : m_sinks)
+    sink->flush();
+
+  for(auto& slot : m_slots)
+  {
+    if(slot.state == eInFlight)
+      vkWaitForFences(m_device, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+    if(slot.buffer.buffer != VK_NULL_HANDLE)
+    {
+      m_pAlloc->unmap(slot.buffer);
+      m_pAlloc->destroy(slot.buffer);
+    }
+    vkDestroyFence(m_device, slot.fence, nullptr);
+    slot.fence    = VK_NULL_HANDLE;
+    slot.mapped   = nullptr;
+    slot.capacity = 0;
+    slot.state    = eFree;
+  }
+
+  vkDestroyCommandPool(m_device, m_cmdPool, nullptr);
+  m_cmdPool = VK_NULL_HANDLE;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Does any sink want the current frame, of this kind
+//
+bool FrameCapture::wanted(CaptureKind kind)
+{
+  return std::any_of(m_sinks.begin(), m_sinks.end(), [kind](FrameSink* s) { return s->kind() == kind && s->wantsFrame(); });
+}
+
+uint32_t FrameCapture::getInFlight() const
+{
+  return static_cast<uint32_t>(std::count_if(m_slots.begin(), m_slots.end(), [](const Slot& s) { return s.state != eFree; }));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Copy the image in a free readback buffer, must be called after the submission of the frame
+// which rendered the image, on the same queue.
+//
+void FrameCapture::capture(CaptureKind kind, const CaptureSource& source, int frameIndex, int spp)
+{
+  auto it = std::find_if(m_slots.begin(), m_slots.end(), [](const Slot& s) { return s.state == eFree; });
+  if(it == m_slots.end())
+  {
+    m_dropped++;
+    return;
+  }
+
+  Slot&        slot     = *it;
+  VkDeviceSize dataSize = VkDeviceSize(source.size.width) * source.size.height * source.pixelStride;
+  if(!reserve(slot, dataSize))
+  {
+    m_dropped++;
+    return;
+  }
+
+  slot.sinks.clear();
+  for(auto* sink : m_sinks)
+  {
+    if(sink->kind() == kind && sink->wantsFrame())
+    {
+      slot.sinks.push_back(sink);
+      sink->scheduled();
+    }
+  }
+
+  slot.frame.data        = slot.mapped;
+  slot.frame.dataSize    = dataSize;
+  slot.frame.size        = source.size;
+  slot.frame.format      = source.format;
+  slot.frame.pixelStride = source.pixelStride;
+  slot.frame.frameIndex  = frameIndex;
+  slot.frame.spp         = spp;
+  slot.frame.sequence    = m_sequence++;
+  slot.frame.timeMs      = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_startTime).count();
+
+  recordCopy(slot, source);
+
+  VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers    = &slot.cmdBuf;
+  vkQueueSubmit(m_queue.queue, 1, &submitInfo, slot.fence);
+
+  slot.state = eInFlight;
+  m_captured++;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Checking, without waiting, the readbacks which are done and delivering them in order
+//
+void FrameCapture::poll()
+{
+  std::array<Slot*, kNbSlots> inFlight{};
+  uint32_t                    nbInFlight = 0;
+  for(auto& slot : m_slots)
+  {
+    if(slot.state == eInFlight)
+      inFlight[nbInFlight++] = &slot;
+  }
+  std::sort(inFlight.begin(), inFlight.begin() + nbInFlight,
+            [](const Slot* a, const Slot* b) { return a->frame.sequence < b->frame.sequence; });
+
+  for(uint32_t i = 0; i < nbInFlight; i++)
+  {
+    Slot& slot = *inFlight[i];
+    if(vkGetFenceStatus(m_device, slot.fence) != VK_SUCCESS)
+      break;  // Keeping the order of the frames
+    vkResetFences(m_device, 1, &slot.fence);
+    if((m_readbackFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
+      invalidate(slot);
+
+    // The slot returns to the ring when the last sink releases the frame
+    slot.state = eDelivered;
+    CapturedFramePtr frame(&slot.frame, [&slot](const CapturedFrame*) { slot.state = eFree; });
+    for(auto* sink : slot.sinks)
+      sink->consume(frame);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Making sure the readback buffer is large enough, it grows but never shrinks
+//
+bool FrameCapture::reserve(Slot& slot, VkDeviceSize size)
+{
+  if(slot.capacity >= size)
+    return true;
+
+  if(slot.buffer.buffer != VK_NULL_HANDLE)
+  {
+    m_pAlloc->unmap(slot.buffer);
+    m_pAlloc->destroy(slot.buffer);
+  }
+
+  MemoryScope memScope(MemCategory::eReadback, "frame capture");
+  slot.buffer = m_pAlloc->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, m_readbackFlags);
+  if(slot.buffer.buffer == VK_NULL_HANDLE)
+  {
+    LOGE("FrameCapture: cannot allocate %llu bytes for readback\n", static_cast<unsigned long long>(size));
+    slot.capacity = 0;
+    return false;
+  }
+  NAME_VK(slot.buffer.buffer);
+  slot.mapped   = static_cast<uint8_t*>(m_pAlloc->map(slot.buffer));
+  slot.capacity = size;
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Making the copy visible to the CPU on non-coherent memory, the range is widened to the atom size.
+// Past the end of the allocation, which may end the VkDeviceMemory, it goes to the whole size.
+//
+void FrameCapture::invalidate(const Slot& slot)
+{
+  auto         memInfo = m_pAlloc->getMemoryAllocator()->getMemoryInfo(slot.buffer.memHandle);
+  VkDeviceSize begin   = memInfo.offset / m_nonCoherentAtomSize * m_nonCoherentAtomSize;
+  VkDeviceSize end     = memInfo.offset + slot.frame.dataSize;
+  end                  = (end + m_nonCoherentAtomSize - 1) / m_nonCoherentAtomSize * m_nonCoherentAtomSize;
+
+  VkMappedMemoryRange range{VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE};
+  range.memory = memInfo.memory;
+  range.offset = begin;
+  range.size   = end < memInfo.offset + memInfo.size ? end - begin : VK_WHOLE_SIZE;
+  vkInvalidateMappedMemoryRanges(m_device, 1, &range);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The image stays in its layout. The barriers order the copy after the rendering of the
+// previous submission and before anything writing the image in the next frame.
+//
+void FrameCapture::recordCopy(Slot& slot, const CaptureSource& source)
+{
+  const VkPipelineStageFlags shaderStages =
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+  vkResetCommandBuffer(slot.cmdBuf, 0);
+  VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(slot.cmdBuf, &beginInfo);
+
+  if(source.record)
+    source.record(slot.cmdBuf);
+
+  VkImageMemoryBarrier imageBarrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+  imageBarrier.srcAccessMask       = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  imageBarrier.dstAccessMask       = VK_ACCESS_TRANSFER_READ_BIT;
+  imageBarrier.oldLayout           = source.layout;
+  imageBarrier.newLayout           = source.layout;
+  imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.image               = source.image;
+  imageBarrier.subresourceRange    = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(slot.cmdBuf, shaderStages | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+  VkBufferImageCopy region{};
+  region.bufferRowLength   = source.size.width;
+  region.bufferImageHeight = source.size.height;
+  region.imageSubresource  = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.imageExtent       = {source.size.width, source.size.height, 1};
+  vkCmdCopyImageToBuffer(slot.cmdBuf, source.image, source.layout, slot.buffer.buffer, 1, &region);
+
+  // Data visible to the host, and the next frame waits for the copy before writing the image
+  VkBufferMemoryBarrier bufferBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+  bufferBarrier.srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bufferBarrier.dstAccessMask       = VK_ACCESS_HOST_READ_BIT;
+  bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.buffer              = slot.buffer.buffer;
+  bufferBarrier.size                = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(slot.cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | shaderStages, 0, 0,
+                       nullptr, 1, &bufferBarrier, 0, nullptr);
+
+  vkEndCommandBuffer(slot.cmdBuf);
+}
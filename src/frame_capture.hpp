@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Asynchronous readback of the rendered image
+// - A ring of host visible, persistently mapped buffers is filled with vkCmdCopyImageToBuffer
+//   in a separate submission, after the frame.
+// - Fences are polled at each frame, never waited on, and the completed frames are handed
+//   to the sinks (image writer, streaming, ...) which process them on their own threads.
+// - Sinks ask either for the HDR image or for the tonemapped image (RGBA8, no UI), each kind
+//   wanted in a frame uses its own slot.
+// - A slot is released when the last sink is done with the frame. If no slot is free when a
+//   frame is requested, the frame is dropped and counted.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/resourceallocator_vk.hpp"
+#include "queue.hpp"
+
+
+enum class CaptureKind
+{
+  eHdr,         // Accumulated radiance, RGBA32F
+  eTonemapped,  // Result of the tonemapper, RGBA8
+};
+
+// Image to read back, `record` adds the commands producing it (optional)
+struct CaptureSource
+{
+  VkImage                              image{VK_NULL_HANDLE};
+  VkImageLayout                        layout{VK_IMAGE_LAYOUT_GENERAL};  // Layout after `record`
+  VkFormat                             format{VK_FORMAT_R32G32B32A32_SFLOAT};
+  uint32_t                             pixelStride{16};
+  VkExtent2D                           size{};
+  std::function<void(VkCommandBuffer)> record;
+};
+
+// Frame read back from the GPU, the data is valid as long as a reference is held
+struct CapturedFrame
+{
+  const uint8_t* data{nullptr};
+  VkDeviceSize   dataSize{0};
+  VkExtent2D     size{};
+  VkFormat       format{VK_FORMAT_R32G32B32A32_SFLOAT};
+  uint32_t       pixelStride{16};  // Bytes per pixel
+  int            frameIndex{0};    // Accumulation frame of the renderer
+  int            spp{0};           // Accumulated samples per pixel
+  uint64_t       sequence{0};      // Number of the capture, increasing
+  double         timeMs{0};        // Time of the capture since the creation of FrameCapture
+};
+using CapturedFramePtr = std::shared_ptr<const CapturedFrame>;
+
+
+// Receiver of captured frames
+class FrameSink
+{
+public:
+  virtual ~FrameSink() = default;
+  virtual CaptureKind kind() { return CaptureKind::eHdr; }  // Render thread: which image is wanted
+  virtual bool wantsFrame() = 0;                          // Render thread: should the current frame be captured
+  virtual void scheduled() {}                             // Render thread: the copy of the frame was submitted
+  virtual void consume(const CapturedFramePtr& frame) = 0;  // Render thread: must not block, keep the pointer to process later
+  virtual void flush() {}                                 // Release all frames, called before destroying the readback buffers
+};
+
+
+class FrameCapture
+{
+public:
+  static constexpr uint32_t kNbSlots = 4;
+
+  void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, const nvvk::Queue& queue, nvvk::ResourceAllocator* allocator);
+  void destroy();
+
+  void addSink(FrameSink* sink) { m_sinks.push_back(sink); }
+  bool wanted(CaptureKind kind);
+  void capture(CaptureKind kind, const CaptureSource& source, int frameIndex, int spp);
+  void poll();
+
+  uint64_t getCaptured() const { return m_captured; }
+  uint64_t getDropped() const { return m_dropped; }
+  uint32_t getInFlight() const;
+
+private:
+  enum SlotState
+  {
+    eFree,
+    eInFlight,   // Copy submitted, waiting on the fence
+    eDelivered,  // Owned by the sinks
+  };
+
+  struct Slot
+  {
+    nvvk::Buffer            buffer;
+    VkDeviceSize            capacity{0};
+    uint8_t*                mapped{nullptr};
+    VkCommandBuffer         cmdBuf{VK_NULL_HANDLE};
+    VkFence                 fence{VK_NULL_HANDLE};
+    std::atomic<int>        state{eFree};
+    CapturedFrame           frame;
+    std::vector<FrameSink*> sinks;
+  };
+
+  bool reserve(Slot& slot, VkDeviceSize size);
+  void recordCopy(Slot& slot, const CaptureSource& source);
+  void invalidate(const Slot& slot);
+
+  std::array<Slot, kNbSlots> m_slots;
+  std::vector<FrameSink*>    m_sinks;
+  uint64_t                   m_captured{0};
+  uint64_t                   m_dropped{0};
+  uint64_t                   m_sequence{0};
+
+  std::chrono::steady_clock::time_point m_startTime{std::chrono::steady_clock::now()};
+
+  // Setup
+  nvvk::ResourceAllocator* m_pAlloc{nullptr};
+  nvvk::DebugUtil          m_debug;
+  VkDevice                 m_device{VK_NULL_HANDLE};
+  nvvk::Queue              m_queue;
+  VkCommandPool            m_cmdPool{VK_NULL_HANDLE};
+  VkMemoryPropertyFlags    m_readbackFlags{0};
+  VkDeviceSize             m_nonCoherentAtomSize{1};
+};
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Streaming captured frames to stdout, a named pipe or a local socket, see frame_stream.hpp
+ */
+
+
+#include "frame_stream.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+namespace {
+#ifdef _WIN32
+int  sysDup(int fd) { return _dup(fd); }
+void sysClose(int fd) { _close(fd); }
+void sysRedirect(int from, int to) { _dup2(from, to); }
+#else
+int  sysDup(int fd) { return dup(fd); }
+void sysClose(int fd) { ::close(fd); }
+void sysRedirect(int from, int to) { dup2(from, to); }
+
+void setNonBlocking(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+#endif
+}  // namespace
+
+
+//--------------------------------------------------------------------------------------------------
+// Starting the writer thread. Only stdout is connected right away, files, pipes and sockets
+// are connected by the writer as they may wait for the reader.
+//
+bool FrameStream::open(const std::string& target)
+{
+  close();
+  if(target.empty())
+    return false;
+
+#ifdef _WIN32
+  if(target.rfind("unix:", 0) == 0)
+  {
+    LOGE("FrameStream: local sockets are not supported on this platform\n");
+    return false;
+  }
+#else
+  signal(SIGPIPE, SIG_IGN);  // A closed reader is reported as an error by write()
+#endif
+
+  if(target == "-")
+  {
+    // The pixels own stdout from now on, everything printed goes to stderr
+    fflush(stdout);
+    int fd = sysDup(fileno(stdout));
+    sysRedirect(fileno(stderr), fileno(stdout));
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#else
+    setNonBlocking(fd);
+#endif
+    m_fd = fd;
+  }
+
+  m_target    = target;
+  m_fixedSize = {};
+  m_failed    = false;
+  m_quit      = false;
+  m_abort     = false;
+  m_open      = true;
+  m_thread    = std::thread(&FrameStream::writer, this);
+  LOGI("FrameStream: streaming %s frames to %s\n", m_hdr ? "RGBA32F" : "RGBA8", target.c_str());
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// The frame being written is finished, the queued ones are dropped
+//
+void FrameStream::close()
+{
+  if(!m_open)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+    m_dropped += m_queue.size();
+    m_queue.clear();
+  }
+  m_cond.notify_all();
+  waitIdle();
+  m_thread.join();
+  m_open = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called from FrameCapture::poll, only queues the frame
+//
+void FrameStream::consume(const CapturedFramePtr& frame)
+{
+  if(!m_open || m_failed)
+    return;
+
+  // Raw video: the consumer was told the size once
+  if(!m_header)
+  {
+    if(m_fixedSize.width == 0)
+      m_fixedSize = frame->size;
+    if(frame->size.width != m_fixedSize.width || frame->size.height != m_fixedSize.height)
+    {
+      m_dropped++;
+      return;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_queue.size() >= m_maxQueue)
+    {
+      m_dropped++;
+      return;
+    }
+    m_queue.push_back(frame);
+  }
+  m_cond.notify_one();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Releasing all frames, the readback buffers are about to be destroyed
+//
+void FrameStream::flush()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dropped += m_queue.size();
+    m_queue.clear();
+  }
+  waitIdle();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Waiting for the frame being written. A consumer not reading anymore would block forever,
+// after a while the frame is abandoned and the stream is marked as failed.
+//
+void FrameStream::waitIdle()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if(!m_idle.wait_for(lock, std::chrono::seconds(2), [&] { return !m_busy; }))
+  {
+    m_abort = true;
+    m_idle.wait(lock, [&] { return !m_busy; });
+  }
+}
+
+void FrameStream::writer()
+{
+  TraceRecorder::get().setThreadName("Frame stream");
+  if(m_fd < 0 && !connect())
+  {
+    if(!m_quit)
+    {
+      LOGE("FrameStream: cannot open %s\n", m_target.c_str());
+      m_failed = true;
+    }
+    return;
+  }
+
+  while(true)
+  {
+    CapturedFramePtr frame;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [&] { return m_quit || !m_queue.empty(); });
+      if(m_quit)
+        break;
+      frame = std::move(m_queue.front());
+      m_queue.pop_front();
+      m_busy = true;
+    }
+
+    FrameStreamHeader header;
+    header.width         = frame->size.width;
+    header.height        = frame->size.height;
+    header.format        = frame->format == VK_FORMAT_R8G8B8A8_UNORM ? 0 : 1;
+    header.bytesPerPixel = frame->pixelStride;
+    header.sequence      = frame->sequence;
+    header.frameIndex    = frame->frameIndex;
+    header.spp           = frame->spp;
+    header.payloadSize   = frame->dataSize;
+
+    // Zero-copy: the pixels are written from the mapped readback buffer
+    TRACE_SCOPE("Stream frame", "worker");
+    bool ok = (!m_header || writeAll(&header, sizeof(header))) && writeAll(frame->data, frame->dataSize);
+    if(ok)
+    {
+      m_sent++;
+      m_bytes += frame->dataSize + (m_header ? sizeof(header) : 0);
+    }
+    frame.reset();  // Returning the readback buffer
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busy = false;
+    }
+    m_idle.notify_all();
+
+    if(!ok)
+    {
+      LOGE("FrameStream: %s was closed by the reader\n", m_target.c_str());
+      m_failed = true;
+      break;
+    }
+  }
+
+  disconnect();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Opening the target, retrying until a reader is there or the stream is closed
+//
+bool FrameStream::connect()
+{
+#ifdef _WIN32
+  int fd = _open(m_target.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  int fd = -1;
+  while(fd < 0 && !m_quit)
+  {
+    if(m_target.rfind("unix:", 0) == 0)
+    {
+      std::string path = m_target.substr(5);
+      sockaddr_un addr{};
+      if(path.size() >= sizeof(addr.sun_path))
+        return false;
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+      {
+        int error = errno;
+        ::close(fd);
+        fd = -1;
+        if(error != ENOENT && error != ECONNREFUSED)
+          return false;  // Listener not started yet is the only retried case
+      }
+    }
+    else
+    {
+      // Non-blocking open of a named pipe fails with ENXIO while there is no reader
+      fd = ::open(m_target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+      if(fd < 0 && errno != ENXIO)
+        return false;
+    }
+
+    if(fd < 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if(fd >= 0)
+    setNonBlocking(fd);
+#endif
+
+  m_fd = fd;
+  return fd >= 0;
+}
+
+void FrameStream::disconnect()
+{
+  int fd = m_fd.exchange(-1);
+  if(fd >= 0)
+    sysClose(fd);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Writing everything, waiting on the reader without blocking the possibility to abort
+//
+bool FrameStream::writeAll(const void* data, size_t size)
+{
+  const char* ptr = static_cast<const char*>(data);
+  while(size > 0)
+  {
+    if(m_abort)
+      return false;
+
+#ifdef _WIN32
+    int written = _write(m_fd, ptr, static_cast<unsigned int>(std::min<size_t>(size, 1 << 30)));
+    if(written <= 0)
+      return false;
+#else
+    ssize_t written = ::write(m_fd, ptr, size);
+    if(written < 0)
+    {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return false;
+      pollfd pfd{m_fd, POLLOUT, 0};
+      poll(&pfd, 1, 100);
+      continue;
+    }
+#endif
+    ptr += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
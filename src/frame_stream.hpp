@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Streams captured frames as raw pixels for an external encoder, ex:
+//   vk_raytrace -stream - | ffmpeg -f rawvideo -pix_fmt rgba -s 1280x720 -i - out.mp4  (with -stream-noheader)
+// Targets:
+//   "-"            stdout, the logs are redirected to stderr
+//   "unix:<path>"  connects to a local socket (not on Windows)
+//   "<path>"       file or named pipe, opened by the writer thread as it blocks until a reader is connected
+// The pixels are written directly from the mapped readback buffer by a single writer thread.
+// Its queue is short: when the consumer is slower than the renderer, frames are dropped, the
+// rendering is never stalled.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "frame_capture.hpp"
+
+
+// Written before each frame, unless disabled
+struct FrameStreamHeader
+{
+  uint32_t magic{kMagic};
+  uint32_t headerSize{sizeof(FrameStreamHeader)};
+  uint32_t width{0};
+  uint32_t height{0};
+  uint32_t format{0};  // 0: RGBA8 tonemapped, 1: RGBA32F radiance
+  uint32_t bytesPerPixel{0};
+  uint64_t sequence{0};  // Capture number, gaps are dropped frames
+  int32_t  frameIndex{0};
+  int32_t  spp{0};
+  uint64_t payloadSize{0};
+
+  static constexpr uint32_t kMagic = 0x53464b56;  // "VKFS"
+};
+
+
+class FrameStream : public FrameSink
+{
+public:
+  ~FrameStream() override { close(); }
+
+  bool open(const std::string& target);
+  void close();
+  bool isOpen() const { return m_open; }
+  bool isConnected() const { return m_fd >= 0; }
+  bool hasFailed() const { return m_failed; }
+  const std::string& getTarget() const { return m_target; }
+
+  // FrameSink
+  CaptureKind kind() override { return m_hdr ? CaptureKind::eHdr : CaptureKind::eTonemapped; }
+  bool        wantsFrame() override { return m_open && !m_failed && !m_paused; }
+  void        consume(const CapturedFramePtr& frame) override;
+  void        flush() override;
+
+  uint64_t getSent() const { return m_sent; }
+  uint64_t getDropped() const { return m_dropped; }
+  uint64_t getBytes() const { return m_bytes; }
+
+  bool     m_hdr{false};     // RGBA32F radiance instead of the tonemapped image
+  bool     m_header{true};   // Without header, the size must stay constant (rawvideo)
+  bool     m_paused{false};  // Keeps the connection but stops sending
+  uint32_t m_maxQueue{2};    // Frames waiting for the writer
+
+private:
+  bool connect();
+  void disconnect();
+  void writer();
+  bool writeAll(const void* data, size_t size);
+  void waitIdle();
+
+  std::string                  m_target;
+  std::thread                  m_thread;
+  std::deque<CapturedFramePtr> m_queue;
+  std::mutex                   m_mutex;
+  std::condition_variable      m_cond;
+  std::condition_variable      m_idle;
+  bool                         m_busy{false};
+  bool                         m_open{false};
+  std::atomic<bool>            m_quit{false};   // Writer stops after the current frame
+  std::atomic<bool>            m_abort{false};  // Writer gives up the current frame
+  std::atomic<bool>            m_failed{false};
+  std::atomic<int>             m_fd{-1};
+  VkExtent2D                   m_fixedSize{};  // First size sent, when there is no header
+
+  std::atomic<uint64_t> m_sent{0};
+  std::atomic<uint64_t> m_dropped{0};
+  std::atomic<uint64_t> m_bytes{0};
+};
@@ -33,6 +33,7 @@
 #include "nvvk/commands_vk.hpp"
 #include "nvh/fileoperations.hpp"
 #include "hdr_sampling.hpp"
+#include "memory_tracker.hpp"
 
 
 void HdrSampling::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
@@ -56,6 +57,7 @@ void HdrSampling::destroy()
 void HdrSampling::loadEnvironment(const std::string& hrdImage)
 {
   destroy();
+  MemoryScope memScope(MemCategory::eEnvironment, nvh::getFileName(hrdImage));
 
   int32_t width{0};
   int32_t height{0};
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Writing captured frames to disk on worker threads, see image_writer.hpp
+ */
+
+
+#include "image_writer.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+
+#include "stb_image_write.h"
+
+
+//--------------------------------------------------------------------------------------------------
+// Each sequence goes in its own folder, named by the date and time
+//
+void ImageWriter::startSequence()
+{
+  char        stamp[32];
+  std::time_t t = std::time(nullptr);
+  std::strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", std::localtime(&t));
+
+  m_sequenceDir   = (std::filesystem::path(m_directory) / (std::string("sequence_") + stamp)).string();
+  m_sequenceFrame = 0;
+  m_recording     = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called from FrameCapture::poll, only queues the work
+//
+void ImageWriter::consume(const CapturedFramePtr& frame)
+{
+  static const char* extensions[] = {".png", ".hdr", ".raw"};
+
+  Job job;
+  job.frame  = frame;
+  job.format = m_format;
+
+  if(m_recording)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "frame_%06u", m_sequenceFrame++);
+    job.filename = (std::filesystem::path(m_sequenceDir) / name).string() + extensions[m_format];
+  }
+  else
+  {
+    char        stamp[32];
+    std::time_t t = std::time(nullptr);
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", std::localtime(&t));
+    job.filename = (std::filesystem::path(m_directory) / (std::string("screenshot_") + stamp + "_"
+                                                          + std::to_string(frame->spp) + "spp"))
+                       .string()
+                   + extensions[m_format];
+  }
+
+  if(m_threads.empty())
+    start();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_queue.size() >= m_maxQueue)
+    {
+      m_dropped++;
+      return;  // The frame is released with `job`
+    }
+    m_queue.push_back(std::move(job));
+  }
+  m_cond.notify_one();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Waiting for all queued frames to be written
+//
+void ImageWriter::flush()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [&] { return m_queue.empty() && m_busy == 0; });
+}
+
+uint32_t ImageWriter::getPending()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return static_cast<uint32_t>(m_queue.size()) + m_busy;
+}
+
+void ImageWriter::start()
+{
+  m_quit            = false;
+  uint32_t nbThread = std::max(2u, std::thread::hardware_concurrency() / 4);
+  for(uint32_t i = 0; i < nbThread; i++)
+    m_threads.emplace_back(&ImageWriter::worker, this);
+}
+
+void ImageWriter::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_cond.notify_all();
+  for(auto& t : m_threads)
+    t.join();
+  m_threads.clear();
+}
+
+void ImageWriter::worker()
+{
+  TraceRecorder::get().setThreadName("Image writer");
+  while(true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [&] { return m_quit || !m_queue.empty(); });
+      if(m_queue.empty())
+        return;  // Quitting once everything is written
+      job = std::move(m_queue.front());
+      m_queue.pop_front();
+      m_busy++;
+    }
+
+    {
+      TRACE_SCOPE("Write image", "worker");
+      if(write(job))
+        m_written++;
+    }
+    job.frame.reset();  // Returning the readback buffer
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busy--;
+    }
+    m_idle.notify_all();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Encoding directly from the mapped readback memory
+//
+bool ImageWriter::write(const Job& job)
+{
+  const CapturedFrame& frame  = *job.frame;
+  const float*         pixels = reinterpret_cast<const float*>(frame.data);
+  const int            width  = static_cast<int>(frame.size.width);
+  const int            height = static_cast<int>(frame.size.height);
+
+  // The format was changed while the frame was in flight
+  bool isLdr = frame.format == VK_FORMAT_R8G8B8A8_UNORM;
+  if(isLdr != (job.format == ePng))
+  {
+    LOGW("ImageWriter: skipping %s, the captured image has another format\n", job.filename.c_str());
+    return false;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(job.filename).parent_path(), ec);
+
+  int result = 0;
+  switch(job.format)
+  {
+    case ePng:
+      result = stbi_write_png(job.filename.c_str(), width, height, 4, frame.data, width * frame.pixelStride);
+      break;
+    case eHdr:
+      result = stbi_write_hdr(job.filename.c_str(), width, height, 4, pixels);
+      break;
+    case eRaw: {
+      std::ofstream out(job.filename, std::ios::binary);
+      out.write(reinterpret_cast<const char*>(frame.data), static_cast<std::streamsize>(frame.dataSize));
+      result = out.good() ? 1 : 0;
+      break;
+    }
+  }
+
+  if(result == 0)
+    LOGE("ImageWriter: failed to write %s\n", job.filename.c_str());
+  return result != 0;
+}
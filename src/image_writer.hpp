@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Writes captured frames to disk: single screenshots or continuous image sequences.
+// Encoding is done by a pool of worker threads. The queue is bounded, when it is full the
+// frame is dropped and counted instead of stalling the rendering.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_capture.hpp"
+
+
+class ImageWriter : public FrameSink
+{
+public:
+  enum Format
+  {
+    ePng,  // Tonemapped image, as displayed
+    eHdr,  // Radiance RGBE, full range
+    eRaw,  // RGBA32F as in memory, no header
+  };
+
+  ~ImageWriter() override { stop(); }
+
+  void screenshot() { m_screenshot = true; }
+  void startSequence();
+  void stopSequence() { m_recording = false; }
+  bool isRecording() const { return m_recording; }
+
+  // FrameSink
+  CaptureKind kind() override { return m_format == ePng ? CaptureKind::eTonemapped : CaptureKind::eHdr; }
+  bool wantsFrame() override { return m_screenshot || m_recording; }
+  void scheduled() override { m_screenshot = false; }
+  void consume(const CapturedFramePtr& frame) override;
+  void flush() override;
+
+  uint64_t getWritten() const { return m_written; }
+  uint64_t getDropped() const { return m_dropped; }
+  uint32_t getPending();
+
+  int         m_format{ePng};
+  uint32_t    m_maxQueue{3};          // Frames waiting for a worker
+  std::string m_directory{"captures"};
+
+private:
+  struct Job
+  {
+    CapturedFramePtr frame;
+    std::string      filename;
+    int              format{ePng};
+  };
+
+  void start();
+  void stop();
+  void worker();
+  bool write(const Job& job);
+
+  std::vector<std::thread> m_threads;
+  std::deque<Job>          m_queue;
+  std::mutex               m_mutex;
+  std::condition_variable  m_cond;
+  std::condition_variable  m_idle;
+  uint32_t                 m_busy{0};
+  bool                     m_quit{false};
+
+  bool        m_screenshot{false};
+  bool        m_recording{false};
+  std::string m_sequenceDir;
+  uint32_t    m_sequenceFrame{0};
+
+  std::atomic<uint64_t> m_written{0};
+  std::atomic<uint64_t> m_dropped{0};
+};
@@ -27,6 +27,10 @@
 #include "nvh/inputparser.h"
 #include "nvvk/context_vk.hpp"
 #include "sample_example.hpp"
+#include "shader_reloader.hpp"
+#include "trace_recorder.hpp"
+
+#include <filesystem>
 
  // Default search path for shaders
 std::vector<std::string> defaultSearchPaths;
@@ -52,6 +56,16 @@ int main(int argc, char** argv)
 	InputParser parser(argc, argv);
 	std::string sceneFile = parser.getString("-f", "pica/scene.gltf");
 	std::string hdrFilename = parser.getString("-e", "daytime.hdr");
+	std::string streamTarget = parser.getString("-stream", "");  // "-" for stdout, "unix:<path>", or a file/pipe
+	bool        runSweep = parser.exist("-sweep");  // Benchmark of the dispatch variants once loaded
+	std::string traceFile = parser.getString("-trace", "");  // Chrome trace of the session, written at exit
+	bool        hotReload = parser.exist("-hotreload");  // Recompiles the shaders when edited
+	bool        rtxPipeline = parser.exist("-rtx");  // Ray tracing pipeline renderer instead of the ray query one
+	std::string displaceBudget = parser.getString("-displace-budget", "");  // Triangles of the displaced meshes
+	std::string lodLevels = parser.getString("-lod-levels", "");  // Simplified meshes for the secondary rays, 0 to disable
+	std::string lodRatio = parser.getString("-lod-ratio", "");  // Triangles kept by each level
+	std::string lodDepth = parser.getString("-lod-depth", "");  // First bounce tracing the simplified meshes
+	TraceRecorder::get().setThreadName("Main");
 
 	// Setup GLFW window
 	glfwSetErrorCallback(onErrorCallback);
@@ -109,6 +123,11 @@ int main(int argc, char** argv)
 	contextInfo.addDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME, true, &rayQueryFeatures);  // Optional extension
 	contextInfo.addDeviceExtension(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
 	contextInfo.addDeviceExtension(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+	VkPhysicalDeviceShaderAtomicFloatFeaturesEXT atomicFloatFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_ATOMIC_FLOAT_FEATURES_EXT };
+	contextInfo.addDeviceExtension(VK_EXT_SHADER_ATOMIC_FLOAT_EXTENSION_NAME, true, &atomicFloatFeature);  // Deferred shadow rays
+	VkPhysicalDevicePipelineExecutablePropertiesFeaturesKHR execPropFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_EXECUTABLE_PROPERTIES_FEATURES_KHR };
+	contextInfo.addDeviceExtension(VK_KHR_PIPELINE_EXECUTABLE_PROPERTIES_EXTENSION_NAME, true, &execPropFeature);  // Register usage
+	contextInfo.addDeviceExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, true);  // Heap usage in the system monitor
 
 	// Extra queues for parallel load/build
 	contextInfo.addRequestedQueue(contextInfo.defaultQueueGCT, 1, 1.0f);  // Loading scene - mipmap generation
@@ -163,6 +182,29 @@ int main(int argc, char** argv)
 
 	// Create example
 	sample.setup(vkctx.m_instance, vkctx.m_device, vkctx.m_physicalDevice, queues);
+	if (!displaceBudget.empty())
+		sample.m_scene.getDisplacement().m_settings.triangleBudget = static_cast<uint32_t>(std::stoul(displaceBudget));
+	if (!lodLevels.empty())
+		sample.m_scene.getMeshLod().m_settings.levels = std::stoi(lodLevels);
+	if (!lodRatio.empty())
+		sample.m_scene.getMeshLod().m_settings.ratio = std::stof(lodRatio);
+	if (!lodDepth.empty())
+		sample.m_rtxState.lodDepth = std::stoi(lodDepth);
+	TraceRecorder::get().setup(vkctx.m_device, vkctx.m_physicalDevice, vkctx.m_queueGCT.queue, vkctx.m_queueGCT.familyIndex);
+
+	// Development mode: the GLSL sources, when found, are watched and recompiled
+	std::string shaderFile = nvh::findFile("shaders/pathtrace.comp", defaultSearchPaths);
+	if (!shaderFile.empty())
+		ShaderReloader::get().setDirectory(std::filesystem::path(shaderFile).parent_path().string());
+	if (hotReload)
+		ShaderReloader::get().start();
+
+	if (!streamTarget.empty())
+	{
+		sample.m_frameStream.m_hdr = parser.exist("-stream-hdr");
+		sample.m_frameStream.m_header = !parser.exist("-stream-noheader");
+		sample.m_frameStream.open(streamTarget);
+	}
 	sample.createSwapchain(surface, SAMPLE_WIDTH, SAMPLE_HEIGHT);
 	sample.createDepthBuffer();
 	sample.createRenderPass();
@@ -180,12 +222,16 @@ int main(int argc, char** argv)
 	sample.loadEnvironmentHdr(nvh::findFile(hdrFilename, defaultSearchPaths, true));
 	sample.m_busy = true;
 	std::thread([&] {
+		TraceRecorder::get().setThreadName("Loader");
+		TRACE_SCOPE("Startup load");
 		sample.m_busyReasonText = "Loading Scene";
 		sample.loadScene(nvh::findFile(sceneFile, defaultSearchPaths, true));
 		sample.createUniformBuffer();
 		sample.createDescriptorSetLayout();
-		sample.createRender();
+		sample.createRender(rtxPipeline ? SampleExample::eRtxPipeline : SampleExample::eRayQuery);
 		sample.resetFrame();
+		if (runSweep)
+			sample.m_sweep.start(sample.m_pRender->variants());
 		sample.m_busy = false;
 		}).detach();
 
@@ -203,13 +249,20 @@ int main(int argc, char** argv)
 			if (sample.isMinimized())
 				continue;
 
+			sample.reloadShaders();  // Frame boundary, nothing in flight uses the pipelines once idle
+
 			// Start the Dear ImGui frame
 			ImGui_ImplGlfw_NewFrame();
 			ImGui::NewFrame();
 
+			TRACE_SCOPE("Frame");
+
 			// Start rendering the scene
 			profiler.beginFrame();  // GPU performance timer
-			sample.prepareFrame();  // Waits for a framebuffer to be available
+			{
+				TRACE_SCOPE("Wait frame");
+				sample.prepareFrame();  // Waits for a framebuffer to be available
+			}
 			sample.updateFrame();   // Increment/update rendering frame count
 
 			// Start command buffer of this frame
@@ -219,6 +272,7 @@ int main(int argc, char** argv)
 			VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 			vkBeginCommandBuffer(cmdBuf, &beginInfo);
+			TraceRecorder::get().beginFrame(cmdBuf);
 
 			sample.renderGui(profiler);          // UI
 			sample.updateUniformBuffer(cmdBuf);  // Updating UBOs
@@ -229,6 +283,7 @@ int main(int argc, char** argv)
 			// Rendering pass in swapchain framebuffer + tone mapper, UI
 			{
 				auto sec = profiler.timeRecurring("Tonemap", cmdBuf);
+				TRACE_GPU_SCOPE(cmdBuf, "Tonemap");
 
 				std::array<VkClearValue, 2> clearValues;
 				clearValues[0].color = { {0.0f, 0.0f, 0.0f, 0.0f} };
@@ -257,13 +312,21 @@ int main(int argc, char** argv)
 
 			// Submit for display
 			vkEndCommandBuffer(cmdBuf);
-			sample.submitFrame();
+			{
+				TRACE_SCOPE("Submit");
+				sample.submitFrame();
+			}
+			sample.captureFrame();  // Asynchronous readback of the rendered image
 
 			CameraManip.updateAnim();
 		}
 
 		// Cleanup
+		ShaderReloader::get().stop();
 		vkDeviceWaitIdle(sample.getDevice());
+		if (!traceFile.empty())
+			TraceRecorder::get().writeChromeTrace(traceFile);
+		TraceRecorder::get().destroy();
 		sample.destroyResources();
 		sample.destroy();
 		profiler.deinit();
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Accounting of the GPU memory by category and owner, see memory_tracker.hpp
+ */
+
+
+#include "memory_tracker.hpp"
+#include "nvh/nvprint.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+
+namespace {
+thread_local MemCategory t_category = MemCategory::eOther;
+thread_local std::string t_owner;
+
+bool isSceneCategory(MemCategory c)
+{
+  return c == MemCategory::eGeometry || c == MemCategory::eTextures || c == MemCategory::eSceneData
+         || c == MemCategory::eBlas || c == MemCategory::eTlas;
+}
+}  // namespace
+
+
+const char* memCategoryName(MemCategory category)
+{
+  static const char* names[] = {"Other",       "Geometry",  "Textures", "Scene Data", "BLAS",    "TLAS",
+                                "Environment", "Offscreen", "Renderer", "Readback",   "Transient"};
+  static_assert(sizeof(names) / sizeof(names[0]) == size_t(MemCategory::eCount), "A name per category");
+  return names[size_t(category)];
+}
+
+MemoryScope::MemoryScope(MemCategory category, const std::string& owner)
+    : m_prevCategory(t_category)
+    , m_prevOwner(t_owner)
+{
+  t_category = category;
+  if(!owner.empty())
+    t_owner = owner;  // Otherwise the owner of the enclosing scope
+}
+
+MemoryScope::~MemoryScope()
+{
+  t_category = m_prevCategory;
+  t_owner    = m_prevOwner;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Allocations, forwarded to the wrapped allocator
+//
+nvvk::MemHandle MemoryTracker::allocMemory(const nvvk::MemAllocateInfo& allocInfo, VkResult* pResult)
+{
+  nvvk::MemHandle handle = m_allocator->allocMemory(allocInfo, pResult);
+  if(handle == nullptr)
+    return handle;
+
+  Record record;
+  record.category    = t_category;
+  record.owner       = t_owner;
+  record.size        = allocInfo.getMemoryRequirements().size;
+  record.deviceLocal = (allocInfo.getMemoryProperties() & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  record.generation     = m_generation;
+  CategoryStats& stats  = m_stats[size_t(record.category)];
+  (record.deviceLocal ? stats.deviceBytes : stats.hostBytes) += record.size;
+  stats.peakBytes = std::max(stats.peakBytes, stats.deviceBytes + stats.hostBytes);
+  stats.live++;
+  stats.allocations++;
+  m_liveBytes += record.size;
+  m_peakBytes = std::max(m_peakBytes, m_liveBytes);
+  m_records[handle] = std::move(record);
+  return handle;
+}
+
+void MemoryTracker::freeMemory(nvvk::MemHandle memHandle)
+{
+  if(memHandle == nullptr)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto                        it = m_records.find(memHandle);
+    if(it != m_records.end())
+    {
+      const Record&  record = it->second;
+      CategoryStats& stats  = m_stats[size_t(record.category)];
+      (record.deviceLocal ? stats.deviceBytes : stats.hostBytes) -= record.size;
+      stats.live--;
+      stats.frees++;
+      m_liveBytes -= record.size;
+      m_records.erase(it);
+    }
+  }
+  m_allocator->freeMemory(memHandle);
+}
+
+nvvk::MemAllocator::MemInfo MemoryTracker::getMemoryInfo(nvvk::MemHandle memHandle) const
+{
+  return m_allocator->getMemoryInfo(memHandle);
+}
+
+void* MemoryTracker::map(nvvk::MemHandle memHandle, VkDeviceSize offset, VkDeviceSize size, VkResult* pResult)
+{
+  return m_allocator->map(memHandle, offset, size, pResult);
+}
+
+void MemoryTracker::unmap(nvvk::MemHandle memHandle)
+{
+  m_allocator->unmap(memHandle);
+}
+
+VkDevice MemoryTracker::getDevice() const
+{
+  return m_allocator->getDevice();
+}
+
+VkPhysicalDevice MemoryTracker::getPhysicalDevice() const
+{
+  return m_allocator->getPhysicalDevice();
+}
+
+void MemoryTracker::deinit()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(!m_records.empty())
+    LOGW("Memory: %d allocations not freed\n", int(m_records.size()));
+  m_records.clear();
+  m_allocator = nullptr;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Statistics
+//
+void MemoryTracker::newGeneration()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_generation++;
+}
+
+std::array<MemoryTracker::CategoryStats, size_t(MemCategory::eCount)> MemoryTracker::getCategoryStats() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+std::vector<MemoryTracker::OwnerStats> MemoryTracker::getOwnerStats() const
+{
+  std::vector<OwnerStats> owners;
+  {
+    std::lock_guard<std::mutex>             lock(m_mutex);
+    std::unordered_map<std::string, size_t> index;  // Owner and category to the entry
+    for(auto& r : m_records)
+    {
+      const Record& record = r.second;
+      std::string   key    = record.owner + '\n' + memCategoryName(record.category);
+      auto          it     = index.find(key);
+      if(it == index.end())
+      {
+        it = index.emplace(key, owners.size()).first;
+        owners.push_back({record.owner, record.category, 0, 0});
+      }
+      owners[it->second].bytes += record.size;
+      owners[it->second].live++;
+    }
+  }
+  std::sort(owners.begin(), owners.end(), [](const OwnerStats& a, const OwnerStats& b) { return a.bytes > b.bytes; });
+  return owners;
+}
+
+uint64_t MemoryTracker::getLiveBytes() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_liveBytes;
+}
+
+uint64_t MemoryTracker::getPeakBytes() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_peakBytes;
+}
+
+void MemoryTracker::getStale(uint32_t& count, uint64_t& bytes) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  count = 0;
+  bytes = 0;
+  for(auto& r : m_records)
+  {
+    if(isSceneCategory(r.second.category) && r.second.generation < m_generation)
+    {
+      count++;
+      bytes += r.second.size;
+    }
+  }
+}
+
+bool MemoryTracker::writeJson(const std::string& filename, float fragmentation) const
+{
+  std::ofstream out(filename);
+  if(!out)
+  {
+    LOGE("Memory: cannot write %s\n", filename.c_str());
+    return false;
+  }
+
+  auto     stats  = getCategoryStats();
+  auto     owners = getOwnerStats();
+  uint32_t staleCount;
+  uint64_t staleBytes;
+  getStale(staleCount, staleBytes);
+
+  out << "{\n  \"liveBytes\": " << getLiveBytes() << ",\n  \"peakBytes\": " << getPeakBytes()
+      << ",\n  \"fragmentation\": " << fragmentation << ",\n  \"staleSceneAllocations\": " << staleCount
+      << ",\n  \"staleSceneBytes\": " << staleBytes << ",\n  \"categories\": [\n";
+  for(size_t c = 0; c < stats.size(); c++)
+  {
+    const CategoryStats& s = stats[c];
+    out << "    {\"name\": \"" << memCategoryName(MemCategory(c)) << "\", \"deviceBytes\": " << s.deviceBytes
+        << ", \"hostBytes\": " << s.hostBytes << ", \"peakBytes\": " << s.peakBytes << ", \"live\": " << s.live
+        << ", \"allocations\": " << s.allocations << ", \"frees\": " << s.frees << "}" << (c + 1 < stats.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"owners\": [\n";
+  for(size_t i = 0; i < owners.size(); i++)
+  {
+    const OwnerStats& o = owners[i];
+    out << "    {\"owner\": \"" << o.owner << "\", \"category\": \"" << memCategoryName(o.category) << "\", \"bytes\": " << o.bytes
+        << ", \"live\": " << o.live << "}" << (i + 1 < owners.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+  LOGI("Memory: report written to %s\n", filename.c_str());
+  return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// The wrapped allocator is initialized as usual, its memory allocator is then used through the
+// tracker by this resource allocator.
+//
+void TrackedAllocator::init(VkInstance instance, VkDevice device, VkPhysicalDevice physicalDevice)
+{
+  m_inner.init(instance, device, physicalDevice);
+  m_tracker.init(m_inner.getMemoryAllocator());
+  nvvk::ResourceAllocator::init(device, physicalDevice, &m_tracker);
+}
+
+void TrackedAllocator::deinit()
+{
+  nvvk::ResourceAllocator::deinit();
+  m_tracker.deinit();
+  m_inner.deinit();
+}
+
+float TrackedAllocator::getFragmentation()
+{
+#if defined(ALLOC_DMA)
+  VkDeviceSize allocated = 0, used = 0;
+  m_inner.getDMA()->getUtilization(allocated, used);
+  return allocated > 0 ? 1.f - float(used) / float(allocated) : 0.f;
+#elif defined(ALLOC_VMA)
+  return -1.f;
+#else
+  return 0.f;  // One memory object per resource
+#endif
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Accounting of the GPU memory by category and owner
+// - MemoryTracker wraps the nvvk::MemAllocator of the resource allocator: every allocation,
+//   buffers, images, acceleration structures and staging included, is recorded.
+// - The category and the owner come from the innermost MemoryScope of the allocating thread,
+//   allocations outside of any scope are "Other".
+// - Live and peak bytes per category, live bytes per owner, and the allocations of the scene
+//   categories still alive after a new scene was loaded (leaks across loadAssets).
+// - TrackedAllocator is the resource allocator of the application with the tracker in place.
+//
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nvvk/memallocator_vk.hpp"
+#include "nvvk/resourceallocator_vk.hpp"
+#if defined(ALLOC_DMA)
+#include <nvvk/memallocator_dma_vk.hpp>
+#elif defined(ALLOC_VMA)
+#include <nvvk/memallocator_vma_vk.hpp>
+#endif
+
+
+enum class MemCategory : uint32_t
+{
+  eOther,
+  eGeometry,     // Vertex and index buffers
+  eTextures,     // Images of the scene
+  eSceneData,    // Materials, instances, lights, camera
+  eBlas,         // Bottom level acceleration structures, build scratch included
+  eTlas,         // Top level acceleration structure, instances and scratch included
+  eEnvironment,  // HDR image and its importance sampling table
+  eOffscreen,    // Rendered image, G-buffer, tonemapper
+  eRenderer,     // Buffers of the renderer: queues, guiding, statistics
+  eReadback,     // Host buffers of the captures
+  eTransient,    // Memory blocks of the render graph, shared by the transient resources
+  eCount
+};
+
+const char* memCategoryName(MemCategory category);
+
+// Category and owner of the allocations made by this thread, until the end of the scope
+class MemoryScope
+{
+public:
+  MemoryScope(MemCategory category, const std::string& owner = {});
+  ~MemoryScope();
+
+private:
+  MemCategory m_prevCategory;
+  std::string m_prevOwner;
+};
+
+
+class MemoryTracker : public nvvk::MemAllocator
+{
+public:
+  struct CategoryStats
+  {
+    uint64_t deviceBytes{0};  // Live, device local
+    uint64_t hostBytes{0};    // Live, host visible (staging, readback)
+    uint64_t peakBytes{0};
+    uint32_t live{0};
+    uint64_t allocations{0};
+    uint64_t frees{0};
+  };
+
+  struct OwnerStats
+  {
+    std::string owner;
+    MemCategory category{MemCategory::eOther};
+    uint64_t    bytes{0};
+    uint32_t    live{0};
+  };
+
+  void init(nvvk::MemAllocator* allocator) { m_allocator = allocator; }
+  void deinit();
+
+  // nvvk::MemAllocator
+  nvvk::MemHandle  allocMemory(const nvvk::MemAllocateInfo& allocInfo, VkResult* pResult = nullptr) override;
+  void             freeMemory(nvvk::MemHandle memHandle) override;
+  MemInfo          getMemoryInfo(nvvk::MemHandle memHandle) const override;
+  void*            map(nvvk::MemHandle memHandle, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE, VkResult* pResult = nullptr) override;
+  void             unmap(nvvk::MemHandle memHandle) override;
+  VkDevice         getDevice() const override;
+  VkPhysicalDevice getPhysicalDevice() const override;
+
+  // A new scene: the scene allocations made before are expected to be freed
+  void newGeneration();
+
+  std::array<CategoryStats, size_t(MemCategory::eCount)> getCategoryStats() const;
+  std::vector<OwnerStats>                                getOwnerStats() const;  // Live, largest first
+  uint64_t                                               getLiveBytes() const;
+  uint64_t                                               getPeakBytes() const;
+  void getStale(uint32_t& count, uint64_t& bytes) const;  // Scene allocations of the previous generations
+
+  bool writeJson(const std::string& filename, float fragmentation) const;
+
+private:
+  struct Record
+  {
+    MemCategory category{MemCategory::eOther};
+    std::string owner;
+    uint64_t    size{0};
+    bool        deviceLocal{false};
+    uint32_t    generation{0};
+  };
+
+  nvvk::MemAllocator* m_allocator{nullptr};
+
+  mutable std::mutex                                     m_mutex;
+  std::unordered_map<nvvk::MemHandle, Record>            m_records;
+  std::array<CategoryStats, size_t(MemCategory::eCount)> m_stats{};
+  uint64_t                                               m_liveBytes{0};
+  uint64_t                                               m_peakBytes{0};
+  uint32_t                                               m_generation{0};
+};
+
+
+//--------------------------------------------------------------------------------------------------
+// Resource allocator of the application (DMA, VMA or dedicated, see CMakeLists.txt) allocating
+// through the tracker. The wrapped allocator only provides its memory allocator.
+//
+class TrackedAllocator : public nvvk::ResourceAllocator
+{
+public:
+  void init(VkInstance instance, VkDevice device, VkPhysicalDevice physicalDevice);
+  void deinit();
+
+  MemoryTracker&       getTracker() { return m_tracker; }
+  const MemoryTracker& getTracker() const { return m_tracker; }
+
+  // Share of the device memory blocks not used by allocations, -1 if not known
+  float getFragmentation();
+
+  bool writeJson(const std::string& filename) { return m_tracker.writeJson(filename, getFragmentation()); }
+
+private:
+#if defined(ALLOC_DMA)
+  nvvk::ResourceAllocatorDma m_inner;
+#elif defined(ALLOC_VMA)
+  nvvk::ResourceAllocatorVma m_inner;
+#else
+  nvvk::ResourceAllocatorDedicated m_inner;
+#endif
+  MemoryTracker m_tracker;
+};
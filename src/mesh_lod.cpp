@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Quadric error simplification of the meshes into coarser levels, see mesh_lod.hpp
+ */
+
+
+#include "mesh_lod.hpp"
+#include "tools.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+
+namespace {
+const float kMinReduction = 0.8f;  // A level keeping more of the previous one is not worth its BLAS
+
+//--------------------------------------------------------------------------------------------------
+// Sum of the squared distances to a set of planes, symmetric 4x4 matrix. The planes are weighted
+// by the area of their triangle, error() is the mean over the area.
+//
+struct Quadric
+{
+  double xx{0}, xy{0}, xz{0}, xw{0}, yy{0}, yz{0}, yw{0}, zz{0}, zw{0}, ww{0};
+  double area{0};
+
+  static Quadric triangle(const nvmath::vec3f& p0, const nvmath::vec3f& p1, const nvmath::vec3f& p2)
+  {
+    Quadric       q;
+    nvmath::vec3f n    = nvmath::cross(p1 - p0, p2 - p0);
+    float         area = nvmath::length(n) * 0.5f;
+    if(area <= 0.f)
+      return q;
+    n        = n * (0.5f / area);
+    double d = -nvmath::dot(n, p0);
+    double a = n.x, b = n.y, c = n.z;
+    q.xx = area * a * a, q.xy = area * a * b, q.xz = area * a * c, q.xw = area * a * d;
+    q.yy = area * b * b, q.yz = area * b * c, q.yw = area * b * d;
+    q.zz = area * c * c, q.zw = area * c * d;
+    q.ww = area * d * d;
+    q.area = area;
+    return q;
+  }
+
+  Quadric operator+(const Quadric& o) const
+  {
+    Quadric q;
+    q.xx = xx + o.xx, q.xy = xy + o.xy, q.xz = xz + o.xz, q.xw = xw + o.xw;
+    q.yy = yy + o.yy, q.yz = yz + o.yz, q.yw = yw + o.yw;
+    q.zz = zz + o.zz, q.zw = zw + o.zw;
+    q.ww = ww + o.ww;
+    q.area = area + o.area;
+    return q;
+  }
+
+  double error(const nvmath::vec3f& p) const
+  {
+    double x = p.x, y = p.y, z = p.z;
+    double e = xx * x * x + 2 * xy * x * y + 2 * xz * x * z + 2 * xw * x + yy * y * y + 2 * yz * y * z + 2 * yw * y
+               + zz * z * z + 2 * zw * z + ww;
+    return area > 0.0 ? std::max(e, 0.0) / area : 0.0;
+  }
+};
+
+//--------------------------------------------------------------------------------------------------
+// Simplification of one mesh by half-edge collapses, in the order of the quadric error. The
+// vertices of the glTF mesh sharing a position are welded in a point; the collapses move points,
+// the triangles keep referencing the original vertices. Can be run again with a lower target to
+// make the next level.
+//
+class MeshSimplifier
+{
+public:
+  MeshSimplifier(const nvh::GltfScene& gltf, const nvh::GltfPrimMesh& prim)
+  {
+    // Welding the vertices on their position
+    struct Key
+    {
+      nvmath::vec3f p;
+      bool          operator==(const Key& o) const { return p.x == o.p.x && p.y == o.p.y && p.z == o.p.z; }
+    };
+    struct KeyHash
+    {
+      size_t operator()(const Key& k) const
+      {
+        uint32_t b[3];
+        std::memcpy(b, &k.p.x, sizeof(float));
+        std::memcpy(b + 1, &k.p.y, sizeof(float));
+        std::memcpy(b + 2, &k.p.z, sizeof(float));
+        return (size_t(b[0]) * 73856093) ^ (size_t(b[1]) * 19349663) ^ (size_t(b[2]) * 83492791);
+      }
+    };
+    std::unordered_map<Key, uint32_t, KeyHash> welded;
+    m_vertexPoint.resize(prim.vertexCount);
+    for(uint32_t v = 0; v < prim.vertexCount; v++)
+    {
+      const nvmath::vec3f& p  = gltf.m_positions[prim.vertexOffset + v];
+      auto                 it = welded.emplace(Key{p}, static_cast<uint32_t>(m_points.size())).first;
+      if(it->second == m_points.size())
+        m_points.push_back(p);
+      m_vertexPoint[v] = it->second;
+    }
+
+    // Triangles, without the degenerated ones
+    m_pointTris.resize(m_points.size());
+    for(uint32_t i = 0; i + 2 < prim.indexCount; i += 3)
+    {
+      const uint32_t* idx = &gltf.m_indices[prim.firstIndex + i];
+      uint32_t        a = m_vertexPoint[idx[0]], b = m_vertexPoint[idx[1]], c = m_vertexPoint[idx[2]];
+      if(a == b || b == c || c == a)
+        continue;
+      uint32_t t = static_cast<uint32_t>(m_tris.size());
+      m_tris.push_back({idx[0], idx[1], idx[2]});
+      for(uint32_t p : {a, b, c})
+        m_pointTris[p].push_back(t);
+    }
+    m_alive.assign(m_tris.size(), true);
+    triangleCount = static_cast<uint32_t>(m_tris.size());
+
+    // Locked: a point on a border or a non-manifold edge, or with several vertices (UV seam, hard edge)
+    m_locked.assign(m_points.size(), false);
+    std::vector<uint32_t> firstVertex(m_points.size(), ~0u);
+    for(uint32_t v = 0; v < prim.vertexCount; v++)
+    {
+      uint32_t& first = firstVertex[m_vertexPoint[v]];
+      if(first != ~0u && first != v)
+        m_locked[m_vertexPoint[v]] = true;
+      first = v;
+    }
+    std::unordered_map<uint64_t, uint32_t> edgeUse;
+    for(const auto& tri : m_tris)
+      for(int k = 0; k < 3; k++)
+        edgeUse[edgeKey(m_vertexPoint[tri[k]], m_vertexPoint[tri[(k + 1) % 3]])]++;
+    for(const auto& e : edgeUse)
+      if(e.second != 2)
+        m_locked[e.first >> 32] = m_locked[e.first & 0xFFFFFFFF] = true;
+
+    m_quadrics.resize(m_points.size());
+    for(const auto& tri : m_tris)
+    {
+      uint32_t a = m_vertexPoint[tri[0]], b = m_vertexPoint[tri[1]], c = m_vertexPoint[tri[2]];
+      Quadric  q = Quadric::triangle(m_points[a], m_points[b], m_points[c]);
+      for(uint32_t p : {a, b, c})
+        m_quadrics[p] = m_quadrics[p] + q;
+    }
+
+    m_version.assign(m_points.size(), 0);
+    for(const auto& e : edgeUse)
+      pushEdge(e.first >> 32, e.first & 0xFFFFFFFF);
+  }
+
+  // Collapses until targetTriangles, or until the next collapse would move the surface by more
+  // than maxError
+  void run(uint32_t targetTriangles, float maxError)
+  {
+    double maxCost = double(maxError) * maxError;
+    while(triangleCount > targetTriangles && !m_heap.empty())
+    {
+      Candidate c = m_heap.top();
+      if(c.cost > maxCost)
+        break;
+      m_heap.pop();
+      if(c.versionQ != m_version[c.q] || c.versionP != m_version[c.p])
+        continue;  // Stale, pushed again when it changed
+      if(collapse(c.q, c.p))
+        error = std::max(error, static_cast<float>(std::sqrt(c.cost)));
+    }
+  }
+
+  // Triangles alive, with the original vertices they use: `vertices` are indices in the source mesh
+  void extract(std::vector<uint32_t>& indices, std::vector<uint32_t>& vertices) const
+  {
+    std::unordered_map<uint32_t, uint32_t> remap;
+    indices.clear();
+    vertices.clear();
+    for(size_t t = 0; t < m_tris.size(); t++)
+    {
+      if(!m_alive[t])
+        continue;
+      for(uint32_t v : m_tris[t])
+      {
+        auto it = remap.emplace(v, static_cast<uint32_t>(vertices.size())).first;
+        if(it->second == vertices.size())
+          vertices.push_back(v);
+        indices.push_back(it->second);
+      }
+    }
+  }
+
+  uint32_t triangleCount{0};
+  float    error{0.f};  // Largest collapse distance so far
+
+private:
+  struct Candidate
+  {
+    double   cost;
+    uint32_t q;  // Removed point
+    uint32_t p;  // Kept point
+    uint32_t versionQ;
+    uint32_t versionP;
+    bool     operator<(const Candidate& o) const { return cost > o.cost; }  // Smallest cost on top
+  };
+
+  static uint64_t edgeKey(uint32_t a, uint32_t b) { return (uint64_t(std::min(a, b)) << 32) | std::max(a, b); }
+
+  // Both directions of the edge, cost of the quadrics of the two points at the kept one
+  void pushEdge(uint32_t a, uint32_t b)
+  {
+    Quadric q = m_quadrics[a] + m_quadrics[b];
+    if(!m_locked[a])
+      m_heap.push({q.error(m_points[b]), a, b, m_version[a], m_version[b]});
+    if(!m_locked[b])
+      m_heap.push({q.error(m_points[a]), b, a, m_version[b], m_version[a]});
+  }
+
+  uint32_t pointOf(uint32_t t, int k) const { return m_vertexPoint[m_tris[t][k]]; }
+
+  void neighbors(uint32_t point, std::vector<uint32_t>& out) const
+  {
+    out.clear();
+    for(uint32_t t : m_pointTris[point])
+      for(int k = 0; k < 3; k++)
+        if(pointOf(t, k) != point)
+          out.push_back(pointOf(t, k));
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+  }
+
+  // Point q merged into p, false when it would fold or pinch the surface
+  bool collapse(uint32_t q, uint32_t p)
+  {
+    // The vertex of p seen from the triangles of q: q has a single vertex, its fan is in one chart
+    uint32_t pVertex = ~0u;
+    for(uint32_t t : m_pointTris[q])
+      for(int k = 0; k < 3; k++)
+        if(pointOf(t, k) == p)
+        {
+          if(pVertex != ~0u && pVertex != m_tris[t][k])
+            return false;
+          pVertex = m_tris[t][k];
+        }
+    if(pVertex == ~0u)
+      return false;
+
+    // Link condition: the two points share exactly the two opposite points of the edge
+    neighbors(q, m_nq);
+    neighbors(p, m_np);
+    size_t common = 0;
+    for(size_t i = 0, j = 0; i < m_nq.size() && j < m_np.size();)
+    {
+      if(m_nq[i] == m_np[j])
+        common++, i++, j++;
+      else if(m_nq[i] < m_np[j])
+        i++;
+      else
+        j++;
+    }
+    if(common != 2)
+      return false;
+
+    // The triangles moving with q must not flip
+    for(uint32_t t : m_pointTris[q])
+    {
+      nvmath::vec3f before[3], after[3];
+      bool          hasP = false;
+      for(int k = 0; k < 3; k++)
+      {
+        uint32_t point = pointOf(t, k);
+        hasP           = hasP || point == p;
+        before[k] = after[k] = m_points[point];
+        if(point == q)
+          after[k] = m_points[p];
+      }
+      if(hasP)
+        continue;
+      nvmath::vec3f n0 = nvmath::cross(before[1] - before[0], before[2] - before[0]);
+      nvmath::vec3f n1 = nvmath::cross(after[1] - after[0], after[2] - after[0]);
+      float         l0 = nvmath::length(n0);
+      float         l1 = nvmath::length(n1);
+      if(l1 <= 1e-6f * l0 || nvmath::dot(n0, n1) < 0.2f * l0 * l1)
+        return false;
+    }
+
+    // Collapse: the triangles of the edge die, the others take the vertex of p
+    for(uint32_t t : m_pointTris[q])
+    {
+      int  slot = 0;
+      bool hasP = false;
+      for(int k = 0; k < 3; k++)
+      {
+        slot = pointOf(t, k) == q ? k : slot;
+        hasP = hasP || pointOf(t, k) == p;
+      }
+      if(hasP)
+      {
+        m_alive[t] = false;
+        triangleCount--;
+        for(int k = 0; k < 3; k++)
+        {
+          uint32_t point = pointOf(t, k);
+          if(point != q)
+          {
+            auto& tris = m_pointTris[point];
+            tris.erase(std::find(tris.begin(), tris.end(), t));
+          }
+        }
+      }
+      else
+      {
+        m_tris[t][slot] = pVertex;
+        m_pointTris[p].push_back(t);
+      }
+    }
+    m_pointTris[q].clear();
+    m_quadrics[p] = m_quadrics[p] + m_quadrics[q];
+    m_version[q]++;
+    m_version[p]++;
+
+    // The edges of p have a new cost
+    neighbors(p, m_np);
+    for(uint32_t n : m_np)
+      pushEdge(n, p);
+    return true;
+  }
+
+  std::vector<nvmath::vec3f>           m_points;
+  std::vector<uint32_t>                m_vertexPoint;  // Point of each vertex of the source mesh
+  std::vector<std::array<uint32_t, 3>> m_tris;         // Vertices of the source mesh
+  std::vector<bool>                    m_alive;
+  std::vector<std::vector<uint32_t>>   m_pointTris;  // Triangles alive around each point
+  std::vector<bool>                    m_locked;
+  std::vector<Quadric>                 m_quadrics;
+  std::vector<uint32_t>                m_version;  // Incremented when a point changes, see Candidate
+  std::priority_queue<Candidate>       m_heap;
+  std::vector<uint32_t>                m_nq, m_np;  // Scratch of collapse()
+};
+
+// Simplified levels of one mesh, level 0 is unused
+struct MeshLevels
+{
+  uint32_t                                      primMesh{0};
+  std::array<std::vector<uint32_t>, LOD_LEVELS> indices;
+  std::array<std::vector<uint32_t>, LOD_LEVELS> vertices;
+  std::array<float, LOD_LEVELS>                 error{};
+  int                                           count{0};  // Levels made, after the full detail
+};
+}  // namespace
+
+
+//--------------------------------------------------------------------------------------------------
+// Simplifies the meshes in parallel, each level continuing the collapses of the previous one.
+// The instances of a mesh share its levels.
+//
+void MeshLod::apply(nvh::GltfScene& gltf)
+{
+  m_reports.clear();
+  m_instances.clear();
+  m_nodeInstances.assign(gltf.m_nodes.size() + 1, 0);
+  m_nodeMasks.assign(gltf.m_nodes.size(), levelMask(0, 0));
+
+  int                     levels = std::min(m_settings.levels, LOD_LEVELS - 1);
+  std::vector<MeshLevels> meshes;
+  for(uint32_t primIndex = 0; primIndex < gltf.m_primMeshes.size() && levels > 0; primIndex++)
+  {
+    const nvh::GltfPrimMesh& prim   = gltf.m_primMeshes[primIndex];
+    const nvh::GltfMaterial& mat    = gltf.m_materials[prim.materialIndex];
+    bool                     opaque = mat.alphaMode == 0 || (mat.baseColorFactor.w == 1.0f && mat.baseColorTexture == -1);
+    if(opaque && luminance(mat.emissiveFactor) <= 1e-2f && prim.indexCount / 3 >= m_settings.minTriangles)
+    {
+      MeshLevels mesh;
+      mesh.primMesh = primIndex;
+      meshes.push_back(mesh);
+    }
+  }
+  if(meshes.empty())
+    return;
+
+  MilliTimer timer("Geometry LOD");
+  LOGI(" - Simplify %d meshes", meshes.size());
+
+  parallelRanges(
+      meshes.size(),
+      [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+          MeshLevels&              mesh = meshes[i];
+          const nvh::GltfPrimMesh& prim = gltf.m_primMeshes[mesh.primMesh];
+          MeshSimplifier           simplifier(gltf, prim);
+          float                    size     = nvmath::length(prim.posMax - prim.posMin);
+          uint32_t                 previous = simplifier.triangleCount;
+          for(int level = 1; level <= levels; level++)
+          {
+            simplifier.run(static_cast<uint32_t>(previous * m_settings.ratio), m_settings.maxError * size);
+            if(simplifier.triangleCount > previous * kMinReduction || simplifier.triangleCount == 0)
+              break;
+            simplifier.extract(mesh.indices[level], mesh.vertices[level]);
+            mesh.error[level] = size > 0.f ? simplifier.error / size : 0.f;
+            mesh.count        = level;
+            previous          = simplifier.triangleCount;
+          }
+        }
+      },
+      1);
+
+  // The levels are appended as new primitive meshes, their vertices copied from the source
+  std::vector<std::array<int, LOD_LEVELS>> lodPrims(gltf.m_primMeshes.size());
+  for(size_t primIndex = 0; primIndex < lodPrims.size(); primIndex++)
+  {
+    lodPrims[primIndex].fill(-1);
+    lodPrims[primIndex][0] = static_cast<int>(primIndex);
+  }
+  for(MeshLevels& mesh : meshes)
+  {
+    if(mesh.count == 0)
+      continue;
+    MeshReport report;
+    report.primMesh = mesh.primMesh;
+    report.name     = gltf.m_primMeshes[mesh.primMesh].name;
+    report.lodPrimMesh.fill(-1);
+    report.lodPrimMesh[0] = static_cast<int>(mesh.primMesh);
+    report.triangles[0]   = gltf.m_primMeshes[mesh.primMesh].indexCount / 3;
+
+    for(int level = 1; level <= mesh.count; level++)
+    {
+      nvh::GltfPrimMesh prim = gltf.m_primMeshes[mesh.primMesh];
+      uint32_t          src  = prim.vertexOffset;
+      prim.name += " LOD " + std::to_string(level);
+      prim.vertexOffset = static_cast<uint32_t>(gltf.m_positions.size());
+      prim.vertexCount  = static_cast<uint32_t>(mesh.vertices[level].size());
+      prim.firstIndex   = static_cast<uint32_t>(gltf.m_indices.size());
+      prim.indexCount   = static_cast<uint32_t>(mesh.indices[level].size());
+      gltf.m_indices.insert(gltf.m_indices.end(), mesh.indices[level].begin(), mesh.indices[level].end());
+      gltf.m_positions.reserve(gltf.m_positions.size() + prim.vertexCount);  // Copies from the same arrays
+      gltf.m_normals.reserve(gltf.m_normals.size() + prim.vertexCount);
+      gltf.m_tangents.reserve(gltf.m_tangents.size() + prim.vertexCount);
+      gltf.m_texcoords0.reserve(gltf.m_texcoords0.size() + prim.vertexCount);
+      gltf.m_colors0.reserve(gltf.m_colors0.size() + prim.vertexCount);
+      for(uint32_t v : mesh.vertices[level])
+      {
+        gltf.m_positions.push_back(gltf.m_positions[src + v]);
+        gltf.m_normals.push_back(gltf.m_normals[src + v]);
+        gltf.m_tangents.push_back(gltf.m_tangents[src + v]);
+        gltf.m_texcoords0.push_back(gltf.m_texcoords0[src + v]);
+        gltf.m_colors0.push_back(gltf.m_colors0[src + v]);
+      }
+
+      int lodPrim                    = static_cast<int>(gltf.m_primMeshes.size());
+      lodPrims[mesh.primMesh][level] = lodPrim;
+      report.lodPrimMesh[level]      = lodPrim;
+      report.triangles[level]        = prim.indexCount / 3;
+      report.error[level]            = mesh.error[level];
+      gltf.m_primMeshes.push_back(prim);
+    }
+    m_reports.push_back(report);
+  }
+
+  // Instances of the levels, grouped by node
+  for(uint32_t nodeIndex = 0; nodeIndex < gltf.m_nodes.size(); nodeIndex++)
+  {
+    const auto& lods     = lodPrims[gltf.m_nodes[nodeIndex].primMesh];
+    int         coarsest = 0;
+    while(coarsest + 1 < LOD_LEVELS && lods[coarsest + 1] >= 0)
+      coarsest++;
+    m_nodeMasks[nodeIndex] = levelMask(0, coarsest);
+    for(int level = 1; level <= coarsest; level++)
+      m_instances.push_back({nodeIndex, static_cast<uint32_t>(lods[level]), levelMask(level, coarsest)});
+    m_nodeInstances[nodeIndex + 1] = static_cast<uint32_t>(m_instances.size());
+  }
+  timer.print();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Rays of level r trace the bit r. The coarsest level of a mesh also answers the levels above it.
+//
+uint32_t MeshLod::levelMask(int level, int coarsest)
+{
+  uint32_t mask = 1u << level;
+  for(int r = level + 1; level == coarsest && r < LOD_LEVELS; r++)
+    mask |= 1u << r;
+  return mask;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Triangles, error and BLAS size of each level of the simplified meshes
+//
+void MeshLod::printReport() const
+{
+  for(const MeshReport& r : m_reports)
+  {
+    LOGI("LOD mesh %d (%s): %s triangles, BLAS %s bytes\n", r.primMesh, r.name.c_str(),
+         FormatNumbers(r.triangles[0]).c_str(), FormatNumbers(r.blasSize[0]).c_str());
+    for(int level = 1; level < LOD_LEVELS && r.lodPrimMesh[level] >= 0; level++)
+      LOGI(" - LOD %d: %s triangles, error %.3f%%, BLAS %s bytes\n", level, FormatNumbers(r.triangles[level]).c_str(),
+           r.error[level] * 100.f, FormatNumbers(r.blasSize[level]).c_str());
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Geometry levels of detail for the secondary rays. At load, the meshes are simplified with
+// quadric error metrics into up to LOD_LEVELS - 1 coarser meshes, appended to the glTF scene as
+// new primitive meshes: they get their own vertex buffers, InstanceData and BLAS.
+// - The TLAS has, after the instance of each node, one instance per simplified mesh of the node
+//   (getInstances). Their NodeData follow the ones of the nodes in the same order.
+// - A ray of level r traces the instances with the bit r of their mask: level 0 is the full detail.
+//   The coarsest level of a mesh also takes the bits of the levels above it, a mesh without
+//   simplified meshes answers all the levels with its full detail instance.
+// - Edge collapses keep one of the two vertices (half-edge collapse): the simplified meshes use a
+//   subset of the original vertices, their attributes stay exact. Borders, UV seams and
+//   non-manifold edges are kept.
+// - Alpha-tested and emissive meshes are not simplified: their hits must match the opacity and
+//   the triangle lights.
+//
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "nvh/gltfscene.hpp"
+#include "vulkan/vulkan_core.h"
+#include "shaders/host_device.h"  // LOD_LEVELS
+
+
+class MeshLod
+{
+public:
+  struct Settings
+  {
+    int      levels{2};           // Simplified meshes per mesh, up to LOD_LEVELS - 1; 0 disables
+    float    ratio{0.25f};        // Triangles kept by each level, relative to the previous one
+    float    maxError{0.01f};     // Collapses stop at this distance, relative to the size of the mesh
+    uint32_t minTriangles{1024};  // Smaller meshes are not simplified
+  };
+
+  struct MeshReport
+  {
+    uint32_t                             primMesh{0};
+    std::string                          name;
+    std::array<int, LOD_LEVELS>          lodPrimMesh{};  // Primitive mesh of each level, -1 when missing
+    std::array<uint32_t, LOD_LEVELS>     triangles{};
+    std::array<float, LOD_LEVELS>        error{};     // Largest collapse distance, relative to the mesh size
+    std::array<VkDeviceSize, LOD_LEVELS> blasSize{};  // Build size, before compaction; set once the BLAS are made
+  };
+
+  // TLAS instance of a simplified mesh, placed after the instances of all the nodes
+  struct Instance
+  {
+    uint32_t node{0};
+    uint32_t primMesh{0};
+    uint32_t mask{0};
+  };
+
+  // Appends the simplified meshes to gltf and makes their instances
+  void apply(nvh::GltfScene& gltf);
+  void printReport() const;
+
+  uint32_t                     nodeMask(uint32_t node) const { return m_nodeMasks[node]; }
+  const std::vector<Instance>& getInstances() const { return m_instances; }
+  const std::vector<uint32_t>& getNodeInstances() const { return m_nodeInstances; }
+  std::vector<MeshReport>&     getReports() { return m_reports; }
+
+  Settings m_settings;
+
+private:
+  static uint32_t levelMask(int level, int coarsest);
+
+  std::vector<MeshReport> m_reports;
+  std::vector<Instance>   m_instances;
+  std::vector<uint32_t>   m_nodeInstances;  // First Instance of each node, then the count
+  std::vector<uint32_t>   m_nodeMasks;      // Mask of the full detail instance of each node
+};
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Raster pre-pass of the primary visibility, see raster_primary.hpp
+ */
+
+
+#include "raster_primary.hpp"
+#include "memory_tracker.hpp"
+#include "nvvk/commands_vk.hpp"
+#include "nvvk/images_vk.hpp"
+#include "nvvk/pipeline_vk.hpp"
+#include "nvvk/renderpasses_vk.hpp"
+#include "nvvk/shaders_vk.hpp"
+#include "scene.hpp"
+#include "tools.hpp"
+
+#include <array>
+
+#include "autogen/raster_primary.frag.h"
+#include "autogen/raster_primary.vert.h"
+
+
+void RasterPrimary::setup(const VkDevice& device, uint32_t queueIndex, nvvk::ResourceAllocator* allocator)
+{
+  m_device     = device;
+  m_queueIndex = queueIndex;
+  m_pAlloc     = allocator;
+  m_debug.setup(device);
+}
+
+void RasterPrimary::destroy()
+{
+  m_pAlloc->destroy(m_hits);
+  m_pAlloc->destroy(m_depth);
+  vkDestroyImageView(m_device, m_depthView, nullptr);
+  vkDestroyFramebuffer(m_device, m_framebuffer, nullptr);
+  vkDestroyRenderPass(m_device, m_renderPass, nullptr);
+  vkDestroyPipeline(m_device, m_pipeline, nullptr);
+  vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+
+  m_depthView      = VK_NULL_HANDLE;
+  m_framebuffer    = VK_NULL_HANDLE;
+  m_renderPass     = VK_NULL_HANDLE;
+  m_pipeline       = VK_NULL_HANDLE;
+  m_pipelineLayout = VK_NULL_HANDLE;
+  m_size           = {};
+}
+
+//--------------------------------------------------------------------------------------------------
+// The descriptor set layouts are the ones of the path tracer, only the scene set is used
+//
+void RasterPrimary::create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetLayouts, Scene* scene)
+{
+  m_scene = scene;
+  m_renderPass = nvvk::createRenderPass(m_device, {m_hitsFormat}, m_depthFormat, 1, true, true, VK_IMAGE_LAYOUT_UNDEFINED,
+                                        VK_IMAGE_LAYOUT_GENERAL);
+  NAME_VK(m_renderPass);
+  createImages(size);
+  createPipeline(descSetLayouts);
+}
+
+void RasterPrimary::update(const VkExtent2D& size)
+{
+  if(size.width != m_size.width || size.height != m_size.height)
+    createImages(size);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Hits are read by the path tracer as storage image, in general layout
+//
+void RasterPrimary::createImages(const VkExtent2D& size)
+{
+  m_pAlloc->destroy(m_hits);
+  m_pAlloc->destroy(m_depth);
+  vkDestroyImageView(m_device, m_depthView, nullptr);
+  vkDestroyFramebuffer(m_device, m_framebuffer, nullptr);
+  m_size = size;
+  MemoryScope memScope(MemCategory::eOffscreen, "raster primary");
+
+  {
+    auto hitsCreateInfo = nvvk::makeImage2DCreateInfo(size, m_hitsFormat,
+                                                      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+    nvvk::Image           image  = m_pAlloc->createImage(hitsCreateInfo);
+    VkImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(image.image, hitsCreateInfo);
+    m_hits                       = m_pAlloc->createTexture(image, ivInfo);
+    m_hits.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    NAME_VK(m_hits.image);
+  }
+
+  {
+    auto depthCreateInfo = nvvk::makeImage2DCreateInfo(size, m_depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+    m_depth              = m_pAlloc->createImage(depthCreateInfo);
+    NAME_VK(m_depth.image);
+
+    VkImageViewCreateInfo depthStencilView{VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
+    depthStencilView.viewType         = VK_IMAGE_VIEW_TYPE_2D;
+    depthStencilView.format           = m_depthFormat;
+    depthStencilView.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+    depthStencilView.image            = m_depth.image;
+    vkCreateImageView(m_device, &depthStencilView, nullptr, &m_depthView);
+  }
+
+  // Until the first run, the image is read as is by the path tracer
+  {
+    nvvk::CommandPool genCmdBuf(m_device, m_queueIndex);
+    auto              cmdBuf = genCmdBuf.createCommandBuffer();
+    nvvk::cmdBarrierImageLayout(cmdBuf, m_hits.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    genCmdBuf.submitAndWait(cmdBuf);
+  }
+
+  std::vector<VkImageView> attachments = {m_hits.descriptor.imageView, m_depthView};
+  VkFramebufferCreateInfo  info{VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO};
+  info.renderPass      = m_renderPass;
+  info.attachmentCount = static_cast<uint32_t>(attachments.size());
+  info.pAttachments    = attachments.data();
+  info.width           = size.width;
+  info.height          = size.height;
+  info.layers          = 1;
+  vkCreateFramebuffer(m_device, &info, nullptr, &m_framebuffer);
+}
+
+//--------------------------------------------------------------------------------------------------
+// No vertex input: the vertex shader pulls the vertices with the index of the indexed draw
+//
+void RasterPrimary::createPipeline(const std::vector<VkDescriptorSetLayout>& descSetLayouts)
+{
+  VkPushConstantRange pushConstantRange{VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(RasterPushConstant)};
+
+  VkPipelineLayoutCreateInfo layoutInfo{VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  layoutInfo.setLayoutCount         = static_cast<uint32_t>(descSetLayouts.size());
+  layoutInfo.pSetLayouts            = descSetLayouts.data();
+  layoutInfo.pushConstantRangeCount = 1;
+  layoutInfo.pPushConstantRanges    = &pushConstantRange;
+  vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_pipelineLayout);
+
+  std::vector<uint32_t> vertexShader(std::begin(raster_primary_vert), std::end(raster_primary_vert));
+  std::vector<uint32_t> fragShader(std::begin(raster_primary_frag), std::end(raster_primary_frag));
+
+  nvvk::GraphicsPipelineGeneratorCombined pipelineGenerator(m_device, m_pipelineLayout, m_renderPass);
+  pipelineGenerator.addShader(vertexShader, VK_SHADER_STAGE_VERTEX_BIT);
+  pipelineGenerator.addShader(fragShader, VK_SHADER_STAGE_FRAGMENT_BIT);
+  pipelineGenerator.rasterizationState.cullMode = VK_CULL_MODE_NONE;  // Facing is resolved by the path tracer
+  pipelineGenerator.depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS;
+  CREATE_NAMED_VK(m_pipeline, pipelineGenerator.createPipeline());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Drawing all nodes with the camera of the frame, shifted by the sub-pixel jitter. The barriers
+// with the path tracer reading the hits are in the render graph.
+//
+void RasterPrimary::run(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize, VkDescriptorSet sceneDescSet, const vec2& jitter)
+{
+  LABEL_SCOPE_VK(cmdBuf);
+
+  std::array<VkClearValue, 2> clearValues{};
+  clearValues[0].color.uint32[0] = VISIBILITY_MISS;
+  clearValues[1].depthStencil    = {1.0f, 0};
+  VkRenderPassBeginInfo beginInfo{VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+  beginInfo.renderPass      = m_renderPass;
+  beginInfo.framebuffer     = m_framebuffer;
+  beginInfo.renderArea      = {{0, 0}, renderSize};
+  beginInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+  beginInfo.pClearValues    = clearValues.data();
+  vkCmdBeginRenderPass(cmdBuf, &beginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  VkViewport viewport{0.0f, 0.0f, static_cast<float>(renderSize.width), static_cast<float>(renderSize.height), 0.0f, 1.0f};
+  VkRect2D   scissor{{0, 0}, renderSize};
+  vkCmdSetViewport(cmdBuf, 0, 1, &viewport);
+  vkCmdSetScissor(cmdBuf, 0, 1, &scissor);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, S_SCENE, 1, &sceneDescSet, 0, nullptr);
+
+  // Same camera as the rays: the inverse of the matrices in the scene camera. The pixel center
+  // is moved onto the jittered position of the ray.
+  const SceneCamera& camera = m_scene->getCamera();
+  nvmath::mat4f      shift  = nvmath::translation_mat4(nvmath::vec3f((0.5f - jitter.x) * 2.0f / renderSize.width,
+                                                                   (0.5f - jitter.y) * 2.0f / renderSize.height, 0.0f));
+  nvmath::mat4f viewProj = shift * nvmath::invert(camera.projInverse) * nvmath::invert(camera.viewInverse);
+
+  auto& gltf    = m_scene->getScene();
+  auto& indices = m_scene->getBuffers(Scene::eIndex);
+
+  RasterPushConstant pc{};
+  for(size_t i = 0; i < gltf.m_nodes.size(); i++)
+  {
+    auto& node     = gltf.m_nodes[i];
+    auto& primMesh = gltf.m_primMeshes[node.primMesh];
+    pc.mvp         = viewProj * node.worldMatrix;
+    pc.instanceID  = static_cast<uint32_t>(i);
+    pc.primMesh    = static_cast<int>(node.primMesh);
+    vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+                       sizeof(RasterPushConstant), &pc);
+    vkCmdBindIndexBuffer(cmdBuf, indices[node.primMesh].buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexed(cmdBuf, primMesh.indexCount, 1, 0, 0, 0);
+  }
+
+  vkCmdEndRenderPass(cmdBuf);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Raster pre-pass of the primary visibility, used when the camera is a pinhole (aperture == 0).
+// - All nodes of the scene are drawn in a RG32UI image: instance (node) and triangle index.
+//   Alpha-masked materials are tested, blended ones are left to the path tracer.
+// - The projection is shifted by the sub-pixel jitter of the frame, so the first camera ray of
+//   each pixel in pathtrace.comp goes through the rasterized position and only has to intersect
+//   the triangle found there, see RasterHit() in shade_state.glsl.
+//
+
+#pragma once
+
+#include "nvmath/nvmath.h"
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/resourceallocator_vk.hpp"
+#include "shaders/host_device.h"
+
+class Scene;
+
+class RasterPrimary
+{
+public:
+  void setup(const VkDevice& device, uint32_t queueIndex, nvvk::ResourceAllocator* allocator);
+  void destroy();
+  void create(const VkExtent2D& size, const std::vector<VkDescriptorSetLayout>& descSetLayouts, Scene* scene);
+  void update(const VkExtent2D& size);
+  void run(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize, VkDescriptorSet sceneDescSet, const vec2& jitter);
+
+  const VkDescriptorImageInfo& getHitsDescriptor() { return m_hits.descriptor; }
+  VkImage                      getHitsImage() { return m_hits.image; }
+
+private:
+  void createImages(const VkExtent2D& size);
+  void createPipeline(const std::vector<VkDescriptorSetLayout>& descSetLayouts);
+
+  nvvk::Texture m_hits;   // instanceID, primitiveID
+  nvvk::Image   m_depth;
+  VkImageView   m_depthView{VK_NULL_HANDLE};
+  VkFormat      m_hitsFormat{VK_FORMAT_R32G32_UINT};
+  VkFormat      m_depthFormat{VK_FORMAT_D32_SFLOAT};
+  VkExtent2D    m_size{};
+
+  VkRenderPass     m_renderPass{VK_NULL_HANDLE};
+  VkFramebuffer    m_framebuffer{VK_NULL_HANDLE};
+  VkPipelineLayout m_pipelineLayout{VK_NULL_HANDLE};
+  VkPipeline       m_pipeline{VK_NULL_HANDLE};
+
+  Scene* m_scene{nullptr};
+
+  // Setup
+  nvvk::ResourceAllocator* m_pAlloc{nullptr};  // Allocator for buffer, images, acceleration structures
+  nvvk::DebugUtil          m_debug;            // Utility to name objects
+  VkDevice                 m_device{VK_NULL_HANDLE};
+  uint32_t                 m_queueIndex{0};
+};
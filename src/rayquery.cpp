@@ -26,15 +26,24 @@
 
 
 
+#include "memory_tracker.hpp"
 #include "nvh/alignment.hpp"
 #include "nvh/fileoperations.hpp"
 #include "nvvk/shaders_vk.hpp"
 #include "rayquery.hpp"
 #include "scene.hpp"
+#include "shader_reloader.hpp"
 #include "tools.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
   // Shaders
+#include "autogen/guide_update.comp.h"
 #include "autogen/pathtrace.comp.h"
+#include "autogen/shadow_resolve.comp.h"
+#include "autogen/shadow_trace.comp.h"
 //--------------------------------------------------------------------------------------------------
 //
 //
@@ -44,6 +53,19 @@ void RayQuery::setup(const VkDevice& device, const VkPhysicalDevice& physicalDev
 	m_pAlloc = allocator;
 	m_queueIndex = familyIndex;
 	m_debug.setup(device);
+	m_raster.setup(device, familyIndex, allocator);
+
+	// Optional features, enabled in main.cpp when supported
+	VkPhysicalDeviceShaderAtomicFloatFeaturesEXT atomicFloat{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_ATOMIC_FLOAT_FEATURES_EXT };
+	VkPhysicalDevicePipelineExecutablePropertiesFeaturesKHR execProp{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_EXECUTABLE_PROPERTIES_FEATURES_KHR };
+	atomicFloat.pNext = &execProp;
+	VkPhysicalDeviceFeatures2 features{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+	features.pNext = &atomicFloat;
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+	m_supportDeferredShadows = atomicFloat.shaderBufferFloat32AtomicAdd == VK_TRUE;
+	m_pipelineStatistics = execProp.pipelineExecutableInfo == VK_TRUE;
+	if (!m_supportDeferredShadows)
+		LOGW("Deferred shadow rays are not available, they need shaderBufferFloat32AtomicAdd\n");
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -51,15 +73,16 @@ void RayQuery::setup(const VkDevice& device, const VkPhysicalDevice& physicalDev
 //
 void RayQuery::destroy()
 {
-	m_pAlloc->destroy(m_buffer);
+	destroyBuffers();
+	m_pAlloc->destroy(m_guideCells);
+	m_guideCapacity = 0;
+	m_raster.destroy();
 	vkDestroyDescriptorPool(m_device, m_descPool, nullptr);
 	vkDestroyDescriptorSetLayout(m_device, m_descSetLayout, nullptr);
 
-	vkDestroyPipeline(m_device, m_pipeline, nullptr);
+	destroyPipelines();
 	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-
 	m_pipelineLayout = VK_NULL_HANDLE;
-	m_pipeline = VK_NULL_HANDLE;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -67,16 +90,21 @@ void RayQuery::destroy()
 //
 void RayQuery::create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout> rtDescSetLayouts, Scene* scene)
 {
-	MilliTimer timer;
+	MilliTimer timer("Ray query pipelines");
 	LOGI("Create Ray Query Pipeline");
 
 	std::vector<VkPushConstantRange> push_constants;
-	push_constants.push_back({ VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState) });
+	push_constants.push_back({ m_pushStages, 0, sizeof(RtxState) });
+
+#if PT_PROFILE
+	m_profileCounters = PROFILE_STAGES + (scene ? static_cast<uint32_t>(scene->getScene().m_materials.size()) : 0);
+#endif
+	createBuffers();
+	createGuideCells();
+
+	// Raster pre-pass, only using the scene set (S_SCENE)
+	m_raster.create(size, { rtDescSetLayouts.begin(), rtDescSetLayouts.begin() + S_SCENE + 1 }, scene);
 
-	// Create Gbuffer
-	m_bufferSize = size.width * size.height;
-	m_buffer = m_pAlloc->createBuffer(sizeof(GeomData) * m_bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	NAME_VK(m_buffer.buffer);
 	createDescriptorSet();
 	rtDescSetLayouts.push_back(m_descSetLayout);
 
@@ -87,73 +115,759 @@ void RayQuery::create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout>
 	layout_info.pSetLayouts = rtDescSetLayouts.data();
 	vkCreatePipelineLayout(m_device, &layout_info, nullptr, &m_pipelineLayout);
 
+	createPipelines();
+
+	timer.print();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Pipelines of the shaders, the path tracer of the current variant and the passes around it.
+// False if one of them could not be created.
+//
+bool RayQuery::createPipelines()
+{
+	bool created = createTracePipelines();
+	m_shadowPipeline = VK_NULL_HANDLE;
+	m_resolvePipeline = VK_NULL_HANDLE;
+	if (m_supportDeferredShadows)
+	{
+		m_shadowPipeline = createComputePipeline("shadow_trace.comp", shadow_trace_comp, sizeof(shadow_trace_comp), "ShadowTrace");
+		m_resolvePipeline = createComputePipeline("shadow_resolve.comp", shadow_resolve_comp, sizeof(shadow_resolve_comp), "ShadowResolve");
+		created = created && m_shadowPipeline != VK_NULL_HANDLE && m_resolvePipeline != VK_NULL_HANDLE;
+	}
+	m_guideUpdatePipeline = createComputePipeline("guide_update.comp", guide_update_comp, sizeof(guide_update_comp), "GuideUpdate");
+	return created && m_guideUpdatePipeline != VK_NULL_HANDLE;
+}
+
+// Path tracer of the current variant, the other variants are created when selected
+bool RayQuery::createTracePipelines()
+{
+	m_pipelines.assign(s_dispatchVariants.size(), VK_NULL_HANDLE);
+	int variant = (m_variant >= 0 && m_variant < static_cast<int>(s_dispatchVariants.size())) ? m_variant : 0;
+	return getVariantPipeline(variant) != VK_NULL_HANDLE;
+}
+
+void RayQuery::destroyPipelines()
+{
+	for (auto& pipeline : m_pipelines)
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+	vkDestroyPipeline(m_device, m_shadowPipeline, nullptr);
+	vkDestroyPipeline(m_device, m_resolvePipeline, nullptr);
+	vkDestroyPipeline(m_device, m_guideUpdatePipeline, nullptr);
+	m_pipelines.clear();
+	m_shadowPipeline = VK_NULL_HANDLE;
+	m_resolvePipeline = VK_NULL_HANDLE;
+	m_guideUpdatePipeline = VK_NULL_HANDLE;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Shaders recompiled by the ShaderReloader: same layout and resources, only the pipelines are
+// replaced. The previous pipelines stay if the driver rejects one of the new ones.
+//
+bool RayQuery::reloadPipelines()
+{
+	if (m_pipelineLayout == VK_NULL_HANDLE)
+		return false;
+
+	// Previous pipelines, set aside while the new ones are created
+	std::vector<VkPipeline> pipelines = m_pipelines;
+	VkPipeline              shadow = m_shadowPipeline;
+	VkPipeline              resolve = m_resolvePipeline;
+	VkPipeline              guideUpdate = m_guideUpdatePipeline;
+
+	if (!createPipelines())
+	{
+		destroyPipelines();  // The new ones
+		m_pipelines = pipelines;
+		m_shadowPipeline = shadow;
+		m_resolvePipeline = resolve;
+		m_guideUpdatePipeline = guideUpdate;
+		return false;
+	}
+
+	for (auto& pipeline : pipelines)
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+	vkDestroyPipeline(m_device, shadow, nullptr);
+	vkDestroyPipeline(m_device, resolve, nullptr);
+	vkDestroyPipeline(m_device, guideUpdate, nullptr);
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Dispatch variants of pathtrace.comp. The swizzle needs groups of 32 invocations, Hilbert
+// squares (or two squares) of power of two.
+//
+const std::vector<RayQuery::DispatchVariant> RayQuery::s_dispatchVariants = {
+	{ 8, 8, ePixelLinear },  // Default
+	{ 16, 8, ePixelLinear },
+	{ 16, 16, ePixelLinear },
+	{ 32, 2, ePixelLinear },
+	{ 32, 2, ePixelSwizzle },
+	{ 32, 4, ePixelSwizzle },
+	{ 64, 1, ePixelMorton },
+	{ 128, 1, ePixelMorton },
+	{ 64, 1, ePixelHilbert },
+	{ 256, 1, ePixelHilbert },
+	{ 64, 1, ePixelMorton, true },
+	{ 128, 1, ePixelMorton, true },
+};
+
+// Pixels covered by a workgroup
+VkExtent2D RayQuery::DispatchVariant::tile() const
+{
+	uint32_t count = groupX * groupY;
+	switch (order)
+	{
+	case ePixelSwizzle:
+		return { 4 * count / 32, 8 };
+	case ePixelMorton:
+	case ePixelHilbert:
+	{
+		uint32_t bits = 0;
+		while ((1u << bits) < count)
+			bits++;
+		return { 1u << ((bits + 1) / 2), 1u << (bits / 2) };
+	}
+	default:
+		return { groupX, groupY };
+	}
+}
+
+std::string RayQuery::DispatchVariant::name() const
+{
+	static const char* orders[] = { "Linear", "Swizzle", "Morton", "Hilbert" };
+	if (persistent)
+		return std::to_string(groupX) + "x" + std::to_string(groupY) + " Persistent";
+	VkExtent2D t = tile();
+	return std::to_string(groupX) + "x" + std::to_string(groupY) + " " + orders[order] + " (" + std::to_string(t.width)
+		+ "x" + std::to_string(t.height) + ")";
+}
+
+std::vector<std::string> RayQuery::variants()
+{
+	std::vector<std::string> names;
+	for (auto& v : s_dispatchVariants)
+		names.push_back(v.name());
+	return names;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Path tracer specialized for the dispatch variant, see the constant_id in pathtrace.comp
+//
+VkPipeline RayQuery::getVariantPipeline(int variant)
+{
+	if (m_pipelines[variant] != VK_NULL_HANDLE)
+		return m_pipelines[variant];
+
+	const DispatchVariant& v = s_dispatchVariants[variant];
+	VkExtent2D             tile = v.tile();
+	std::array<uint32_t, 6> values{ v.groupX, v.groupY, static_cast<uint32_t>(v.order), tile.width, tile.height,
+		v.persistent ? VK_TRUE : VK_FALSE };
+	std::array<VkSpecializationMapEntry, 6> entries;
+	for (uint32_t i = 0; i < entries.size(); i++)
+		entries[i] = { i, i * static_cast<uint32_t>(sizeof(uint32_t)), sizeof(uint32_t) };
+
+	VkSpecializationInfo specialization{};
+	specialization.mapEntryCount = static_cast<uint32_t>(entries.size());
+	specialization.pMapEntries = entries.data();
+	specialization.dataSize = sizeof(values);
+	specialization.pData = values.data();
+
+	std::string name = "RayQuery " + v.name();
+	m_pipelines[variant] = createComputePipeline("pathtrace.comp", pathtrace_comp, sizeof(pathtrace_comp), name.c_str(), &specialization);
+	return m_pipelines[variant];
+}
+
+//--------------------------------------------------------------------------------------------------
+// Compute pipeline using the layout of the path tracer. The code is the embedded one, unless the
+// shader was recompiled (ShaderReloader). The statistics of the compiled pipeline, registers
+// among others, are logged when VK_KHR_pipeline_executable_properties is there.
+//
+VkPipeline RayQuery::createComputePipeline(const char* shader, const uint32_t* code, size_t codeSize, const char* name, const VkSpecializationInfo* specialization)
+{
+	std::vector<uint32_t> spirv = ShaderReloader::get().code(shader, code, codeSize);
+
 	VkComputePipelineCreateInfo computePipelineCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
 	computePipelineCreateInfo.layout = m_pipelineLayout;
 	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, pathtrace_comp, sizeof(pathtrace_comp));
+	computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, spirv.data(), spirv.size() * sizeof(uint32_t));
 	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = specialization;
+	if (m_pipelineStatistics)
+		computePipelineCreateInfo.flags |= VK_PIPELINE_CREATE_CAPTURE_STATISTICS_BIT_KHR;
 
-	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_pipeline);
+	VkPipeline pipeline{ VK_NULL_HANDLE };
+	vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &pipeline);
 
-	m_debug.setObjectName(m_pipeline, "RayQuery");
+	m_debug.setObjectName(pipeline, name);
 	vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
 
+	if (m_pipelineStatistics)
+		logPipelineStatistics(pipeline, name);
 
-	timer.print();
+	return pipeline;
+}
+
+void RayQuery::logPipelineStatistics(VkPipeline pipeline, const char* name)
+{
+	VkPipelineInfoKHR pipelineInfo{ VK_STRUCTURE_TYPE_PIPELINE_INFO_KHR };
+	pipelineInfo.pipeline = pipeline;
+	uint32_t nbExecutables{ 0 };
+	vkGetPipelineExecutablePropertiesKHR(m_device, &pipelineInfo, &nbExecutables, nullptr);
+
+	for (uint32_t e = 0; e < nbExecutables; e++)
+	{
+		VkPipelineExecutableInfoKHR executableInfo{ VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_INFO_KHR };
+		executableInfo.pipeline = pipeline;
+		executableInfo.executableIndex = e;
+		uint32_t nbStats{ 0 };
+		vkGetPipelineExecutableStatisticsKHR(m_device, &executableInfo, &nbStats, nullptr);
+		std::vector<VkPipelineExecutableStatisticKHR> stats(nbStats, { VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_STATISTIC_KHR });
+		vkGetPipelineExecutableStatisticsKHR(m_device, &executableInfo, &nbStats, stats.data());
+
+		for (auto& stat : stats)
+		{
+			switch (stat.format)
+			{
+			case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_BOOL32_KHR:
+				LOGI(" - %s %s: %s\n", name, stat.name, stat.value.b32 ? "true" : "false");
+				break;
+			case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_INT64_KHR:
+				LOGI(" - %s %s: %lld\n", name, stat.name, static_cast<long long>(stat.value.i64));
+				break;
+			case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_UINT64_KHR:
+				LOGI(" - %s %s: %llu\n", name, stat.name, static_cast<unsigned long long>(stat.value.u64));
+				break;
+			case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_FLOAT64_KHR:
+				LOGI(" - %s %s: %f\n", name, stat.name, stat.value.f64);
+				break;
+			default:
+				break;
+			}
+		}
+	}
 }
 
 
 //--------------------------------------------------------------------------------------------------
-// Executing the Ray Query compute shader
+// Passes of the ray query renderer. The per pixel buffers are transient: the visibility only
+// lives in the path tracer, the shadow records and accumulation until the resolve.
 //
-#define GROUP_SIZE 8  // Same group size as in compute shader
-void RayQuery::run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, std::vector<VkDescriptorSet> descSets)
+#define GROUP_SIZE 8  // Same group size as in shadow_resolve.comp
+void RayQuery::declare(RenderGraph& graph, const VkExtent2D& size, RenderGraph::Resource output, const std::vector<VkDescriptorSet>& descSets)
 {
+	m_descSets = descSets;
+	m_descSets.push_back(m_descSet);
+	m_deferShadows = m_supportDeferredShadows && m_state.deferShadows == 1;
+	m_decoupled = m_state.indirectRes != eIndirectFull;
+
+	const VkDeviceSize         nbPixels = VkDeviceSize(size.width) * size.height;
+	const VkPipelineStageFlags compute = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	const VkPipelineStageFlags trace = m_traceStages;  // Path tracer, compute or ray tracing shaders
+	const VkPipelineStageFlags filled = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | m_traceStages;
+	const VkAccessFlags        readWrite = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	const VkAccessFlags        fillReadWrite = VK_ACCESS_TRANSFER_WRITE_BIT | readWrite;
+
+	m_transients.visibility = graph.createBuffer("Visibility", sizeof(VisibilityData) * nbPixels, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_transients.shadowRecords = graph.createBuffer("ShadowRecords", sizeof(ShadowRecord) * SHADOW_RECORDS_PER_PIXEL * nbPixels,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_transients.shadowAccum = graph.createBuffer("ShadowAccum", sizeof(float) * 3 * nbPixels, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_shadowCapacity = static_cast<uint32_t>(nbPixels * SHADOW_RECORDS_PER_PIXEL);
+	const VkExtent2D grid = indirectGrid(size, m_state.indirectRes);
+	m_transients.indirect = graph.createBuffer("Indirect", sizeof(IndirectCell) * VkDeviceSize(grid.width) * grid.height,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+	RenderGraph::Resource hits = graph.importImage("PrimaryHits", m_raster.getHitsImage(), VK_IMAGE_LAYOUT_GENERAL);
+	RenderGraph::Resource queue = graph.importBuffer("ShadowQueue", m_shadowQueue.buffer);
+	RenderGraph::Resource work = graph.importBuffer("WorkQueue", m_workQueue.buffer);
+	RenderGraph::Resource guide = graph.importBuffer("GuideCells", m_guideCells.buffer);
+#if PT_STATS
+	RenderGraph::Resource rayStats = graph.importBuffer("RayStats", m_rayStats.buffer);
+#endif
+#if PT_PROFILE
+	RenderGraph::Resource profile = graph.importBuffer("Profile", m_profile.buffer);
+#endif
+
+	// Primary hits of the first sample, see RasterHit() in shade_state.glsl
+	const bool raster = m_state.rasterPrimary == 1;
+	if (raster)
+	{
+		graph.addPass("Raster", [this](VkCommandBuffer cmdBuf) { m_raster.run(cmdBuf, m_renderSize, m_descSets[S_SCENE], m_state.jitter); })
+			.write(hits, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+	}
+
+	// Decoupled indirect lighting, one pixel per cell. The counters and guiding cells are emptied
+	// at the start of the first pass tracing paths.
+	if (m_decoupled)
+	{
+		auto& indirect = graph.addPass("Indirect", [this](VkCommandBuffer cmdBuf) { runIndirect(cmdBuf); });
+		indirect.write(m_transients.indirect, trace)
+			.write(work, filled, fillReadWrite)
+			.write(guide, filled, fillReadWrite)
+			.write(queue, filled, fillReadWrite);
+#if PT_STATS
+		indirect.write(rayStats, filled, fillReadWrite);
+#endif
+#if PT_PROFILE
+		indirect.write(profile, filled, fillReadWrite);
+#endif
+	}
+
+	auto& pathTrace = graph.addPass("Path trace", [this](VkCommandBuffer cmdBuf) { runPathTrace(cmdBuf); });
+	pathTrace.write(m_transients.visibility, trace, readWrite)
+		.write(output, trace, readWrite)
+		.write(work, filled, fillReadWrite)
+		.write(guide, filled, fillReadWrite);
+	if (raster)
+		pathTrace.read(hits, trace);
+	if (m_decoupled)
+		pathTrace.read(m_transients.indirect, trace);
+#if PT_STATS
+	pathTrace.write(rayStats, filled, fillReadWrite);
+#endif
+#if PT_PROFILE
+	pathTrace.write(profile, filled, fillReadWrite);
+#endif
+
+	if (m_deferShadows)
+	{
+		pathTrace.write(queue, filled, fillReadWrite)
+			.write(m_transients.shadowRecords, trace)
+			.write(m_transients.shadowAccum, trace);
+
+		// Occlusion pass: as many invocations as queued rays
+		auto& shadow = graph.addPass("Shadow", [this](VkCommandBuffer cmdBuf) { runShadows(cmdBuf); });
+		shadow.read(queue, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | compute, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT)
+			.read(m_transients.shadowRecords, compute)
+			.write(m_transients.shadowAccum, compute, readWrite);
+#if PT_STATS
+		shadow.write(rayStats, compute, readWrite);
+#endif
+#if PT_PROFILE
+		shadow.write(profile, compute, readWrite);
+#endif
+
+		// Accumulating the frame in the output image
+		graph.addPass("Resolve", [this](VkCommandBuffer cmdBuf) { runResolve(cmdBuf); })
+			.read(m_transients.shadowAccum, compute)
+			.write(output, compute, readWrite);
+	}
+
+	// Counters of the frame, read on the next frames
+	auto& statistics = graph.addPass("Statistics", [this](VkCommandBuffer cmdBuf) { copyStatistics(cmdBuf); });
+	statistics.read(work, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+#if PT_STATS
+	statistics.read(rayStats, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+#endif
+#if PT_PROFILE
+	statistics.read(profile, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Buffers of the compiled graph, the ones of passes not declared are not allocated
+//
+void RayQuery::bind(const RenderGraph& graph)
+{
+	m_visibility = graph.getBuffer(m_transients.visibility);
+	m_shadowRecords = graph.isUsed(m_transients.shadowRecords) ? graph.getBuffer(m_transients.shadowRecords) : VK_NULL_HANDLE;
+	m_shadowAccum = graph.isUsed(m_transients.shadowAccum) ? graph.getBuffer(m_transients.shadowAccum) : VK_NULL_HANDLE;
+	m_indirect = graph.isUsed(m_transients.indirect) ? graph.getBuffer(m_transients.indirect) : VK_NULL_HANDLE;
+	writeDescriptorSet();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Cells of the decoupled indirect lighting, same as IndirectGrid() in pathtrace.comp
+//
+VkExtent2D RayQuery::indirectGrid(const VkExtent2D& size, int indirectRes)
+{
+	switch (indirectRes)
+	{
+	case eIndirectHalf:
+		return { (size.width + 1) / 2, (size.height + 1) / 2 };
+	case eIndirectQuarter:
+		return { (size.width + 3) / 4, (size.height + 3) / 4 };
+	case eIndirectCheckerboard:
+		return { (size.width + 1) / 2, size.height };
+	default:
+		return { 1, 1 };  // Not used
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+// Start of the frame, in the first pass tracing paths: state of the frame, counters emptied and
+// path guiding. The descriptor sets stay bound for the next passes.
+//
+void RayQuery::beginFrame(const VkCommandBuffer& cmdBuf)
+{
+	RtxState state = m_state;
+	if (!m_deferShadows)
+		state.deferShadows = 0;
+	if (!m_decoupled)
+		state.indirectRes = eIndirectFull;
+	state.indirectPass = 0;
+	state.guideCapacity = m_guideCapacity;
+	state.guideTrain = 0;
+	// The adjoint Russian roulette uses the radiance learned by the guiding cells
+	const bool useGuideCells = state.guiding == 1 || state.rrMode == eRrAdjoint;
+
+	// Cells of the path guiding, reallocated when the memory setting changed
+	if (useGuideCells && m_guiding.memoryMB * (1ull << 20) / sizeof(GuideCell) != m_guideCapacity)
+	{
+		vkDeviceWaitIdle(m_device);
+		m_pAlloc->destroy(m_guideCells);
+		createGuideCells();
+		writeDescriptorSet();
+		state.guideCapacity = m_guideCapacity;
+	}
+
+	// Empty work queue and, with deferred shadows, empty shadow queue: the dispatch of the
+	// occlusion pass grows with the queued rays
+	{
+		vkCmdFillBuffer(cmdBuf, m_workQueue.buffer, 0, VK_WHOLE_SIZE, 0);
+#if PT_STATS
+		vkCmdFillBuffer(cmdBuf, m_rayStats.buffer, 0, VK_WHOLE_SIZE, 0);
+#endif
+#if PT_PROFILE
+		vkCmdFillBuffer(cmdBuf, m_profile.buffer, 0, VK_WHOLE_SIZE, 0);
+#endif
+		if (useGuideCells && m_guideReset)
+		{
+			vkCmdFillBuffer(cmdBuf, m_guideCells.buffer, 0, VK_WHOLE_SIZE, 0);
+			m_guideReset = false;
+			m_guideFrame = 0;
+		}
+		if (state.deferShadows == 1)
+		{
+			ShadowQueue queue{ 0, 0, 1, 1, m_shadowCapacity };
+			vkCmdUpdateBuffer(cmdBuf, m_shadowQueue.buffer, 0, sizeof(ShadowQueue), &queue);
+		}
+		VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | m_traceStages, 0, 1,
+			&barrier, 0, nullptr, 0, nullptr);
+	}
+
 	// Preparing for the compute shader
-	descSets.push_back(m_descSet);
-	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
-		static_cast<uint32_t>(descSets.size()), descSets.data(), 0, nullptr);
+		static_cast<uint32_t>(m_descSets.size()), m_descSets.data(), 0, nullptr);
+
+	if (useGuideCells)
+	{
+		TRACE_GPU_SCOPE(cmdBuf, "Guiding");
+		runGuiding(cmdBuf, state);
+	}
+	m_frameState = state;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Indirect lighting of one pixel per cell, upsampled by the path tracer
+//
+void RayQuery::runIndirect(const VkCommandBuffer& cmdBuf)
+{
+	beginFrame(cmdBuf);
+	RtxState state = m_frameState;
+	state.indirectPass = 1;
+	state.deferShadows = 0;  // Shadow rays of the paths traced inline, the queue holds the ones of the pixels
+	vkCmdPushConstants(cmdBuf, m_pipelineLayout, m_pushStages, 0, sizeof(RtxState), &state);
+
+	int variant = (m_variant >= 0 && m_variant < static_cast<int>(s_dispatchVariants.size())) ? m_variant : 0;
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, getVariantPipeline(variant));
+	const DispatchVariant& v = s_dispatchVariants[variant];
+	VkExtent2D             grid = indirectGrid(m_renderSize, m_frameState.indirectRes);
+	vkCmdDispatch(cmdBuf, (grid.width + (v.groupX - 1)) / v.groupX, (grid.height + (v.groupY - 1)) / v.groupY, 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Executing the Ray Query compute shader
+//
+void RayQuery::runPathTrace(const VkCommandBuffer& cmdBuf)
+{
+	if (m_decoupled)
+		vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0,
+			static_cast<uint32_t>(m_descSets.size()), m_descSets.data(), 0, nullptr);
+	else
+		beginFrame(cmdBuf);
 
 	// Sending the push constant information
-	vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RtxState), &m_state);
+	vkCmdPushConstants(cmdBuf, m_pipelineLayout, m_pushStages, 0, sizeof(RtxState), &m_frameState);
+	dispatchPaths(cmdBuf);
+}
+
+// Dispatching the shader, one workgroup per tile, or the persistent workgroups
+void RayQuery::dispatchPaths(const VkCommandBuffer& cmdBuf)
+{
+	int variant = (m_variant >= 0 && m_variant < static_cast<int>(s_dispatchVariants.size())) ? m_variant : 0;
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, getVariantPipeline(variant));
+	const DispatchVariant& v = s_dispatchVariants[variant];
+	VkExtent2D             tile = v.tile();
+	uint32_t               groupsX = (m_renderSize.width + (tile.width - 1)) / tile.width;
+	uint32_t               groupsY = (m_renderSize.height + (tile.height - 1)) / tile.height;
+	if (v.persistent)
+		vkCmdDispatch(cmdBuf, std::min(groupsX * groupsY, m_persistentGroups), 1, 1);
+	else
+		vkCmdDispatch(cmdBuf, groupsX, groupsY, 1);
+}
+
+void RayQuery::runShadows(const VkCommandBuffer& cmdBuf)
+{
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_shadowPipeline);
+	vkCmdDispatchIndirect(cmdBuf, m_shadowQueue.buffer, offsetof(ShadowQueue, groupX));
+}
+
+void RayQuery::runResolve(const VkCommandBuffer& cmdBuf)
+{
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_resolvePipeline);
+	vkCmdDispatch(cmdBuf, (m_renderSize.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (m_renderSize.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Lane utilization, ray statistics and clocks of the frame, shadow pass included
+//
+void RayQuery::copyStatistics(const VkCommandBuffer& cmdBuf)
+{
+	VkBufferCopy region{ 0, 0, sizeof(WorkQueue) };
+	vkCmdCopyBuffer(cmdBuf, m_workQueue.buffer, m_workQueueReadback.buffer, 1, &region);
+#if PT_STATS
+	region.size = sizeof(RayStats);
+	vkCmdCopyBuffer(cmdBuf, m_rayStats.buffer, m_rayStatsReadback.buffer, 1, &region);
+#endif
+#if PT_PROFILE
+	region.size = sizeof(ProfileCounter) * m_profileCounters;
+	vkCmdCopyBuffer(cmdBuf, m_profile.buffer, m_profileReadback.buffer, 1, &region);
+#endif
+}
 
-	// Dispatching the shader
-	vkCmdDispatch(cmdBuf, (size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+//--------------------------------------------------------------------------------------------------
+// Path guiding schedule. The cells learn during the first trainFrames frames (always with 0), the
+// distributions are updated from what was learned on frames 1, 2, 4, ... 64, then every 64 frames:
+// early updates give a rough guide quickly, later ones have more samples.
+// The update pass goes before the path tracer of the frame, the descriptor sets must be bound.
+//
+void RayQuery::runGuiding(const VkCommandBuffer& cmdBuf, RtxState& state)
+{
+	const int frame = m_guideFrame;
+	bool      training = m_guiding.trainFrames == 0 || frame < m_guiding.trainFrames;
+	bool      lastTraining = frame == m_guiding.trainFrames;
+	bool      scheduled = frame % 64 == 0 || (frame < 64 && (frame & (frame - 1)) == 0);
+	state.guideTrain = training ? 1 : 0;
+
+	if (frame > 0 && ((training && scheduled) || lastTraining))
+	{
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_guideUpdatePipeline);
+		vkCmdPushConstants(cmdBuf, m_pipelineLayout, m_pushStages, 0, sizeof(RtxState), &state);
+		vkCmdDispatch(cmdBuf, (m_guideCapacity + GUIDE_UPDATE_GROUP_SIZE - 1) / GUIDE_UPDATE_GROUP_SIZE, 1, 1);
+
+		VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | m_traceStages, 0,
+			1, &barrier, 0, nullptr, 0, nullptr);
+	}
+	m_guideFrame++;
 }
 
-// handle window resize
+// handle window resize: the per pixel buffers are in the render graph, declared again
 void RayQuery::update(const VkExtent2D& size) {
-	if ((size.width * size.height) > m_bufferSize) {
-		m_bufferSize = size.width * size.height;
-		m_pAlloc->destroy(m_buffer);
-		m_buffer = m_pAlloc->createBuffer(sizeof(GeomData) * m_bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		NAME_VK(m_buffer.buffer);
-
-		VkShaderStageFlags flag = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
-			| VK_SHADER_STAGE_ANY_HIT_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-		nvvk::DescriptorSetBindings bind;
-		bind.addBinding({ RayQBindings::eGbuffer, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
-		VkDescriptorBufferInfo dbi{ m_buffer.buffer, 0, VK_WHOLE_SIZE };
-		VkWriteDescriptorSet write = bind.makeWrite(m_descSet, RayQBindings::eGbuffer, &dbi);
-		vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+	m_raster.update(size);
+	writeDescriptorSet();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Buffers kept across frames. The per pixel ones are transients of the render graph.
+//
+void RayQuery::createBuffers()
+{
+	MemoryScope memScope(MemCategory::eRenderer, "ray query");
+
+	m_unused = m_pAlloc->createBuffer(16, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_shadowQueue = m_pAlloc->createBuffer(sizeof(ShadowQueue),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	NAME_VK(m_unused.buffer);
+	NAME_VK(m_shadowQueue.buffer);
+
+	m_workQueue = m_pAlloc->createBuffer(sizeof(WorkQueue),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_workQueueReadback = m_pAlloc->createBuffer(sizeof(WorkQueue), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	m_workQueueMapped = static_cast<WorkQueue*>(m_pAlloc->map(m_workQueueReadback));
+	*m_workQueueMapped = {};
+	NAME_VK(m_workQueue.buffer);
+	NAME_VK(m_workQueueReadback.buffer);
+
+#if PT_STATS
+	m_rayStats = m_pAlloc->createBuffer(sizeof(RayStats),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_rayStatsReadback = m_pAlloc->createBuffer(sizeof(RayStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	m_rayStatsMapped = static_cast<RayStats*>(m_pAlloc->map(m_rayStatsReadback));
+	*m_rayStatsMapped = {};
+	NAME_VK(m_rayStats.buffer);
+	NAME_VK(m_rayStatsReadback.buffer);
+#endif
+
+#if PT_PROFILE
+	m_profile = m_pAlloc->createBuffer(sizeof(ProfileCounter) * m_profileCounters,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_profileReadback = m_pAlloc->createBuffer(sizeof(ProfileCounter) * m_profileCounters, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	m_profileMapped = static_cast<ProfileCounter*>(m_pAlloc->map(m_profileReadback));
+	std::fill_n(m_profileMapped, m_profileCounters, ProfileCounter{});
+	NAME_VK(m_profile.buffer);
+	NAME_VK(m_profileReadback.buffer);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Hash grid of the path guiding, GuidingSettings::memoryMB. Emptied by the next frame guiding.
+//
+void RayQuery::createGuideCells()
+{
+	MemoryScope memScope(MemCategory::eRenderer, "path guiding");
+	m_guideCapacity = std::max(1u, static_cast<uint32_t>(m_guiding.memoryMB * (1ull << 20) / sizeof(GuideCell)));
+	m_guideCells = m_pAlloc->createBuffer(sizeof(GuideCell) * m_guideCapacity,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	NAME_VK(m_guideCells.buffer);
+	m_guideReset = true;
+}
+
+void RayQuery::destroyBuffers()
+{
+	m_pAlloc->destroy(m_unused);
+	m_pAlloc->destroy(m_shadowQueue);
+	m_visibility = VK_NULL_HANDLE;  // Owned by the render graph
+	m_shadowRecords = VK_NULL_HANDLE;
+	m_shadowAccum = VK_NULL_HANDLE;
+	m_indirect = VK_NULL_HANDLE;
+	m_pAlloc->destroy(m_workQueue);
+	if (m_workQueueMapped)
+		m_pAlloc->unmap(m_workQueueReadback);
+	m_pAlloc->destroy(m_workQueueReadback);
+	m_workQueueMapped = nullptr;
+
+#if PT_STATS
+	m_pAlloc->destroy(m_rayStats);
+	if (m_rayStatsMapped)
+		m_pAlloc->unmap(m_rayStatsReadback);
+	m_pAlloc->destroy(m_rayStatsReadback);
+	m_rayStatsMapped = nullptr;
+#endif
+
+#if PT_PROFILE
+	m_pAlloc->destroy(m_profile);
+	if (m_profileMapped)
+		m_pAlloc->unmap(m_profileReadback);
+	m_pAlloc->destroy(m_profileReadback);
+	m_profileMapped = nullptr;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// From a frame in flight, good enough for a statistic
+//
+float RayQuery::getLaneUtilization()
+{
+	if (m_workQueueMapped == nullptr || m_state.laneStats == 0 || m_workQueueMapped->slotSteps == 0)
+		return 0.f;
+	return float(m_workQueueMapped->activeSteps) / float(m_workQueueMapped->slotSteps);
+}
+
+std::vector<Renderer::BounceStatistics> RayQuery::getBounceStatistics()
+{
+	std::vector<BounceStatistics> stats;
+	if (m_workQueueMapped == nullptr || m_state.bounceStats == 0)
+		return stats;
+	for (int i = 0; i < BOUNCE_STAT_DEPTH; i++)
+	{
+		if (m_workQueueMapped->bouncePaths[i] == 0)
+			break;
+		stats.push_back({ m_workQueueMapped->bouncePaths[i], m_workQueueMapped->bounceTerminated[i], m_workQueueMapped->bounceSplits[i] });
 	}
+	return stats;
+}
+
+#if PT_STATS
+// Copy of a recent frame: the readback is written by the frames in flight
+bool RayQuery::getRayStats(RayStats& stats)
+{
+	if (m_rayStatsMapped == nullptr)
+		return false;
+	stats = *m_rayStatsMapped;
+	return stats.paths > 0 || stats.primaryRays > 0;
+}
+#endif
+
+#if PT_PROFILE
+bool RayQuery::getProfile(std::vector<ProfileCounter>& counters)
+{
+	if (m_profileMapped == nullptr)
+		return false;
+	counters.assign(m_profileMapped, m_profileMapped + m_profileCounters);
+	return true;
 }
+#endif
 
 void RayQuery::createDescriptorSet()
 {
 	VkShaderStageFlags flag = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
 		| VK_SHADER_STAGE_ANY_HIT_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-	nvvk::DescriptorSetBindings bind;
-	bind.addBinding({ RayQBindings::eGbuffer, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind = nvvk::DescriptorSetBindings();
+	m_bind.addBinding({ RayQBindings::eVisibility, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::ePrimaryHits, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, flag });
+	m_bind.addBinding({ RayQBindings::eShadowQueue, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::eShadowRecords, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::eShadowAccum, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::eWorkQueue, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::eGuideCells, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	m_bind.addBinding({ RayQBindings::eIndirect, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+#if PT_STATS
+	m_bind.addBinding({ RayQBindings::eRayStats, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+#endif
+#if PT_PROFILE
+	m_bind.addBinding({ RayQBindings::eProfile, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+#endif
 
-	m_descPool = bind.createPool(m_device, 1);
-	CREATE_NAMED_VK(m_descSetLayout, bind.createLayout(m_device));
+	m_descPool = m_bind.createPool(m_device, 1);
+	CREATE_NAMED_VK(m_descSetLayout, m_bind.createLayout(m_device));
 	CREATE_NAMED_VK(m_descSet, nvvk::allocateDescriptorSet(m_device, m_descPool, m_descSetLayout));
 
-	VkDescriptorBufferInfo dbi{ m_buffer.buffer, 0, VK_WHOLE_SIZE };
-	VkWriteDescriptorSet write = bind.makeWrite(m_descSet, RayQBindings::eGbuffer, &dbi);
-	vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+	writeDescriptorSet();
+}
+
+// Transients not bound yet, or not declared, are replaced by m_unused
+void RayQuery::writeDescriptorSet()
+{
+	auto transient = [&](VkBuffer buffer) { return buffer != VK_NULL_HANDLE ? buffer : m_unused.buffer; };
+	VkDescriptorBufferInfo visibilityInfo{ transient(m_visibility), 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo queueInfo{ m_shadowQueue.buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo recordsInfo{ transient(m_shadowRecords), 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo accumInfo{ transient(m_shadowAccum), 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo workInfo{ m_workQueue.buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo guideInfo{ m_guideCells.buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo indirectInfo{ transient(m_indirect), 0, VK_WHOLE_SIZE };
 
+	std::vector<VkWriteDescriptorSet> writes;
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eVisibility, &visibilityInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::ePrimaryHits, &m_raster.getHitsDescriptor()));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eShadowQueue, &queueInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eShadowRecords, &recordsInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eShadowAccum, &accumInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eWorkQueue, &workInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eGuideCells, &guideInfo));
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eIndirect, &indirectInfo));
+#if PT_STATS
+	VkDescriptorBufferInfo statsInfo{ m_rayStats.buffer, 0, VK_WHOLE_SIZE };
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eRayStats, &statsInfo));
+#endif
+#if PT_PROFILE
+	VkDescriptorBufferInfo profileInfo{ m_profile.buffer, 0, VK_WHOLE_SIZE };
+	writes.emplace_back(m_bind.makeWrite(m_descSet, RayQBindings::eProfile, &profileInfo));
+#endif
+	vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 }
@@ -25,6 +25,7 @@
 #include "nvvk/descriptorsets_vk.hpp"
 
 #include "nvvk/profiler_vk.hpp"
+#include "raster_primary.hpp"
 #include "renderer.h"
 #include "shaders/host_device.h"
 
@@ -39,7 +40,7 @@ Creating the Compute ray query renderer
 * Usage
   - setup as usual
   - create
-  - run
+  - declare the passes in the render graph, bind the compiled graph
 */
 class RayQuery : public Renderer
 {
@@ -47,27 +48,120 @@ public:
   void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator) override;
   void destroy() override;
   void create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout> rtDescSetLayouts, Scene* scene) override;
-  void              run(const VkCommandBuffer& cmdBuf, const VkExtent2D& size, nvvk::ProfilerVK& profiler, std::vector<VkDescriptorSet> descSets) override;
+  void declare(RenderGraph& graph, const VkExtent2D& size, RenderGraph::Resource output, const std::vector<VkDescriptorSet>& descSets) override;
+  void bind(const RenderGraph& graph) override;
   const std::string name() override { return std::string("RQ"); }
   void update(const VkExtent2D& size) override;
   void createDescriptorSet();
+  std::vector<std::string> variants() override;
+  float                    getLaneUtilization() override;
+  std::vector<BounceStatistics> getBounceStatistics() override;
+#if PT_STATS
+  bool getRayStats(RayStats& stats) override;
+#endif
+#if PT_PROFILE
+  bool getProfile(std::vector<ProfileCounter>& counters) override;
+#endif
+  void                     resetGuiding() override { m_guideReset = true; }
+  bool                     reloadPipelines() override;
+
+protected:
+  void       createBuffers();
+  void       destroyBuffers();
+  void       writeDescriptorSet();
+  bool       createPipelines();
+  virtual bool createTracePipelines();  // Into m_pipelines
+  void       destroyPipelines();
+  VkPipeline createComputePipeline(const char* shader, const uint32_t* code, size_t codeSize, const char* name, const VkSpecializationInfo* specialization = nullptr);
+  VkPipeline getVariantPipeline(int variant);
+  void       createGuideCells();
+  void       runGuiding(const VkCommandBuffer& cmdBuf, RtxState& state);
+  void       beginFrame(const VkCommandBuffer& cmdBuf);
+  void       runIndirect(const VkCommandBuffer& cmdBuf);
+  void       runPathTrace(const VkCommandBuffer& cmdBuf);
+  virtual void dispatchPaths(const VkCommandBuffer& cmdBuf);  // Path tracer, the frame state pushed
+  void       runShadows(const VkCommandBuffer& cmdBuf);
+  void       runResolve(const VkCommandBuffer& cmdBuf);
+  void       copyStatistics(const VkCommandBuffer& cmdBuf);
+
+  // Dispatch of pathtrace.comp: workgroup shape and order of the pixels in the tile of a workgroup
+  struct DispatchVariant
+  {
+    uint32_t   groupX;
+    uint32_t   groupY;
+    PixelOrder order;
+    bool       persistent{false};  // Persistent threads fetching pixels, see PersistentMain()
+    VkExtent2D tile() const;
+    std::string name() const;
+  };
+  static const std::vector<DispatchVariant> s_dispatchVariants;
+  void       logPipelineStatistics(VkPipeline pipeline, const char* name);
+  static VkExtent2D indirectGrid(const VkExtent2D& size, int indirectRes);
 
-private:
   uint32_t m_nbHit{0};
+  bool     m_supportDeferredShadows{false};  // shaderBufferFloat32AtomicAdd
+  bool     m_pipelineStatistics{false};      // VK_KHR_pipeline_executable_properties
 
-private:
+  // Stages of the path tracer: push constants and the barriers of its passes
+  VkShaderStageFlags   m_pushStages{VK_SHADER_STAGE_COMPUTE_BIT};
+  VkPipelineStageFlags m_traceStages{VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
+
+protected:
   // Setup
   nvvk::ResourceAllocator* m_pAlloc{nullptr};  // Allocator for buffer, images, acceleration structures
   nvvk::DebugUtil          m_debug;            // Utility to name objects
   VkDevice                 m_device{VK_NULL_HANDLE};
   uint32_t                 m_queueIndex{0};
 
-  nvvk::Buffer m_buffer;
-  uint m_bufferSize;
+  // Per pixel buffers, transient in the render graph: m_unused is bound when not declared
+  struct Transients
+  {
+    RenderGraph::Resource visibility{RenderGraph::kInvalid};     // VisibilityData
+    RenderGraph::Resource shadowRecords{RenderGraph::kInvalid};  // ShadowRecord, SHADOW_RECORDS_PER_PIXEL per pixel
+    RenderGraph::Resource shadowAccum{RenderGraph::kInvalid};    // Color of the frame, 3 floats per pixel
+    RenderGraph::Resource indirect{RenderGraph::kInvalid};       // IndirectCell, per cell of RtxState::indirectRes
+  };
+  Transients   m_transients;
+  VkBuffer     m_visibility{VK_NULL_HANDLE};
+  VkBuffer     m_shadowRecords{VK_NULL_HANDLE};
+  VkBuffer     m_shadowAccum{VK_NULL_HANDLE};
+  VkBuffer     m_indirect{VK_NULL_HANDLE};
+  nvvk::Buffer m_unused;
+  uint32_t     m_shadowCapacity{0};  // Records of the shadow queue
+  bool         m_deferShadows{false};  // Shadow passes declared
+  bool         m_decoupled{false};     // Indirect pass declared, see RtxState::indirectRes
+  RtxState     m_frameState{};         // State of the passes of the frame, set by beginFrame()
+  std::vector<VkDescriptorSet> m_descSets;  // Of the declared passes, m_descSet last
+  nvvk::Buffer m_shadowQueue;    // ShadowQueue
+  nvvk::Buffer m_workQueue;          // WorkQueue, reset every frame
+  nvvk::Buffer m_workQueueReadback;  // Copy of the WorkQueue of the last frame
+  WorkQueue*   m_workQueueMapped{nullptr};
+  uint32_t     m_persistentGroups{1024};  // Workgroups of the persistent variants, more than the GPU can hold
+#if PT_STATS
+  nvvk::Buffer m_rayStats;          // RayStats, reset every frame
+  nvvk::Buffer m_rayStatsReadback;  // Copy of the RayStats of the last frame
+  RayStats*    m_rayStatsMapped{nullptr};
+#endif
+#if PT_PROFILE
+  nvvk::Buffer    m_profile;  // ProfileCounter, stages then materials, reset every frame
+  nvvk::Buffer    m_profileReadback;
+  ProfileCounter* m_profileMapped{nullptr};
+  uint32_t        m_profileCounters{PROFILE_STAGES};
+#endif
+  nvvk::Buffer m_guideCells;              // GuideCell, kept on resize: not per pixel
+  uint32_t     m_guideCapacity{0};
+  int          m_guideFrame{0};           // Frames since the cells were reset
+  bool         m_guideReset{true};
+  nvvk::DescriptorSetBindings m_bind;
   VkDescriptorPool      m_descPool{ VK_NULL_HANDLE };
   VkDescriptorSetLayout m_descSetLayout{ VK_NULL_HANDLE };
   VkDescriptorSet       m_descSet{ VK_NULL_HANDLE };
 
   VkPipelineLayout m_pipelineLayout{VK_NULL_HANDLE};
-  VkPipeline       m_pipeline{VK_NULL_HANDLE};
+  std::vector<VkPipeline> m_pipelines;  // One per dispatch variant, created when used
+  VkPipeline       m_shadowPipeline{VK_NULL_HANDLE};   // Occlusion pass of the deferred shadow rays
+  VkPipeline       m_resolvePipeline{VK_NULL_HANDLE};  // Accumulation of the frame with deferred shadow rays
+  VkPipeline       m_guideUpdatePipeline{VK_NULL_HANDLE};  // Learned radiance to sampling distributions
+
+  RasterPrimary m_raster;  // Primary hits, when RtxState::rasterPrimary is set
 };
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Passes of the frame with their resources, see render_graph.hpp
+ */
+
+
+#include "render_graph.hpp"
+#include "memory_tracker.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+const VkAccessFlags kWriteAccess = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+                                   | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT
+                                   | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+}  // namespace
+
+
+RenderGraph::Pass& RenderGraph::Pass::read(Resource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout)
+{
+  m_uses.push_back({resource, stages, access, layout});
+  return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::write(Resource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout)
+{
+  m_uses.push_back({resource, stages, access, layout});
+  return *this;
+}
+
+void RenderGraph::setup(VkDevice device, nvvk::ResourceAllocator* allocator)
+{
+  m_device = device;
+  m_pAlloc = allocator;
+  m_debug.setup(device);
+}
+
+void RenderGraph::reset()
+{
+  releaseTransients();
+  m_resources.clear();
+  m_passes.clear();
+  m_stats = {};
+}
+
+void RenderGraph::releaseTransients()
+{
+  for(auto& r : m_resources)
+  {
+    if(r.info.imported)
+      continue;
+    vkDestroyBuffer(m_device, r.buffer, nullptr);
+    vkDestroyImage(m_device, r.image, nullptr);
+    r.buffer = VK_NULL_HANDLE;
+    r.image  = VK_NULL_HANDLE;
+  }
+  for(auto& block : m_blocks)
+  {
+    if(block.memory)
+      m_pAlloc->getMemoryAllocator()->freeMemory(block.memory);
+  }
+  m_blocks.clear();
+}
+
+RenderGraph::Resource RenderGraph::createBuffer(const std::string& name, VkDeviceSize size, VkBufferUsageFlags usage)
+{
+  ResourceData r;
+  r.info.name        = name;
+  r.info.size        = size;
+  r.bufferInfo.size  = size;
+  r.bufferInfo.usage = usage;
+  m_resources.push_back(r);
+  return static_cast<Resource>(m_resources.size() - 1);
+}
+
+RenderGraph::Resource RenderGraph::createImage(const std::string& name, const VkImageCreateInfo& createInfo)
+{
+  ResourceData r;
+  r.info.name  = name;
+  r.isImage    = true;
+  r.imageInfo  = createInfo;
+  r.range      = {VK_IMAGE_ASPECT_COLOR_BIT, 0, createInfo.mipLevels, 0, createInfo.arrayLayers};
+  m_resources.push_back(r);
+  return static_cast<Resource>(m_resources.size() - 1);
+}
+
+RenderGraph::Resource RenderGraph::importBuffer(const std::string& name, VkBuffer buffer)
+{
+  ResourceData r;
+  r.info.name     = name;
+  r.info.imported = true;
+  r.buffer        = buffer;
+  m_resources.push_back(r);
+  return static_cast<Resource>(m_resources.size() - 1);
+}
+
+RenderGraph::Resource RenderGraph::importImage(const std::string& name, VkImage image, VkImageLayout layout, uint32_t mipLevels)
+{
+  ResourceData r;
+  r.info.name     = name;
+  r.info.imported = true;
+  r.isImage       = true;
+  r.image         = image;
+  r.importLayout  = layout;
+  r.range         = {VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1};
+  m_resources.push_back(r);
+  return static_cast<Resource>(m_resources.size() - 1);
+}
+
+RenderGraph::Pass& RenderGraph::addPass(const char* name, std::function<void(VkCommandBuffer)> execute)
+{
+  m_passes.emplace_back();
+  m_passes.back().m_name    = name;
+  m_passes.back().m_execute = std::move(execute);
+  return m_passes.back();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Lifetimes of the resources, memory of the transients and barriers of the passes
+//
+bool RenderGraph::compile(bool allocate)
+{
+  releaseTransients();
+  m_stats        = {};
+  m_stats.passes = static_cast<uint32_t>(m_passes.size());
+
+  for(auto& r : m_resources)
+    r.info.first = r.info.last = -1;
+  for(int p = 0; p < static_cast<int>(m_passes.size()); p++)
+  {
+    for(auto& use : m_passes[p].m_uses)
+    {
+      auto& info = m_resources[use.resource].info;
+      if(info.first < 0)
+        info.first = p;
+      info.last = p;
+    }
+  }
+
+  // Handles of the used transients, for their memory requirements
+  for(auto& r : m_resources)
+  {
+    if(r.info.imported || r.info.first < 0)
+      continue;
+    if(r.isImage)
+    {
+      vkCreateImage(m_device, &r.imageInfo, nullptr, &r.image);
+      vkGetImageMemoryRequirements(m_device, r.image, &r.requirements);
+      m_debug.setObjectName(r.image, r.info.name);
+    }
+    else
+    {
+      vkCreateBuffer(m_device, &r.bufferInfo, nullptr, &r.buffer);
+      vkGetBufferMemoryRequirements(m_device, r.buffer, &r.requirements);
+      m_debug.setObjectName(r.buffer, r.info.name);
+    }
+    r.info.size = r.requirements.size;
+    m_stats.transients++;
+    m_stats.separateBytes += r.requirements.size;
+  }
+
+  placeTransients();
+  for(auto& block : m_blocks)
+    m_stats.aliasedBytes += block.size;
+
+  if(!allocate)
+  {
+    releaseTransients();
+    return true;
+  }
+
+  // One allocation per block, the transients bound in it
+  MemoryScope memScope(MemCategory::eTransient, "render graph");
+  auto*       memAlloc = m_pAlloc->getMemoryAllocator();
+  for(auto& block : m_blocks)
+  {
+    VkMemoryRequirements  requirements{block.size, block.alignment, block.memoryTypeBits};
+    nvvk::MemAllocateInfo allocInfo(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, block.images);
+    block.memory = memAlloc->allocMemory(allocInfo);
+    if(block.memory == nullptr)
+    {
+      LOGE("Render graph: cannot allocate %.1f MB\n", double(block.size) / double(1 << 20));
+      releaseTransients();
+      return false;
+    }
+  }
+  for(auto& r : m_resources)
+  {
+    if(r.info.imported || r.info.first < 0)
+      continue;
+    auto memInfo = memAlloc->getMemoryInfo(m_blocks[r.info.block].memory);
+    if(r.isImage)
+      vkBindImageMemory(m_device, r.image, memInfo.memory, memInfo.offset + r.info.offset);
+    else
+      vkBindBufferMemory(m_device, r.buffer, memInfo.memory, memInfo.offset + r.info.offset);
+  }
+
+  buildBarriers();
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Transients placed in blocks, largest first, each at the lowest offset not used by a resource
+// alive at the same time
+//
+void RenderGraph::placeTransients()
+{
+  std::vector<uint32_t> order;
+  for(uint32_t i = 0; i < m_resources.size(); i++)
+  {
+    if(!m_resources[i].info.imported && m_resources[i].info.first >= 0)
+      order.push_back(i);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](uint32_t a, uint32_t b) { return m_resources[a].requirements.size > m_resources[b].requirements.size; });
+
+  std::vector<std::vector<uint32_t>> placed;
+  for(uint32_t index : order)
+  {
+    auto& r = m_resources[index];
+
+    uint32_t block = 0;
+    while(block < m_blocks.size()
+          && (m_blocks[block].memoryTypeBits != r.requirements.memoryTypeBits || m_blocks[block].images != r.isImage))
+      block++;
+    if(block == m_blocks.size())
+    {
+      m_blocks.push_back({r.requirements.memoryTypeBits, r.isImage});
+      placed.emplace_back();
+    }
+
+    // Candidates: the start of the block and the end of each resource alive at the same time
+    std::vector<uint32_t> alive;
+    for(uint32_t other : placed[block])
+    {
+      const auto& o = m_resources[other].info;
+      if(o.first <= r.info.last && r.info.first <= o.last)
+        alive.push_back(other);
+    }
+    std::vector<VkDeviceSize> candidates{0};
+    for(uint32_t other : alive)
+      candidates.push_back(alignUp(m_resources[other].info.offset + m_resources[other].info.size, r.requirements.alignment));
+    std::sort(candidates.begin(), candidates.end());
+
+    VkDeviceSize offset = 0;
+    for(VkDeviceSize candidate : candidates)
+    {
+      bool free = true;
+      for(uint32_t other : alive)
+      {
+        const auto& o = m_resources[other].info;
+        free          = free && (candidate + r.info.size <= o.offset || o.offset + o.size <= candidate);
+      }
+      if(free)
+      {
+        offset = candidate;
+        break;
+      }
+    }
+
+    r.info.block  = block;
+    r.info.offset = offset;
+    placed[block].push_back(index);
+    m_blocks[block].size      = std::max(m_blocks[block].size, offset + r.info.size);
+    m_blocks[block].alignment = std::max(m_blocks[block].alignment, r.requirements.alignment);
+  }
+}
+
+bool RenderGraph::overlap(const ResourceData& a, const ResourceData& b) const
+{
+  return a.info.block == b.info.block && a.info.offset < b.info.offset + b.info.size && b.info.offset < a.info.offset + a.info.size;
+}
+
+//--------------------------------------------------------------------------------------------------
+// The frame is simulated twice: the first run gives the state at the end of a frame, the
+// second starts from it to find the barriers with the previous frame. A transient starts with
+// the accesses of everything that used its memory: previous occupants and the last frame.
+//
+void RenderGraph::buildBarriers()
+{
+  std::vector<State> states(m_resources.size());
+  for(size_t i = 0; i < m_resources.size(); i++)
+    states[i].layout = m_resources[i].importLayout;
+  simulate(states, false);
+
+  std::vector<State> start = states;
+  for(size_t i = 0; i < m_resources.size(); i++)
+  {
+    const auto& r = m_resources[i];
+    if(r.info.imported || r.info.first < 0)
+      continue;
+    State merged;
+    for(size_t j = 0; j < m_resources.size(); j++)
+    {
+      const auto& o = m_resources[j];
+      if(o.info.imported || o.info.first < 0 || !overlap(r, o))
+        continue;
+      merged.writeStages |= states[j].writeStages;
+      merged.writeAccess |= states[j].writeAccess;
+      merged.readStages |= states[j].readStages;
+    }
+    merged.layout = VK_IMAGE_LAYOUT_UNDEFINED;  // Content discarded
+    start[i]      = merged;
+  }
+  simulate(start, true);
+}
+
+void RenderGraph::simulate(std::vector<State>& states, bool record)
+{
+  for(auto& pass : m_passes)
+  {
+    pass.m_srcStages     = 0;
+    pass.m_dstStages     = 0;
+    pass.m_memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    pass.m_imageBarriers.clear();
+
+    for(auto& use : pass.m_uses)
+    {
+      const auto&   r       = m_resources[use.resource];
+      State&        s       = states[use.resource];
+      VkImageLayout layout  = r.info.imported ? r.importLayout : use.layout;  // Imported images keep their layout
+      VkAccessFlags written = use.access & kWriteAccess;
+      bool          relayout = r.isImage && s.layout != layout;
+
+      VkPipelineStageFlags srcStages = 0;
+      VkAccessFlags        srcAccess = 0;
+      if(written || relayout)
+      {
+        // Writes wait for the last write and the reads since, without hazard after a transition
+        srcStages = s.writeStages | s.readStages;
+        srcAccess = s.writeAccess;
+      }
+      else if(s.writeStages != 0 && ((s.visibleStages & use.stages) != use.stages || (s.visibleAccess & use.access) != use.access))
+      {
+        srcStages = s.writeStages;
+        srcAccess = s.writeAccess;
+      }
+
+      if(record && (srcStages != 0 || relayout))
+      {
+        pass.m_srcStages |= srcStages != 0 ? srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        pass.m_dstStages |= use.stages;
+        if(r.isImage)
+        {
+          VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+          barrier.srcAccessMask       = srcAccess;
+          barrier.dstAccessMask       = use.access;
+          barrier.oldLayout           = s.layout;
+          barrier.newLayout           = layout;
+          barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+          barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+          barrier.image               = r.image;
+          barrier.subresourceRange    = r.range;
+          pass.m_imageBarriers.push_back(barrier);
+        }
+        else
+        {
+          pass.m_memoryBarrier.srcAccessMask |= srcAccess;
+          pass.m_memoryBarrier.dstAccessMask |= use.access;
+        }
+      }
+
+      if(written || relayout)
+      {
+        s.writeStages   = use.stages;
+        s.writeAccess   = written;
+        s.readStages    = written ? 0 : use.stages;
+        s.visibleStages = use.stages;
+        s.visibleAccess = use.access;
+        s.layout        = layout;
+      }
+      else
+      {
+        if(srcStages != 0)
+        {
+          s.visibleStages |= use.stages;
+          s.visibleAccess |= use.access;
+        }
+        s.readStages |= use.stages;
+      }
+    }
+
+    if(record && pass.m_srcStages != 0)
+      m_stats.barriers++;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Recording the passes with their barriers. Passes without callback are recorded elsewhere
+// (ex. the tonemapper in the swapchain render pass): their barriers go first.
+//
+void RenderGraph::execute(VkCommandBuffer cmdBuf, nvvk::ProfilerVK& profiler, uint32_t begin, uint32_t end)
+{
+  end = std::min(end, static_cast<uint32_t>(m_passes.size()));
+  for(uint32_t p = begin; p < end; p++)
+  {
+    const Pass& pass = m_passes[p];
+    if(pass.m_srcStages != 0)
+    {
+      const bool memory = pass.m_memoryBarrier.srcAccessMask != 0 || pass.m_memoryBarrier.dstAccessMask != 0;
+      vkCmdPipelineBarrier(cmdBuf, pass.m_srcStages, pass.m_dstStages, 0, memory ? 1 : 0, &pass.m_memoryBarrier, 0,
+                           nullptr, static_cast<uint32_t>(pass.m_imageBarriers.size()), pass.m_imageBarriers.data());
+    }
+    if(pass.m_execute)
+    {
+      auto section = profiler.timeRecurring(pass.m_name, cmdBuf);
+      TRACE_GPU_SCOPE(cmdBuf, pass.m_name);
+      pass.m_execute(cmdBuf);
+    }
+  }
+}
+
+std::vector<RenderGraph::ResourceInfo> RenderGraph::getResources() const
+{
+  std::vector<ResourceInfo> infos;
+  for(const auto& r : m_resources)
+    infos.push_back(r.info);
+  return infos;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Frame graph of the passes recorded every frame: raster pre-pass, path trace, deferred shadows,
+// exposure and tonemap.
+// - Passes declare the resources they read and write, with the pipeline stages and accesses.
+//   The barriers before each pass are derived from these declarations. A frame starts in the
+//   state the previous one ended, the barriers with the frames in flight are included.
+// - Transient resources only live during the frame, from their first to their last use. They
+//   are placed in shared memory blocks: resources whose lifetimes do not overlap get the same
+//   memory. Resources of passes not declared (ex. deferred shadows off) are not allocated.
+// - Imported resources (accumulation image, persistent buffers) are owned elsewhere, the graph
+//   only handles their barriers. Imported images keep their layout.
+// - The graph is declared and compiled when the passes change (size, options), not per frame.
+//   compile(false) only plans the memory, to compare configurations without allocating.
+//
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/profiler_vk.hpp"
+#include "nvvk/resourceallocator_vk.hpp"
+
+
+class RenderGraph
+{
+public:
+  using Resource                     = uint32_t;
+  static constexpr Resource kInvalid = ~0u;
+
+  class Pass
+  {
+  public:
+    Pass& read(Resource resource, VkPipelineStageFlags stages, VkAccessFlags access = VK_ACCESS_SHADER_READ_BIT,
+               VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL);
+    Pass& write(Resource resource, VkPipelineStageFlags stages, VkAccessFlags access = VK_ACCESS_SHADER_WRITE_BIT,
+                VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL);
+
+  private:
+    friend class RenderGraph;
+    struct Use
+    {
+      Resource             resource;
+      VkPipelineStageFlags stages;
+      VkAccessFlags        access;
+      VkImageLayout        layout;
+    };
+
+    const char*                          m_name{""};  // Literal: kept by the profiler and the trace
+    std::function<void(VkCommandBuffer)> m_execute;   // Empty: recorded elsewhere, only the barriers here
+    std::vector<Use>                     m_uses;
+
+    // Barriers before the pass, from compile()
+    VkPipelineStageFlags              m_srcStages{0};
+    VkPipelineStageFlags              m_dstStages{0};
+    VkMemoryBarrier                   m_memoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    std::vector<VkImageMemoryBarrier> m_imageBarriers;
+  };
+
+  struct Stats
+  {
+    uint32_t     passes{0};
+    uint32_t     transients{0};
+    uint32_t     barriers{0};         // Pipeline barriers recorded per frame
+    VkDeviceSize separateBytes{0};    // Transients each with their own memory
+    VkDeviceSize aliasedBytes{0};     // Memory blocks of the graph
+  };
+
+  struct ResourceInfo
+  {
+    std::string  name;
+    bool         imported{false};
+    VkDeviceSize size{0};    // Transients only
+    uint32_t     block{0};   // Memory block and offset in it
+    VkDeviceSize offset{0};
+    int          first{-1};  // First and last pass using it, -1 if unused
+    int          last{-1};
+  };
+
+  void setup(VkDevice device, nvvk::ResourceAllocator* allocator);
+  void destroy() { reset(); }
+  void reset();  // Removes passes and resources, the GPU must be idle
+
+  Resource createBuffer(const std::string& name, VkDeviceSize size, VkBufferUsageFlags usage);
+  Resource createImage(const std::string& name, const VkImageCreateInfo& createInfo);
+  Resource importBuffer(const std::string& name, VkBuffer buffer);
+  Resource importImage(const std::string& name, VkImage image, VkImageLayout layout, uint32_t mipLevels = 1);
+
+  Pass& addPass(const char* name, std::function<void(VkCommandBuffer)> execute);
+
+  bool compile(bool allocate = true);
+  // Passes [begin, end), barriers included, each timed in the profiler and the trace
+  void execute(VkCommandBuffer cmdBuf, nvvk::ProfilerVK& profiler, uint32_t begin = 0, uint32_t end = ~0u);
+
+  VkBuffer     getBuffer(Resource resource) const { return m_resources[resource].buffer; }
+  VkImage      getImage(Resource resource) const { return m_resources[resource].image; }
+  VkDeviceSize getSize(Resource resource) const { return m_resources[resource].info.size; }
+  bool         isUsed(Resource resource) const { return resource != kInvalid && m_resources[resource].info.first >= 0; }
+  uint32_t     getPassCount() const { return static_cast<uint32_t>(m_passes.size()); }
+  const char*  getPassName(uint32_t pass) const { return m_passes[pass].m_name; }
+  const Stats& getStats() const { return m_stats; }
+  std::vector<ResourceInfo> getResources() const;
+
+private:
+  struct ResourceData
+  {
+    ResourceInfo            info;
+    bool                    isImage{false};
+    VkBufferCreateInfo      bufferInfo{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    VkImageCreateInfo       imageInfo{VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
+    VkImageSubresourceRange range{};
+    VkImageLayout           importLayout{VK_IMAGE_LAYOUT_UNDEFINED};
+    VkBuffer                buffer{VK_NULL_HANDLE};
+    VkImage                 image{VK_NULL_HANDLE};
+    VkMemoryRequirements    requirements{};
+  };
+
+  // Accesses since the last write, to know which barrier a new use needs
+  struct State
+  {
+    VkPipelineStageFlags writeStages{0};
+    VkAccessFlags        writeAccess{0};
+    VkPipelineStageFlags readStages{0};     // Reads since the write
+    VkPipelineStageFlags visibleStages{0};  // Stages and accesses the write was made visible to
+    VkAccessFlags        visibleAccess{0};
+    VkImageLayout        layout{VK_IMAGE_LAYOUT_UNDEFINED};
+  };
+
+  struct Block
+  {
+    uint32_t         memoryTypeBits{0};
+    bool             images{false};  // Buffers and optimal images are not mixed (granularity)
+    VkDeviceSize     size{0};
+    VkDeviceSize     alignment{1};
+    nvvk::MemHandle  memory{nullptr};
+  };
+
+  void placeTransients();
+  void buildBarriers();
+  bool overlap(const ResourceData& a, const ResourceData& b) const;
+  void simulate(std::vector<State>& states, bool record);
+  void releaseTransients();
+
+  VkDevice                 m_device{VK_NULL_HANDLE};
+  nvvk::ResourceAllocator* m_pAlloc{nullptr};
+  nvvk::DebugUtil          m_debug;
+
+  std::vector<ResourceData> m_resources;
+  std::deque<Pass>          m_passes;  // Stable references from addPass()
+  std::vector<Block>        m_blocks;
+  Stats                     m_stats;
+};
@@ -21,6 +21,7 @@
 /*
  *  This creates the image in floating point, holding the result of ray tracing.
  *  It also creates a pipeline for drawing this image from HDR to LDR applying a tonemapper
+ *  and the compute pipelines finding the exposure of the image.
  */
 
 
@@ -29,10 +30,18 @@
 #include "nvvk/images_vk.hpp"
 #include "nvvk/pipeline_vk.hpp"
 #include "nvvk/renderpasses_vk.hpp"
+#include "memory_tracker.hpp"
+#include "nvvk/shaders_vk.hpp"
 #include "render_output.hpp"
+#include "shader_reloader.hpp"
 #include "tools.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 // Shaders
+#include "autogen/exposure_average.comp.h"
+#include "autogen/exposure_histogram.comp.h"
 #include "autogen/passthrough.vert.h"
 #include "autogen/post.frag.h"
 
@@ -51,19 +60,38 @@ void RenderOutput::setup(const VkDevice& device, const VkPhysicalDevice& physica
 void RenderOutput::destroy()
 {
   m_pAlloc->destroy(m_offscreenColor);
+  m_pAlloc->destroy(m_lumImage);
+  m_pAlloc->destroy(m_exposureBuffer);
+  vkDestroyImageView(m_device, m_lumStoreView, nullptr);
+  m_lumStoreView = VK_NULL_HANDLE;
 
   vkDestroyPipeline(m_device, m_postPipeline, nullptr);
   vkDestroyPipelineLayout(m_device, m_postPipelineLayout, nullptr);
+  vkDestroyPipeline(m_device, m_histogramPipeline, nullptr);
+  vkDestroyPipeline(m_device, m_averagePipeline, nullptr);
+  vkDestroyPipelineLayout(m_device, m_exposurePipelineLayout, nullptr);
   vkDestroyDescriptorPool(m_device, m_postDescPool, nullptr);
   vkDestroyDescriptorSetLayout(m_device, m_postDescSetLayout, nullptr);
+
+  vkDestroyPipeline(m_device, m_capturePipeline, nullptr);
+  vkDestroyRenderPass(m_device, m_captureRenderPass, nullptr);
+  vkDestroyFramebuffer(m_device, m_captureFramebuffer, nullptr);
+  vkDestroyImageView(m_device, m_captureView, nullptr);
+  m_pAlloc->destroy(m_captureColor);
+  m_capturePipeline    = VK_NULL_HANDLE;
+  m_captureRenderPass  = VK_NULL_HANDLE;
+  m_captureFramebuffer = VK_NULL_HANDLE;
+  m_captureView        = VK_NULL_HANDLE;
+  m_captureSize        = {};
 }
 
 void RenderOutput::create(const VkExtent2D& size, const VkRenderPass& renderPass)
 {
-  MilliTimer timer;
+  MilliTimer timer("Offscreen");
   LOGI("Create Offscreen");
   createOffscreenRender(size);
   createPostPipeline(renderPass);
+  createExposurePipeline();
   timer.print();
 }
 
@@ -78,16 +106,24 @@ void RenderOutput::update(const VkExtent2D& size)
 void RenderOutput::createOffscreenRender(const VkExtent2D& size)
 {
   m_size = size;
+  MemoryScope memScope(MemCategory::eOffscreen, "offscreen");
   if(m_offscreenColor.image != VK_NULL_HANDLE)
   {
     m_pAlloc->destroy(m_offscreenColor);
   }
+  if(m_lumImage.image != VK_NULL_HANDLE)
+  {
+    m_pAlloc->destroy(m_lumImage);
+    vkDestroyImageView(m_device, m_lumStoreView, nullptr);
+  }
 
   // Creating the color image
+  // No mipmaps: the exposure is computed with a histogram, see genExposure()
   {
     auto colorCreateInfo = nvvk::makeImage2DCreateInfo(
         size, m_offscreenColorFormat,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, true);
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT
+            | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);  // Transfer: frame capture
 
     nvvk::Image image = m_pAlloc->createImage(colorCreateInfo);
     NAME_VK(image.image);
@@ -99,11 +135,50 @@ void RenderOutput::createOffscreenRender(const VkExtent2D& size)
     m_offscreenColor.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
   }
 
+  // Low resolution luminance, one texel per 16x16 pixels, used by the local exposure
+  {
+    m_lumSize = {(size.width + EXPOSURE_GROUP_SIZE - 1) / EXPOSURE_GROUP_SIZE,
+                 (size.height + EXPOSURE_GROUP_SIZE - 1) / EXPOSURE_GROUP_SIZE};
+    auto lumCreateInfo =
+        nvvk::makeImage2DCreateInfo(m_lumSize, m_lumFormat, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, true);
+
+    nvvk::Image image = m_pAlloc->createImage(lumCreateInfo);
+    NAME_VK(image.image);
+    VkImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(image.image, lumCreateInfo);
+
+    VkSamplerCreateInfo sampler{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+    sampler.magFilter                 = VK_FILTER_LINEAR;
+    sampler.minFilter                 = VK_FILTER_LINEAR;
+    sampler.mipmapMode                = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    sampler.addressModeU              = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler.addressModeV              = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler.maxLod                    = FLT_MAX;
+    m_lumImage                        = m_pAlloc->createTexture(image, ivInfo, sampler);
+    m_lumImage.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    // Storage access is only on the first level
+    ivInfo.subresourceRange.levelCount = 1;
+    vkCreateImageView(m_device, &ivInfo, nullptr, &m_lumStoreView);
+  }
+
+  // Histogram and exposure, kept across resizes to preserve the adaptation
+  bool newExposureBuffer = m_exposureBuffer.buffer == VK_NULL_HANDLE;
+  if(newExposureBuffer)
+  {
+    m_exposureBuffer = m_pAlloc->createBuffer(sizeof(ExposureData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    NAME_VK(m_exposureBuffer.buffer);
+  }
+
   // Setting the image layout for both color and depth
   {
     nvvk::CommandPool genCmdBuf(m_device, m_queueIndex);
     auto              cmdBuf = genCmdBuf.createCommandBuffer();
     nvvk::cmdBarrierImageLayout(cmdBuf, m_offscreenColor.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    VkImageSubresourceRange lumRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1};
+    nvvk::cmdBarrierImageLayout(cmdBuf, m_lumImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, lumRange);
+    if(newExposureBuffer)
+      vkCmdFillBuffer(cmdBuf, m_exposureBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
 
     genCmdBuf.submitAndWait(cmdBuf);
   }
@@ -132,14 +207,35 @@ void RenderOutput::createPostPipeline(const VkRenderPass& renderPass)
   vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo, nullptr, &m_postPipelineLayout);
 
   // Pipeline: completely generic, no vertices
-  std::vector<uint32_t> vertexShader(std::begin(passthrough_vert), std::end(passthrough_vert));
-  std::vector<uint32_t> fragShader(std::begin(post_frag), std::end(post_frag));
+  std::vector<uint32_t> vertexShader = ShaderReloader::get().code("passthrough.vert", passthrough_vert, sizeof(passthrough_vert));
+  std::vector<uint32_t> fragShader   = ShaderReloader::get().code("post.frag", post_frag, sizeof(post_frag));
 
   nvvk::GraphicsPipelineGeneratorCombined pipelineGenerator(m_device, m_postPipelineLayout, renderPass);
   pipelineGenerator.addShader(vertexShader, VK_SHADER_STAGE_VERTEX_BIT);
   pipelineGenerator.addShader(fragShader, VK_SHADER_STAGE_FRAGMENT_BIT);
   pipelineGenerator.rasterizationState.cullMode = VK_CULL_MODE_NONE;
   CREATE_NAMED_VK(m_postPipeline, pipelineGenerator.createPipeline());
+
+  // Same tonemapper, rendering in a RGBA8 image for frame capture
+  if(m_captureRenderPass == VK_NULL_HANDLE)
+    m_captureRenderPass = nvvk::createRenderPass(m_device, {m_captureFormat}, VK_FORMAT_UNDEFINED, 1, true, false,
+                                                 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  vkDestroyPipeline(m_device, m_capturePipeline, nullptr);
+  nvvk::GraphicsPipelineGeneratorCombined captureGenerator(m_device, m_postPipelineLayout, m_captureRenderPass);
+  captureGenerator.addShader(vertexShader, VK_SHADER_STAGE_VERTEX_BIT);
+  captureGenerator.addShader(fragShader, VK_SHADER_STAGE_FRAGMENT_BIT);
+  captureGenerator.rasterizationState.cullMode = VK_CULL_MODE_NONE;
+  CREATE_NAMED_VK(m_capturePipeline, captureGenerator.createPipeline());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Shaders recompiled by the ShaderReloader, the GPU being idle: tonemapper and auto-exposure
+// pipelines are recreated, the images and descriptors stay.
+//
+void RenderOutput::reloadPipelines(const VkRenderPass& renderPass)
+{
+  createPostPipeline(renderPass);
+  createExposurePipeline();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -158,6 +254,11 @@ void RenderOutput::createPostDescriptor()
   bind.addBinding({OutputBindings::eSampler, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT});
   bind.addBinding({OutputBindings::eStore, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
                    VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR});
+  // Auto-exposure: written by the exposure compute shaders, read by the tonemapper
+  bind.addBinding({OutputBindings::eExposure, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                   VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT});
+  bind.addBinding({OutputBindings::eLumSampler, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT});
+  bind.addBinding({OutputBindings::eLumStore, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT});
   m_postDescSetLayout = bind.createLayout(m_device);
   m_postDescPool      = bind.createPool(m_device);
   m_postDescSet       = nvvk::allocateDescriptorSet(m_device, m_postDescPool, m_postDescSetLayout);
@@ -165,6 +266,12 @@ void RenderOutput::createPostDescriptor()
   std::vector<VkWriteDescriptorSet> writes;
   writes.emplace_back(bind.makeWrite(m_postDescSet, OutputBindings::eSampler, &m_offscreenColor.descriptor));  // This is use by the tonemapper
   writes.emplace_back(bind.makeWrite(m_postDescSet, OutputBindings::eStore, &m_offscreenColor.descriptor));  // This will be used by the ray trace to write the image
+
+  VkDescriptorBufferInfo exposureDesc{m_exposureBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorImageInfo  lumStoreDesc{VK_NULL_HANDLE, m_lumStoreView, VK_IMAGE_LAYOUT_GENERAL};
+  writes.emplace_back(bind.makeWrite(m_postDescSet, OutputBindings::eExposure, &exposureDesc));
+  writes.emplace_back(bind.makeWrite(m_postDescSet, OutputBindings::eLumSampler, &m_lumImage.descriptor));
+  writes.emplace_back(bind.makeWrite(m_postDescSet, OutputBindings::eLumStore, &lumStoreDesc));
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 }
 
@@ -182,12 +289,187 @@ void RenderOutput::run(VkCommandBuffer cmdBuf)
 }
 
 //--------------------------------------------------------------------------------------------------
-// Generating all pyramid images, the highest level is used for getting the average luminance
-// of the image, which is then use to auto-expose.
+// Compute pipelines of the auto-exposure: building the luminance histogram and finding the
+// average luminance. They use the same descriptor set as the tonemapper.
+//
+void RenderOutput::createExposurePipeline()
+{
+  vkDestroyPipeline(m_device, m_histogramPipeline, nullptr);
+  vkDestroyPipeline(m_device, m_averagePipeline, nullptr);
+  vkDestroyPipelineLayout(m_device, m_exposurePipelineLayout, nullptr);
+
+  VkPushConstantRange pushConstantRanges{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ExposureSettings)};
+
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  pipelineLayoutCreateInfo.setLayoutCount         = 1;
+  pipelineLayoutCreateInfo.pSetLayouts            = &m_postDescSetLayout;
+  pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+  pipelineLayoutCreateInfo.pPushConstantRanges    = &pushConstantRanges;
+  vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo, nullptr, &m_exposurePipelineLayout);
+
+  VkComputePipelineCreateInfo computePipelineCreateInfo{VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  computePipelineCreateInfo.layout       = m_exposurePipelineLayout;
+  computePipelineCreateInfo.stage.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  computePipelineCreateInfo.stage.stage  = VK_SHADER_STAGE_COMPUTE_BIT;
+  computePipelineCreateInfo.stage.pName  = "main";
+
+  std::vector<uint32_t> histogramCode = ShaderReloader::get().code("exposure_histogram.comp", exposure_histogram_comp, sizeof(exposure_histogram_comp));
+  computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, histogramCode.data(), histogramCode.size() * sizeof(uint32_t));
+  vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_histogramPipeline);
+  NAME_VK(m_histogramPipeline);
+  vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
+
+  std::vector<uint32_t> averageCode = ShaderReloader::get().code("exposure_average.comp", exposure_average_comp, sizeof(exposure_average_comp));
+  computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, averageCode.data(), averageCode.size() * sizeof(uint32_t));
+  vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_averagePipeline);
+  NAME_VK(m_averagePipeline);
+  vkDestroyShaderModule(m_device, computePipelineCreateInfo.stage.module, nullptr);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Finding the exposure of the rendered image, used by the auto-exposure of the tonemapper
+// - Log-luminance histogram and 16x16 tile average luminance
+// - Smoothed average luminance from the histogram (single workgroup)
+// - Mipmaps of the small luminance image, for the local exposure
+//
+void RenderOutput::genExposure(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize)
+{
+  LABEL_SCOPE_VK(cmdBuf);
+
+  // Adaptation is time based, to be independent of the frame rate
+  auto  now     = std::chrono::steady_clock::now();
+  float elapsed = std::min(std::chrono::duration<float>(now - m_lastExposure).count(), 1.0f);
+  m_lastExposure = now;
+
+  m_exposure.size       = {static_cast<int>(renderSize.width), static_cast<int>(renderSize.height)};
+  m_exposure.adaptation = m_adaptationSpeed > 0.0f ? 1.0f - std::exp(-elapsed * m_adaptationSpeed) : 1.0f;
+
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_exposurePipelineLayout, 0, 1, &m_postDescSet, 0, nullptr);
+  vkCmdPushConstants(cmdBuf, m_exposurePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ExposureSettings), &m_exposure);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_histogramPipeline);
+  vkCmdDispatch(cmdBuf, (renderSize.width + (EXPOSURE_GROUP_SIZE - 1)) / EXPOSURE_GROUP_SIZE,
+                (renderSize.height + (EXPOSURE_GROUP_SIZE - 1)) / EXPOSURE_GROUP_SIZE, 1);
+
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_averagePipeline);
+  vkCmdDispatch(cmdBuf, 1, 1, 1);
+
+  // The luminance image is tiny, generating its mipmaps is almost free
+  if((m_tonemapper.autoExposure >> 1) & 1)
+    nvvk::cmdGenerateMipmaps(cmdBuf, m_lumImage.image, m_lumFormat, m_lumSize, nvvk::mipLevels(m_lumSize), 1, VK_IMAGE_LAYOUT_GENERAL);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Passes reading the rendered image. The barriers with the renderer and the tonemapper are in
+// the graph. The tonemapper is drawn in the swapchain render pass with the UI (main.cpp): the
+// graph only records its barriers.
+//
+void RenderOutput::declare(RenderGraph& graph, RenderGraph::Resource output)
+{
+  const VkPipelineStageFlags fragment = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  RenderGraph::Resource      exposure = graph.importBuffer("Exposure", m_exposureBuffer.buffer);
+  RenderGraph::Resource lum = graph.importImage("Luminance", m_lumImage.image, VK_IMAGE_LAYOUT_GENERAL, nvvk::mipLevels(m_lumSize));
+
+  // Histogram and average in compute, mipmaps with transfers
+  if(m_tonemapper.autoExposure)
+  {
+    const VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+    const VkAccessFlags access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT
+                                 | VK_ACCESS_TRANSFER_WRITE_BIT;
+    graph.addPass("Exposure", [this](VkCommandBuffer cmdBuf) { genExposure(cmdBuf, m_renderSize); })
+        .read(output, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)
+        .write(exposure, stages, access)
+        .write(lum, stages, access);
+  }
+
+  graph.addPass("Tonemap", nullptr).read(output, fragment).read(exposure, fragment).read(lum, fragment);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Image receiving the tonemapped result for frame capture, re-created when the size changes
+//
+void RenderOutput::createCaptureTarget(const VkExtent2D& size)
+{
+  // Only when the render region is resized, a previous capture may still be reading the image
+  if(m_captureColor.image != VK_NULL_HANDLE)
+    vkDeviceWaitIdle(m_device);
+
+  vkDestroyFramebuffer(m_device, m_captureFramebuffer, nullptr);
+  vkDestroyImageView(m_device, m_captureView, nullptr);
+  m_pAlloc->destroy(m_captureColor);
+
+  MemoryScope memScope(MemCategory::eOffscreen, "capture");
+  auto        colorCreateInfo =
+      nvvk::makeImage2DCreateInfo(size, m_captureFormat, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+  m_captureColor = m_pAlloc->createImage(colorCreateInfo);
+  NAME_VK(m_captureColor.image);
+  VkImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(m_captureColor.image, colorCreateInfo);
+  vkCreateImageView(m_device, &ivInfo, nullptr, &m_captureView);
+
+  VkFramebufferCreateInfo info{VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO};
+  info.renderPass      = m_captureRenderPass;
+  info.attachmentCount = 1;
+  info.pAttachments    = &m_captureView;
+  info.width           = size.width;
+  info.height          = size.height;
+  info.layers          = 1;
+  vkCreateFramebuffer(m_device, &info, nullptr, &m_captureFramebuffer);
+
+  m_captureSize = size;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Capture target of the size of the rendered region. Called before recording the capture: a resize
+// waits for the device.
+//
+void RenderOutput::prepareCapture(const VkExtent2D& renderSize)
+{
+  if(m_captureSize.width != renderSize.width || m_captureSize.height != renderSize.height)
+    createCaptureTarget(renderSize);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Applying the tonemapper on the rendered region only, without the UI, in the target made by
+// prepareCapture. The result is left in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, ready to be copied.
 //
-void RenderOutput::genMipmap(VkCommandBuffer cmdBuf)
+void RenderOutput::runCapture(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize)
 {
   LABEL_SCOPE_VK(cmdBuf);
-  nvvk::cmdGenerateMipmaps(cmdBuf, m_offscreenColor.image, m_offscreenColorFormat, m_size, nvvk::mipLevels(m_size), 1,
-                           VK_IMAGE_LAYOUT_GENERAL);
+
+  // The image and the exposure were written by the frame submitted before, and the previous
+  // capture may still be copying the target
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 1,
+                       &barrier, 0, nullptr, 0, nullptr);
+
+  VkClearValue          clearValue{};
+  VkRenderPassBeginInfo beginInfo{VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+  beginInfo.renderPass      = m_captureRenderPass;
+  beginInfo.framebuffer     = m_captureFramebuffer;
+  beginInfo.renderArea      = {{0, 0}, renderSize};
+  beginInfo.clearValueCount = 1;
+  beginInfo.pClearValues    = &clearValue;
+  vkCmdBeginRenderPass(cmdBuf, &beginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  // Same mapping as on screen: the viewport covers the whole offscreen image, the scissor the rendered region
+  VkViewport viewport{0.0f, 0.0f, static_cast<float>(m_size.width), static_cast<float>(m_size.height), 0.0f, 1.0f};
+  VkRect2D   scissor{{0, 0}, renderSize};
+  vkCmdSetViewport(cmdBuf, 0, 1, &viewport);
+  vkCmdSetScissor(cmdBuf, 0, 1, &scissor);
+
+  vkCmdPushConstants(cmdBuf, m_postPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(Tonemapper), &m_tonemapper);
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, m_capturePipeline);
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, m_postPipelineLayout, 0, 1, &m_postDescSet, 0, nullptr);
+  vkCmdDraw(cmdBuf, 3, 1, 0, 0);
+
+  vkCmdEndRenderPass(cmdBuf);
 }
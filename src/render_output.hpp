@@ -20,6 +20,7 @@
 //--------------------------------------------------------------------------------------------------
 // This creates the image in floating point, holding the result of ray tracing.
 // It also creates a pipeline for drawing this image from HDR to LDR applying a tonemapper
+// and the compute pipelines finding the exposure of the image (auto-exposure).
 //
 
 
@@ -30,8 +31,11 @@
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
+#include "render_graph.hpp"
 #include "shaders/host_device.h"
 
+#include <chrono>
+
 
 class RenderOutput
 {
@@ -49,21 +53,39 @@ public:
       0.5f,          // key;     // Log-average luminance
   };
 
+  ExposureSettings m_exposure{
+      {0, 0},  // size;
+      -10.0f,  // minLogLum;    // 1/1024
+      22.0f,   // logLumRange;  // up to 4096
+      1.0f,    // adaptation;
+  };
+  float m_adaptationSpeed{2.0f};  // Exposure adaptation per second, 0 = instant
+
 public:
   void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator);
   void destroy();
   void create(const VkExtent2D& size, const VkRenderPass& renderPass);
   void update(const VkExtent2D& size);
   void run(VkCommandBuffer cmdBuf);
-  void genMipmap(VkCommandBuffer cmdBuf);
+  void genExposure(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize);
+  void declare(RenderGraph& graph, RenderGraph::Resource output);
+  void setRenderSize(const VkExtent2D& size) { m_renderSize = size; }
+  void prepareCapture(const VkExtent2D& renderSize);
+  void runCapture(VkCommandBuffer cmdBuf, const VkExtent2D& renderSize);
+  void reloadPipelines(const VkRenderPass& renderPass);
 
   VkDescriptorSetLayout getDescLayout() { return m_postDescSetLayout; }
   VkDescriptorSet       getDescSet() { return m_postDescSet; }
+  VkImage               getImage() { return m_offscreenColor.image; }
+  VkImage               getCaptureImage() { return m_captureColor.image; }
+  VkFormat              getCaptureFormat() { return m_captureFormat; }
 
 private:
   void createOffscreenRender(const VkExtent2D& size);
   void createPostPipeline(const VkRenderPass& renderPass);
   void createPostDescriptor();
+  void createExposurePipeline();
+  void createCaptureTarget(const VkExtent2D& size);
 
   VkDescriptorPool      m_postDescPool{VK_NULL_HANDLE};
   VkDescriptorSetLayout m_postDescSetLayout{VK_NULL_HANDLE};
@@ -75,6 +97,27 @@ private:
   VkFormat m_offscreenColorFormat{VK_FORMAT_R32G32B32A32_SFLOAT};
   VkFormat m_offscreenDepthFormat{VK_FORMAT_X8_D24_UNORM_PACK32};  // Will be replaced by best supported format
 
+  // Auto-exposure
+  VkPipeline       m_histogramPipeline{VK_NULL_HANDLE};
+  VkPipeline       m_averagePipeline{VK_NULL_HANDLE};
+  VkPipelineLayout m_exposurePipelineLayout{VK_NULL_HANDLE};
+  nvvk::Buffer     m_exposureBuffer;  // ExposureData
+  nvvk::Texture    m_lumImage;        // Average luminance of 16x16 tiles, with mipmaps
+  VkImageView      m_lumStoreView{VK_NULL_HANDLE};  // First level only, for writing
+  VkExtent2D       m_lumSize{};
+  VkFormat         m_lumFormat{VK_FORMAT_R16_SFLOAT};
+
+  std::chrono::steady_clock::time_point m_lastExposure{std::chrono::steady_clock::now()};
+
+  // Tonemapped image without UI, for frame capture
+  VkRenderPass  m_captureRenderPass{VK_NULL_HANDLE};
+  VkPipeline    m_capturePipeline{VK_NULL_HANDLE};
+  nvvk::Image   m_captureColor;
+  VkImageView   m_captureView{VK_NULL_HANDLE};
+  VkFramebuffer m_captureFramebuffer{VK_NULL_HANDLE};
+  VkExtent2D    m_captureSize{};
+  VkFormat      m_captureFormat{VK_FORMAT_R8G8B8A8_UNORM};
+
 
   // Setup
   nvvk::ResourceAllocator* m_pAlloc;  // Allocator for buffer, images, acceleration structures
@@ -83,4 +126,5 @@ private:
   uint32_t                 m_queueIndex;
 
   VkExtent2D m_size{};
+  VkExtent2D m_renderSize{};  // Of the frame, for the exposure pass
 };
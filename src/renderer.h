@@ -23,6 +23,7 @@
 #include "nvvk/profiler_vk.hpp"
 
 #include "nvmath/nvmath.h"
+#include "render_graph.hpp"
 #include "shaders/host_device.h"
 
 // Forward declaration
@@ -36,15 +37,60 @@ public:
                                   uint32_t                 familyIndex,
                                   nvvk::ResourceAllocator* allocator)              = 0;
   virtual void              destroy()                                              = 0;
-  virtual void              run(const VkCommandBuffer&              cmdBuf,
-                                const VkExtent2D&                   size,
-                                nvvk::ProfilerVK&                   profiler,
-                                std::vector<VkDescriptorSet> extraDescSets) = 0;
   virtual void              create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout> extraDescSetsLayout, Scene* _scene = nullptr) = 0;
   virtual const std::string name() = 0;
   void                      setPushContants(const RtxState& state) { m_state = state; }
   virtual void              update(const VkExtent2D& size) = 0;
 
+  // Passes of the renderer in the render graph, writing the output image. Declared again when the
+  // size or the options (push constants) change, the per-frame values are read when recording.
+  virtual void declare(RenderGraph&                        graph,
+                       const VkExtent2D&                   size,
+                       RenderGraph::Resource               output,
+                       const std::vector<VkDescriptorSet>& extraDescSets) = 0;
+  // Transient resources of the compiled graph, written in the descriptor sets
+  virtual void bind(const RenderGraph& graph) = 0;
+  // Size rendered this frame, up to the declared one (GUI panels, de-scaling)
+  void setRenderSize(const VkExtent2D& size) { m_renderSize = size; }
 
-  RtxState m_state{};
+  // Pipeline variants doing the same work (ex. dispatch layout), selected with setVariant
+  virtual std::vector<std::string> variants() { return {}; }
+  void                             setVariant(int variant) { m_variant = variant; }
+  // Fraction of the SIMD lanes doing work, measured by the shaders (0 if not measured)
+  virtual float getLaneUtilization() { return 0.f; }
+  // Paths of each bounce, RtxState::bounceStats (empty if not measured)
+  struct BounceStatistics
+  {
+    uint32_t paths;       // Reaching the bounce
+    uint32_t terminated;  // Russian roulette
+    uint32_t splits;      // Branches added
+  };
+  virtual std::vector<BounceStatistics> getBounceStatistics() { return {}; }
+#if PT_STATS
+  // Ray and path counters of a recent frame, false if not measured
+  virtual bool getRayStats(RayStats& stats) { return false; }
+#endif
+#if PT_PROFILE
+  // Shader clocks of a recent frame: PROFILE_STAGES stages, then one per material
+  virtual bool getProfile(std::vector<ProfileCounter>& counters) { return false; }
+#endif
+
+  // Path guiding (RtxState::guiding): memory of the cells and number of frames they learn
+  struct GuidingSettings
+  {
+    uint32_t memoryMB{32};
+    int      trainFrames{512};  // 0: always learning
+  };
+  void         setGuiding(const GuidingSettings& settings) { m_guiding = settings; }
+  virtual void resetGuiding() {}  // Forget what was learned, ex. new scene
+
+  // Pipelines recreated with the shaders recompiled by the ShaderReloader, the GPU being idle.
+  // False if not supported or if the previous pipelines were kept.
+  virtual bool reloadPipelines() { return false; }
+
+
+  RtxState        m_state{};
+  VkExtent2D      m_renderSize{};
+  int             m_variant{0};
+  GuidingSettings m_guiding;
 };
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Path tracer on the ray tracing pipeline, the passes of RayQuery with the path trace pass
+ *  replaced by vkCmdTraceRaysKHR. See rtx_pipeline.hpp.
+ */
+
+
+#include "rtx_pipeline.hpp"
+#include "nvvk/shaders_vk.hpp"
+#include "shader_reloader.hpp"
+
+#include <array>
+
+// Shaders
+#include "autogen/pathtrace.rahit.h"
+#include "autogen/pathtrace.rchit.h"
+#include "autogen/pathtrace.rgen.h"
+#include "autogen/pathtrace.rmiss.h"
+#include "autogen/pathtrace_shadow.rahit.h"
+#include "autogen/pathtrace_shadow.rmiss.h"
+
+//--------------------------------------------------------------------------------------------------
+// The push constants and the path tracer barriers are on the ray tracing stages
+//
+void RtxPipeline::setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator)
+{
+  RayQuery::setup(device, physicalDevice, familyIndex, allocator);
+  m_pushStages = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
+                 | VK_SHADER_STAGE_ANY_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR;
+  m_traceStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+  VkPhysicalDeviceProperties2 properties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+  properties.pNext = &m_rtProperties;
+  vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+  m_sbt.setup(device, familyIndex, allocator, m_rtProperties);
+}
+
+void RtxPipeline::destroy()
+{
+  RayQuery::destroy();
+  m_sbt.destroy();
+}
+
+void RtxPipeline::create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout> rtDescSetLayouts, Scene* scene)
+{
+  RayQuery::create(size, rtDescSetLayouts, scene);
+  createSbt();
+}
+
+//--------------------------------------------------------------------------------------------------
+// The passes of RayQuery, never decoupled
+//
+void RtxPipeline::declare(RenderGraph& graph, const VkExtent2D& size, RenderGraph::Resource output, const std::vector<VkDescriptorSet>& descSets)
+{
+  m_state.indirectRes = eIndirectFull;
+  RayQuery::declare(graph, size, output, descSets);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The shader binding table follows the pipeline kept, the new one or the previous one
+//
+bool RtxPipeline::reloadPipelines()
+{
+  bool reloaded = RayQuery::reloadPipelines();
+  createSbt();
+  return reloaded;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Ray tracing pipeline. Hit groups, RAY_TYPES per material class:
+// - paths: closest hit of the class, stochastic opacity any hit for the alpha-tested class
+// - shadow rays: no closest hit (skipped), stochastic opacity any hit for the alpha-tested class
+//
+bool RtxPipeline::createTracePipelines()
+{
+  enum StageIndices
+  {
+    eRaygen,
+    eMiss,
+    eShadowMiss,
+    eAnyHit,
+    eShadowAnyHit,
+    eClosestHit,  // One per material class
+    eStageCount = eClosestHit + MATERIAL_CLASSES
+  };
+
+  auto shaderModule = [&](const char* shader, const uint32_t* code, size_t codeSize) {
+    std::vector<uint32_t> spirv = ShaderReloader::get().code(shader, code, codeSize);
+    return nvvk::createShaderModule(m_device, spirv.data(), spirv.size() * sizeof(uint32_t));
+  };
+
+  VkPipelineShaderStageCreateInfo stage{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
+  stage.pName = "main";
+  m_stages.assign(eStageCount, stage);
+  m_stages[eRaygen].module       = shaderModule("pathtrace.rgen", pathtrace_rgen, sizeof(pathtrace_rgen));
+  m_stages[eRaygen].stage        = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+  m_stages[eMiss].module         = shaderModule("pathtrace.rmiss", pathtrace_rmiss, sizeof(pathtrace_rmiss));
+  m_stages[eMiss].stage          = VK_SHADER_STAGE_MISS_BIT_KHR;
+  m_stages[eShadowMiss].module   = shaderModule("pathtrace_shadow.rmiss", pathtrace_shadow_rmiss, sizeof(pathtrace_shadow_rmiss));
+  m_stages[eShadowMiss].stage    = VK_SHADER_STAGE_MISS_BIT_KHR;
+  m_stages[eAnyHit].module       = shaderModule("pathtrace.rahit", pathtrace_rahit, sizeof(pathtrace_rahit));
+  m_stages[eAnyHit].stage        = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
+  m_stages[eShadowAnyHit].module = shaderModule("pathtrace_shadow.rahit", pathtrace_shadow_rahit, sizeof(pathtrace_shadow_rahit));
+  m_stages[eShadowAnyHit].stage  = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
+
+  // The closest hit specialized for each class (MATERIAL_CLASS), from the same module
+  VkShaderModule                                      closestHit = shaderModule("pathtrace.rchit", pathtrace_rchit, sizeof(pathtrace_rchit));
+  std::array<int32_t, MATERIAL_CLASSES>               classes;
+  std::array<VkSpecializationInfo, MATERIAL_CLASSES> specializations;
+  VkSpecializationMapEntry                            entry{0, 0, sizeof(int32_t)};
+  for(int c = 0; c < MATERIAL_CLASSES; c++)
+  {
+    classes[c]                       = c;
+    specializations[c]               = {1, &entry, sizeof(int32_t), &classes[c]};
+    m_stages[eClosestHit + c].module = closestHit;
+    m_stages[eClosestHit + c].stage  = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+    m_stages[eClosestHit + c].pSpecializationInfo = &specializations[c];
+  }
+
+  // Raygen, then the two misses, then the hit groups
+  VkRayTracingShaderGroupCreateInfoKHR group{VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR};
+  group.generalShader      = VK_SHADER_UNUSED_KHR;
+  group.closestHitShader   = VK_SHADER_UNUSED_KHR;
+  group.anyHitShader       = VK_SHADER_UNUSED_KHR;
+  group.intersectionShader = VK_SHADER_UNUSED_KHR;
+  m_groups.clear();
+
+  group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+  for(uint32_t general : {eRaygen, eMiss, eShadowMiss})
+  {
+    group.generalShader = general;
+    m_groups.push_back(group);
+  }
+  group.generalShader = VK_SHADER_UNUSED_KHR;
+
+  group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
+  for(int c = 0; c < MATERIAL_CLASSES; c++)
+  {
+    bool alphaTested = c == eClassAlphaTested;
+    // Paths
+    group.closestHitShader = eClosestHit + c;
+    group.anyHitShader     = alphaTested ? eAnyHit : VK_SHADER_UNUSED_KHR;
+    m_groups.push_back(group);
+    // Shadow rays
+    group.closestHitShader = VK_SHADER_UNUSED_KHR;
+    group.anyHitShader     = alphaTested ? eShadowAnyHit : VK_SHADER_UNUSED_KHR;
+    m_groups.push_back(group);
+  }
+
+  VkRayTracingPipelineCreateInfoKHR pipelineInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR};
+  pipelineInfo.stageCount                   = static_cast<uint32_t>(m_stages.size());
+  pipelineInfo.pStages                      = m_stages.data();
+  pipelineInfo.groupCount                   = static_cast<uint32_t>(m_groups.size());
+  pipelineInfo.pGroups                      = m_groups.data();
+  pipelineInfo.maxPipelineRayRecursionDepth = 1;  // Only the ray generation shader traces rays
+  pipelineInfo.layout                       = m_pipelineLayout;
+  if(m_pipelineStatistics)
+    pipelineInfo.flags |= VK_PIPELINE_CREATE_CAPTURE_STATISTICS_BIT_KHR;
+
+  VkPipeline pipeline{VK_NULL_HANDLE};
+  vkCreateRayTracingPipelinesKHR(m_device, {}, {}, 1, &pipelineInfo, nullptr, &pipeline);
+  m_debug.setObjectName(pipeline, "RtxPipeline");
+
+  for(int s = 0; s < eClosestHit + 1; s++)
+    vkDestroyShaderModule(m_device, m_stages[s].module, nullptr);
+  for(auto& s : m_stages)
+  {
+    s.module              = VK_NULL_HANDLE;
+    s.pSpecializationInfo = nullptr;
+  }
+
+  if(m_pipelineStatistics && pipeline != VK_NULL_HANDLE)
+    logPipelineStatistics(pipeline, "RtxPipeline");
+
+  m_pipelines.assign(1, pipeline);
+  return pipeline != VK_NULL_HANDLE;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Shader binding table of the pipeline, one record per group
+//
+void RtxPipeline::createSbt()
+{
+  m_sbt.destroy();
+  if(m_pipelines.empty() || m_pipelines[0] == VK_NULL_HANDLE)
+    return;
+
+  VkRayTracingPipelineCreateInfoKHR pipelineInfo{VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR};
+  pipelineInfo.stageCount = static_cast<uint32_t>(m_stages.size());
+  pipelineInfo.pStages    = m_stages.data();
+  pipelineInfo.groupCount = static_cast<uint32_t>(m_groups.size());
+  pipelineInfo.pGroups    = m_groups.data();
+
+  m_sbt.create(m_pipelines[0], pipelineInfo);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The frame state is pushed, the descriptor sets are bound again on the ray tracing bind point
+//
+void RtxPipeline::dispatchPaths(const VkCommandBuffer& cmdBuf)
+{
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_pipelines[0]);
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_pipelineLayout, 0,
+                          static_cast<uint32_t>(m_descSets.size()), m_descSets.data(), 0, nullptr);
+
+  auto regions = m_sbt.getRegions();
+  vkCmdTraceRaysKHR(cmdBuf, &regions[0], &regions[1], &regions[2], &regions[3], m_renderSize.width, m_renderSize.height, 1);
+}
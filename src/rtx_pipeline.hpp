@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Path tracer on the ray tracing pipeline (VK_KHR_ray_tracing_pipeline), to compare with the
+// ray query one. Same buffers, passes and shading code as RayQuery; the traversal is done by
+// vkCmdTraceRaysKHR and the shading of the hits by closest-hit shaders, one hit group per material
+// class (MaterialClass, see AccelStructure::materialClass):
+// - the closest-hit shader of the class is specialized (MATERIAL_CLASS), the unlit and opaque
+//   ones skip the material textures they cannot use
+// - only the alpha-tested class has any-hit shaders, the other instances are forced opaque
+// - the shading state is returned to the ray generation shader in the payload (HitPayload)
+// Decoupled indirect lighting (RtxState::indirectRes) is not supported, the indirect paths are
+// traced at full resolution. There are no dispatch variants and no lane utilization measure.
+//
+
+#pragma once
+
+#include "nvvk/sbtwrapper_vk.hpp"
+#include "rayquery.hpp"
+
+
+class RtxPipeline : public RayQuery
+{
+public:
+  void setup(const VkDevice& device, const VkPhysicalDevice& physicalDevice, uint32_t familyIndex, nvvk::ResourceAllocator* allocator) override;
+  void destroy() override;
+  void create(const VkExtent2D& size, std::vector<VkDescriptorSetLayout> rtDescSetLayouts, Scene* scene) override;
+  void declare(RenderGraph& graph, const VkExtent2D& size, RenderGraph::Resource output, const std::vector<VkDescriptorSet>& descSets) override;
+  const std::string        name() override { return std::string("RTX"); }
+  std::vector<std::string> variants() override { return {}; }
+  bool                     reloadPipelines() override;
+
+private:
+  bool createTracePipelines() override;
+  void dispatchPaths(const VkCommandBuffer& cmdBuf) override;
+  void createSbt();
+
+  VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProperties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR};
+  nvvk::SBTWrapper m_sbt;
+
+  // Of the pipeline in m_pipelines, for the shader binding table (the modules are destroyed)
+  std::vector<VkPipelineShaderStageCreateInfo>      m_stages;
+  std::vector<VkRayTracingShaderGroupCreateInfoKHR> m_groups;
+};
@@ -27,18 +27,15 @@
 
 #include "shaders/host_device.h"
 #include "rayquery.hpp"
+#include "rtx_pipeline.hpp"
 #include "sample_example.hpp"
 #include "sample_gui.hpp"
+#include "shader_reloader.hpp"
 #include "tools.hpp"
 
-#include "nvml_monitor.hpp"
 #include "fileformats/tiny_gltf_freeimage.h"
 
 
-#if defined(NVP_SUPPORTS_NVML)
-NvmlMonitor g_nvml(100, 100);
-#endif
-
 //--------------------------------------------------------------------------------------------------
 // Keep the handle on the device
 // Initialize the tool to do all our allocations: buffers, images
@@ -49,6 +46,7 @@ void SampleExample::setup(const VkInstance& instance,
 	const std::vector<nvvk::Queue>& queues)
 {
 	AppBaseVk::setup(instance, device, physicalDevice, queues[eGCT0].familyIndex);
+	m_queues = queues;
 
 	m_gui = std::make_shared<SampleGUI>(this);  // GUI of this class
 
@@ -69,9 +67,22 @@ void SampleExample::setup(const VkInstance& instance,
 	m_offscreen.setup(m_device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
 	m_skydome.setup(device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
 
-	// Create and setup all renderers
+	// Readback of the rendered image, on the queue rendering the frames
+	m_capture.setup(m_device, physicalDevice, queues[eGCT0], &m_alloc);
+	m_capture.addSink(&m_imageWriter);
+	m_capture.addSink(&m_frameStream);
+	m_capture.addSink(&m_convergence);
+
+	m_sweep.setup(m_device, physicalDevice);
+
+	// CPU, GPU and memory load, sampled on its own thread
+	m_monitor.start(physicalDevice);
+
+	// Create and setup the renderer, switched by createRender()
 	m_pRender.reset(new RayQuery);
 	m_pRender->setup(m_device, physicalDevice, queues[eTransfer].familyIndex, &m_alloc);
+	m_rndMethod = eRayQuery;
+	m_graph.setup(m_device, &m_alloc);
 }
 
 
@@ -81,12 +92,35 @@ void SampleExample::setup(const VkInstance& instance,
 //
 void SampleExample::loadScene(const std::string& filename)
 {
+	TRACE_SCOPE("Load scene");
+	m_alloc.getTracker().newGeneration();
+	MemoryScope memScope(MemCategory::eSceneData, std::filesystem::path(filename).stem().string());
 	m_scene.load(filename);
-	m_accelStruct.create(m_scene.getScene(), m_scene.getBuffers(Scene::eVertex), m_scene.getBuffers(Scene::eIndex));
+	m_accelStruct.create(m_scene.getScene(), m_scene.getBuffers(Scene::eVertex), m_scene.getBuffers(Scene::eIndex), m_scene.getMeshLod());
+	auto blasSize = [&](uint32_t primMesh) {
+		return m_accelStruct.blasBuildSize(m_scene.getScene().m_primMeshes[primMesh], m_scene.getBuffers(Scene::eVertex)[primMesh].buffer,
+			m_scene.getBuffers(Scene::eIndex)[primMesh].buffer);
+	};
+	for (auto& report : m_scene.getDisplacement().getReports())
+		report.blasSize = blasSize(report.primMesh);
+	m_scene.getDisplacement().printReport();
+	for (auto& report : m_scene.getMeshLod().getReports())
+		for (int level = 0; level < LOD_LEVELS && report.lodPrimMesh[level] >= 0; level++)
+			report.blasSize[level] = blasSize(report.lodPrimMesh[level]);
+	m_scene.getMeshLod().printReport();
+
+	// The resources of the previous scene must all be released by now
+	uint32_t staleCount;
+	uint64_t staleBytes;
+	m_alloc.getTracker().getStale(staleCount, staleBytes);
+	if (staleCount > 0)
+		LOGW("Memory: %d allocations (%s bytes) of previous scenes still alive\n", int(staleCount), FormatNumbers(staleBytes).c_str());
 
 	// The picker is the helper to return information from a ray hit under the mouse cursor
 	m_picker.setTlas(m_accelStruct.getTlas());
 	m_start_time = std::chrono::steady_clock::now();
+	if (m_pRender)
+		m_pRender->resetGuiding();
 	resetFrame();
 }
 
@@ -95,7 +129,7 @@ void SampleExample::loadScene(const std::string& filename)
 //
 void SampleExample::loadEnvironmentHdr(const std::string& hdrFilename)
 {
-	MilliTimer timer;
+	MilliTimer timer("Environment HDR");
 	LOGI("Loading HDR and converting %s\n", hdrFilename.c_str());
 	m_skydome.loadEnvironment(hdrFilename);
 	timer.print();
@@ -118,6 +152,7 @@ void SampleExample::loadAssets(const char* filename)
 	vkDeviceWaitIdle(m_device);
 
 	std::thread([&, sfile]() {
+		TraceRecorder::get().setThreadName("Loader");
 		LOGI("Loading: %s\n", sfile.c_str());
 
 		// Supporting only GLTF and HDR files
@@ -138,6 +173,7 @@ void SampleExample::loadAssets(const char* filename)
 			}
 			m_pRender->create(
 				m_size, { m_accelStruct.getDescLayout(), m_offscreen.getDescLayout(), m_scene.getDescLayout(), m_descSetLayout }, &m_scene);
+			m_graphDirty = true;
 		}
 
 		if (extension == ".hdr")  //|| extension == ".exr")
@@ -167,9 +203,52 @@ void SampleExample::updateUniformBuffer(const VkCommandBuffer& cmdBuf)
 	const float aspectRatio = m_renderRegion.extent.width / static_cast<float>(m_renderRegion.extent.height);
 
 	m_scene.updateCamera(cmdBuf, aspectRatio);
+	if (m_scene.uploadChanges(cmdBuf))  // Edited materials, light sampling rebuilt on a worker
+		resetFrame();
 	vkCmdUpdateBuffer(cmdBuf, m_sunAndSkyBuffer.buffer, 0, sizeof(SunAndSky), &m_sunAndSky);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Called after the submission of the frame: delivers the finished readbacks and, if a sink
+// wants it, copies the rendered image without waiting.
+//
+void SampleExample::captureFrame()
+{
+	m_capture.poll();
+	if (m_busy)
+		return;
+
+	int spp = (m_rtxState.frame + 1) * m_rtxState.spp;
+
+	// Accumulated radiance, as rendered
+	VkExtent2D size{ static_cast<uint32_t>(m_rtxState.size.x), static_cast<uint32_t>(m_rtxState.size.y) };
+	if (m_capture.wanted(CaptureKind::eHdr) && size.width > 0 && size.height > 0)
+	{
+		CaptureSource source;
+		source.image = m_offscreen.getImage();
+		source.layout = VK_IMAGE_LAYOUT_GENERAL;
+		source.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		source.pixelStride = 4 * sizeof(float);
+		source.size = size;
+		m_capture.capture(CaptureKind::eHdr, source, m_rtxState.frame, spp);
+	}
+
+	// Tonemapped image of the rendered region, without the UI
+	VkExtent2D region = m_renderRegion.extent;
+	if (m_capture.wanted(CaptureKind::eTonemapped) && region.width > 0 && region.height > 0)
+	{
+		m_offscreen.prepareCapture(region);
+		CaptureSource source;
+		source.image = m_offscreen.getCaptureImage();
+		source.layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		source.format = m_offscreen.getCaptureFormat();
+		source.pixelStride = 4;
+		source.size = region;
+		source.record = [&](VkCommandBuffer cmdBuf) { m_offscreen.runCapture(cmdBuf, region); };
+		m_capture.capture(CaptureKind::eTonemapped, source, m_rtxState.frame, spp);
+	}
+}
+
 //--------------------------------------------------------------------------------------------------
 // If the camera matrix has changed, resets the frame otherwise, increments frame.
 //
@@ -197,6 +276,7 @@ void SampleExample::updateFrame()
 void SampleExample::resetFrame()
 {
 	m_rtxState.frame = -1;
+	m_convergence.restart();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -265,6 +345,9 @@ void SampleExample::destroyResources()
 	vkDestroyDescriptorSetLayout(m_device, m_descSetLayout, nullptr);
 
 	// Other
+	m_monitor.stop();
+	m_capture.destroy();
+	m_sweep.destroy();
 	m_picker.destroy();
 	m_scene.destroy();
 	m_accelStruct.destroy();
@@ -272,6 +355,7 @@ void SampleExample::destroyResources()
 	m_skydome.destroy();
 	m_axis.deinit();
 
+	m_graph.destroy();
 	m_pRender->destroy();
 	m_pRender = nullptr;
 
@@ -286,6 +370,7 @@ void SampleExample::onResize(int /*w*/, int /*h*/)
 {
 	m_offscreen.update(m_size);
 	m_pRender->update(m_size);
+	m_graphDirty = true;
 	resetFrame();
 }
 
@@ -309,15 +394,100 @@ void SampleExample::renderGui(nvvk::ProfilerVK& profiler)
 //--------------------------------------------------------------------------------------------------
 // Creating the render: RTX, Ray Query, ...
 // - Destroy the previous one.
-void SampleExample::createRender()
+void SampleExample::createRender(RndMethod method)
 {
 	if (m_pRender) {
 		vkDeviceWaitIdle(m_device);  // cannot destroy while in use
 		m_pRender->destroy();
 	}
 
+	if (method != m_rndMethod)
+	{
+		LOGI("Renderer: %s\n", method == eRtxPipeline ? "RTX pipeline" : "Ray Query");
+		if (method == eRtxPipeline)
+			m_pRender.reset(new RtxPipeline);
+		else
+			m_pRender.reset(new RayQuery);
+		m_pRender->setup(m_device, m_physicalDevice, m_queues[eTransfer].familyIndex, &m_alloc);
+		m_rndMethod = method;
+	}
+
 	m_pRender->create(
 		m_size, { m_accelStruct.getDescLayout(), m_offscreen.getDescLayout(), m_scene.getDescLayout(), m_descSetLayout }, &m_scene);
+	m_graphDirty = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Passes of a frame: the renderer, once per view, then exposure and tonemap. Returns the
+// number of passes of the renderer.
+//
+uint32_t SampleExample::declareFrame(RenderGraph& graph, const VkExtent2D& size, uint32_t views)
+{
+	RenderGraph::Resource        output = graph.importImage("Output", m_offscreen.getImage(), VK_IMAGE_LAYOUT_GENERAL);
+	std::vector<VkDescriptorSet> descSets{ m_accelStruct.getDescSet(), m_offscreen.getDescSet(), m_scene.getDescSet(), m_descSet };
+	for (uint32_t view = 0; view < views; view++)
+		m_pRender->declare(graph, size, output, descSets);
+	uint32_t renderPasses = graph.getPassCount();
+	m_offscreen.declare(graph, output);
+	return renderPasses;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Render graph declared and compiled again, the GPU being idle. The same passes are planned at
+// 3840x2160 with one and two views (eyes rendered one after the other), to report the memory
+// saved by the aliasing of the transients.
+//
+bool SampleExample::buildGraph()
+{
+	TRACE_SCOPE("Render graph");
+	MilliTimer timer("Render graph");
+	vkDeviceWaitIdle(m_device);
+	m_graph.reset();
+
+	for (uint32_t views = 1; views <= 2; views++)
+	{
+		RenderGraph plan;
+		plan.setup(m_device, &m_alloc);
+		declareFrame(plan, { 3840, 2160 }, views);
+		plan.compile(false);
+		m_graphPlan[views - 1] = plan.getStats();
+		plan.destroy();
+	}
+
+	m_graphRenderPasses = declareFrame(m_graph, m_size, 1);
+	if (!m_graph.compile())
+		return false;
+	m_pRender->bind(m_graph);
+	m_graphDirty = false;
+
+	auto  mb = [](VkDeviceSize bytes) { return double(bytes) / double(1 << 20); };
+	auto& stats = m_graph.getStats();
+	LOGI("Render graph: %u passes, %u barriers, %u transients in %.1f MB (%.1f MB without aliasing)\n", stats.passes,
+		stats.barriers, stats.transients, mb(stats.aliasedBytes), mb(stats.separateBytes));
+	LOGI(" - 3840x2160: %.1f MB (%.1f MB), stereo: %.1f MB (%.1f MB)\n", mb(m_graphPlan[0].aliasedBytes),
+		mb(m_graphPlan[0].separateBytes), mb(m_graphPlan[1].aliasedBytes), mb(m_graphPlan[1].separateBytes));
+	timer.print();
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Shaders recompiled in the development mode (-hotreload), swapped at the frame boundary.
+// The scene and the resources stay, only the pipelines are recreated.
+//
+void SampleExample::reloadShaders()
+{
+	if (m_busy)
+		return;  // The loader can be creating the pipelines
+	std::vector<std::string> compiled = ShaderReloader::get().takeCompiled();
+	if (compiled.empty())
+		return;
+
+	TRACE_SCOPE("Reload shaders");
+	vkDeviceWaitIdle(m_device);
+	if (!m_pRender->reloadPipelines())
+		LOGE("%s pipelines not recreated, keeping the previous ones\n", m_pRender->name().c_str());
+	m_offscreen.reloadPipelines(m_renderPass);
+	resetFrame();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -373,10 +543,6 @@ void SampleExample::drawPost(VkCommandBuffer cmdBuf)
 
 void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK& profiler)
 {
-#if defined(NVP_SUPPORTS_NVML)
-	g_nvml.refresh();
-#endif
-
 	if (m_busy)
 	{
 		m_gui->showBusyWindow();  // Busy while loading scene
@@ -386,9 +552,21 @@ void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK&
 	LABEL_SCOPE_VK(cmdBuf);
 
 	auto sec = profiler.timeRecurring("Render", cmdBuf);
+	TRACE_GPU_SCOPE(cmdBuf, "Render");
+
+	// Results of a finished sweep, the fastest variant is kept
+	if (m_sweep.collect())
+	{
+		std::vector<SystemSample> system;
+		m_monitor.since(m_sweep.getStartTime(), system);
+		m_sweep.writeJson("sweep.json", system);
+		m_dispatchVariant = m_sweep.getBest();
+		resetFrame();
+	}
+	const bool sweeping = m_sweep.isRunning();
 
 	// We are done rendering
-	if (m_rtxState.frame >= m_maxFrames)
+	if (m_rtxState.frame >= m_maxFrames && !sweeping)
 		return;
 
 	// Handling de-scaling by reducing the size to render
@@ -398,19 +576,65 @@ void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK&
 
 	m_rtxState.size = { render_size.width, render_size.height };
 	m_rtxState.time = (uint)(std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start_time).count() * 1000.0);
-	// State is the push constant structure
-	m_pRender->setPushContants(m_rtxState);
-	// Running the renderer
-	m_pRender->run(cmdBuf, render_size, profiler,
-		{ m_accelStruct.getDescSet(), m_offscreen.getDescSet(), m_scene.getDescSet(), m_descSet });
 
+	// Debug modes show part of the sample, the queued contributions would be added anyway
+	m_rtxState.deferShadows = (m_deferShadows && m_rtxState.debugging_mode == eNoDebug) ? 1 : 0;
+
+	// Path guiding cells, relative to the size of the scene
+	const auto& dimensions = m_scene.getScene().m_dimensions;
+	m_rtxState.guideCellSize = std::max(nvmath::length(dimensions.max - dimensions.min), 1e-3f) / float(m_guideResolution);
 
-	// For automatic brightness tonemapping
-	if (m_offscreen.m_tonemapper.autoExposure)
+	// The first sample of all pixels shares the jitter of the frame, for the raster pre-pass to
+	// land on the same position. Not usable with depth of field.
+	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+	m_rtxState.rasterPrimary = (m_rasterPrimary && m_scene.getCamera().aperture == 0.0f) ? 1 : 0;
+	m_rtxState.jitter = m_rtxState.frame == 0 ? vec2(0.5f, 0.5f) : vec2(dist(m_jitterGen), dist(m_jitterGen));
+
+	// State is the push constant structure. The sweep renders the same frame with all variants.
+	RtxState state = m_rtxState;
+	state.laneStats = (sweeping || m_rtxState.bounceStats != 0) ? 1 : 0;
+	if (sweeping)
 	{
-		auto slot = profiler.timeRecurring("Mipmap", cmdBuf);
-		m_offscreen.genMipmap(cmdBuf);
+		state.frame = 0;
+		state.time = 0;
+		state.jitter = vec2(0.5f, 0.5f);
 	}
+	m_pRender->setPushContants(state);
+	m_pRender->setVariant(sweeping ? m_sweep.getVariant() : m_dispatchVariant);
+	m_pRender->setGuiding(m_guiding);
+	m_pRender->setRenderSize(render_size);
+	m_offscreen.setRenderSize(render_size);
+
+	// Passes of the frame, declared for the window size and the options changing them
+	std::array<uint32_t, 6> graphKey{ m_size.width, m_size.height, uint32_t(state.deferShadows), uint32_t(state.rasterPrimary),
+		m_offscreen.m_tonemapper.autoExposure != 0 ? 1u : 0u, uint32_t(state.indirectRes) };
+	if (m_graphDirty || graphKey != m_graphKey)
+	{
+		m_graphKey = graphKey;
+		if (!buildGraph())
+		{
+			LOGE("Render graph not allocated, frame skipped\n");
+			return;
+		}
+	}
+
+	// Running the renderer
+	if (sweeping)
+		m_sweep.begin(cmdBuf);
+	m_graph.execute(cmdBuf, profiler, 0, m_graphRenderPasses);
+	if (sweeping)
+	{
+		double rays = 0;
+#if PT_STATS
+		RayStats rayStats;
+		if (m_pRender->getRayStats(rayStats))
+			rays = double(rayStats.primaryRays) + double(rayStats.indirectRays) + double(rayStats.shadowRays);
+#endif
+		m_sweep.end(cmdBuf, m_pRender->getLaneUtilization(), rays);
+	}
+
+	// Automatic brightness tonemapping, and the barriers of the tonemapper drawn after
+	m_graph.execute(cmdBuf, profiler, m_graphRenderPasses);
 }
 
 
@@ -423,6 +647,7 @@ void SampleExample::renderScene(const VkCommandBuffer& cmdBuf, nvvk::ProfilerVK&
 // - Home key: fit all, the camera will move to see the entire scene bounding box
 // - Space: Trigger ray picking and set the interest point at the intersection
 //          also return all information under the cursor
+// - F12: Save a screenshot of the rendered image
 //
 void SampleExample::onKeyboard(int key, int scancode, int action, int mods)
 {
@@ -444,6 +669,9 @@ void SampleExample::onKeyboard(int key, int scancode, int action, int mods)
 	case GLFW_KEY_R:
 		resetFrame();
 		break;
+	case GLFW_KEY_F12:
+		m_imageWriter.screenshot();
+		break;
 	default:
 		break;
 	}
@@ -493,6 +721,7 @@ void SampleExample::screenPicking()
 	auto& prim = m_scene.getScene().m_primMeshes[pr.instanceCustomIndex];
 	LOGI("Hit(%d): %s\n", pr.instanceCustomIndex, prim.name.c_str());
 	LOGI(" - PrimId(%d)\n", pr.primitiveID);
+	m_editMaterial = prim.materialIndex;
 }
 
 //--------------------------------------------------------------------------------------------------
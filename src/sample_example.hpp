@@ -30,7 +30,7 @@
 	 +--------------------------------------------+
 	 |             SampleExample                  |
 	 +--------+-----------------------------------+
-	 |  Pick  |    RtxPipeline   | other   ? ...  |
+	 |  Pick  |    RayQuery     |   RtxPipeline   |
 	 +--------+---------+-------------------------+
 	 |       TLAS       |                         |
 	 +------------------+     Offscreen           |
@@ -41,16 +41,9 @@
 
 
  // #define ALLOC_DMA  <--- This is in the CMakeLists.txt
-#include "nvvk/resourceallocator_vk.hpp"
-#if defined(ALLOC_DMA)
-#include <nvvk/memallocator_dma_vk.hpp>
-typedef nvvk::ResourceAllocatorDma Allocator;
-#elif defined(ALLOC_VMA)
-#include <nvvk/memallocator_vma_vk.hpp>
-typedef nvvk::ResourceAllocatorVma Allocator;
-#else
-typedef nvvk::ResourceAllocatorDedicated Allocator;
-#endif
+ // The allocator selected there is wrapped, to account the memory by category
+#include "memory_tracker.hpp"
+typedef TrackedAllocator Allocator;
 
 #define CPP  // For sun_and_sky
 
@@ -62,14 +55,23 @@ typedef nvvk::ResourceAllocatorDedicated Allocator;
 #include "nvvk/raypicker_vk.hpp"
 
 #include "accelstruct.hpp"
+#include "convergence_tracker.hpp"
+#include "dispatch_sweep.hpp"
+#include "frame_capture.hpp"
+#include "frame_stream.hpp"
+#include "image_writer.hpp"
+#include "render_graph.hpp"
 #include "render_output.hpp"
 #include "scene.hpp"
 #include "shaders/host_device.h"
+#include "system_monitor.hpp"
 
 #include "imgui_internal.h"
 #include "queue.hpp"
 
+#include <array>
 #include <chrono>
+#include <random>
 
 class SampleGUI;
 
@@ -94,6 +96,13 @@ public:
 		eTransfer
 	};
 
+	enum RndMethod
+	{
+		eRayQuery,
+		eRtxPipeline,
+		eNone,
+	};
+
 
 	void setup(const VkInstance& instance, const VkDevice& device, const VkPhysicalDevice& physicalDevice, const std::vector<nvvk::Queue>& queues);
 
@@ -110,12 +119,16 @@ public:
 	void onMouseMotion(int x, int y) override;
 	void onResize(int /*w*/, int /*h*/) override;
 	void renderGui(nvvk::ProfilerVK& profiler);
-	void createRender();
+	void createRender(RndMethod method);
 	void resetFrame();
 	void screenPicking();
 	void updateFrame();
 	void updateHdrDescriptors();
 	void updateUniformBuffer(const VkCommandBuffer& cmdBuf);
+	void captureFrame();
+	void reloadShaders();
+	uint32_t declareFrame(RenderGraph& graph, const VkExtent2D& size, uint32_t views);
+	bool     buildGraph();
 
 	Scene              m_scene;
 	AccelStructure     m_accelStruct;
@@ -123,8 +136,23 @@ public:
 	HdrSampling        m_skydome;
 	nvvk::AxisVK       m_axis;
 	nvvk::RayPickerKHR m_picker;
+	FrameCapture       m_capture;
+	ImageWriter        m_imageWriter;
+	FrameStream        m_frameStream;
+	ConvergenceTracker m_convergence;
+	DispatchSweep      m_sweep;
+	SystemMonitor      m_monitor;
 
 	std::unique_ptr<Renderer> m_pRender;
+	RndMethod                 m_rndMethod{ eNone };
+	std::vector<nvvk::Queue>  m_queues;  // Of setup, for the renderers created later
+
+	// Passes of the frame, declared again when the size or their options change (m_graphKey)
+	RenderGraph             m_graph;
+	std::array<uint32_t, 6> m_graphKey{};
+	bool                    m_graphDirty{ true };
+	uint32_t                m_graphRenderPasses{ 0 };  // Passes of the renderer, first in the graph
+	RenderGraph::Stats      m_graphPlan[2];            // Same passes at 3840x2160: one view, two views
 
 	nvvk::Buffer m_sunAndSkyBuffer;
 
@@ -163,7 +191,26 @@ public:
 		{0, 0},  // size;
 		0,       // minHeatmap;
 		65000,   // maxHeatmap;
-		0
+		0,       // time;
+
+		{0.5f, 0.5f},  // jitter;
+		0,       // rasterPrimary;
+		0,       // deferShadows;
+
+		1,       // lightMis;
+		0,       // guiding;
+		0,       // guideTrain;
+		0.5f,    // guideProb;
+
+		0.f,     // guideCellSize;
+		0,       // guideCapacity;
+		0,       // rrMode;
+		0,       // bounceStats;
+		-1,      // heatmapStage;
+		0,       // indirectRes;
+		0,       // indirectPass;
+		0,       // lodDepth;
+		0,       // laneStats;
 	};
 
 	SunAndSky m_sunAndSky{
@@ -189,6 +236,12 @@ public:
 	bool        m_showAxis{ true };
 	bool        m_descaling{ false };
 	int         m_descalingLevel{ 1 };
+	bool        m_rasterPrimary{ false };
+	bool        m_deferShadows{ false };
+	int         m_dispatchVariant{ 0 };  // See Renderer::variants()
+	int         m_guideResolution{ 64 };  // Guiding cells along the diagonal of the scene
+	Renderer::GuidingSettings m_guiding;
+	int         m_editMaterial{ 0 };  // Material of the editor, set by picking
 	bool        m_busy{ false };
 	std::string m_busyReasonText;
 
@@ -196,4 +249,5 @@ public:
 	std::shared_ptr<SampleGUI> m_gui;
 
 	std::chrono::steady_clock::time_point m_start_time;
+	std::mt19937                          m_jitterGen;  // Sub-pixel position of the first sample
 };
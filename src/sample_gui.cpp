@@ -23,6 +23,7 @@
   */
 
 
+#include <algorithm>
 #include <bitset>  // std::bitset
 #include <iomanip>
 #include <sstream>
@@ -33,19 +34,15 @@
 #include "imgui_orient.h"
 #include "sample_example.hpp"
 #include "sample_gui.hpp"
+#include "shader_reloader.hpp"
 #include "tools.hpp"
 
-#include "nvml_monitor.hpp"
 #ifdef _WIN32
 #include <commdlg.h>
 #endif  // _WIN32
 
 using GuiH = ImGuiH::Control;
 
-#if defined(NVP_SUPPORTS_NVML)
-extern NvmlMonitor g_nvml;  // GPU load and memory
-#endif
-
 //--------------------------------------------------------------------------------------------------
 // Main rendering function for all
 //
@@ -69,11 +66,31 @@ void SampleGUI::render(nvvk::ProfilerVK& profiler)
 			changed |= guiTonemapper();
 		if (ImGui::CollapsingHeader("Environment" /*, ImGuiTreeNodeFlags_DefaultOpen*/))
 			changed |= guiEnvironment();
+		if (ImGui::CollapsingHeader("Materials" /*, ImGuiTreeNodeFlags_DefaultOpen*/))
+			changed |= guiMaterials();
+		if (ImGui::CollapsingHeader("Capture" /*, ImGuiTreeNodeFlags_DefaultOpen*/))
+			guiCapture();
+		if (ImGui::CollapsingHeader("Convergence" /*, ImGuiTreeNodeFlags_DefaultOpen*/))
+			guiConvergence();
 		if (ImGui::CollapsingHeader("Stats"))
 		{
 			Gui::Group<bool>("Scene Info", false, [&] { return guiStatistics(); });
+			if (!_se->m_scene.getDisplacement().getReports().empty())
+				Gui::Group<bool>("Displacement", false, [&] { return guiDisplacement(); });
+			if (!_se->m_scene.getMeshLod().getReports().empty())
+				Gui::Group<bool>("Geometry LOD", false, [&] { return guiMeshLod(); });
 			Gui::Group<bool>("Profiler", false, [&] { return guiProfiler(profiler); });
+#if PT_STATS
+			Gui::Group<bool>("Rays", false, [&] { return guiRayStats(profiler); });
+#endif
+#if PT_PROFILE
+			Gui::Group<bool>("Shader Clocks", false, [&] { return guiShaderClocks(); });
+#endif
 			Gui::Group<bool>("Plot", false, [&] { return guiGpuMeasures(); });
+			Gui::Group<bool>("Timeline", false, [&] { return guiTrace(); });
+			Gui::Group<bool>("Memory", false, [&] { return guiMemory(); });
+			Gui::Group<bool>("Render Graph", false, [&] { return guiRenderGraph(); });
+			Gui::Group<bool>("Shaders", false, [&] { return guiShaders(); });
 		}
 		ImGui::TextWrapped("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 			ImGui::GetIO().Framerate);
@@ -122,6 +139,19 @@ bool SampleGUI::guiRayTracing()
 	bool  changed{ false };
 	auto& rtxState(_se->m_rtxState);
 
+	int rndMethod = _se->m_rndMethod;
+	if (GuiH::Selection("Pipeline",
+		"Ray Query: path tracer in a compute shader.\n"
+		"RTX Pipeline: ray tracing pipeline, the hits shaded by the closest-hit shader of their material class.\n"
+		"Compare the render time in Statistics.",
+		&rndMethod, nullptr, Normal, { "Ray Query", "RTX Pipeline" }))
+	{
+		if (rndMethod == SampleExample::eRtxPipeline)
+			rtxState.indirectRes = eIndirectFull;  // Not decoupled in the RTX pipeline
+		_se->createRender(SampleExample::RndMethod(rndMethod));
+		changed = true;
+	}
+
 	changed |= GuiH::Slider("Max Ray Depth", "Maximum bounce number", &rtxState.maxDepth, nullptr, Normal, 1, 32);
 	changed |= GuiH::Slider("Max Iteration ", "", &_se->m_maxFrames, nullptr, Normal, 1, 10000);
 	changed |= GuiH::Slider("De-scaling ",
@@ -131,6 +161,30 @@ bool SampleGUI::guiRayTracing()
 		&_se->m_descalingLevel, nullptr, Normal, 1, 8);
 
 	changed |= GuiH::Selection("Pbr Mode", "PBR material model", &rtxState.pbrMode, nullptr, Normal, { "Disney", "Gltf" });
+	changed |= GuiH::Checkbox("Raster Primary",
+		"Primary visibility of the first sample from a raster pre-pass.\n"
+		"Only used with a pinhole camera (aperture of 0).",
+		&_se->m_rasterPrimary);
+	changed |= GuiH::Checkbox("Deferred Shadows",
+		"Shadow rays are queued and traced in a separate occlusion pass,\n"
+		"instead of inline in the path tracer.",
+		&_se->m_deferShadows);
+	GuiH::Group<bool>("Dispatch", false, [&] {
+		// Same image with all variants, only the speed differs
+		std::vector<std::string> variants = _se->m_pRender ? _se->m_pRender->variants() : std::vector<std::string>();
+		if (variants.empty())
+			return false;
+		GuiH::Selection("Layout", "Workgroup shape and order of the pixels in the tile of a workgroup (tile size)",
+			&_se->m_dispatchVariant, nullptr, Normal, variants);
+		if (_se->m_sweep.isRunning())
+			ImGui::Text("Sweep: %s", variants[_se->m_sweep.getVariant()].c_str());
+		else if (ImGui::Button("Sweep"))
+			_se->m_sweep.start(variants);
+		for (auto& result : _se->m_sweep.getResults())
+			ImGui::Text("%-28s %8.3f ms/frame %5.1f%% lanes %8.1f Mrays/s", result.name.c_str(), result.msPerFrame,
+				result.laneUtilization * 100.0, result.mraysPerSecond());
+		return false;
+		});
 
 	changed |= GuiH::Selection("Debug Mode", "Display unique values of material", &rtxState.debugging_mode, nullptr, Normal,
 		{
@@ -154,6 +208,15 @@ bool SampleGUI::guiRayTracing()
 			&rtxState.minHeatmap, nullptr, Normal, 0, 1'000'000, 100);
 		changed |= GuiH::Drag("Max Heat map", "Maximum timing value, above this value it will be red",
 			&rtxState.maxHeatmap, nullptr, Normal, 0, 1'000'000, 100);
+#if PT_PROFILE
+		int stage = rtxState.heatmapStage + 1;
+		if (GuiH::Selection("Heat map Stage", "Time of the whole pixel, or of one stage of the path tracer", &stage, nullptr,
+			Normal, { "Pixel", "Traversal", "Shadow", "Shade State", "Material", "BSDF" }))
+		{
+			rtxState.heatmapStage = stage - 1;
+			changed = true;
+		}
+#endif
 	}
 
 	GuiH::Info("Frame", "", std::to_string(rtxState.frame), GuiH::Flags::Disabled);
@@ -165,12 +228,62 @@ bool SampleGUI::guiRayTracing()
 		changed |= GuiH::Slider("Environment Weight",
 			"If there is a environment map, the probability it will be used in direct light sampling",
 			&rtxState.environmentProb, nullptr, Normal, 0.f, 1.f);
+		changed |= GuiH::Checkbox("MIS", "Weight light sampling and BSDF sampling with the power heuristic, otherwise only light sampling reaches the lights",
+			(bool*)&rtxState.lightMis);
 		return changed;
 		});
 	GuiH::Group<bool>("Indirect Light", false, [&] {
-		ImGui::Text("Place Holder");
-		return true;
+		changed |= GuiH::Selection("Russian Roulette",
+			"Termination of the paths.\n"
+			"Adjoint: on the expected contribution to the pixel, paths above it are split.\n"
+			"Uses the radiance learned by the path guiding cells (see Path Guiding).",
+			&rtxState.rrMode, nullptr, Normal, { "Throughput", "Adjoint" });
+		if (_se->m_rndMethod == SampleExample::eRayQuery)
+			changed |= GuiH::Selection("Resolution",
+				"Pixels tracing the indirect paths, the direct light stays at full resolution.\n"
+				"The others upsample it from their neighbors with a similar normal and distance.\n"
+				"Compare the quality in the Convergence panel, the time in Statistics.",
+				&rtxState.indirectRes, nullptr, Normal, { "Full", "Half (2x2)", "Quarter (4x4)", "Checkerboard" });
+		GuiH::Checkbox("Bounce Statistics", "Count the paths reaching each bounce and the SIMD lane utilization", (bool*)&rtxState.bounceStats);
+		auto stats = _se->m_pRender ? _se->m_pRender->getBounceStatistics() : std::vector<Renderer::BounceStatistics>();
+		if (!stats.empty())
+			ImGui::Text("%-7s %10s %10s %10s", "Bounce", "Paths", "Terminated", "Splits");
+		for (size_t i = 0; i < stats.size(); i++)
+			ImGui::Text("%-7s %10u %10u %10u", (std::to_string(i) + (i + 1 == BOUNCE_STAT_DEPTH ? "+" : "")).c_str(),
+				stats[i].paths, stats[i].terminated, stats[i].splits);
+		return changed;
 		});
+	GuiH::Group<bool>("Path Guiding", false, [&] {
+		// Compare with the BSDF sampling in the Convergence panel: reference, then track both
+		bool reset{ false };
+		changed |= GuiH::Checkbox("Guiding", "Sample the indirect directions from the radiance learned in a grid over the scene",
+			(bool*)&rtxState.guiding);
+		changed |= GuiH::Slider("Guided Probability", "Probability to sample the learned distribution instead of the BSDF",
+			&rtxState.guideProb, nullptr, Normal, 0.f, 1.f);
+		int memoryMB = static_cast<int>(_se->m_guiding.memoryMB);
+		if (GuiH::Slider("Memory (MB)", "Size of the hash table of the cells, full cells are not guided", &memoryMB, nullptr,
+			Normal, 1, 512))
+		{
+			_se->m_guiding.memoryMB = static_cast<uint32_t>(memoryMB);
+			reset = true;
+		}
+		reset |= GuiH::Slider("Training Frames", "Frames the cells learn from the paths, 0 to never stop",
+			&_se->m_guiding.trainFrames, nullptr, Normal, 0, 4096);
+		reset |= GuiH::Slider("Resolution", "Cells along the diagonal of the scene", &_se->m_guideResolution, nullptr, Normal, 4, 512);
+		reset |= ImGui::Button("Reset Guiding");
+		if (reset && _se->m_pRender)
+			_se->m_pRender->resetGuiding();
+		changed |= reset;
+		return changed;
+		});
+	if (!_se->m_scene.getMeshLod().getInstances().empty())
+		GuiH::Group<bool>("Geometry LOD", false, [&] {
+			changed |= GuiH::Slider("LOD Depth",
+				"First bounce tracing the simplified meshes, the next level at each following bounce. 0: full detail.\n"
+				"Bias: set the reference without LOD in the Convergence panel. Time: Statistics.",
+				&rtxState.lodDepth, nullptr, Normal, 0, 4);
+			return changed;
+			});
 	return changed;
 }
 
@@ -211,6 +324,8 @@ bool SampleGUI::guiTonemapper()
 			changed |= GuiH::Checkbox("Local", "", &localExposure);
 			changed |= GuiH::Slider("Burning White", "", &tm.Ywhite, &default_tm.Ywhite, GuiH::Flags::Normal, 0.0f, 1.0f);
 			changed |= GuiH::Slider("Brightness", "", &tm.key, &default_tm.key, GuiH::Flags::Normal, 0.0f, 1.0f);
+			changed |= GuiH::Slider("Adaptation", "Speed of the exposure adaptation, 0 is instant",
+				&_se->m_offscreen.m_adaptationSpeed, nullptr, GuiH::Flags::Normal, 0.0f, 10.0f);
 			b.set(1, localExposure);
 			return changed;
 			});
@@ -304,6 +419,177 @@ bool SampleGUI::guiEnvironment()
 	return changed;
 }
 
+//--------------------------------------------------------------------------------------------------
+// Editing the factors of one material, picked in the viewport (double-click) or by index. Only that
+// entry of the material buffer is uploaded. The transmission, alpha mode and unlit, which choose
+// the hit shaders of the RTX pipeline, are not editable.
+//
+bool SampleGUI::guiMaterials()
+{
+	auto& materials = _se->m_scene.getScene().m_materials;
+	if (materials.empty())
+		return false;
+
+	bool  changed{ false };
+	int&  matIndex = _se->m_editMaterial;
+	matIndex = std::min(std::max(matIndex, 0), static_cast<int>(materials.size()) - 1);
+	GuiH::Slider("Material", "Index of the material, also set by picking", &matIndex, nullptr, GuiH::Flags::Normal, 0,
+		static_cast<int>(materials.size()) - 1);
+
+	auto&                    mat = materials[matIndex];
+	static nvh::GltfMaterial dm;  // Defaults
+	if (mat.shadingModel == 0)  // Metallic-roughness, otherwise specular-glossiness
+	{
+		changed |= GuiH::Color("Base Color", "", &mat.baseColorFactor.x, &dm.baseColorFactor.x, GuiH::Flags::Normal);
+		changed |= GuiH::Slider("Metallic", "", &mat.metallicFactor, &dm.metallicFactor, GuiH::Flags::Normal, 0.f, 1.f);
+		changed |= GuiH::Slider("Roughness", "", &mat.roughnessFactor, &dm.roughnessFactor, GuiH::Flags::Normal, 0.f, 1.f);
+	}
+	else
+	{
+		changed |= GuiH::Color("Diffuse", "", &mat.specularGlossiness.diffuseFactor.x, &dm.specularGlossiness.diffuseFactor.x,
+			GuiH::Flags::Normal);
+		changed |= GuiH::Color("Specular", "", &mat.specularGlossiness.specularFactor.x,
+			&dm.specularGlossiness.specularFactor.x, GuiH::Flags::Normal);
+		changed |= GuiH::Slider("Glossiness", "", &mat.specularGlossiness.glossinessFactor,
+			&dm.specularGlossiness.glossinessFactor, GuiH::Flags::Normal, 0.f, 1.f);
+	}
+	changed |= GuiH::Slider("IOR", "", &mat.ior.ior, &dm.ior.ior, GuiH::Flags::Normal, 1.f, 3.f);
+	changed |= GuiH::Slider("Clearcoat", "", &mat.clearcoat.factor, &dm.clearcoat.factor, GuiH::Flags::Normal, 0.f, 1.f);
+	changed |= GuiH::Slider("Clearcoat Rough.", "", &mat.clearcoat.roughnessFactor, &dm.clearcoat.roughnessFactor,
+		GuiH::Flags::Normal, 0.f, 1.f);
+
+	// Emission: the triangle lights exist for the materials emissive at load
+	if (_se->m_scene.isTrigLightMaterial(matIndex))
+		changed |= GuiH::Custom("Emissive", "Light sampling is re-weighted", [&] {
+			return ImGui::ColorEdit3("##Emissive", &mat.emissiveFactor.x, ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float);
+			});
+	else
+		GuiH::Info("Emissive", "", "Not a light: reload the scene", GuiH::Flags::Disabled);
+
+	if (changed)
+		_se->m_scene.updateMaterial(matIndex);
+	return changed;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Screenshots and image sequences, written asynchronously
+//
+bool SampleGUI::guiCapture()
+{
+	auto& writer = _se->m_imageWriter;
+	auto& capture = _se->m_capture;
+
+	GuiH::Selection("Format", "PNG is the tonemapped image as displayed, HDR and Raw are the accumulated radiance", &writer.m_format, nullptr,
+		GuiH::Flags::Normal, { "PNG", "HDR", "Raw RGBA32F" });
+	GuiH::Custom("Screenshot", "Save the current image (F12)", [&] {
+		if (ImGui::Button("Save"))
+			writer.screenshot();
+		return false;
+		});
+	bool recording = writer.isRecording();
+	if (GuiH::Checkbox("Record Sequence", "Save every frame in a new folder", &recording))
+	{
+		if (recording)
+			writer.startSequence();
+		else
+			writer.stopSequence();
+	}
+	GuiH::Info("Folder", "", writer.m_directory, GuiH::Flags::Disabled);
+	GuiH::Info("Captured", "", FormatNumbers(capture.getCaptured()), GuiH::Flags::Disabled);
+	GuiH::Info("Written", "", FormatNumbers(writer.getWritten()), GuiH::Flags::Disabled);
+	GuiH::Info("Pending", "", std::to_string(capture.getInFlight()) + " readback / " + std::to_string(writer.getPending()) + " encode",
+		GuiH::Flags::Disabled);
+	GuiH::Info("Dropped", "Frames skipped because all readback buffers or the encoding queue were busy",
+		FormatNumbers(capture.getDropped() + writer.getDropped()), GuiH::Flags::Disabled);
+
+	// Raw frames for an external encoder
+	auto& stream = _se->m_frameStream;
+	static char target[256] = "-";
+	if (!stream.isOpen())
+	{
+		GuiH::Custom("Stream", "Raw frames to stdout (-), a file or named pipe, or unix:<socket path>", [&] {
+			ImGui::InputText("##StreamTarget", target, sizeof(target));
+			return false;
+			});
+		GuiH::Checkbox("Stream HDR", "RGBA32F radiance instead of the tonemapped RGBA8 image", &stream.m_hdr);
+		GuiH::Checkbox("Frame Header", "Size, frame index and spp before each frame.\nWithout it the size must not change (rawvideo)",
+			&stream.m_header);
+		GuiH::Custom("", "", [&] {
+			if (ImGui::Button("Start Streaming"))
+				stream.open(target);
+			return false;
+			});
+	}
+	else
+	{
+		std::string status = stream.hasFailed() ? "Closed by reader" : (stream.isConnected() ? "Connected" : "Waiting for reader");
+		GuiH::Info("Stream", "", stream.getTarget() + " - " + status, GuiH::Flags::Disabled);
+		GuiH::Checkbox("Pause", "Keep the connection but stop sending frames", &stream.m_paused);
+		GuiH::Info("Sent", "", FormatNumbers(stream.getSent()) + " (" + FormatNumbers(stream.getBytes() >> 20) + " MB)",
+			GuiH::Flags::Disabled);
+		GuiH::Info("Stream Dropped", "Frames skipped because the reader is slower than the rendering",
+			FormatNumbers(stream.getDropped()), GuiH::Flags::Disabled);
+		GuiH::Custom("", "", [&] {
+			if (ImGui::Button("Stop Streaming"))
+				stream.close();
+			return false;
+			});
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Error against a reference image over the time of the accumulation, to compare sampling
+// strategies at equal time
+//
+bool SampleGUI::guiConvergence()
+{
+	auto& tracker = _se->m_convergence;
+
+	GuiH::Custom("Reference", "Take the current image as the reference, it should be converged", [&] {
+		if (ImGui::Button("Set Reference"))
+			tracker.setReference();
+		return false;
+		});
+	if (!tracker.hasReference())
+	{
+		ImGui::TextWrapped("Accumulate a converged image and set it as the reference first.");
+		return false;
+	}
+
+	GuiH::Checkbox("Track", "Measure the error of the accumulation since the last reset", &tracker.m_enabled);
+	GuiH::Slider("Period [ms]", "Time between two measures", &tracker.m_periodMs, nullptr, GuiH::Flags::Normal, 50.f, 2000.f);
+
+	// Measures are evenly spaced in time, the curves can be compared point by point
+	auto curve = tracker.getCurve();
+	auto previous = tracker.getPrevious();
+	auto plot = [](const char* label, const std::vector<ConvergenceTracker::Point>& points) {
+		std::vector<float> values(points.size());
+		for (size_t i = 0; i < points.size(); i++)
+			values[i] = static_cast<float>(points[i].rmse);
+		ImGui::PlotLines(label, values.data(), static_cast<int>(values.size()), 0, nullptr, 0.f, FLT_MAX, ImVec2(0, 60));
+	};
+	plot("Current", curve);
+	plot("Previous", previous);
+
+	// Equal time: where the previous accumulation was after the same time
+	if (!curve.empty())
+	{
+		const auto& last = curve.back();
+		ImGui::Text("Current RMSE:  %.5f at %.1f s, %d spp", last.rmse, last.timeMs / 1000.0, last.spp);
+		auto it = std::find_if(previous.rbegin(), previous.rend(), [&](const ConvergenceTracker::Point& p) { return p.timeMs <= last.timeMs; });
+		if (it != previous.rend())
+			ImGui::Text("Previous RMSE: %.5f at %.1f s, %d spp", it->rmse, it->timeMs / 1000.0, it->spp);
+	}
+
+	GuiH::Custom("CSV", "Write both curves in convergence.csv", [&] {
+		if (ImGui::Button("Save"))
+			tracker.writeCsv("convergence.csv");
+		return false;
+		});
+	return false;
+}
+
 //--------------------------------------------------------------------------------------------------
 //
 //
@@ -342,6 +628,144 @@ bool SampleGUI::guiStatistics()
 	return false;
 }
 
+//--------------------------------------------------------------------------------------------------
+// Meshes subdivided and displaced at load, see displacement.hpp
+//
+bool SampleGUI::guiDisplacement()
+{
+	auto& displacement = _se->m_scene.getDisplacement();
+	GuiH::Info("Budget", "Triangles of all the displaced meshes", FormatNumbers(displacement.m_settings.triangleBudget),
+		GuiH::Flags::Disabled);
+	ImGui::Text("%-5s %12s %12s %10s", "Mesh", "Triangles", "Displaced", "BLAS [MB]");
+	for (const auto& r : displacement.getReports())
+	{
+		ImGui::Text("%-5d %12u %12u %10.2f", r.primMesh, r.trianglesIn, r.trianglesOut, r.blasSize / (1024.0 * 1024.0));
+		if (ImGui::IsItemHovered() && !r.name.empty())
+			ImGui::SetTooltip("%s", r.name.c_str());
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Levels of the meshes simplified at load, see mesh_lod.hpp. Error relative to the mesh size.
+//
+bool SampleGUI::guiMeshLod()
+{
+	auto& lod = _se->m_scene.getMeshLod();
+	GuiH::Info("Ratio", "Triangles kept by each level, from the previous one",
+		std::to_string(static_cast<int>(lod.m_settings.ratio * 100.f + 0.5f)) + "%", GuiH::Flags::Disabled);
+	ImGui::Text("%-5s %-4s %12s %9s %10s", "Mesh", "LOD", "Triangles", "Error [%]", "BLAS [MB]");
+	for (const auto& r : lod.getReports())
+	{
+		for (int level = 0; level < LOD_LEVELS && r.lodPrimMesh[level] >= 0; level++)
+		{
+			ImGui::Text("%-5d %-4d %12u %9.3f %10.2f", r.primMesh, level, r.triangles[level], r.error[level] * 100.f,
+				r.blasSize[level] / (1024.0 * 1024.0));
+			if (ImGui::IsItemHovered() && !r.name.empty())
+				ImGui::SetTooltip("%s", r.name.c_str());
+		}
+	}
+	return false;
+}
+
+#if PT_STATS
+//--------------------------------------------------------------------------------------------------
+// Counters of the shaders (PT_STATS), from a recent frame. The rate uses the GPU time of "Render".
+//
+bool SampleGUI::guiRayStats(nvvk::ProfilerVK& profiler)
+{
+	RayStats stats;
+	if (!_se->m_pRender || !_se->m_pRender->getRayStats(stats))
+	{
+		ImGui::Text("No statistics");
+		return false;
+	}
+
+	nvh::Profiler::TimerInfo info;
+	profiler.getTimerInfo("Render", info);
+	const double gpuMs = info.gpu.average / 1000.0;
+	const double rays = double(stats.primaryRays) + double(stats.indirectRays) + double(stats.shadowRays);
+
+	ImGui::Text("Mrays/s: %.1f", gpuMs > 0.0 ? rays / (gpuMs * 1000.0) : 0.0);
+	ImGui::Text("Rays/frame: %s", FormatNumbers(static_cast<uint64_t>(rays)).c_str());
+	ImGui::Text(" - Primary:  %s", FormatNumbers(stats.primaryRays).c_str());
+	ImGui::Text(" - Indirect: %s", FormatNumbers(stats.indirectRays).c_str());
+	ImGui::Text(" - Shadow:   %s", FormatNumbers(stats.shadowRays).c_str());
+	ImGui::Text("Any-hit candidates per ray: %.2f", rays > 0.0 ? stats.candidateHits / rays : 0.0);
+	ImGui::Text("Paths: %s", FormatNumbers(stats.paths).c_str());
+	ImGui::Text(" - Russian roulette: %s", FormatNumbers(stats.rrTerminations).c_str());
+	ImGui::Text(" - Environment:      %s", FormatNumbers(stats.envEscapes).c_str());
+
+	// Fraction of the paths per number of bounces, the last bin has the longer ones
+	float lengths[STATS_PATH_LENGTHS];
+	for (int i = 0; i < STATS_PATH_LENGTHS; i++)
+		lengths[i] = stats.paths > 0 ? float(stats.pathLength[i]) / float(stats.paths) : 0.f;
+	ImGui::PlotHistogram("Path Length", lengths, STATS_PATH_LENGTHS, 0, nullptr, 0.f, 1.f, ImVec2(0, 60));
+	return false;
+}
+#endif
+
+#if PT_PROFILE
+//--------------------------------------------------------------------------------------------------
+// Shader clocks (PT_PROFILE) of a recent frame, summed over all invocations: where the time of the
+// path tracer goes, by stage and by material. The materials are sorted by the selected column.
+//
+bool SampleGUI::guiShaderClocks()
+{
+	std::vector<ProfileCounter> counters;
+	if (!_se->m_pRender || !_se->m_pRender->getProfile(counters) || counters.size() < PROFILE_STAGES)
+	{
+		ImGui::Text("No clocks");
+		return false;
+	}
+	auto milliseconds = [](const ProfileCounter& c) { return (double(c.clocksHi) * 4294967296.0 + double(c.clocksLo)) / 1e6; };
+
+	static const char* stages[PROFILE_STAGES] = { "Traversal", "Shadow", "Shade State", "Material", "BSDF" };
+	double total = 0;
+	for (int i = 0; i < PROFILE_STAGES; i++)
+		total += milliseconds(counters[i]);
+	for (int i = 0; i < PROFILE_STAGES; i++)
+	{
+		double ms = milliseconds(counters[i]);
+		ImGui::Text("%-12s %10.2f ms %5.1f%%", stages[i], ms, total > 0 ? ms * 100.0 / total : 0.0);
+	}
+
+	struct Row
+	{
+		int    material;
+		double ms;
+		uint32_t hits;
+		double usPerHit() const { return hits > 0 ? ms * 1000.0 / hits : 0.0; }
+	};
+	std::vector<Row> rows;
+	for (size_t i = PROFILE_STAGES; i < counters.size(); i++)
+		if (counters[i].count > 0)
+			rows.push_back({ static_cast<int>(i - PROFILE_STAGES), milliseconds(counters[i]), counters[i].count });
+
+	static int sortBy = 0;
+	ImGui::Separator();
+	GuiH::Selection("Sort By", "Column of the most expensive materials", &sortBy, nullptr, ImGuiH::Control::Flags::Normal,
+		{ "Time", "Hits", "Time per Hit" });
+	std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+		switch (sortBy)
+		{
+		case 1:
+			return a.hits > b.hits;
+		case 2:
+			return a.usPerHit() > b.usPerHit();
+		default:
+			return a.ms > b.ms;
+		}
+		});
+
+	ImGui::Text("%-9s %10s %10s %10s", "Material", "Time [ms]", "Hits", "[us]/Hit");
+	const size_t maxRows = 32;
+	for (size_t i = 0; i < std::min(rows.size(), maxRows); i++)
+		ImGui::Text("%-9d %10.2f %10u %10.3f", rows[i].material, rows[i].ms, rows[i].hits, rows[i].usPerHit());
+	return false;
+}
+#endif
+
 //--------------------------------------------------------------------------------------------------
 //
 //
@@ -355,7 +779,15 @@ bool SampleGUI::guiProfiler(nvvk::ProfilerVK& profiler)
 	};
 	static Info  display;
 	static Info  collect;
-	static float mipmapGen{ 0.f };
+	static float exposureGen{ 0.f };
+	static float rasterGen{ 0.f };
+	static float renderPerMode[2]{ 0.f, 0.f };  // Render GPU time with traced / rasterized primary
+	static float shadowGen{ 0.f };
+	static float renderPerShadowMode[2]{ 0.f, 0.f };  // Render GPU time with inline / deferred shadow rays
+	static float indirectGen{ 0.f };
+	static float renderPerIndirectRes[4]{ 0.f, 0.f, 0.f, 0.f };  // Render GPU time per IndirectResolution
+	static float renderPerMethod[2]{ 0.f, 0.f };  // Render GPU time with the Ray Query / RTX pipeline renderer
+	static float renderPerLod[2]{ 0.f, 0.f };  // Render GPU time with full detail / simplified secondary rays
 
 	// Collecting data
 	static float dirtyCnt = 0.0f;
@@ -370,11 +802,27 @@ bool SampleGUI::guiProfiler(nvvk::ProfilerVK& profiler)
 		collect.statTone.y += float(info.cpu.average / 1000.0f);
 		collect.frameTime += 1000.0f / ImGui::GetIO().Framerate;
 
-		if (_se->m_offscreen.m_tonemapper.autoExposure == 1)
+		if (_se->m_offscreen.m_tonemapper.autoExposure & 1)
+		{
+			profiler.getTimerInfo("Exposure", info);
+			exposureGen = float(info.gpu.average / 1000.0f);
+		}
+		if (_se->m_rtxState.rasterPrimary == 1)
 		{
-			profiler.getTimerInfo("Mipmap", info);
-			mipmapGen = float(info.gpu.average / 1000.0f);
-			//LOGI("Mipmap Generation: %.2fms\n", info.gpu.average / 1000.0f);
+			profiler.getTimerInfo("Raster", info);
+			rasterGen = float(info.gpu.average / 1000.0f);
+		}
+		if (_se->m_rtxState.deferShadows == 1)
+		{
+			profiler.getTimerInfo("Shadow", info);
+			shadowGen = float(info.gpu.average / 1000.0f);
+			profiler.getTimerInfo("Resolve", info);
+			shadowGen += float(info.gpu.average / 1000.0f);
+		}
+		if (_se->m_rtxState.indirectRes != eIndirectFull)
+		{
+			profiler.getTimerInfo("Indirect", info);
+			indirectGen = float(info.gpu.average / 1000.0f);
 		}
 	}
 
@@ -386,6 +834,12 @@ bool SampleGUI::guiProfiler(nvvk::ProfilerVK& profiler)
 		display.statRender = collect.statRender / dirtyCnt;
 		display.statTone = collect.statTone / dirtyCnt;
 		display.frameTime = collect.frameTime / dirtyCnt;
+		renderPerMode[_se->m_rtxState.rasterPrimary] = display.statRender.x;
+		renderPerShadowMode[_se->m_rtxState.deferShadows] = display.statRender.x;
+		renderPerIndirectRes[_se->m_rtxState.indirectRes] = display.statRender.x;
+		if (_se->m_rndMethod == SampleExample::eRayQuery || _se->m_rndMethod == SampleExample::eRtxPipeline)
+			renderPerMethod[_se->m_rndMethod] = display.statRender.x;
+		renderPerLod[_se->m_rtxState.lodDepth > 0 ? 1 : 0] = display.statRender.x;
 		dirtyTimer = 0;
 		dirtyCnt = 0;
 		collect = Info{};
@@ -394,96 +848,269 @@ bool SampleGUI::guiProfiler(nvvk::ProfilerVK& profiler)
 	ImGui::Text("Frame     [ms]: %2.3f", display.frameTime);
 	ImGui::Text("Render GPU/CPU [ms]: %2.3f  /  %2.3f", display.statRender.x, display.statRender.y);
 	ImGui::Text("Tone+UI GPU/CPU [ms]: %2.3f  /  %2.3f", display.statTone.x, display.statTone.y);
-	if (_se->m_offscreen.m_tonemapper.autoExposure == 1)
-		ImGui::Text("Mipmap Gen: %2.3fms", mipmapGen);
+	if (_se->m_offscreen.m_tonemapper.autoExposure & 1)
+		ImGui::Text("Auto Exposure: %2.3fms", exposureGen);
+	if (_se->m_rtxState.rasterPrimary == 1)
+		ImGui::Text("Raster Primary: %2.3fms", rasterGen);
+	if (renderPerMode[0] > 0.f && renderPerMode[1] > 0.f)
+		ImGui::Text("Raster Primary saves [ms]: %2.3f", renderPerMode[0] - renderPerMode[1]);
+	if (_se->m_rtxState.deferShadows == 1)
+		ImGui::Text("Shadow pass: %2.3fms", shadowGen);
+	if (renderPerShadowMode[0] > 0.f && renderPerShadowMode[1] > 0.f)
+		ImGui::Text("Deferred Shadows saves [ms]: %2.3f", renderPerShadowMode[0] - renderPerShadowMode[1]);
+	if (_se->m_rtxState.indirectRes != eIndirectFull)
+		ImGui::Text("Indirect pass: %2.3fms", indirectGen);
+	if (renderPerIndirectRes[0] > 0.f && _se->m_rtxState.indirectRes != eIndirectFull && renderPerIndirectRes[_se->m_rtxState.indirectRes] > 0.f)
+		ImGui::Text("Decoupled Indirect saves [ms]: %2.3f", renderPerIndirectRes[0] - renderPerIndirectRes[_se->m_rtxState.indirectRes]);
+	if (renderPerMethod[0] > 0.f && renderPerMethod[1] > 0.f)
+		ImGui::Text("RTX Pipeline vs Ray Query [ms]: %+2.3f", renderPerMethod[1] - renderPerMethod[0]);
+	if (renderPerLod[0] > 0.f && renderPerLod[1] > 0.f)
+		ImGui::Text("Geometry LOD saves [ms]: %2.3f", renderPerLod[0] - renderPerLod[1]);
+	if (_se->m_pRender && _se->m_pRender->getLaneUtilization() > 0.f)
+		ImGui::Text("SIMD lane utilization: %2.1f%%", _se->m_pRender->getLaneUtilization() * 100.f);
 	ImGui::ProgressBar(display.statRender.x / display.frameTime);
 
 
 	return false;
 }
 
+//--------------------------------------------------------------------------------------------------
+// CPU scopes and GPU sections recorded for chrome://tracing or Perfetto
+//
+bool SampleGUI::guiTrace()
+{
+	auto& trace = TraceRecorder::get();
+	static std::string filename = "trace.json";
+
+	bool enabled = trace.m_enabled;
+	if (GuiH::Checkbox("Record", "Record CPU scopes and GPU sections in the timeline", &enabled))
+		trace.m_enabled = enabled;
+	GuiH::Info("Events", "Oldest events are overwritten when the buffer is full", FormatNumbers(trace.size()), GuiH::Flags::Disabled);
+	GuiH::Custom("Trace", "Chrome Trace Event JSON, open in chrome://tracing or ui.perfetto.dev", [&] {
+		if (ImGui::Button("Save Trace"))
+			trace.writeChromeTrace(filename);
+		return false;
+		});
+	GuiH::Info("File", "", filename, GuiH::Flags::Disabled);
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// GPU memory per category and the largest owners, as allocated through the resource allocator
+//
+bool SampleGUI::guiMemory()
+{
+	const MemoryTracker& tracker = _se->m_alloc.getTracker();
+	auto                 stats = tracker.getCategoryStats();
+	auto                 mb = [](uint64_t bytes) { return double(bytes) / double(1 << 20); };
+
+	ImGui::Text("%-12s %9s %9s %9s %6s", "Category", "Device MB", "Host MB", "Peak MB", "Live");
+	for (size_t c = 0; c < stats.size(); c++)
+	{
+		const auto& s = stats[c];
+		if (s.allocations == 0)
+			continue;
+		ImGui::Text("%-12s %9.2f %9.2f %9.2f %6u", memCategoryName(MemCategory(c)), mb(s.deviceBytes), mb(s.hostBytes),
+			mb(s.peakBytes), s.live);
+	}
+	ImGui::Text("%-12s %9.2f  peak %.2f", "Total", mb(tracker.getLiveBytes()), mb(tracker.getPeakBytes()));
+
+	float fragmentation = _se->m_alloc.getFragmentation();
+	if (fragmentation >= 0.f)
+		ImGui::Text("Unused in memory blocks: %.1f%%", fragmentation * 100.f);
+
+	uint32_t staleCount;
+	uint64_t staleBytes;
+	tracker.getStale(staleCount, staleBytes);
+	if (staleCount > 0)
+		ImGui::TextColored(ImVec4(1.f, 0.4f, 0.2f, 1.f), "Leaked from previous scenes: %u allocations, %.2f MB", staleCount, mb(staleBytes));
+
+	// Largest owners
+	auto owners = tracker.getOwnerStats();
+	ImGui::Separator();
+	for (size_t i = 0; i < std::min<size_t>(owners.size(), 12); i++)
+		ImGui::Text("%9.2f MB  %-11s %s", mb(owners[i].bytes), memCategoryName(owners[i].category),
+			owners[i].owner.empty() ? "-" : owners[i].owner.c_str());
+
+	GuiH::Custom("Report", "Categories and owners written as JSON in memory.json", [&] {
+		if (ImGui::Button("Save"))
+			_se->m_alloc.writeJson("memory.json");
+		return false;
+		});
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Passes of the frame and the memory of their transients, aliased or each in its own memory
+//
+bool SampleGUI::guiRenderGraph()
+{
+	const RenderGraph& graph = _se->m_graph;
+	auto               mb = [](VkDeviceSize bytes) { return double(bytes) / double(1 << 20); };
+
+	std::string passes;
+	for (uint32_t p = 0; p < graph.getPassCount(); p++)
+		passes += (p > 0 ? ", " : "") + std::string(graph.getPassName(p));
+	ImGui::TextWrapped("Passes: %s", passes.c_str());
+
+	const auto& stats = graph.getStats();
+	ImGui::Text("Barriers per frame: %u", stats.barriers);
+	ImGui::Text("%-12s %9s %9s", "Transients", "Aliased", "Separate");
+	ImGui::Text("%-12s %9.1f %9.1f MB", "Window", mb(stats.aliasedBytes), mb(stats.separateBytes));
+	ImGui::Text("%-12s %9.1f %9.1f MB", "3840x2160", mb(_se->m_graphPlan[0].aliasedBytes), mb(_se->m_graphPlan[0].separateBytes));
+	ImGui::Text("%-12s %9.1f %9.1f MB", "  stereo", mb(_se->m_graphPlan[1].aliasedBytes), mb(_se->m_graphPlan[1].separateBytes));
+
+	ImGui::Separator();
+	for (const auto& r : graph.getResources())
+	{
+		if (r.first < 0)
+			continue;
+		if (r.imported)
+			ImGui::Text("%-14s imported      passes %d-%d", r.name.c_str(), r.first, r.last);
+		else
+			ImGui::Text("%-14s %7.1f MB at %7.1f MB  passes %d-%d", r.name.c_str(), mb(r.size), mb(r.offset), r.first, r.last);
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Development mode: the GLSL sources are recompiled when saved, the pipelines swapped
+//
+bool SampleGUI::guiShaders()
+{
+	auto& reloader = ShaderReloader::get();
+	auto  status = reloader.getStatus();
+	if (status.directory.empty())
+	{
+		ImGui::TextWrapped("Shader sources not found");
+		return false;
+	}
+
+	bool watch = reloader.isRunning();
+	if (GuiH::Checkbox("Hot Reload", "Recompile the shaders when edited, as with -hotreload", &watch))
+	{
+		if (watch)
+			reloader.start();
+		else
+			reloader.stop();
+	}
+	GuiH::Info("Compiler", "", status.compiler, GuiH::Flags::Disabled);
+	GuiH::Info("Folder", "", status.directory, GuiH::Flags::Disabled);
+	if (watch)
+	{
+		GuiH::Custom("Rebuild", "Recompile all shaders in use, edited or not", [&] {
+			if (ImGui::Button("Rebuild All"))
+				reloader.requestRebuild();
+			return false;
+			});
+	}
+	if (status.batches > 0 || !status.error.empty())
+		GuiH::Info("Last Compile", "", std::to_string(static_cast<int>(status.lastMs)) + " ms", GuiH::Flags::Disabled);
+	if (!status.error.empty())
+		ImGui::TextColored(ImVec4(1.f, 0.4f, 0.2f, 1.f), "%s", status.error.c_str());
+	return false;
+}
+
 //--------------------------------------------------------------------------------------------------
 //
 //
 bool SampleGUI::guiGpuMeasures()
 {
-#if defined(NVP_SUPPORTS_NVML)
-	if (g_nvml.isValid() == false)
-		ImGui::Text("NVML wasn't loaded");
-
-	auto memoryNumbers = [](float n) {  // Memory numbers from nvml are in KB
-		static const std::vector<const char*> t{ " KB", " MB", " GB", " TB" };
-		static char                     s[16];
-		int                             level{ 0 };
-		while (n > 1000)
+	// Last samples of the system monitor, never waiting on its thread
+	std::vector<SystemSample> samples;
+	_se->m_monitor.latest(samples);
+	if (samples.empty())
+	{
+		ImGui::Text("No measurement yet");
+		return false;
+	}
+	const SystemSample& last = samples.back();
+
+	auto memoryNumbers = [](int64_t n) {
+		static const std::vector<const char*> t{ " B", " KB", " MB", " GB", " TB" };
+		double                                v = double(n);
+		int                                   level{ 0 };
+		while (v > 1000 && level + 1 < int(t.size()))
 		{
-			n = n / 1000;
+			v = v / 1000;
 			level++;
 		}
-		sprintf(s, "%.3f %s", n, t[level]);
-		return s;
+		char s[32];
+		sprintf(s, "%.3f%s", v, t[level]);
+		return std::string(s);
 	};
 
-	uint32_t offset = g_nvml.getOffset();
-
-	for (uint32_t g = 0; g < g_nvml.nbGpu(); g++)  // Number of gpu
+	// GPU memory of all processes when the driver reports it, otherwise the heaps of this process
+	const bool driverMemory = last.gpuMemUsed >= 0 && last.gpuMemTotal > 0;
+	auto       memUsed = [&](const SystemSample& s) { return driverMemory ? s.gpuMemUsed : s.heapUsage; };
+	int64_t    memTotal = driverMemory ? last.gpuMemTotal : last.heapBudget;
+
+	const std::string& source = _se->m_monitor.gpuSource();
+	ImGui::Text("%s (%s)", _se->m_monitor.gpuName().c_str(), source.empty() ? "no load sensor" : source.c_str());
+	if (last.gpuLoad >= 0)
+		ImGui::Text("- Load: %2.0f%%", last.gpuLoad);
+	if (memUsed(last) >= 0 && memTotal > 0)
+		ImGui::Text("- Mem: %2.0f%% %s", memUsed(last) / double(memTotal) * 100.0, memoryNumbers(memUsed(last)).c_str());
+	if (last.heapUsage >= 0)
+		ImGui::Text("- Vulkan heaps: %s / %s", memoryNumbers(last.heapUsage).c_str(), memoryNumbers(last.heapBudget).c_str());
+	if (last.gpuTemperature >= 0)
+		ImGui::Text("- Temperature: %.0f C", last.gpuTemperature);
+	if (last.gpuPower >= 0)
+		ImGui::Text("- Power: %.1f W", last.gpuPower);
+
+	std::vector<float> gpuLoad, gpuMem, cpuLoad;
+	for (const auto& s : samples)
 	{
-		const auto& i = g_nvml.getInfo(g);
-		const auto& m = g_nvml.getMeasures(g);
-
-		float                mem = m.memory[offset] / float(i.max_mem) * 100.f;
-		std::array<char, 64> desc;
-		sprintf(desc.data(), "%s: \n- Load: %2.0f%s \n- Mem: %2.0f%s", i.name.c_str(), m.load[offset], "%", mem, "%");
-		ImGui::Text("%s \n- Load: %2.0f%s \n- Mem: %2.0f%s %s", i.name.c_str(), m.load[offset], "%", mem, "%",
-			memoryNumbers(m.memory[offset]));
-		{
-			ImGui::ImPlotMulti datas[2];
-			datas[0].plot_type = static_cast<ImGuiPlotType>(ImGuiPlotType_Area);
-			datas[0].name = "Load";
-			datas[0].color = ImColor(0.07f, 0.9f, 0.06f, 1.0f);
-			datas[0].thickness = 1.5;
-			datas[0].data = m.load.data();
-			datas[0].values_count = (int)m.load.size();
-			datas[0].values_offset = offset + 1;
-			datas[0].scale_min = 0;
-			datas[0].scale_max = 100;
-
-			datas[1].plot_type = ImGuiPlotType_Histogram;
-			datas[1].name = "Mem";
-			datas[1].color = ImColor(0.06f, 0.6f, 0.97f, 0.8f);
-			datas[1].thickness = 2.0;
-			datas[1].data = m.memory.data();
-			datas[1].values_count = (int)m.memory.size();
-			datas[1].values_offset = offset + 1;
-			datas[1].scale_min = 0;
-			datas[1].scale_max = float(i.max_mem);
-
-
-			std::string overlay = std::to_string((int)m.load[offset]) + " %";
-			ImGui::PlotMultiEx("##NoName", 2, datas, overlay.c_str(), ImVec2(ImGui::GetContentRegionAvail().x, 150));
-		}
+		gpuLoad.push_back(std::max(s.gpuLoad, 0.f));
+		gpuMem.push_back(float(std::max<int64_t>(memUsed(s), 0)));
+		cpuLoad.push_back(std::max(s.cpuLoad, 0.f));
+	}
 
+	{
+		ImGui::ImPlotMulti datas[2];
+		datas[0].plot_type = static_cast<ImGuiPlotType>(ImGuiPlotType_Area);
+		datas[0].name = "Load";
+		datas[0].color = ImColor(0.07f, 0.9f, 0.06f, 1.0f);
+		datas[0].thickness = 1.5;
+		datas[0].data = gpuLoad.data();
+		datas[0].values_count = (int)gpuLoad.size();
+		datas[0].values_offset = 0;
+		datas[0].scale_min = 0;
+		datas[0].scale_max = 100;
+
+		datas[1].plot_type = ImGuiPlotType_Histogram;
+		datas[1].name = "Mem";
+		datas[1].color = ImColor(0.06f, 0.6f, 0.97f, 0.8f);
+		datas[1].thickness = 2.0;
+		datas[1].data = gpuMem.data();
+		datas[1].values_count = (int)gpuMem.size();
+		datas[1].values_offset = 0;
+		datas[1].scale_min = 0;
+		datas[1].scale_max = float(std::max<int64_t>(memTotal, 1));
+
+		std::string overlay = last.gpuLoad >= 0 ? std::to_string((int)last.gpuLoad) + " %" : std::string();
+		ImGui::PlotMultiEx("##NoName", 2, datas, overlay.c_str(), ImVec2(ImGui::GetContentRegionAvail().x, 150));
+	}
 
-		ImGui::Text("CPU");
-		{
-			ImGui::ImPlotMulti datas[1];
-			datas[0].plot_type = ImGuiPlotType_Lines;
-			datas[0].name = "CPU";
-			datas[0].color = ImColor(0.96f, 0.96f, 0.07f, 1.0f);
-			datas[0].thickness = 1.0;
-			datas[0].data = g_nvml.getSysInfo().cpu.data();
-			datas[0].values_count = (int)g_nvml.getSysInfo().cpu.size();
-			datas[0].values_offset = offset + 1;
-			datas[0].scale_min = 0;
-			datas[0].scale_max = 100;
-
-			std::string overlay = std::to_string((int)m.load[offset]) + " %";
-			ImGui::PlotMultiEx("##NoName", 1, datas, nullptr, ImVec2(0, 0));
-		}
+	ImGui::Text("CPU: %2.0f%%, process memory %s", std::max(last.cpuLoad, 0.f),
+		last.processRss >= 0 ? memoryNumbers(last.processRss).c_str() : "-");
+	{
+		ImGui::ImPlotMulti datas[1];
+		datas[0].plot_type = ImGuiPlotType_Lines;
+		datas[0].name = "CPU";
+		datas[0].color = ImColor(0.96f, 0.96f, 0.07f, 1.0f);
+		datas[0].thickness = 1.0;
+		datas[0].data = cpuLoad.data();
+		datas[0].values_count = (int)cpuLoad.size();
+		datas[0].values_offset = 0;
+		datas[0].scale_min = 0;
+		datas[0].scale_max = 100;
+
+		ImGui::PlotMultiEx("##NoName", 1, datas, nullptr, ImVec2(0, 0));
 	}
-#else
-	ImGui::Text("NVML wasn't loaded");
-#endif
+	if (last.nbCores > 0)  // Load of each core, as bars
+		ImGui::PlotHistogram("##Cores", last.coreLoad.data(), int(last.nbCores), 0, nullptr, 0.f, 100.f,
+			ImVec2(ImGui::GetContentRegionAvail().x, 40));
 	return false;
 }
 
@@ -504,14 +1131,9 @@ void SampleGUI::titleBar()
 		o << " | " << _se->m_renderRegion.extent.width << "x" << _se->m_renderRegion.extent.height;  // resolution
 		o << " | " << static_cast<int>(ImGui::GetIO().Framerate)                                     // FPS / ms
 			<< " FPS / " << std::setprecision(3) << 1000.F / ImGui::GetIO().Framerate << "ms";
-#if defined(NVP_SUPPORTS_NVML)
-		if (g_nvml.isValid())  // Graphic card, driver
-		{
-			const auto& i = g_nvml.getInfo(0);
-			o << " | " << i.name;
-			o << " | " << g_nvml.getSysInfo().driverVersion;
-		}
-#endif
+		o << " | " << _se->m_monitor.gpuName();  // Graphic card, driver
+		if (!_se->m_monitor.driverVersion().empty())
+			o << " | " << _se->m_monitor.driverVersion();
 		glfwSetWindowTitle(_se->m_window, o.str().c_str());
 		dirtyTimer = 0;
 	}
@@ -565,6 +1187,8 @@ void SampleGUI::menuBar()
 		{
 			ImGui::MenuItem("Settings", "F10", &_se->m_show_gui);
 			ImGui::MenuItem("Axis", nullptr, &_se->m_showAxis);
+			if (ImGui::MenuItem("Screenshot", "F12"))
+				_se->m_imageWriter.screenshot();
 			ImGui::EndMenu();
 		}
 
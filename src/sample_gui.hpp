@@ -19,6 +19,7 @@
 
 #pragma once
 #include "nvvk/profiler_vk.hpp"
+#include "shaders/host_device.h"  // PT_STATS, PT_PROFILE
 
 
 //--------------------------------------------------------------------------------------------------
@@ -42,9 +43,24 @@ private:
   bool           guiRayTracing();
   bool           guiTonemapper();
   bool           guiEnvironment();
+  bool           guiMaterials();
+  bool           guiCapture();
+  bool           guiConvergence();
   bool           guiStatistics();
+  bool           guiDisplacement();
+  bool           guiMeshLod();
   bool           guiProfiler(nvvk::ProfilerVK& profiler);
+#if PT_STATS
+  bool           guiRayStats(nvvk::ProfilerVK& profiler);
+#endif
+#if PT_PROFILE
+  bool           guiShaderClocks();
+#endif
   bool           guiGpuMeasures();
+  bool           guiTrace();
+  bool           guiMemory();
+  bool           guiRenderGraph();
+  bool           guiShaders();
 
   SampleExample* _se{nullptr};
 };
@@ -24,6 +24,7 @@
   */
 
 
+#include <algorithm>
 #include <sstream>
 
 #include "imgui/imgui_camera_widget.h"
@@ -37,7 +38,9 @@
 #include "scene.hpp"
 #include "shaders/compress.glsl"
 #include "tiny_gltf.h"
+#include "memory_tracker.hpp"
 #include "tools.hpp"
+#include "trace_recorder.hpp"
 
 #include "fileformats/tiny_gltf_freeimage.h"
 
@@ -64,17 +67,23 @@ bool Scene::load(const std::string& filename)
 		return false;
 
 	m_stats = gltf.getStatistics(tmodel);
+	MemoryScope memScope(MemCategory::eSceneData, m_sceneName);
 
 	// Extracting GLTF information to our format and adding, if missing, attributes such as tangent
 	{
 		LOGI("Convert to internal GLTF");
-		MilliTimer timer;
+		MilliTimer timer("Import glTF");
 		gltf.importMaterials(tmodel);
 		gltf.importDrawableNodes(tmodel, nvh::GltfAttributes::Normal | nvh::GltfAttributes::Texcoord_0
 			| nvh::GltfAttributes::Tangent | nvh::GltfAttributes::Color_0);
 		timer.print();
 	}
 
+	// Meshes with a height map are subdivided and displaced before their buffers are made
+	m_displacement.apply(gltf, tmodel);
+	// Coarser meshes for the secondary rays, appended as new primitive meshes
+	m_meshLod.apply(gltf);
+
 	// Setting all cameras found in the scene, such that they appears in the camera GUI helper
 	setCameraFromScene(filename, gltf);
 	m_camera.nbLights = static_cast<int>(gltf.m_lights.size());
@@ -96,17 +105,18 @@ bool Scene::load(const std::string& filename)
 	createTextureImages(cmdBuf, tmodel);
 	createVertexBuffer(cmdBuf, gltf);
 	createInstanceDataBuffer(cmdBuf, gltf);
-	createTrigLightBuffer(cmdBuf, gltf, tmodel);
+	createNodeDataBuffer(cmdBuf, gltf);
+	createTrigLightBuffer(cmdBuf, gltf);
 
 	// light buffer info buffer
-	if (m_lightBufInfo.puncLightSize > 0 || m_lightBufInfo.trigLightSize > 0)
-		m_lightBufInfo.trigSampProb = m_trigLightWeight / (m_trigLightWeight + m_puncLightWeight);
-	m_buffer[eLightBufInfo] = m_pAlloc->createBuffer(cmdBuf, sizeof(LightBufInfo), &m_lightBufInfo, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+	setTrigSampProb();
+	m_buffer[eLightBufInfo] = m_pAlloc->createBuffer(cmdBuf, sizeof(LightBufInfo), &m_lightBufInfo,
+		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 	NAME_VK(m_buffer[eLightBufInfo].buffer);
 
 	// Finalizing the command buffer - upload data to GPU
 	LOGI(" <Finalize>");
-	MilliTimer timer;
+	MilliTimer timer("Scene upload");
 	cmdBufGet.submitAndWait(cmdBuf);
 	m_pAlloc->finalizeAndReleaseStaging();
 	timer.print();
@@ -131,7 +141,7 @@ bool Scene::loadGltfScene(const std::string& filename, tinygltf::Model& tmodel)
 {
 	tinygltf::TinyGLTF tcontext;
 	std::string        warn, error;
-	MilliTimer         timer;
+	MilliTimer         timer("Parse glTF");
 
 	LOGI("Loading scene: %s", filename.c_str());
 	bool        result;
@@ -194,6 +204,32 @@ void Scene::createInstanceDataBuffer(VkCommandBuffer cmdBuf, nvh::GltfScene& glt
 	NAME_VK(m_buffer[eInstData].buffer);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Transformation of each node, in the same order as the TLAS instances. Used to reconstruct
+// hits from the visibility buffer, where only the instance index is stored. The instances of the
+// simplified meshes (MeshLod) follow the nodes.
+//
+void Scene::createNodeDataBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf)
+{
+	std::vector<NodeData> nodeData;
+	nodeData.reserve(gltf.m_nodes.size() + m_meshLod.getInstances().size());
+	for (auto& node : gltf.m_nodes)
+		nodeData.emplace_back(makeNodeData(node.worldMatrix, node.primMesh));
+	for (auto& inst : m_meshLod.getInstances())
+		nodeData.emplace_back(makeNodeData(gltf.m_nodes[inst.node].worldMatrix, inst.primMesh));
+	m_buffer[eNodeData] = m_pAlloc->createBuffer(cmdBuf, nodeData, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	NAME_VK(m_buffer[eNodeData].buffer);
+}
+
+NodeData Scene::makeNodeData(const nvmath::mat4f& worldMatrix, uint32_t primMesh)
+{
+	NodeData data{};
+	data.objectToWorld = worldMatrix;
+	data.worldToObject = nvmath::invert(worldMatrix);
+	data.primMesh = static_cast<int>(primMesh);
+	return data;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Creating a buffer per primitive mesh (BLAS) containing all Vertex (pos, nrm, .. )
 // and a buffer of index.
@@ -209,13 +245,14 @@ void Scene::createInstanceDataBuffer(VkCommandBuffer cmdBuf, nvh::GltfScene& glt
 void Scene::createVertexBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf)
 {
 	LOGI(" - Create %d Vertex Buffers", gltf.m_primMeshes.size());
-	MilliTimer timer;
+	MilliTimer timer("Vertex buffers");
 
 	std::unordered_map<std::string, nvvk::Buffer> m_cachePrimitive;
 
 	uint32_t prim_idx{ 0 };
 	for (const nvh::GltfPrimMesh& primMesh : gltf.m_primMeshes)
 	{
+		MemoryScope memScope(MemCategory::eGeometry, m_sceneName + " prim " + std::to_string(prim_idx));
 
 		std::vector<VertexAttributes> vertices;
 		std::vector<uint32_t> indices;
@@ -275,7 +312,8 @@ void Scene::createVertexBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& glt
 
 		nvvk::Buffer i_buffer = m_pAlloc->createBuffer(cmdBuf, indices,
 			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-			| VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
+			| VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
+			| VK_BUFFER_USAGE_INDEX_BUFFER_BIT);  // Raster primary pass
 
 		m_buffers[eVertex].push_back(v_buffer);
 		NAME_IDX_VK(v_buffer.buffer, prim_idx);
@@ -352,60 +390,95 @@ void Scene::createPuncLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene&
 	NAME_VK(m_buffer[ePuncLights].buffer);
 }
 
-void Scene::createTrigLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf, const tinygltf::Model& gltfModel)
+//--------------------------------------------------------------------------------------------------
+// Triangles of the emissive meshes, in object space: the shader transforms them with the NodeData
+// of their instance (transformIndex). Moving an emitter only changes its NodeData, see
+// setNodeTransform.
+// The triangles of a mesh are extracted once (TrigLightGeom) and shared by its instances, each
+// instance has its own TrigLight for the sampling. Counted per node, then filled in parallel.
+//
+void Scene::createTrigLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf)
 {
-	std::vector<TrigLight> trigLights;
-	std::vector<nvmath::mat4f> transforms;
+	MilliTimer timer("Triangle lights");
 
-	for (const auto& node : gltf.m_nodes)
+	// Count: triangles of the emissive meshes, and of their instances
+	std::vector<uint32_t> geomOffsets(gltf.m_primMeshes.size() + 1, 0);  // First TrigLightGeom of each mesh, then the count
+	for (size_t primIndex = 0; primIndex < gltf.m_primMeshes.size(); primIndex++)
 	{
-		const auto& primMesh = gltf.m_primMeshes[node.primMesh];
-		nvh::GltfMaterial mat = gltf.m_materials[primMesh.materialIndex];
-		
-		if (luminance(mat.emissiveFactor) > 1e-2f) {
-			//std::cout << luminance(mat.emissiveFactor) << " Emissive\n";
-
-			// so far we only test static light sources .
-			//transforms.push_back(node.worldMatrix); // nvmath is col-major
-			for (uint32_t idx = primMesh.firstIndex; idx < primMesh.firstIndex + primMesh.indexCount - 1; idx += 3) {
-				TrigLight trig;
-				//VertexAttributes vert0 = (*m_pVertices)[(*m_pIndices)[idx]];
-				//VertexAttributes vert1 = (*m_pVertices)[(*m_pIndices)[idx + 1]];
-				//VertexAttributes vert2 = (*m_pVertices)[(*m_pIndices)[idx + 2]];
-
-				uint32_t index0 = gltf.m_indices[idx] + primMesh.vertexOffset;
-				uint32_t index1 = gltf.m_indices[idx+1] + primMesh.vertexOffset;
-				uint32_t index2 = gltf.m_indices[idx+2] + primMesh.vertexOffset;
-				trig.transformIndex = transforms.size()-1;
-				trig.matIndex = primMesh.materialIndex;
-				trig.v0 = gltf.m_positions[index0];
-				trig.uv0 = gltf.m_texcoords0[index0];
-				trig.v1 = gltf.m_positions[index1];
-				trig.uv1 = gltf.m_texcoords0[index1];
-				trig.v2 = gltf.m_positions[index2];
-				trig.uv2 = gltf.m_texcoords0[index2];
-
-				trig.v0 = node.worldMatrix * vec4(trig.v0, 1.0);
-				trig.v1 = node.worldMatrix * vec4(trig.v1, 1.0);
-				trig.v2 = node.worldMatrix * vec4(trig.v2, 1.0);
-
-				trigLights.push_back(trig);
-			}
-		}
+		const auto& primMesh = gltf.m_primMeshes[primIndex];
+		const auto& mat = gltf.m_materials[primMesh.materialIndex];
+		uint32_t    count = luminance(mat.emissiveFactor) > 1e-2f ? primMesh.indexCount / 3 : 0;
+		geomOffsets[primIndex + 1] = geomOffsets[primIndex] + count;
+	}
+	m_trigLightOffsets.assign(gltf.m_nodes.size() + 1, 0);
+	for (size_t nodeIndex = 0; nodeIndex < gltf.m_nodes.size(); nodeIndex++)
+	{
+		uint32_t primIndex = gltf.m_nodes[nodeIndex].primMesh;
+		m_trigLightOffsets[nodeIndex + 1] = m_trigLightOffsets[nodeIndex] + geomOffsets[primIndex + 1] - geomOffsets[primIndex];
 	}
-	m_trigLightWeight = createTrigLightImptSampAccel(trigLights, gltf, gltfModel);
+
+	// Fill: the item of a thread finds its mesh, or its node, in the offsets
+	auto owner = [](const std::vector<uint32_t>& offsets, size_t item) {
+		return static_cast<uint32_t>(std::upper_bound(offsets.begin(), offsets.end(), static_cast<uint32_t>(item)) - offsets.begin() - 1);
+	};
+
+	std::vector<TrigLightGeom> geoms(geomOffsets.back());
+	m_trigLightCross.resize(geoms.size());
+	parallelRanges(geoms.size(), [&](size_t begin, size_t end) {
+		for (size_t g = begin; g < end; g++)
+		{
+			uint32_t    primIndex = owner(geomOffsets, g);
+			const auto& primMesh = gltf.m_primMeshes[primIndex];
+			uint32_t    idx = primMesh.firstIndex + 3 * (static_cast<uint32_t>(g) - geomOffsets[primIndex]);
+			uint32_t    index0 = gltf.m_indices[idx] + primMesh.vertexOffset;
+			uint32_t    index1 = gltf.m_indices[idx + 1] + primMesh.vertexOffset;
+			uint32_t    index2 = gltf.m_indices[idx + 2] + primMesh.vertexOffset;
+
+			TrigLightGeom& geom = geoms[g];
+			geom.v0 = gltf.m_positions[index0];
+			geom.uv0 = gltf.m_texcoords0[index0];
+			geom.v1 = gltf.m_positions[index1];
+			geom.uv1 = gltf.m_texcoords0[index1];
+			geom.v2 = gltf.m_positions[index2];
+			geom.uv2 = gltf.m_texcoords0[index2];
+			m_trigLightCross[g] = nvmath::cross(geom.v1 - geom.v0, geom.v2 - geom.v0);
+		}
+		});
+
+	std::vector<TrigLight> trigLights(m_trigLightOffsets.back());
+	parallelRanges(trigLights.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			uint32_t    nodeIndex = owner(m_trigLightOffsets, i);
+			const auto& primMesh = gltf.m_primMeshes[gltf.m_nodes[nodeIndex].primMesh];
+			TrigLight&  trig = trigLights[i];
+			trig.matIndex = primMesh.materialIndex;
+			trig.transformIndex = nodeIndex;  // NodeData of the instance
+			trig.geomIndex = geomOffsets[gltf.m_nodes[nodeIndex].primMesh] + static_cast<uint32_t>(i) - m_trigLightOffsets[nodeIndex];
+		}
+		});
+
+	m_matTrigLights.assign(gltf.m_materials.size(), {});
+	for (uint32_t i = 0; i < trigLights.size(); i++)
+		m_matTrigLights[trigLights[i].matIndex].push_back(i);
+
+	m_trigLightWeight = createTrigLightImptSampAccel(trigLights, gltf);
 
 	m_lightBufInfo.trigLightSize = trigLights.size();
+	m_lightBufInfo.trigLightWeight = m_trigLightWeight;
 	if (trigLights.empty()) {  // Cannot be null
 		trigLights.emplace_back(TrigLight{});
 	}
-	if (transforms.empty()) {
-		transforms.emplace_back(nvmath::mat4f{});
+	if (geoms.empty()) {
+		geoms.emplace_back(TrigLightGeom{});
 	}
-	m_buffer[eTrigLights] = m_pAlloc->createBuffer(cmdBuf, trigLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	m_buffer[eTrigLights] = m_pAlloc->createBuffer(cmdBuf, trigLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	m_buffer[eTrigLightGeoms] = m_pAlloc->createBuffer(cmdBuf, geoms, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	NAME_VK(m_buffer[eTrigLights].buffer);
-	// m_buffer[eTrigLightTransforms] = m_pAlloc->createBuffer(cmdBuf, transforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
-	// NAME_VK(m_buffer[eTrigLightTransforms].buffer);
+	NAME_VK(m_buffer[eTrigLightGeoms].buffer);
+	m_trigLights = std::move(trigLights);  // Kept for the re-weighting
+	LOGI(" - Triangle lights: %d, shared triangles: %d", m_lightBufInfo.trigLightSize, geomOffsets.back());
+	timer.print();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -415,60 +488,70 @@ void Scene::createTrigLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene&
 void Scene::createMaterialBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf)
 {
 	LOGI(" - Create %d Material Buffer", gltf.m_materials.size());
-	MilliTimer timer;
+	MilliTimer timer("Materials");
 
 	std::vector<GltfShadeMaterial> shadeMaterials;
 	shadeMaterials.reserve(gltf.m_materials.size());
 	for (auto& m : gltf.m_materials)
-	{
-		GltfShadeMaterial smat{};
-		smat.pbrBaseColorFactor = m.baseColorFactor;
-		smat.pbrBaseColorTexture = m.baseColorTexture;
-		smat.pbrMetallicFactor = m.metallicFactor;
-		smat.pbrRoughnessFactor = m.roughnessFactor;
-		smat.pbrMetallicRoughnessTexture = m.metallicRoughnessTexture;
-		smat.khrDiffuseFactor = m.specularGlossiness.diffuseFactor;
-		smat.khrSpecularFactor = m.specularGlossiness.specularFactor;
-		smat.khrDiffuseTexture = m.specularGlossiness.diffuseTexture;
-		smat.khrGlossinessFactor = m.specularGlossiness.glossinessFactor;
-		smat.khrSpecularGlossinessTexture = m.specularGlossiness.specularGlossinessTexture;
-		smat.shadingModel = m.shadingModel;
-		smat.emissiveTexture = m.emissiveTexture;
-		smat.emissiveFactor = m.emissiveFactor;
-		smat.alphaMode = m.alphaMode;
-		smat.alphaCutoff = m.alphaCutoff;
-		smat.doubleSided = m.doubleSided;
-		smat.normalTexture = m.normalTexture;
-		smat.normalTextureScale = m.normalTextureScale;
-		smat.uvTransform = m.textureTransform.uvTransform;
-		smat.unlit = m.unlit.active;
-		smat.transmissionFactor = m.transmission.factor;
-		smat.transmissionTexture = m.transmission.texture;
-		smat.anisotropy = m.anisotropy.factor;
-		smat.anisotropyDirection = m.anisotropy.direction;
-		smat.ior = m.ior.ior;
-		smat.attenuationColor = m.volume.attenuationColor;
-		smat.thicknessFactor = m.volume.thicknessFactor;
-		smat.thicknessTexture = m.volume.thicknessTexture;
-		smat.attenuationDistance = m.volume.attenuationDistance;
-		smat.clearcoatFactor = m.clearcoat.factor;
-		smat.clearcoatRoughness = m.clearcoat.roughnessFactor;
-		smat.clearcoatTexture = m.clearcoat.texture;
-		smat.clearcoatRoughnessTexture = m.clearcoat.roughnessTexture;
-		smat.sheen = packUnorm4x8(vec4(m.sheen.colorFactor, m.sheen.roughnessFactor));
-
-		shadeMaterials.emplace_back(smat);
-	}
-	m_buffer[eMaterial] = m_pAlloc->createBuffer(cmdBuf, shadeMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		shadeMaterials.emplace_back(shadeMaterial(m));
+	m_buffer[eMaterial] = m_pAlloc->createBuffer(cmdBuf, shadeMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 	NAME_VK(m_buffer[eMaterial].buffer);
 	timer.print();
 }
 
+//--------------------------------------------------------------------------------------------------
+// The material as read by the shaders
+//
+GltfShadeMaterial Scene::shadeMaterial(const nvh::GltfMaterial& m)
+{
+	GltfShadeMaterial smat{};
+	smat.pbrBaseColorFactor = m.baseColorFactor;
+	smat.pbrBaseColorTexture = m.baseColorTexture;
+	smat.pbrMetallicFactor = m.metallicFactor;
+	smat.pbrRoughnessFactor = m.roughnessFactor;
+	smat.pbrMetallicRoughnessTexture = m.metallicRoughnessTexture;
+	smat.khrDiffuseFactor = m.specularGlossiness.diffuseFactor;
+	smat.khrSpecularFactor = m.specularGlossiness.specularFactor;
+	smat.khrDiffuseTexture = m.specularGlossiness.diffuseTexture;
+	smat.khrGlossinessFactor = m.specularGlossiness.glossinessFactor;
+	smat.khrSpecularGlossinessTexture = m.specularGlossiness.specularGlossinessTexture;
+	smat.shadingModel = m.shadingModel;
+	smat.emissiveTexture = m.emissiveTexture;
+	smat.emissiveFactor = m.emissiveFactor;
+	smat.alphaMode = m.alphaMode;
+	smat.alphaCutoff = m.alphaCutoff;
+	smat.doubleSided = m.doubleSided;
+	smat.normalTexture = m.normalTexture;
+	smat.normalTextureScale = m.normalTextureScale;
+	smat.uvTransform = m.textureTransform.uvTransform;
+	smat.unlit = m.unlit.active;
+	smat.transmissionFactor = m.transmission.factor;
+	smat.transmissionTexture = m.transmission.texture;
+	smat.anisotropy = m.anisotropy.factor;
+	smat.anisotropyDirection = m.anisotropy.direction;
+	smat.ior = m.ior.ior;
+	smat.attenuationColor = m.volume.attenuationColor;
+	smat.thicknessFactor = m.volume.thicknessFactor;
+	smat.thicknessTexture = m.volume.thicknessTexture;
+	smat.attenuationDistance = m.volume.attenuationDistance;
+	smat.clearcoatFactor = m.clearcoat.factor;
+	smat.clearcoatRoughness = m.clearcoat.roughnessFactor;
+	smat.clearcoatTexture = m.clearcoat.texture;
+	smat.clearcoatRoughnessTexture = m.clearcoat.roughnessTexture;
+	smat.sheen = packUnorm4x8(vec4(m.sheen.colorFactor, m.sheen.roughnessFactor));
+	return smat;
+}
+
 //--------------------------------------------------------------------------------------------------
 // Destroying all allocated resources
 //
 void Scene::destroy()
 {
+	if (m_reweightJob.valid())  // The worker only reads its own copies
+		m_reweightJob.wait();
+	m_reweightJob = {};
+	m_trigLightsDirty = false;
+	m_dirtyMaterials.clear();
 
 	for (auto& buffer : m_buffer)
 	{
@@ -571,7 +654,8 @@ VkSamplerCreateInfo gltfSamplerToVulkan(tinygltf::Sampler& tsampler)
 void Scene::createTextureImages(VkCommandBuffer cmdBuf, tinygltf::Model& gltfModel)
 {
 	LOGI(" - Create %d Textures, %d Images", gltfModel.textures.size(), gltfModel.images.size());
-	MilliTimer timer;
+	MilliTimer  timer("Textures");
+	MemoryScope memScope(MemCategory::eTextures);
 
 	VkFormat format = VK_FORMAT_B8G8R8A8_UNORM;
 
@@ -615,6 +699,8 @@ void Scene::createTextureImages(VkCommandBuffer cmdBuf, tinygltf::Model& gltfMod
 			continue;
 		}
 
+		MemoryScope imageScope(MemCategory::eTextures,
+			m_sceneName + " " + (gltfimage.uri.empty() ? "image " + std::to_string(i) : gltfimage.uri));
 		void* buffer = &gltfimage.image[0];
 		VkDeviceSize bufferSize = gltfimage.image.size();
 		auto         imgSize = VkExtent2D{ (uint32_t)gltfimage.width, (uint32_t)gltfimage.height };
@@ -669,7 +755,8 @@ void Scene::createTextureImages(VkCommandBuffer cmdBuf, tinygltf::Model& gltfMod
 void Scene::createDescriptorSet(const nvh::GltfScene& gltf)
 {
 	VkShaderStageFlags flag = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
-		| VK_SHADER_STAGE_ANY_HIT_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+		| VK_SHADER_STAGE_ANY_HIT_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
+		| VK_SHADER_STAGE_VERTEX_BIT;
 	auto nb_meshes = static_cast<uint32_t>(gltf.m_primMeshes.size());
 	auto nbTextures = static_cast<uint32_t>(m_textures.size());
 
@@ -680,9 +767,9 @@ void Scene::createDescriptorSet(const nvh::GltfScene& gltf)
 	bind.addBinding({ SceneBindings::eInstData, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
 	bind.addBinding({ SceneBindings::ePuncLights, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
 	bind.addBinding({ SceneBindings::eTrigLights, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
-	// bind.addBinding({ SceneBindings::eTrigLightTransforms, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, flag });
+	bind.addBinding({ SceneBindings::eTrigLightGeoms, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
 	bind.addBinding({ SceneBindings::eLightBufInfo, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, flag });
-	//bind.addBinding({ SceneBindings::eGbuffer, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
+	bind.addBinding({ SceneBindings::eNodeData, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, flag });
 
 	m_descPool = bind.createPool(m_device, 1);
 	CREATE_NAMED_VK(m_descSetLayout, bind.createLayout(m_device));
@@ -704,9 +791,9 @@ void Scene::createDescriptorSet(const nvh::GltfScene& gltf)
 	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eInstData, &dbi[eInstData]));
 	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::ePuncLights, &dbi[ePuncLights]));
 	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eTrigLights, &dbi[eTrigLights]));
-	// writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eTrigLightTransforms, &dbi[eTrigLightTransforms]));
+	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eTrigLightGeoms, &dbi[eTrigLightGeoms]));
 	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eLightBufInfo, &dbi[eLightBufInfo]));
-	//writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eGbuffer, &dbi[eGbuffer]));
+	writes.emplace_back(bind.makeWrite(m_descSet, SceneBindings::eNodeData, &dbi[eNodeData]));
 	writes.emplace_back(bind.makeWriteArray(m_descSet, SceneBindings::eTextures, t_info.data()));
 
 	// Writing the information
@@ -755,37 +842,232 @@ float Scene::computeTrigIntensity(const TrigLight& trig, const nvh::GltfMaterial
 	return intensity;
 }
 
-float Scene::createTrigLightImptSampAccel(std::vector<TrigLight>& trigLights, const nvh::GltfScene& gltf, const tinygltf::Model& gltfModel)
+// The power of a triangle is from its area in world space, with the transform of its instance
+float Scene::createTrigLightImptSampAccel(std::vector<TrigLight>& trigLights, const nvh::GltfScene& gltf)
 {
+	std::vector<CrossTransform> nodeCross(gltf.m_nodes.size());
+	for (size_t nodeIndex = 0; nodeIndex < gltf.m_nodes.size(); nodeIndex++)
+		if (m_trigLightOffsets[nodeIndex + 1] > m_trigLightOffsets[nodeIndex])
+			nodeCross[nodeIndex] = crossTransform(gltf.m_nodes[nodeIndex].worldMatrix);
+
+	m_trigLightPower.resize(trigLights.size());
+	parallelRanges(trigLights.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			m_trigLightPower[i] = trigLightPower(trigLights[i], nodeCross[trigLights[i].transformIndex], gltf);
+		});
+
 	float total_weight{ 0.f };
-	std::vector<float> distrib;
-	distrib.reserve(trigLights.size());
-	for (auto& trig : trigLights) {
-		nvh::GltfMaterial mtl = gltf.m_materials[trig.matIndex];
-		float power;
-		
-		if (mtl.emissiveTexture > -1) {
-			//TODO
-			power = luminance(mtl.emissiveFactor);
-		}
-		else power = luminance(mtl.emissiveFactor);
-		distrib.push_back(power);
+	for (float power : m_trigLightPower)
 		total_weight += power;
+
+	std::vector<ImptSampData> impSamp = trigLightAliasTable(m_trigLightPower, total_weight);
+	for (size_t i = 0; i < trigLights.size(); i++)
+		trigLights[i].impSamp = impSamp[i];
+
+	return total_weight;
+}
+
+float Scene::trigLightPower(const TrigLight& trig, const CrossTransform& worldCross, const nvh::GltfScene& gltf) const
+{
+	const nvh::GltfMaterial& mtl = gltf.m_materials[trig.matIndex];
+	float power;
+
+	if (mtl.emissiveTexture > -1) {
+		//TODO
+		power = luminance(mtl.emissiveFactor);
 	}
+	else power = luminance(mtl.emissiveFactor);
+	if (power <= 1e-2f)  // Not a light for TrigLightPdf in pathtrace.glsl
+		return 0.f;
 
-	DiscreteSampler1D<float> aliasTable(distrib);
+	// Emitted power, both sides of the triangle emit (see TrigLightPdf in pathtrace.glsl)
+	return power * trigLightArea(m_trigLightCross[trig.geomIndex], worldCross) * 3.1416f * 2.f;
+}
 
-	for (size_t i = 0; i < trigLights.size(); i++)
+// Only reads its arguments: it also runs on the worker of uploadChanges
+std::vector<ImptSampData> Scene::trigLightAliasTable(const std::vector<float>& power, float totalWeight)
+{
+	std::vector<ImptSampData> impSamp(power.size(), ImptSampData{});
+	if (totalWeight <= 0.f)  // Every emitter is off, the triangle lights are never picked
+		return impSamp;
+
+	DiscreteSampler1D<float> aliasTable(power);
+	for (size_t i = 0; i < power.size(); i++)
 	{
-		auto& alias = trigLights[i].impSamp;
+		auto& alias = impSamp[i];
 		auto& table = aliasTable.binomDistribs[i];
 		alias.alias = table.failId;
 		alias.q = table.prob;
-		alias.pdf = distrib[i] / total_weight;
-		alias.aliasPdf = distrib[table.failId] / total_weight;
+		alias.pdf = power[i] / totalWeight;
+		alias.aliasPdf = power[table.failId] / totalWeight;
 	}
+	return impSamp;
+}
 
-	return total_weight;
+//--------------------------------------------------------------------------------------------------
+// The cross product of two transformed edges is the cofactor matrix of the transform applied to the
+// cross product of the object space edges: (A*e1)x(A*e2) = cof(A)*(e1 x e2). Its columns are the
+// cross products of the columns of A, computed once per instance; the area of each triangle of the
+// instance is then one 3x3 product of its object space cross product, kept in m_trigLightCross.
+//
+Scene::CrossTransform Scene::crossTransform(const nvmath::mat4f& worldMatrix)
+{
+	nvmath::vec3f a0(worldMatrix * nvmath::vec4f(1.f, 0.f, 0.f, 0.f));
+	nvmath::vec3f a1(worldMatrix * nvmath::vec4f(0.f, 1.f, 0.f, 0.f));
+	nvmath::vec3f a2(worldMatrix * nvmath::vec4f(0.f, 0.f, 1.f, 0.f));
+	return { nvmath::cross(a1, a2), nvmath::cross(a2, a0), nvmath::cross(a0, a1) };
+}
+
+float Scene::trigLightArea(const nvmath::vec3f& objectCross, const CrossTransform& worldCross)
+{
+	nvmath::vec3f c = worldCross[0] * objectCross.x + worldCross[1] * objectCross.y + worldCross[2] * objectCross.z;
+	return nvmath::length(c) * 0.5f;
+}
+
+void Scene::setTrigSampProb()
+{
+	float total = m_trigLightWeight + m_puncLightWeight;
+	m_lightBufInfo.trigSampProb = total > 0.f ? m_trigLightWeight / total : 0.f;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Moving an instance: its NodeData, and the ones of its simplified meshes, are updated. The
+// triangle lights of the instance are in object space, they follow. Only when the transform
+// changes their area (scale), their power is computed again and the alias table is rebuilt by
+// uploadChanges.
+// The acceleration structure is not updated here.
+//
+void Scene::setNodeTransform(const VkCommandBuffer& cmdBuf, uint32_t nodeIndex, const nvmath::mat4f& worldMatrix)
+{
+	auto& node = m_gltf.m_nodes[nodeIndex];
+	node.worldMatrix = worldMatrix;
+
+	NodeData data = makeNodeData(worldMatrix, node.primMesh);
+	updateBuffer(cmdBuf, m_buffer[eNodeData].buffer, sizeof(NodeData) * nodeIndex, sizeof(NodeData), &data);
+
+	// Its simplified meshes
+	const auto& lodInstances = m_meshLod.getInstances();
+	const auto& nodeInstances = m_meshLod.getNodeInstances();
+	for (uint32_t i = nodeInstances[nodeIndex]; i < nodeInstances[nodeIndex + 1]; i++)
+	{
+		data = makeNodeData(worldMatrix, lodInstances[i].primMesh);
+		size_t instanceIndex = m_gltf.m_nodes.size() + i;
+		updateBuffer(cmdBuf, m_buffer[eNodeData].buffer, sizeof(NodeData) * instanceIndex, sizeof(NodeData), &data);
+	}
+
+	CrossTransform worldCross = crossTransform(worldMatrix);
+	for (uint32_t i = m_trigLightOffsets[nodeIndex]; i < m_trigLightOffsets[nodeIndex + 1]; i++)
+		reweightTrigLight(i, worldCross);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The material was edited in m_gltf: its entry is uploaded at the next uploadChanges, and the power
+// of its triangle lights computed again. A material which was not emissive at load has no
+// triangle lights, its emission is only found by the BSDF rays.
+//
+void Scene::updateMaterial(uint32_t matIndex)
+{
+	if (std::find(m_dirtyMaterials.begin(), m_dirtyMaterials.end(), matIndex) == m_dirtyMaterials.end())
+		m_dirtyMaterials.push_back(matIndex);
+
+	uint32_t       nodeIndex = ~0u;
+	CrossTransform worldCross;
+	for (uint32_t i : m_matTrigLights[matIndex])
+	{
+		if (m_trigLights[i].transformIndex != nodeIndex)  // The lights of an instance are contiguous
+		{
+			nodeIndex = m_trigLights[i].transformIndex;
+			worldCross = crossTransform(m_gltf.m_nodes[nodeIndex].worldMatrix);
+		}
+		reweightTrigLight(i, worldCross);
+	}
+}
+
+bool Scene::isTrigLightMaterial(uint32_t matIndex) const
+{
+	return matIndex < m_matTrigLights.size() && !m_matTrigLights[matIndex].empty();
+}
+
+void Scene::reweightTrigLight(uint32_t trigIndex, const CrossTransform& worldCross)
+{
+	float power = trigLightPower(m_trigLights[trigIndex], worldCross, m_gltf);
+	float before = m_trigLightPower[trigIndex];
+	if (std::abs(power - before) > 1e-4f * before)
+	{
+		m_trigLightPower[trigIndex] = power;
+		m_trigLightsDirty = true;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called at each frame: uploads the edited materials, only their entries, and the triangle lights
+// once the worker has rebuilt their alias table. The table is built again from all the powers, but
+// only the changed ones were computed. Returns true when the light sampling changed.
+//
+bool Scene::uploadChanges(const VkCommandBuffer& cmdBuf)
+{
+	for (uint32_t matIndex : m_dirtyMaterials)
+	{
+		GltfShadeMaterial smat = shadeMaterial(m_gltf.m_materials[matIndex]);
+		updateBuffer(cmdBuf, m_buffer[eMaterial].buffer, sizeof(GltfShadeMaterial) * matIndex, sizeof(GltfShadeMaterial), &smat);
+	}
+	m_dirtyMaterials.clear();
+
+	bool uploaded = false;
+	if (m_reweightJob.valid() && m_reweightJob.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		std::vector<ImptSampData> impSamp = m_reweightJob.get();
+		for (size_t i = 0; i < impSamp.size(); i++)
+			m_trigLights[i].impSamp = impSamp[i];
+		m_trigLightWeight = m_reweightWeight;
+		m_lightBufInfo.trigLightWeight = m_trigLightWeight;
+		setTrigSampProb();
+		updateBuffer(cmdBuf, m_buffer[eTrigLights].buffer, 0, sizeof(TrigLight) * m_trigLights.size(), m_trigLights.data());
+		updateBuffer(cmdBuf, m_buffer[eLightBufInfo].buffer, 0, sizeof(LightBufInfo), &m_lightBufInfo);
+		uploaded = true;
+	}
+
+	// One rebuild at a time, the changes made meanwhile start the next one
+	if (m_trigLightsDirty && !m_reweightJob.valid())
+	{
+		m_trigLightsDirty = false;
+		m_reweightWeight = 0.f;
+		for (float power : m_trigLightPower)
+			m_reweightWeight += power;
+		m_reweightJob = std::async(std::launch::async, [power = m_trigLightPower, total = m_reweightWeight]() {
+			TraceRecorder::get().setThreadName("Light re-weighting");
+			TRACE_SCOPE("Triangle lights alias table");
+			return trigLightAliasTable(power, total);
+		});
+	}
+	return uploaded;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Scene buffer updated in the command buffer, by pieces of the vkCmdUpdateBuffer limit. The
+// barriers order it after the shaders of the previous frames, and before the next ones.
+//
+void Scene::updateBuffer(const VkCommandBuffer& cmdBuf, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const void* data)
+{
+	const VkPipelineStageFlags shaders = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+		| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+	VkBufferMemoryBarrier barrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.buffer = buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+	vkCmdPipelineBarrier(cmdBuf, shaders, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+	const VkDeviceSize maxUpdate = 65536;
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (VkDeviceSize done = 0; done < size; done += maxUpdate)
+		vkCmdUpdateBuffer(cmdBuf, buffer, offset + done, std::min(maxUpdate, size - done), bytes + done);
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, shaders, 0, 0, nullptr, 1, &barrier, 0, nullptr);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -25,12 +25,15 @@
  // - Creates the buffers and descriptor set for the scene
 
 
+#include <future>
 #include <string>
 
 #include "nvh/gltfscene.hpp"
 #include "nvvk/resourceallocator_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
+#include "displacement.hpp"
+#include "mesh_lod.hpp"
 #include "queue.hpp"
 
 
@@ -44,9 +47,9 @@ public:
 		eInstData,
 		ePuncLights,
 		eTrigLights,
-		// eTrigLightTransforms,
 		eLightBufInfo,
-		//eGbuffer
+		eNodeData,
+		eTrigLightGeoms,
 	};
 
 
@@ -61,29 +64,41 @@ public:
 	bool load(const std::string& filename);
 
 	void createInstanceDataBuffer(VkCommandBuffer cmdBuf, nvh::GltfScene& gltf);
+	void createNodeDataBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
 	void createVertexBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
 	void setCameraFromScene(const std::string& filename, const nvh::GltfScene& gltf);
 	bool loadGltfScene(const std::string& filename, tinygltf::Model& tmodel);
 	void createPuncLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
-	void createTrigLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf, const tinygltf::Model& gltfModel);
+	void createTrigLightBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
 	void createMaterialBuffer(VkCommandBuffer cmdBuf, const nvh::GltfScene& gltf);
 	void destroy();
 	void updateCamera(const VkCommandBuffer& cmdBuf, float aspectRatio);
+	void setNodeTransform(const VkCommandBuffer& cmdBuf, uint32_t nodeIndex, const nvmath::mat4f& worldMatrix);
+	void updateMaterial(uint32_t matIndex);  // After editing getScene().m_materials[matIndex]
+	bool uploadChanges(const VkCommandBuffer& cmdBuf);
+	bool isTrigLightMaterial(uint32_t matIndex) const;
 
 
 	VkDescriptorSetLayout            getDescLayout() { return m_descSetLayout; }
 	VkDescriptorSet                  getDescSet() { return m_descSet; }
 	nvh::GltfScene& getScene() { return m_gltf; }
 	nvh::GltfStats& getStat() { return m_stats; }
+	Displacement& getDisplacement() { return m_displacement; }
+	MeshLod& getMeshLod() { return m_meshLod; }
 	const std::vector<nvvk::Buffer>& getBuffers(EBuffers b) { return m_buffers[b]; }
 	const std::string& getSceneName() const { return m_sceneName; }
 	SceneCamera& getCamera() { return m_camera; }
 private:
 	void createTextureImages(VkCommandBuffer cmdBuf, tinygltf::Model& gltfModel);
 	void createDescriptorSet(const nvh::GltfScene& gltf);
+	void updateBuffer(const VkCommandBuffer& cmdBuf, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const void* data);
+	static GltfShadeMaterial shadeMaterial(const nvh::GltfMaterial& m);
+	static NodeData makeNodeData(const nvmath::mat4f& worldMatrix, uint32_t primMesh);
 
 	nvh::GltfScene m_gltf;
 	nvh::GltfStats m_stats;
+	Displacement   m_displacement;
+	MeshLod        m_meshLod;
 
 	std::string m_sceneName;
 	SceneCamera m_camera{};
@@ -95,7 +110,7 @@ private:
 	nvvk::Queue              m_queue;
 
 	// Resources
-	std::array<nvvk::Buffer, 6>                            m_buffer;           // For single buffer
+	std::array<nvvk::Buffer, 8>                            m_buffer;           // For single buffer
 	std::array<std::vector<nvvk::Buffer>, 2>               m_buffers;          // For array of buffers (vertex/index)
 	std::vector<nvvk::Texture>                             m_textures;         // vector of all textures of the scene
 	std::vector<std::pair<nvvk::Image, VkImageCreateInfo>> m_images;           // vector of all images of the scene
@@ -107,9 +122,27 @@ private:
 	VkDescriptorSet       m_descSet{ VK_NULL_HANDLE };
 
 	// Direct light importance sampling
-	LightBufInfo m_lightBufInfo;
+	LightBufInfo m_lightBufInfo{};
 	float m_puncLightWeight{ 0.f }, m_trigLightWeight{ 0.f };
 	float createPuncLightImptSampAccel(std::vector<PuncLight>& puncLights, const nvh::GltfScene& gltf);
-	float createTrigLightImptSampAccel(std::vector<TrigLight>& trigLights, const nvh::GltfScene& gltf, const tinygltf::Model& gltfModel);
+	float createTrigLightImptSampAccel(std::vector<TrigLight>& trigLights, const nvh::GltfScene& gltf);
+	using CrossTransform = std::array<nvmath::vec3f, 3>;  // Cofactor columns, see crossTransform
+	static CrossTransform crossTransform(const nvmath::mat4f& worldMatrix);
+	static float trigLightArea(const nvmath::vec3f& objectCross, const CrossTransform& worldCross);
+	float trigLightPower(const TrigLight& trig, const CrossTransform& worldCross, const nvh::GltfScene& gltf) const;
+	static std::vector<ImptSampData> trigLightAliasTable(const std::vector<float>& power, float totalWeight);
+	void setTrigSampProb();
+	void reweightTrigLight(uint32_t trigIndex, const CrossTransform& worldCross);
+	std::vector<TrigLight>     m_trigLights;        // Copy of the buffer, one per instance
+	std::vector<uint32_t>      m_trigLightOffsets;  // First triangle light of each node, then the count
+	std::vector<float>         m_trigLightPower;    // Weights of the alias table, kept up to date
+	std::vector<nvmath::vec3f> m_trigLightCross;    // Object space edge cross product of each TrigLightGeom
+
+	// Live edits, uploaded by uploadChanges
+	std::vector<std::vector<uint32_t>>     m_matTrigLights;   // Triangle lights of each material
+	std::vector<uint32_t>                  m_dirtyMaterials;
+	bool                                   m_trigLightsDirty{ false };
+	std::future<std::vector<ImptSampData>> m_reweightJob;     // Alias table built on a worker
+	float                                  m_reweightWeight{ 0.f };
 	float computeTrigIntensity(const TrigLight& trig, const nvh::GltfMaterial& mtl, const tinygltf::Model& gltfModel);
 };
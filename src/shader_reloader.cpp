@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Runtime compilation of the shaders for the development mode, see shader_reloader.hpp
+ */
+
+
+#include "shader_reloader.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#if defined(NVP_SUPPORTS_SHADERC)
+#include <shaderc/shaderc.hpp>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+bool readFile(const fs::path& path, std::string& content)
+{
+  std::ifstream in(path, std::ios::binary);
+  if(!in)
+    return false;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  content = ss.str();
+  return true;
+}
+
+#if defined(NVP_SUPPORTS_SHADERC)
+// Resolves #include from the folder of the including file, then from the shader folder, and
+// records the files read: the dependencies of the shader.
+class Includer : public shaderc::CompileOptions::IncluderInterface
+{
+public:
+  Includer(const fs::path& directory, std::set<std::string>& files)
+      : m_directory(directory)
+      , m_files(files)
+  {
+  }
+
+  shaderc_include_result* GetInclude(const char* requested, shaderc_include_type type, const char* requesting, size_t /*depth*/) override
+  {
+    auto*    include = new Include;
+    fs::path path    = m_directory / requested;
+    if(type == shaderc_include_type_relative && fs::exists(fs::path(requesting).parent_path() / requested))
+      path = fs::path(requesting).parent_path() / requested;
+
+    if(readFile(path, include->content))
+    {
+      include->name = path.string();
+      m_files.insert(path.filename().string());
+    }
+    else
+      include->content = std::string("cannot open ") + requested;  // Empty name: error
+
+    include->result = {include->name.data(), include->name.size(), include->content.data(), include->content.size(), include};
+    return &include->result;
+  }
+
+  void ReleaseInclude(shaderc_include_result* data) override { delete static_cast<Include*>(data->user_data); }
+
+private:
+  struct Include
+  {
+    shaderc_include_result result;
+    std::string            name;
+    std::string            content;
+  };
+  fs::path               m_directory;
+  std::set<std::string>& m_files;
+};
+
+bool shaderKind(const std::string& extension, shaderc_shader_kind& kind)
+{
+  static const std::map<std::string, shaderc_shader_kind> kinds = {
+      {".comp", shaderc_glsl_compute_shader},   {".vert", shaderc_glsl_vertex_shader},
+      {".frag", shaderc_glsl_fragment_shader},  {".rgen", shaderc_glsl_raygen_shader},
+      {".rchit", shaderc_glsl_closesthit_shader}, {".rahit", shaderc_glsl_anyhit_shader},
+      {".rmiss", shaderc_glsl_miss_shader},
+  };
+  auto it = kinds.find(extension);
+  if(it == kinds.end())
+    return false;
+  kind = it->second;
+  return true;
+}
+#else
+// Files included by the source, recursively, for the dependencies of the shader
+void collectIncludes(const fs::path& directory, const fs::path& path, std::set<std::string>& files)
+{
+  std::ifstream in(path);
+  std::string   line;
+  while(std::getline(in, line))
+  {
+    size_t pos = line.find("#include");
+    if(pos == std::string::npos || line.find_first_not_of(" \t") != pos)
+      continue;
+    size_t open  = line.find('"', pos);
+    size_t close = line.find('"', open + 1);
+    if(open == std::string::npos || close == std::string::npos)
+      continue;
+    std::string name = line.substr(open + 1, close - open - 1);
+    if(files.insert(fs::path(name).filename().string()).second)
+      collectIncludes(directory, directory / name, files);
+  }
+}
+#endif
+}  // namespace
+
+
+ShaderReloader& ShaderReloader::get()
+{
+  static ShaderReloader reloader;
+  return reloader;
+}
+
+ShaderReloader::~ShaderReloader()
+{
+  stop();
+}
+
+void ShaderReloader::setDirectory(const std::string& shaderDir)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_directory        = shaderDir;
+  m_status.directory = shaderDir;
+#if defined(NVP_SUPPORTS_SHADERC)
+  m_status.compiler = "shaderc";
+#else
+  m_status.compiler = "glslangValidator";
+#endif
+}
+
+void ShaderReloader::start(int intervalMs)
+{
+  if(m_running || m_directory.empty())
+    return;
+  m_intervalMs = intervalMs;
+  m_running    = true;
+  m_thread     = std::thread(&ShaderReloader::run, this);
+  LOGI("Watching shaders in %s (%s)\n", m_directory.c_str(), m_status.compiler.c_str());
+}
+
+void ShaderReloader::stop()
+{
+  if(!m_running)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(m_wakeMutex);
+    m_running = false;
+  }
+  m_wake.notify_all();
+  m_thread.join();
+}
+
+void ShaderReloader::requestRebuild()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_wakeMutex);
+    m_rebuild = true;
+  }
+  m_wake.notify_all();
+}
+
+std::vector<std::string> ShaderReloader::takeCompiled()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<std::string>    names;
+  for(auto& shader : m_pending)
+  {
+    names.push_back(shader.first);
+    m_active[shader.first] = std::move(shader.second);
+  }
+  m_pending.clear();
+  return names;
+}
+
+std::vector<uint32_t> ShaderReloader::code(const std::string& name, const uint32_t* embedded, size_t embeddedSize)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_used.insert(name);
+  auto it = m_active.find(name);
+  if(it != m_active.end())
+    return it->second;
+  return std::vector<uint32_t>(embedded, embedded + embeddedSize / sizeof(uint32_t));
+}
+
+ShaderReloader::Status ShaderReloader::getStatus()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_status;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Files of the shader folder modified since the last scan. The first scan only takes the times.
+//
+bool ShaderReloader::scan(std::set<std::string>& changed)
+{
+  const bool      first = m_times.empty();
+  std::error_code ec;
+  for(auto& entry : fs::directory_iterator(m_directory, ec))
+  {
+    if(!entry.is_regular_file(ec))
+      continue;
+    std::string name = entry.path().filename().string();
+    FileTime    time = entry.last_write_time(ec);
+    if(ec)
+      continue;  // Being replaced by the editor, seen on the next scan
+    auto it = m_times.find(name);
+    if(it == m_times.end() || it->second != time)
+    {
+      m_times[name] = time;
+      if(!first)
+        changed.insert(name);
+    }
+  }
+  return !changed.empty();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Polling the folder and compiling the shaders depending on the changed files
+//
+void ShaderReloader::run()
+{
+  TraceRecorder::get().setThreadName("Shader compiler");
+
+  std::set<std::string> changed;
+  scan(changed);
+
+  while(m_running)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_wakeMutex);
+      m_wake.wait_for(lock, std::chrono::milliseconds(m_intervalMs), [&] { return !m_running || m_rebuild; });
+    }
+    if(!m_running)
+      break;
+
+    changed.clear();
+    const bool rebuild = m_rebuild.exchange(false);
+    if(!scan(changed) && !rebuild)
+      continue;
+    // Editors can save in several writes
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    scan(changed);
+
+    // Shaders depending on the changed files, all of them if not compiled yet (unknown includes)
+    std::vector<std::string> names;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for(const auto& name : m_used)
+      {
+        auto deps  = m_includes.find(name);
+        bool dirty = rebuild || deps == m_includes.end() || changed.count(name) > 0;
+        for(auto it = changed.begin(); !dirty && it != changed.end(); ++it)
+          dirty = deps->second.count(*it) > 0;
+        if(dirty)
+          names.push_back(name);
+      }
+    }
+    if(names.empty())
+      continue;
+
+    TRACE_SCOPE("Compile shaders");
+    auto start = std::chrono::steady_clock::now();
+
+    std::map<std::string, std::vector<uint32_t>> batch;
+    std::string                                  errors;
+    for(const auto& name : names)
+    {
+      std::vector<uint32_t> spirv;
+      std::set<std::string> includes;
+      std::string           error;
+      if(compile(name, spirv, includes, error))
+      {
+        batch[name]      = std::move(spirv);
+        m_includes[name] = std::move(includes);
+      }
+      else
+        errors += name + ":\n" + error + "\n";
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_status.lastMs = ms;
+    if(errors.empty())
+    {
+      for(auto& shader : batch)
+        m_pending[shader.first] = std::move(shader.second);
+      m_status.batches++;
+      m_status.error.clear();
+      LOGI("Shaders recompiled: %zu in %.0f ms\n", batch.size(), ms);
+    }
+    else
+    {
+      // Nothing published: the pipelines keep the code that compiled
+      m_status.error = errors;
+      LOGE("Shader compilation failed, keeping the current pipelines\n%s", errors.c_str());
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// GLSL to SPIR-V, same target as the build (VULKAN_TARGET in CMakeLists.txt)
+//
+bool ShaderReloader::compile(const std::string& name, std::vector<uint32_t>& spirv, std::set<std::string>& includes, std::string& error)
+{
+  fs::path path = fs::path(m_directory) / name;
+  includes.insert(name);
+
+#if defined(NVP_SUPPORTS_SHADERC)
+  shaderc_shader_kind kind;
+  if(!shaderKind(path.extension().string(), kind))
+  {
+    error = "unknown shader stage";
+    return false;
+  }
+  std::string source;
+  if(!readFile(path, source))
+  {
+    error = "cannot read " + path.string();
+    return false;
+  }
+
+  shaderc::CompileOptions options;
+  options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
+  options.SetIncluder(std::make_unique<Includer>(fs::path(m_directory), includes));
+
+  shaderc::Compiler             compiler;
+  shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source, kind, path.string().c_str(), options);
+  if(result.GetCompilationStatus() != shaderc_compilation_status_success)
+  {
+    error = result.GetErrorMessage();
+    return false;
+  }
+  spirv.assign(result.cbegin(), result.cend());
+  return true;
+#else
+  collectIncludes(fs::path(m_directory), path, includes);
+
+  // glslangValidator of the Vulkan SDK, or the one in the PATH
+  std::string exe = "glslangValidator";
+  if(const char* sdk = std::getenv("VULKAN_SDK"))
+  {
+#ifdef _WIN32
+    fs::path sdkExe = fs::path(sdk) / "Bin" / "glslangValidator.exe";
+#else
+    fs::path sdkExe = fs::path(sdk) / "bin" / "glslangValidator";
+#endif
+    if(fs::exists(sdkExe))
+      exe = sdkExe.string();
+  }
+
+  fs::path    output  = fs::temp_directory_path() / (name + ".spv");
+  fs::path    log     = fs::temp_directory_path() / (name + ".log");
+  std::string command = "\"" + exe + "\" -V --target-env vulkan1.2 -o \"" + output.string() + "\" \"" + path.string()
+                        + "\" > \"" + log.string() + "\" 2>&1";
+#ifdef _WIN32
+  command = "\"" + command + "\"";  // cmd.exe strips the outer quotes
+#endif
+  if(std::system(command.c_str()) != 0)
+  {
+    if(!readFile(log, error) || error.empty())
+      error = "cannot run " + exe;
+    return false;
+  }
+
+  std::string binary;
+  if(!readFile(output, binary) || binary.empty() || binary.size() % sizeof(uint32_t) != 0)
+  {
+    error = "cannot read " + output.string();
+    return false;
+  }
+  spirv.resize(binary.size() / sizeof(uint32_t));
+  memcpy(spirv.data(), binary.data(), binary.size());
+  return true;
+#endif
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+// Development mode recompiling the GLSL shaders while the application runs
+// - A worker thread polls the modification time of the files in shaders/ and recompiles the
+//   shaders depending on the changed files, with shaderc when available, otherwise with the
+//   glslangValidator of the Vulkan SDK.
+// - A batch of shaders is only published when all of them compiled: on error, the log has the
+//   message and the current pipelines stay.
+// - takeCompiled() is called at a frame boundary: the pipelines are then recreated, their code
+//   coming from code(), which falls back to the SPIR-V embedded at build time (autogen/).
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+class ShaderReloader
+{
+public:
+  static ShaderReloader& get();
+  ~ShaderReloader();
+
+  void setDirectory(const std::string& shaderDir);  // Folder of the GLSL sources
+  void start(int intervalMs = 250);
+  void stop();
+  bool isRunning() const { return m_running; }
+  void requestRebuild();  // Recompiles all used shaders, changed or not
+
+  // Names (ex. "pathtrace.comp") of the shaders compiled since the last call, their new code
+  // is then returned by code(). Only at a frame boundary, nothing using the old pipelines.
+  std::vector<std::string> takeCompiled();
+
+  // SPIR-V of the shader: the last compiled one, or the embedded code. The name is remembered
+  // as used by a pipeline, only the used shaders are recompiled.
+  std::vector<uint32_t> code(const std::string& name, const uint32_t* embedded, size_t embeddedSize);
+
+  struct Status
+  {
+    std::string directory;
+    std::string compiler;
+    std::string error;          // Message of the last failed batch, empty if it compiled
+    int         batches{0};     // Batches published
+    double      lastMs{0};      // Duration of the last batch
+  };
+  Status getStatus();
+
+private:
+  ShaderReloader() = default;
+  void run();
+  bool scan(std::set<std::string>& changed);
+  bool compile(const std::string& name, std::vector<uint32_t>& spirv, std::set<std::string>& includes, std::string& error);
+
+  using FileTime = std::filesystem::file_time_type;
+
+  std::thread             m_thread;
+  std::atomic<bool>       m_running{false};
+  std::atomic<bool>       m_rebuild{false};
+  std::mutex              m_wakeMutex;
+  std::condition_variable m_wake;
+  int                     m_intervalMs{250};
+
+  std::mutex                                    m_mutex;
+  std::string                                   m_directory;
+  std::set<std::string>                         m_used;      // Shaders of the pipelines
+  std::map<std::string, std::vector<uint32_t>>  m_pending;   // Compiled, not yet taken
+  std::map<std::string, std::vector<uint32_t>>  m_active;    // Taken, used by the pipelines
+  Status                                        m_status;
+
+  // Worker thread only
+  std::map<std::string, FileTime>              m_times;
+  std::map<std::string, std::set<std::string>> m_includes;  // Files read by each shader
+};
@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Background sampling of the CPU, GPU and memory load, see system_monitor.hpp
+ */
+
+
+#include "system_monitor.hpp"
+#include "nvh/nvprint.hpp"
+#include "trace_recorder.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#if defined(NVP_SUPPORTS_NVML)
+#include "nvml_monitor.hpp"
+#else
+class NvmlMonitor
+{
+};
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "Psapi.lib")
+#else
+#include <unistd.h>
+#endif
+
+
+namespace {
+bool readInt64(const std::string& path, int64_t& value)
+{
+  if(path.empty())
+    return false;
+  std::ifstream in(path);
+  return static_cast<bool>(in >> value);
+}
+}  // namespace
+
+
+SystemMonitor::SystemMonitor() = default;
+
+SystemMonitor::~SystemMonitor()
+{
+  stop();
+}
+
+void SystemMonitor::start(VkPhysicalDevice physicalDevice, uint32_t intervalMs)
+{
+  if(isRunning())
+    return;
+
+  m_physicalDevice = physicalDevice;
+  m_intervalMs     = std::max(intervalMs, 10u);
+  m_start          = std::chrono::steady_clock::now();
+  m_quit           = false;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  m_gpuName = properties.deviceName;
+
+  uint32_t nbExtensions = 0;
+  vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &nbExtensions, nullptr);
+  std::vector<VkExtensionProperties> extensions(nbExtensions);
+  vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &nbExtensions, extensions.data());
+  m_hasBudget = std::any_of(extensions.begin(), extensions.end(), [](const VkExtensionProperties& e) {
+    return strcmp(e.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0;
+  });
+
+  // The names are set before the thread starts and not changed after
+#if defined(NVP_SUPPORTS_NVML)
+  if(!m_nvml)
+    m_nvml = std::make_unique<NvmlMonitor>(0, 2);  // Sampling on each refresh
+  if(m_nvml->isValid() && m_nvml->nbGpu() > 0)
+  {
+    m_gpuName       = m_nvml->getInfo(0).name;
+    m_gpuSource     = "NVML";
+    m_driverVersion = m_nvml->getSysInfo().driverVersion;
+  }
+#endif
+  if(m_gpuSource.empty())
+    findSysfsGpu();
+  m_thread = std::thread(&SystemMonitor::worker, this);
+}
+
+void SystemMonitor::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_cond.notify_all();
+  if(m_thread.joinable())
+    m_thread.join();
+}
+
+void SystemMonitor::since(std::chrono::steady_clock::time_point time, std::vector<SystemSample>& samples) const
+{
+  double fromMs = std::chrono::duration<double, std::milli>(time - m_start).count();
+  m_samples.latest(samples, kHistory);
+  samples.erase(std::remove_if(samples.begin(), samples.end(), [&](const SystemSample& s) { return s.timeMs < fromMs; }),
+                samples.end());
+}
+
+void SystemMonitor::worker()
+{
+  TraceRecorder::get().setThreadName("System monitor");
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while(!m_quit)
+  {
+    lock.unlock();
+    SystemSample s;
+    sample(s);
+    m_samples.push(s);
+
+    auto& trace = TraceRecorder::get();
+    if(s.cpuLoad >= 0)
+      trace.addCounter("CPU load %", s.cpuLoad);
+    if(s.gpuLoad >= 0)
+      trace.addCounter("GPU load %", s.gpuLoad);
+    if(s.processRss >= 0)
+      trace.addCounter("Process RSS MB", s.processRss / double(1 << 20));
+    if(s.heapUsage >= 0)
+      trace.addCounter("Device heap MB", s.heapUsage / double(1 << 20));
+
+    lock.lock();
+    m_cond.wait_for(lock, std::chrono::milliseconds(m_intervalMs), [&] { return m_quit; });
+  }
+}
+
+void SystemMonitor::sample(SystemSample& s)
+{
+  s.timeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+  sampleCpu(s);
+  sampleProcess(s);
+  sampleGpu(s);
+  sampleHeaps(s);
+}
+
+//--------------------------------------------------------------------------------------------------
+// CPU load between this sample and the previous one
+//
+void SystemMonitor::sampleCpu(SystemSample& s)
+{
+  std::vector<uint64_t> total, idle;  // Entry 0 is all cores
+#ifdef _WIN32
+  FILETIME idleTime, kernelTime, userTime;
+  if(!GetSystemTimes(&idleTime, &kernelTime, &userTime))
+    return;
+  auto toInt64 = [](const FILETIME& ft) { return (uint64_t(ft.dwHighDateTime) << 32) | uint64_t(ft.dwLowDateTime); };
+  total.push_back(toInt64(kernelTime) + toInt64(userTime));  // Kernel time includes the idle time
+  idle.push_back(toInt64(idleTime));
+#else
+  std::ifstream in("/proc/stat");
+  std::string   line;
+  while(std::getline(in, line) && line.compare(0, 3, "cpu") == 0)
+  {
+    std::istringstream ss(line);
+    std::string        name;
+    uint64_t           user = 0, nice = 0, system = 0, idleTicks = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    ss >> name >> user >> nice >> system >> idleTicks >> iowait >> irq >> softirq >> steal;
+    total.push_back(user + nice + system + idleTicks + iowait + irq + softirq + steal);
+    idle.push_back(idleTicks + iowait);
+  }
+#endif
+  if(total.empty())
+    return;
+
+  if(m_cpuTotal.size() == total.size())
+  {
+    auto load = [&](size_t i) {
+      uint64_t dt = total[i] - m_cpuTotal[i];
+      uint64_t di = idle[i] - m_cpuIdle[i];
+      return dt > 0 ? 100.f * (1.f - float(di) / float(dt)) : 0.f;
+    };
+    s.cpuLoad = load(0);
+    s.nbCores = static_cast<uint32_t>(std::min<size_t>(total.size() - 1, SystemSample::kMaxCores));
+    for(uint32_t c = 0; c < s.nbCores; c++)
+      s.coreLoad[c] = load(c + 1);
+  }
+  m_cpuTotal = std::move(total);
+  m_cpuIdle  = std::move(idle);
+}
+
+void SystemMonitor::sampleProcess(SystemSample& s)
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters{};
+  if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    s.processRss = static_cast<int64_t>(counters.WorkingSetSize);
+#else
+  std::ifstream in("/proc/self/statm");
+  int64_t       size = 0, resident = 0;
+  if(in >> size >> resident)
+    s.processRss = resident * static_cast<int64_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// The first DRM card exposing a load or a memory usage, and its hwmon sensors
+//
+void SystemMonitor::findSysfsGpu()
+{
+#ifndef _WIN32
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  for(auto& card : fs::directory_iterator("/sys/class/drm", ec))
+  {
+    std::string name = card.path().filename().string();
+    if(name.compare(0, 4, "card") != 0 || name.find('-') != std::string::npos)
+      continue;  // Connectors are named card0-DP-1, ...
+
+    fs::path device = card.path() / "device";
+    auto     file   = [&](const fs::path& p) { return fs::exists(p, ec) ? p.string() : std::string(); };
+    m_sysBusy       = file(device / "gpu_busy_percent");
+    m_sysMemUsed    = file(device / "mem_info_vram_used");
+    m_sysMemTotal   = file(device / "mem_info_vram_total");
+    if(m_sysBusy.empty() && m_sysMemUsed.empty())
+      continue;
+
+    for(auto& hwmon : fs::directory_iterator(device / "hwmon", ec))
+    {
+      m_sysTemperature = file(hwmon.path() / "temp1_input");
+      m_sysPower       = file(hwmon.path() / "power1_average");
+      if(m_sysPower.empty())
+        m_sysPower = file(hwmon.path() / "power1_input");
+      break;
+    }
+    m_gpuSource = "sysfs";
+    LOGI("System monitor: GPU sensors of %s\n", device.string().c_str());
+    return;
+  }
+#endif
+}
+
+void SystemMonitor::sampleGpu(SystemSample& s)
+{
+#if defined(NVP_SUPPORTS_NVML)
+  if(m_nvml && m_nvml->isValid() && m_nvml->nbGpu() > 0)
+  {
+    m_nvml->refresh();
+    uint32_t offset = m_nvml->getOffset();
+    s.gpuLoad       = m_nvml->getMeasures(0).load[offset];
+    s.gpuMemUsed    = static_cast<int64_t>(m_nvml->getMeasures(0).memory[offset]) * 1000;  // KB
+    s.gpuMemTotal   = static_cast<int64_t>(m_nvml->getInfo(0).max_mem) * 1024;             // KiB
+
+    nvmlDevice_t device;
+    if(nvmlDeviceGetHandleByIndex(0, &device) == NVML_SUCCESS)
+    {
+      unsigned int temperature = 0, milliwatts = 0;
+      if(nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature) == NVML_SUCCESS)
+        s.gpuTemperature = float(temperature);
+      if(nvmlDeviceGetPowerUsage(device, &milliwatts) == NVML_SUCCESS)
+        s.gpuPower = milliwatts / 1000.f;
+    }
+    return;
+  }
+#endif
+
+  int64_t value = 0;
+  if(readInt64(m_sysBusy, value))
+    s.gpuLoad = float(value);
+  if(readInt64(m_sysMemUsed, value))
+    s.gpuMemUsed = value;
+  if(readInt64(m_sysMemTotal, value))
+    s.gpuMemTotal = value;
+  if(readInt64(m_sysTemperature, value))
+    s.gpuTemperature = value / 1000.f;  // Millidegrees
+  if(readInt64(m_sysPower, value))
+    s.gpuPower = value / 1e6f;  // Microwatts
+}
+
+//--------------------------------------------------------------------------------------------------
+// Usage and budget of the device local heaps, as seen by this process
+//
+void SystemMonitor::sampleHeaps(SystemSample& s)
+{
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT};
+  VkPhysicalDeviceMemoryProperties2         properties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2};
+  if(m_hasBudget)
+    properties.pNext = &budget;
+  vkGetPhysicalDeviceMemoryProperties2(m_physicalDevice, &properties);
+
+  int64_t usage = 0, available = 0;
+  for(uint32_t h = 0; h < properties.memoryProperties.memoryHeapCount; h++)
+  {
+    if((properties.memoryProperties.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) == 0)
+      continue;
+    usage += static_cast<int64_t>(budget.heapUsage[h]);
+    available += static_cast<int64_t>(m_hasBudget ? budget.heapBudget[h] : properties.memoryProperties.memoryHeaps[h].size);
+  }
+  if(m_hasBudget)
+    s.heapUsage = usage;
+  s.heapBudget = available;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Samples as a JSON array, for the reports
+//
+void SystemMonitor::writeJson(std::ostream& out, const std::vector<SystemSample>& samples, const char* indent)
+{
+  out << "[";
+  for(size_t i = 0; i < samples.size(); i++)
+  {
+    const SystemSample& s = samples[i];
+    out << (i > 0 ? ",\n" : "\n") << indent << "  {\"timeMs\": " << s.timeMs << ", \"cpuLoad\": " << s.cpuLoad
+        << ", \"coreLoad\": [";
+    for(uint32_t c = 0; c < s.nbCores; c++)
+      out << (c > 0 ? ", " : "") << s.coreLoad[c];
+    out << "], \"processRss\": " << s.processRss << ", \"gpuLoad\": " << s.gpuLoad << ", \"gpuMemUsed\": " << s.gpuMemUsed
+        << ", \"gpuMemTotal\": " << s.gpuMemTotal << ", \"gpuTemperature\": " << s.gpuTemperature
+        << ", \"gpuPower\": " << s.gpuPower << ", \"heapUsage\": " << s.heapUsage << ", \"heapBudget\": " << s.heapBudget << "}";
+  }
+  if(!samples.empty())
+    out << "\n" << indent;
+  out << "]";
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Load of the system, sampled on a background thread
+// - CPU load per core and process memory (RSS), from /proc on Linux, the Win32 API on Windows
+// - GPU load, memory, temperature and power from NVML when available, otherwise from the
+//   DRM/hwmon files of /sys (amdgpu, i915 partially)
+// - Vulkan heap usage and budget with VK_EXT_memory_budget
+// Samples are published in a lock-free ring: a single writer, readers never block it and
+// never wait. A value which is not known is negative.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vulkan/vulkan_core.h"
+
+
+struct SystemSample
+{
+  static constexpr uint32_t kMaxCores = 64;
+
+  double                       timeMs{0};           // Since the start of the monitor
+  float                        cpuLoad{-1};         // All cores, [0, 100]
+  uint32_t                     nbCores{0};          // Cores in coreLoad, 0 if not measured
+  std::array<float, kMaxCores> coreLoad{};          // [0, 100]
+  int64_t                      processRss{-1};      // Bytes
+  float                        gpuLoad{-1};         // [0, 100]
+  int64_t                      gpuMemUsed{-1};      // Bytes, all processes
+  int64_t                      gpuMemTotal{-1};     // Bytes
+  float                        gpuTemperature{-1};  // Celsius
+  float                        gpuPower{-1};        // Watts
+  int64_t                      heapUsage{-1};       // Device local heaps used by the process, bytes (VK_EXT_memory_budget)
+  int64_t                      heapBudget{-1};      // Device local heaps available to the process, bytes
+};
+
+
+//--------------------------------------------------------------------------------------------------
+// Ring of the last N samples. Each slot has a sequence number, odd while written: a reader
+// copies the slot and drops it if the sequence changed meanwhile.
+//
+template <typename T, size_t N>
+class SampleRing
+{
+public:
+  void push(const T& value)
+  {
+    uint64_t index = m_count.load(std::memory_order_relaxed);
+    Slot&    slot  = m_slots[index % N];
+    uint64_t seq   = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.value = value;
+    slot.seq.store(seq + 2, std::memory_order_release);
+    m_count.store(index + 1, std::memory_order_release);
+  }
+
+  // Up to `count` samples, the oldest first
+  void latest(std::vector<T>& out, size_t count) const
+  {
+    out.clear();
+    uint64_t end   = m_count.load(std::memory_order_acquire);
+    uint64_t first = end - std::min<uint64_t>(end, std::min(count, N));
+    for(uint64_t i = first; i < end; i++)
+    {
+      T value;
+      if(read(i, value))
+        out.push_back(value);
+    }
+  }
+
+  bool last(T& value) const
+  {
+    uint64_t end = m_count.load(std::memory_order_acquire);
+    return end > 0 && read(end - 1, value);
+  }
+
+  uint64_t count() const { return m_count.load(std::memory_order_acquire); }
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> seq{0};
+    T                     value{};
+  };
+
+  bool read(uint64_t index, T& value) const
+  {
+    const Slot& slot   = m_slots[index % N];
+    uint64_t    before = slot.seq.load(std::memory_order_acquire);
+    if(before & 1)
+      return false;
+    value = slot.value;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == before && m_count.load(std::memory_order_relaxed) - index <= N;
+  }
+
+  std::array<Slot, N>   m_slots;
+  std::atomic<uint64_t> m_count{0};
+};
+
+
+class NvmlMonitor;
+
+class SystemMonitor
+{
+public:
+  static constexpr size_t kHistory = 256;
+
+  SystemMonitor();
+  ~SystemMonitor();
+
+  void start(VkPhysicalDevice physicalDevice, uint32_t intervalMs = 100);
+  void stop();
+
+  bool isRunning() const { return m_thread.joinable(); }
+
+  // Non blocking, from any thread
+  bool last(SystemSample& sample) const { return m_samples.last(sample); }
+  void latest(std::vector<SystemSample>& samples, size_t count = kHistory) const { m_samples.latest(samples, count); }
+  void since(std::chrono::steady_clock::time_point time, std::vector<SystemSample>& samples) const;
+
+  const std::string& gpuName() const { return m_gpuName; }
+  const std::string& gpuSource() const { return m_gpuSource; }  // "NVML", "sysfs" or empty
+  const std::string& driverVersion() const { return m_driverVersion; }  // Empty if not known
+
+  static void writeJson(std::ostream& out, const std::vector<SystemSample>& samples, const char* indent = "  ");
+
+private:
+  void worker();
+  void sample(SystemSample& s);
+  void sampleCpu(SystemSample& s);
+  void sampleProcess(SystemSample& s);
+  void sampleGpu(SystemSample& s);
+  void sampleHeaps(SystemSample& s);
+  void findSysfsGpu();
+
+  SampleRing<SystemSample, kHistory> m_samples;
+  std::unique_ptr<NvmlMonitor>       m_nvml;
+
+  std::thread                           m_thread;
+  std::mutex                            m_mutex;
+  std::condition_variable               m_cond;
+  bool                                  m_quit{false};
+  uint32_t                              m_intervalMs{100};
+  std::chrono::steady_clock::time_point m_start;
+
+  VkPhysicalDevice m_physicalDevice{VK_NULL_HANDLE};
+  bool             m_hasBudget{false};
+  std::string      m_gpuName;
+  std::string      m_gpuSource;
+  std::string      m_driverVersion;
+
+  // Previous CPU times, the load is measured between two samples
+  std::vector<uint64_t> m_cpuTotal;
+  std::vector<uint64_t> m_cpuIdle;
+
+  // Files of the GPU in /sys, empty if not found
+  std::string m_sysBusy;
+  std::string m_sysMemUsed;
+  std::string m_sysMemTotal;
+  std::string m_sysTemperature;
+  std::string m_sysPower;
+};
@@ -31,16 +31,34 @@
 //   ... stuff ...
 //   double time_elapse = timer.elapse();
 // }
+// A named timer also adds its lifetime to the trace timeline (trace_recorder.hpp)
+#include <algorithm>
 #include <chrono>
 #include <sstream>
 #include <ios>
+#include <thread>
+#include <vector>
 
 #include "nvh/nvprint.hpp"
 #include "nvh/timesampler.hpp"
+#include "trace_recorder.hpp"
 
 struct MilliTimer : public nvh::Stopwatch
 {
+  MilliTimer(const char* name = nullptr)
+      : m_name(name)
+      , m_startUs(TraceRecorder::get().nowUs())
+  {
+  }
+  ~MilliTimer()
+  {
+    if(m_name)
+      TraceRecorder::get().addCpu(m_name, "load", m_startUs, TraceRecorder::get().nowUs() - m_startUs);
+  }
   void print() { LOGI(" --> (%5.3f ms)\n", elapsed()); }
+
+  const char* m_name;
+  int64_t     m_startUs;
 };
 
 
@@ -54,6 +72,25 @@ std::string FormatNumbers(T value)
   return ss.str();
 }
 
+// Calls fn(begin, end) on contiguous ranges of [0, count), one per hardware thread.
+// Small counts stay on the calling thread.
+template <typename F>
+void parallelRanges(size_t count, F&& fn, size_t minPerThread = 1024)
+{
+  size_t nbThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count / minPerThread);
+  if(nbThreads <= 1)
+  {
+    fn(size_t(0), count);
+    return;
+  }
+  std::vector<std::thread> threads;
+  size_t                   perThread = (count + nbThreads - 1) / nbThreads;
+  for(size_t begin = 0; begin < count; begin += perThread)
+    threads.emplace_back([&fn, begin, end = std::min(count, begin + perThread)] { fn(begin, end); });
+  for(auto& t : threads)
+    t.join();
+}
+
 template<typename T>
 inline float luminance(const T& color)
 {
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+/*
+ *  Timeline of CPU scopes and GPU sections, exported as Chrome Trace Event JSON
+ */
+
+
+#include "trace_recorder.hpp"
+#include "nvh/nvprint.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+
+namespace {
+thread_local uint32_t t_threadId = 0;  // 0: not yet assigned, also the id of the GPU track
+
+// Names are identifiers or file names, only quotes, backslashes and control characters need care
+void writeEscaped(std::ofstream& out, const std::string& s)
+{
+  for(char c : s)
+  {
+    if(c == '"' || c == '\\')
+      out << '\\' << c;
+    else if(static_cast<unsigned char>(c) < 0x20)
+      out << ' ';
+    else
+      out << c;
+  }
+}
+}  // namespace
+
+
+TraceRecorder& TraceRecorder::get()
+{
+  static TraceRecorder recorder;
+  return recorder;
+}
+
+TraceRecorder::TraceRecorder()
+    : m_start(std::chrono::steady_clock::now())
+{
+  m_events.resize(kCapacity);
+}
+
+int64_t TraceRecorder::nowUs() const
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+uint32_t TraceRecorder::threadId()
+{
+  if(t_threadId == 0)
+    t_threadId = m_nextThreadId++;
+  return t_threadId;
+}
+
+size_t TraceRecorder::size()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_wrapped ? kCapacity : m_next;
+}
+
+void TraceRecorder::push(Event&& event)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_events[m_next] = std::move(event);
+  m_next           = (m_next + 1) % kCapacity;
+  m_wrapped |= m_next == 0;
+}
+
+void TraceRecorder::addCpu(const char* name, const char* category, int64_t startUs, int64_t durationUs)
+{
+  if(!m_enabled)
+    return;
+  Event e;
+  e.name     = name;
+  e.category = category;
+  e.tid      = threadId();
+  e.ts       = startUs;
+  e.dur      = durationUs;
+  push(std::move(e));
+}
+
+void TraceRecorder::addCounter(const char* name, double value)
+{
+  if(!m_enabled)
+    return;
+  Event e;
+  e.name     = name;
+  e.category = "counter";
+  e.phase    = 'C';
+  e.ts       = nowUs();
+  e.value    = value;
+  push(std::move(e));
+}
+
+void TraceRecorder::setThreadName(const std::string& name)
+{
+  uint32_t                    tid = threadId();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_threadNames[tid] = name;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Scopes
+//
+TraceRecorder::Scope::Scope(const char* name, const char* category)
+    : m_name(name)
+    , m_category(category)
+    , m_start(TraceRecorder::get().nowUs())
+{
+}
+
+TraceRecorder::Scope::~Scope()
+{
+  TraceRecorder& recorder = TraceRecorder::get();
+  recorder.addCpu(m_name, m_category, m_start, recorder.nowUs() - m_start);
+}
+
+TraceRecorder::GpuScope::GpuScope(VkCommandBuffer cmdBuf, const char* name)
+    : m_cmdBuf(cmdBuf)
+{
+  TraceRecorder& recorder = TraceRecorder::get();
+  if(!recorder.m_gpuReady || !recorder.m_enabled || cmdBuf != recorder.m_frameCmdBuf)
+    return;  // Scopes are only measured in the command buffer of the frame
+  uint32_t  slot  = recorder.m_frame % kFrames;
+  GpuFrame& frame = recorder.m_gpuFrames[slot];
+  if(frame.names.size() >= kMaxSections)
+    return;
+  m_index = static_cast<int32_t>(slot * kMaxSections + frame.names.size());
+  frame.names.push_back(name);
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, recorder.m_queryPool, m_index * 2);
+}
+
+TraceRecorder::GpuScope::~GpuScope()
+{
+  if(m_index < 0)
+    return;
+  vkCmdWriteTimestamp(m_cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, TraceRecorder::get().m_queryPool, m_index * 2 + 1);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// GPU timestamps
+//
+void TraceRecorder::setup(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily)
+{
+  m_device = device;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  m_tickUs = properties.limits.timestampPeriod / 1000.0;
+
+  uint32_t nbFamilies = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &nbFamilies, nullptr);
+  std::vector<VkQueueFamilyProperties> families(nbFamilies);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &nbFamilies, families.data());
+  uint32_t validBits = queueFamily < nbFamilies ? families[queueFamily].timestampValidBits : 0;
+  if(validBits == 0)
+  {
+    LOGW("Trace: no timestamps on the queue, GPU sections are not recorded\n");
+    return;
+  }
+  m_tickMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+  VkQueryPoolCreateInfo poolInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+  poolInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+  poolInfo.queryCount = kFrames * kMaxSections * 2;
+  vkCreateQueryPool(m_device, &poolInfo, nullptr, &m_queryPool);
+
+  calibrate(queue, queueFamily);
+}
+
+void TraceRecorder::destroy()
+{
+  if(m_device == VK_NULL_HANDLE)
+    return;
+  vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+  m_queryPool = VK_NULL_HANDLE;
+  m_gpuReady  = false;
+  for(auto& frame : m_gpuFrames)
+    frame = {};
+}
+
+//--------------------------------------------------------------------------------------------------
+// Submitting a timestamp and waiting for it: the tick is taken as happening in the middle of
+// the wait. The error is the latency of the submission, a few tens of microseconds.
+//
+void TraceRecorder::calibrate(VkQueue queue, uint32_t queueFamily)
+{
+  VkCommandPoolCreateInfo cmdPoolInfo{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+  cmdPoolInfo.flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  cmdPoolInfo.queueFamilyIndex = queueFamily;
+  VkCommandPool cmdPool;
+  vkCreateCommandPool(m_device, &cmdPoolInfo, nullptr, &cmdPool);
+
+  VkCommandBufferAllocateInfo allocInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+  allocInfo.commandPool        = cmdPool;
+  allocInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+  VkCommandBuffer cmdBuf;
+  vkAllocateCommandBuffers(m_device, &allocInfo, &cmdBuf);
+
+  VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(cmdBuf, &beginInfo);
+  vkCmdResetQueryPool(cmdBuf, m_queryPool, 0, 1);
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 0);
+  vkEndCommandBuffer(cmdBuf);
+
+  VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+  VkFence           fence;
+  vkCreateFence(m_device, &fenceInfo, nullptr, &fence);
+
+  VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers    = &cmdBuf;
+
+  int64_t before = nowUs();
+  vkQueueSubmit(queue, 1, &submitInfo, fence);
+  vkWaitForFences(m_device, 1, &fence, VK_TRUE, UINT64_MAX);
+  int64_t after = nowUs();
+
+  uint64_t tick = 0;
+  VkResult result = vkGetQueryPoolResults(m_device, m_queryPool, 0, 1, sizeof(uint64_t), &tick, sizeof(uint64_t),
+                                          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+  if(result == VK_SUCCESS)
+  {
+    m_gpuBase   = tick & m_tickMask;
+    m_cpuBaseUs = (before + after) / 2;
+    m_gpuReady  = true;
+  }
+  else
+  {
+    LOGW("Trace: GPU clock calibration failed, GPU sections are not recorded\n");
+  }
+
+  vkDestroyFence(m_device, fence, nullptr);
+  vkFreeCommandBuffers(m_device, cmdPool, 1, &cmdBuf);
+  vkDestroyCommandPool(m_device, cmdPool, nullptr);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The slot of the frame is reused: its timestamps, kFrames frames old, are read back and the
+// queries are reset in the command buffer of the new frame.
+//
+void TraceRecorder::beginFrame(VkCommandBuffer cmdBuf)
+{
+  if(!m_gpuReady)
+    return;
+  m_frame++;
+  uint32_t  slot  = m_frame % kFrames;
+  GpuFrame& frame = m_gpuFrames[slot];
+  if(frame.pending)
+    resolve(slot);
+  frame.names.clear();
+  frame.pending = true;
+  m_frameCmdBuf = cmdBuf;
+  vkCmdResetQueryPool(cmdBuf, m_queryPool, slot * kMaxSections * 2, kMaxSections * 2);
+}
+
+void TraceRecorder::resolve(uint32_t slot)
+{
+  GpuFrame& frame = m_gpuFrames[slot];
+  uint32_t  count = static_cast<uint32_t>(frame.names.size());
+  if(count == 0 || !m_enabled)
+    return;
+
+  // Pairs of (timestamp, availability) for the begin and the end of each section
+  std::vector<uint64_t> data(count * 4);
+  vkGetQueryPoolResults(m_device, m_queryPool, slot * kMaxSections * 2, count * 2, data.size() * sizeof(uint64_t),
+                        data.data(), 2 * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+  for(uint32_t i = 0; i < count; i++)
+  {
+    if(data[i * 4 + 1] == 0 || data[i * 4 + 3] == 0)
+      continue;  // Not executed, the section is dropped
+    uint64_t begin = data[i * 4 + 0] & m_tickMask;
+    uint64_t end   = data[i * 4 + 2] & m_tickMask;
+
+    Event e;
+    e.name     = frame.names[i];
+    e.category = "gpu";
+    e.tid      = 0;
+    e.ts       = m_cpuBaseUs + static_cast<int64_t>(static_cast<double>(static_cast<int64_t>(begin - m_gpuBase)) * m_tickUs);
+    e.dur      = static_cast<int64_t>(static_cast<double>((end - begin) & m_tickMask) * m_tickUs);
+    push(std::move(e));
+  }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Writing the events in the JSON object format of the Chrome Trace Event specification
+//
+bool TraceRecorder::writeChromeTrace(const std::string& filename)
+{
+  std::vector<Event>                        events;
+  std::unordered_map<uint32_t, std::string> threadNames;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t first = m_wrapped ? m_next : 0;
+    size_t count = m_wrapped ? kCapacity : m_next;
+    events.reserve(count);
+    for(size_t i = 0; i < count; i++)
+      events.push_back(m_events[(first + i) % kCapacity]);
+    threadNames = m_threadNames;
+  }
+
+  std::ofstream out(filename);
+  if(!out)
+  {
+    LOGE("Trace: cannot write %s\n", filename.c_str());
+    return false;
+  }
+
+  // GPU sections are added when resolved, a few frames late
+  std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.ts < b.ts; });
+
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  out << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"vk_raytrace\"}},\n";
+  out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"GPU\"}}";
+  for(auto& t : threadNames)
+  {
+    out << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t.first << ", \"args\": {\"name\": \"";
+    writeEscaped(out, t.second);
+    out << "\"}}";
+  }
+  for(auto& e : events)
+  {
+    out << ",\n  {\"name\": \"";
+    writeEscaped(out, e.name);
+    out << "\", \"cat\": \"" << e.category << "\", \"ph\": \"" << e.phase << "\", \"pid\": 1, \"tid\": " << e.tid
+        << ", \"ts\": " << e.ts;
+    if(e.phase == 'X')
+      out << ", \"dur\": " << e.dur << "}";
+    else
+      out << ", \"args\": {\"value\": " << e.value << "}}";
+  }
+  out << "\n]}\n";
+
+  LOGI("Trace: %zu events written to %s\n", events.size(), filename.c_str());
+  return true;
+}
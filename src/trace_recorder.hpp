@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//--------------------------------------------------------------------------------------------------
+// Timeline of the application, exported as Chrome Trace Event JSON (chrome://tracing, Perfetto)
+// - CPU scopes (TRACE_SCOPE) are recorded from any thread: loading phases, worker tasks,
+//   recording of the frame.
+// - GPU sections (TRACE_GPU_SCOPE) write timestamps in a ring of query pools, one per frame in
+//   flight. They are read back, without waiting, when the ring wraps around.
+// - GPU timestamps are moved on the CPU timeline with a one-time calibration: a timestamp is
+//   submitted and waited on, the middle of the wait is taken as the CPU time of the tick.
+// - Counters (ex. GPU load) are sampled values, shown as graphs.
+// - All events go into a fixed size ring buffer: the oldest are overwritten, a long session
+//   keeps its most recent part.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vulkan/vulkan_core.h"
+
+
+class TraceRecorder
+{
+public:
+  static TraceRecorder& get();
+
+  // CPU scope, measured on the calling thread
+  class Scope
+  {
+  public:
+    Scope(const char* name, const char* category = "cpu");
+    ~Scope();
+
+  private:
+    const char* m_name;
+    const char* m_category;
+    int64_t     m_start;
+  };
+
+  // GPU section, the timestamps are written around the commands recorded in the scope
+  class GpuScope
+  {
+  public:
+    GpuScope(VkCommandBuffer cmdBuf, const char* name);
+    ~GpuScope();
+
+  private:
+    VkCommandBuffer m_cmdBuf;
+    int32_t         m_index{-1};
+  };
+
+  void setup(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily);
+  void destroy();
+
+  // Must be called once per frame, on the command buffer of the frame, before any GPU scope
+  void beginFrame(VkCommandBuffer cmdBuf);
+
+  void addCpu(const char* name, const char* category, int64_t startUs, int64_t durationUs);
+  void addCounter(const char* name, double value);
+  void setThreadName(const std::string& name);  // Label of the calling thread in the timeline
+
+  bool writeChromeTrace(const std::string& filename);
+
+  int64_t nowUs() const;
+  size_t  size();
+
+  std::atomic<bool> m_enabled{true};
+
+private:
+  static constexpr uint32_t kFrames      = 4;   // Must exceed the number of frames in flight
+  static constexpr uint32_t kMaxSections = 32;  // GPU scopes per frame
+  static constexpr size_t   kCapacity    = 1 << 18;
+
+  struct Event
+  {
+    std::string name;
+    const char* category{""};
+    char        phase{'X'};  // 'X' complete event, 'C' counter
+    uint32_t    tid{0};
+    int64_t     ts{0};   // Microseconds since the start of the recorder
+    int64_t     dur{0};  // Microseconds
+    double      value{0};
+  };
+
+  struct GpuFrame
+  {
+    std::vector<const char*> names;
+    bool                     pending{false};
+  };
+
+  TraceRecorder();
+  uint32_t threadId();
+  void     push(Event&& event);
+  void     calibrate(VkQueue queue, uint32_t queueFamily);
+  void     resolve(uint32_t slot);
+
+  std::chrono::steady_clock::time_point m_start;
+
+  std::mutex                                m_mutex;
+  std::vector<Event>                        m_events;
+  size_t                                    m_next{0};
+  bool                                      m_wrapped{false};
+  std::unordered_map<uint32_t, std::string> m_threadNames;
+  std::atomic<uint32_t>                     m_nextThreadId{1};
+
+  // GPU, only used from the thread recording the frames
+  VkDevice                      m_device{VK_NULL_HANDLE};
+  VkQueryPool                   m_queryPool{VK_NULL_HANDLE};
+  std::array<GpuFrame, kFrames> m_gpuFrames;
+  uint32_t                      m_frame{0};
+  VkCommandBuffer               m_frameCmdBuf{VK_NULL_HANDLE};
+  double                        m_tickUs{0};  // Microseconds per timestamp tick
+  uint64_t                      m_tickMask{~0ull};
+  uint64_t                      m_gpuBase{0};    // Tick of the calibration
+  int64_t                       m_cpuBaseUs{0};  // CPU time of the calibration tick
+  bool                          m_gpuReady{false};
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) TraceRecorder::Scope TRACE_CONCAT(traceScope_, __LINE__)(__VA_ARGS__)
+#define TRACE_GPU_SCOPE(cmdBuf, name) TraceRecorder::GpuScope TRACE_CONCAT(traceGpuScope_, __LINE__)(cmdBuf, name)